@@ -0,0 +1,2180 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_bptree.c - B+ Tree
+ *
+ * Copyright (C) 2000-2008, David Beckett http://www.dajobe.org/
+ * Copyright (C) 2000-2004, University of Bristol, UK http://www.bristol.ac.uk/
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
+
+#include <redland.h>
+#include "rdf_bptree_internal.h"
+
+
+/*
+ * Items live only in the leaves, kept as sorted arrays of pointers,
+ * so that a walk over a range is mostly a scan along consecutive
+ * arrays, with a short climb back up the tree between leaves.  A
+ * branch keeps, for each child, the smallest item under that child,
+ * so the separators are always live items and never need to be
+ * copied or freed.
+ *
+ * Every node except the root holds between LIBRDF_BPTREE_NODE_MIN and
+ * LIBRDF_BPTREE_NODE_SIZE entries, so no tree that fits in memory is
+ * deeper than LIBRDF_BPTREE_MAX_DEPTH.
+ *
+ * Trees sharing a librdf_bptree_versions can be read while they are
+ * written.  An iterator pins the version of the tree current when it
+ * starts and walks the nodes of that version without locking.  A
+ * write copies any node that a pinned version can see before changing
+ * it, along the path from the root down, and publishes the new root
+ * when it is done.  The nodes and items a write replaces are retired
+ * and freed once no version that could see them is pinned.  When
+ * nothing is pinned, writes change the nodes in place.
+ */
+#define LIBRDF_BPTREE_NODE_SIZE 64
+#define LIBRDF_BPTREE_NODE_MIN (LIBRDF_BPTREE_NODE_SIZE / 2)
+#define LIBRDF_BPTREE_MAX_DEPTH 16
+
+
+typedef struct librdf_bptree_node_s librdf_bptree_node;
+
+/* B+ tree node */
+struct librdf_bptree_node_s {
+  /* non-0 for a leaf */
+  int is_leaf;
+
+  /* number of items (leaf) or children (branch) */
+  int count;
+
+  /* version that created the node (0 for trees without versions) */
+  unsigned long version;
+
+  /* leaf: the items in order
+   * branch: items[i] is the smallest item under children[i]
+   */
+  void* items[LIBRDF_BPTREE_NODE_SIZE];
+
+  /* child nodes (branches only - not allocated for leaves) */
+  librdf_bptree_node* children[LIBRDF_BPTREE_NODE_SIZE];
+};
+
+
+/* B+ tree */
+struct librdf_bptree_s {
+  /* root node of tree or NULL if empty */
+  librdf_bptree_node* root;
+
+  /* item comparison function */
+  librdf_bptree_data_compare_function compare_fn;
+
+  /* item deletion function (optional) */
+  librdf_bptree_data_free_function free_fn;
+
+  /* number of items in tree */
+  size_t size;
+
+  /* versions the tree belongs to or NULL */
+  librdf_bptree_versions* versions;
+
+  /* nodes allocated before an add changes anything, so that it cannot
+   * run out of memory halfway through splitting: a leaf and a branch
+   * for each level a split can reach, the new root included */
+  librdf_bptree_node* spare_leaf;
+  librdf_bptree_node* spare_branches[LIBRDF_BPTREE_MAX_DEPTH];
+  int spare_branches_count;
+};
+
+
+/* a version pinned by one or more iterators or other readers */
+struct librdf_bptree_pin_s {
+  librdf_bptree_pin* prev;
+  librdf_bptree_pin* next;
+  unsigned long version;
+  int usage;
+};
+
+
+typedef enum {
+  LIBRDF_BPTREE_RETIRED_NODE,    /* a node */
+  LIBRDF_BPTREE_RETIRED_NODES,   /* a node and all its descendants */
+  LIBRDF_BPTREE_RETIRED_DATA     /* anything else, freed by free_fn */
+} librdf_bptree_retired_type;
+
+typedef struct librdf_bptree_retired_s librdf_bptree_retired;
+
+/* something replaced by a write, to free once unreachable */
+struct librdf_bptree_retired_s {
+  librdf_bptree_retired* next;
+  /* last version that could reach it */
+  unsigned long version;
+  librdf_bptree_retired_type type;
+  void* data;
+  /* item (NODES) or data (DATA) free function or NULL */
+  librdf_bptree_data_free_function free_fn;
+};
+
+
+/* versions shared by a set of trees */
+struct librdf_bptree_versions_s {
+#ifdef WITH_THREADS
+  /* held for each write, and while pinning and retiring */
+  pthread_mutex_t lock;
+#endif
+
+  /* last published version */
+  unsigned long version;
+
+  /* pinned versions, oldest first */
+  librdf_bptree_pin* pins;
+  librdf_bptree_pin* last_pin;
+
+  /* retired things, oldest first */
+  librdf_bptree_retired* retired;
+  librdf_bptree_retired* last_retired;
+};
+
+
+/* path from the root to an item in a leaf */
+typedef struct {
+  /* number of levels in the path, 0 at the end */
+  int depth;
+  librdf_bptree_node* nodes[LIBRDF_BPTREE_MAX_DEPTH];
+  int positions[LIBRDF_BPTREE_MAX_DEPTH];
+} librdf_bptree_cursor;
+
+
+/* local prototypes */
+static librdf_bptree_node* librdf_bptree_new_node(librdf_bptree* tree, int is_leaf);
+static int librdf_bptree_reserve(librdf_bptree* tree);
+static librdf_bptree_node* librdf_bptree_spare_node(librdf_bptree* tree, int is_leaf);
+static void librdf_bptree_free_spares(librdf_bptree* tree);
+static void librdf_free_bptree_internal(librdf_bptree_node* node, librdf_bptree_data_free_function free_fn);
+static void librdf_bptree_free_tree(void* data);
+static void librdf_bptree_lock(librdf_bptree_versions* versions);
+static void librdf_bptree_unlock(librdf_bptree_versions* versions);
+static librdf_bptree_pin* librdf_bptree_pin_version(librdf_bptree_versions* versions);
+static librdf_bptree_retired* librdf_bptree_unpin_version(librdf_bptree_versions* versions, librdf_bptree_pin* pin);
+static void librdf_bptree_retire(librdf_bptree_versions* versions, librdf_bptree_retired_type type, void* data, librdf_bptree_data_free_function free_fn);
+static librdf_bptree_retired* librdf_bptree_reclaim(librdf_bptree_versions* versions);
+static librdf_bptree_retired* librdf_bptree_publish(librdf_bptree_versions* versions);
+static void librdf_bptree_free_retired(librdf_bptree_retired* retired);
+static int librdf_bptree_is_shared(librdf_bptree* tree, librdf_bptree_node* node);
+static librdf_bptree_node* librdf_bptree_writable(librdf_bptree* tree, librdf_bptree_node* node);
+static void librdf_bptree_free_node(librdf_bptree* tree, librdf_bptree_node* node);
+static int librdf_bptree_leaf_position(librdf_bptree* tree, librdf_bptree_node* node, const void* p_data);
+static int librdf_bptree_branch_position(librdf_bptree* tree, librdf_bptree_node* node, const void* p_data, int strict);
+static void librdf_bptree_node_insert_at(librdf_bptree_node* node, int pos, void* item, librdf_bptree_node* child);
+static void librdf_bptree_node_remove_at(librdf_bptree_node* node, int pos);
+static librdf_bptree_node* librdf_bptree_node_split(librdf_bptree* tree, librdf_bptree_node* node, int pos, void* item, librdf_bptree_node* child);
+static int librdf_bptree_insert_internal(librdf_bptree* tree, librdf_bptree_node* node, void* p_data, librdf_bptree_node** split_p);
+static void* librdf_bptree_find(librdf_bptree* tree, const void* p_data);
+static void* librdf_bptree_remove_internal(librdf_bptree* tree, librdf_bptree_node* node, const void* p_data);
+static void librdf_bptree_rebalance(librdf_bptree* tree, librdf_bptree_node* parent, int index);
+static void* librdf_bptree_cursor_item(librdf_bptree_cursor* cursor);
+static void librdf_bptree_cursor_first(librdf_bptree_cursor* cursor, librdf_bptree_node* node);
+static void librdf_bptree_cursor_lower_bound(librdf_bptree_cursor* cursor, librdf_bptree* tree, librdf_bptree_node* node, const void* p_data);
+static int librdf_bptree_cursor_next(librdf_bptree_cursor* cursor);
+static void librdf_bptree_sort(librdf_bptree* tree, void** items, void** buffer, size_t count);
+static librdf_bptree_node* librdf_bptree_build(librdf_bptree* tree, void** items, size_t count);
+
+
+/* bptree constructor */
+librdf_bptree*
+librdf_new_bptree(librdf_bptree_data_compare_function compare_fn,
+                  librdf_bptree_data_free_function free_fn)
+{
+  librdf_bptree* tree;
+
+  tree = (librdf_bptree*)LIBRDF_MALLOC(librdf_bptree, sizeof(*tree));
+  if(!tree)
+    return NULL;
+
+  tree->root = NULL;
+  tree->compare_fn = compare_fn;
+  tree->free_fn = free_fn;
+  tree->size = 0;
+  tree->versions = NULL;
+  tree->spare_leaf = NULL;
+  tree->spare_branches_count = 0;
+
+  return tree;
+}
+
+
+/* bptree destructor (items and nodes still pinned are freed later) */
+void
+librdf_free_bptree(librdf_bptree* tree)
+{
+  librdf_bptree_versions* versions;
+  librdf_bptree_retired* retired;
+
+  if(!tree)
+    return;
+
+  /* never seen by any reader */
+  librdf_bptree_free_spares(tree);
+
+  versions = tree->versions;
+  if(!versions) {
+    if(tree->root)
+      librdf_free_bptree_internal(tree->root, tree->free_fn);
+    LIBRDF_FREE(librdf_bptree, tree);
+    return;
+  }
+
+  librdf_bptree_lock(versions);
+
+  if(versions->pins) {
+    if(tree->root)
+      librdf_bptree_retire(versions, LIBRDF_BPTREE_RETIRED_NODES, tree->root,
+                           tree->free_fn);
+    librdf_bptree_retire(versions, LIBRDF_BPTREE_RETIRED_DATA, tree,
+                         librdf_bptree_free_tree);
+    tree = NULL;
+  }
+
+  retired = librdf_bptree_publish(versions);
+  librdf_bptree_unlock(versions);
+  librdf_bptree_free_retired(retired);
+
+  if(tree) {
+    if(tree->root)
+      librdf_free_bptree_internal(tree->root, tree->free_fn);
+    LIBRDF_FREE(librdf_bptree, tree);
+  }
+}
+
+
+static void
+librdf_free_bptree_internal(librdf_bptree_node* node,
+                            librdf_bptree_data_free_function free_fn)
+{
+  int i;
+
+  if(node->is_leaf) {
+    if(free_fn) {
+      for(i = 0; i < node->count; i++)
+        free_fn(node->items[i]);
+    }
+  } else {
+    for(i = 0; i < node->count; i++)
+      librdf_free_bptree_internal(node->children[i], free_fn);
+  }
+
+  LIBRDF_FREE(librdf_bptree_node, node);
+}
+
+
+static void
+librdf_bptree_free_tree(void* data)
+{
+  LIBRDF_FREE(librdf_bptree, data);
+}
+
+
+/**
+ * librdf_new_bptree_versions:
+ *
+ * Constructor - create versions to share between trees that are read
+ * while they are written.
+ *
+ * Return value: new versions or NULL on failure
+ **/
+librdf_bptree_versions*
+librdf_new_bptree_versions(void)
+{
+  librdf_bptree_versions* versions;
+
+  versions = (librdf_bptree_versions*)LIBRDF_CALLOC(librdf_bptree_versions, 1,
+                                                    sizeof(*versions));
+  if(!versions)
+    return NULL;
+
+#ifdef WITH_THREADS
+  pthread_mutex_init(&versions->lock, NULL);
+#endif
+
+  /* so that version 0 is never pinned and marks unversioned nodes */
+  versions->version = 1;
+
+  return versions;
+}
+
+
+/**
+ * librdf_free_bptree_versions:
+ * @versions: versions
+ *
+ * Destructor - free versions and everything still retired, after all
+ * the trees using them have been freed and no iterators are left.
+ **/
+void
+librdf_free_bptree_versions(librdf_bptree_versions* versions)
+{
+  if(!versions)
+    return;
+
+  /* freeing retired data may retire more */
+  while(versions->retired) {
+    librdf_bptree_retired* retired = versions->retired;
+
+    versions->retired = NULL;
+    versions->last_retired = NULL;
+    librdf_bptree_free_retired(retired);
+  }
+
+  while(versions->pins) {
+    librdf_bptree_pin* pin = versions->pins;
+
+    versions->pins = pin->next;
+    LIBRDF_FREE(librdf_bptree_pin, pin);
+  }
+
+#ifdef WITH_THREADS
+  pthread_mutex_destroy(&versions->lock);
+#endif
+
+  LIBRDF_FREE(librdf_bptree_versions, versions);
+}
+
+
+/* make an empty tree use versions so it can be read while written */
+void
+librdf_bptree_set_versions(librdf_bptree* tree,
+                           librdf_bptree_versions* versions)
+{
+  if(!tree->root)
+    tree->versions = versions;
+}
+
+
+/**
+ * librdf_bptree_versions_pin:
+ * @versions: versions
+ *
+ * Pin the current version of the trees sharing @versions, so that
+ * nothing it can see is freed - neither nodes and items nor data
+ * retired after this - until librdf_bptree_versions_unpin().  Take
+ * it before finding something in a tree that is read while written.
+ *
+ * Return value: pin or NULL on failure
+ **/
+librdf_bptree_pin*
+librdf_bptree_versions_pin(librdf_bptree_versions* versions)
+{
+  librdf_bptree_pin* pin;
+
+  librdf_bptree_lock(versions);
+  pin = librdf_bptree_pin_version(versions);
+  librdf_bptree_unlock(versions);
+
+  return pin;
+}
+
+
+/* release a pin from librdf_bptree_versions_pin() */
+void
+librdf_bptree_versions_unpin(librdf_bptree_versions* versions,
+                             librdf_bptree_pin* pin)
+{
+  librdf_bptree_retired* retired;
+
+  librdf_bptree_lock(versions);
+  retired = librdf_bptree_unpin_version(versions, pin);
+  librdf_bptree_unlock(versions);
+  librdf_bptree_free_retired(retired);
+}
+
+
+/* free data once no pinned version can see it, such as an item
+ * returned by librdf_bptree_remove() */
+void
+librdf_bptree_versions_retire(librdf_bptree_versions* versions, void* data,
+                              librdf_bptree_data_free_function free_fn)
+{
+  librdf_bptree_retired* retired;
+
+  librdf_bptree_lock(versions);
+  if(!versions->pins) {
+    librdf_bptree_unlock(versions);
+    free_fn(data);
+    return;
+  }
+
+  librdf_bptree_retire(versions, LIBRDF_BPTREE_RETIRED_DATA, data, free_fn);
+  retired = librdf_bptree_reclaim(versions);
+  librdf_bptree_unlock(versions);
+  librdf_bptree_free_retired(retired);
+}
+
+
+static void
+librdf_bptree_lock(librdf_bptree_versions* versions)
+{
+#ifdef WITH_THREADS
+  if(versions)
+    pthread_mutex_lock(&versions->lock);
+#endif
+}
+
+
+static void
+librdf_bptree_unlock(librdf_bptree_versions* versions)
+{
+#ifdef WITH_THREADS
+  if(versions)
+    pthread_mutex_unlock(&versions->lock);
+#endif
+}
+
+
+/*
+ * librdf_bptree_pin_version:
+ * @versions: locked versions
+ *
+ * INTERNAL - Pin the last published version.
+ *
+ * Return value: pin or NULL on failure
+ */
+static librdf_bptree_pin*
+librdf_bptree_pin_version(librdf_bptree_versions* versions)
+{
+  librdf_bptree_pin* pin = versions->last_pin;
+
+  if(pin && pin->version == versions->version) {
+    pin->usage++;
+    return pin;
+  }
+
+  pin = (librdf_bptree_pin*)LIBRDF_MALLOC(librdf_bptree_pin, sizeof(*pin));
+  if(!pin)
+    return NULL;
+
+  pin->version = versions->version;
+  pin->usage = 1;
+  pin->next = NULL;
+  pin->prev = versions->last_pin;
+  if(versions->last_pin)
+    versions->last_pin->next = pin;
+  else
+    versions->pins = pin;
+  versions->last_pin = pin;
+
+  return pin;
+}
+
+
+/*
+ * librdf_bptree_unpin_version:
+ * @versions: locked versions
+ * @pin: pin
+ *
+ * INTERNAL - Release a pin of a version.
+ *
+ * Return value: list to free with librdf_bptree_free_retired() once
+ * unlocked
+ */
+static librdf_bptree_retired*
+librdf_bptree_unpin_version(librdf_bptree_versions* versions,
+                            librdf_bptree_pin* pin)
+{
+  if(--pin->usage)
+    return NULL;
+
+  if(pin->prev)
+    pin->prev->next = pin->next;
+  else
+    versions->pins = pin->next;
+  if(pin->next)
+    pin->next->prev = pin->prev;
+  else
+    versions->last_pin = pin->prev;
+  LIBRDF_FREE(librdf_bptree_pin, pin);
+
+  return librdf_bptree_reclaim(versions);
+}
+
+
+/*
+ * librdf_bptree_retire:
+ * @versions: locked versions
+ * @type: what @data is
+ * @data: node or data no longer reachable from the version being written
+ * @free_fn: item or data free function
+ *
+ * INTERNAL - Keep something for freeing once no pinned version can
+ * see it.  If there is no memory to do so it is leaked rather than
+ * freed under a reader.
+ */
+static void
+librdf_bptree_retire(librdf_bptree_versions* versions,
+                     librdf_bptree_retired_type type, void* data,
+                     librdf_bptree_data_free_function free_fn)
+{
+  librdf_bptree_retired* retired;
+
+  retired = (librdf_bptree_retired*)LIBRDF_MALLOC(librdf_bptree_retired,
+                                                  sizeof(*retired));
+  if(!retired)
+    return;
+
+  retired->next = NULL;
+  retired->version = versions->version;
+  retired->type = type;
+  retired->data = data;
+  retired->free_fn = free_fn;
+
+  if(versions->last_retired)
+    versions->last_retired->next = retired;
+  else
+    versions->retired = retired;
+  versions->last_retired = retired;
+}
+
+
+/*
+ * librdf_bptree_reclaim:
+ * @versions: locked versions
+ *
+ * INTERNAL - Take everything retired that no pinned version can see.
+ *
+ * Return value: list to free with librdf_bptree_free_retired() once
+ * unlocked
+ */
+static librdf_bptree_retired*
+librdf_bptree_reclaim(librdf_bptree_versions* versions)
+{
+  librdf_bptree_retired* retired = versions->retired;
+  librdf_bptree_retired* last = NULL;
+  librdf_bptree_retired* r;
+
+  for(r = retired; r; r = r->next) {
+    if(versions->pins && r->version >= versions->pins->version)
+      break;
+    last = r;
+  }
+
+  if(!last)
+    return NULL;
+
+  versions->retired = last->next;
+  if(!versions->retired)
+    versions->last_retired = NULL;
+  last->next = NULL;
+
+  return retired;
+}
+
+
+/* INTERNAL - End a write, making its changes the last published version */
+static librdf_bptree_retired*
+librdf_bptree_publish(librdf_bptree_versions* versions)
+{
+  if(!versions)
+    return NULL;
+
+  versions->version++;
+
+  return librdf_bptree_reclaim(versions);
+}
+
+
+static void
+librdf_bptree_free_retired(librdf_bptree_retired* retired)
+{
+  while(retired) {
+    librdf_bptree_retired* next = retired->next;
+
+    switch(retired->type) {
+      case LIBRDF_BPTREE_RETIRED_NODE:
+        LIBRDF_FREE(librdf_bptree_node, retired->data);
+        break;
+      case LIBRDF_BPTREE_RETIRED_NODES:
+        librdf_free_bptree_internal((librdf_bptree_node*)retired->data,
+                                    retired->free_fn);
+        break;
+      case LIBRDF_BPTREE_RETIRED_DATA:
+      default:
+        retired->free_fn(retired->data);
+        break;
+    }
+
+    LIBRDF_FREE(librdf_bptree_retired, retired);
+    retired = next;
+  }
+}
+
+
+/* INTERNAL - non-0 if a pinned version may see a node */
+static int
+librdf_bptree_is_shared(librdf_bptree* tree, librdf_bptree_node* node)
+{
+  return (tree->versions && tree->versions->last_pin &&
+          node->version <= tree->versions->last_pin->version);
+}
+
+
+/*
+ * librdf_bptree_writable:
+ * @tree: tree being written
+ * @node: node to change
+ *
+ * INTERNAL - Get a node that a write can change in place of @node:
+ * the node itself, or a copy retiring the node if a pinned version
+ * may see it.  The caller must put the result in the parent.
+ *
+ * Return value: node or NULL on failure
+ */
+static librdf_bptree_node*
+librdf_bptree_writable(librdf_bptree* tree, librdf_bptree_node* node)
+{
+  librdf_bptree_node* copy;
+
+  if(!librdf_bptree_is_shared(tree, node))
+    return node;
+
+  copy = librdf_bptree_new_node(tree, node->is_leaf);
+  if(!copy)
+    return NULL;
+
+  memcpy(copy->items, node->items, node->count * sizeof(void*));
+  if(!node->is_leaf)
+    memcpy(copy->children, node->children,
+           node->count * sizeof(librdf_bptree_node*));
+  copy->count = node->count;
+
+  librdf_bptree_retire(tree->versions, LIBRDF_BPTREE_RETIRED_NODE, node, NULL);
+
+  return copy;
+}
+
+
+/* INTERNAL - free a node dropped by a write */
+static void
+librdf_bptree_free_node(librdf_bptree* tree, librdf_bptree_node* node)
+{
+  if(librdf_bptree_is_shared(tree, node))
+    librdf_bptree_retire(tree->versions, LIBRDF_BPTREE_RETIRED_NODE, node,
+                         NULL);
+  else
+    LIBRDF_FREE(librdf_bptree_node, node);
+}
+
+
+/*
+ * librdf_bptree_new_node:
+ * @tree: tree
+ * @is_leaf: non-0 to make a leaf
+ *
+ * INTERNAL - Allocate an empty node for the version being written;
+ * leaves are allocated without the children array.
+ *
+ * Return value: new node or NULL on failure
+ */
+static librdf_bptree_node*
+librdf_bptree_new_node(librdf_bptree* tree, int is_leaf)
+{
+  librdf_bptree_node* node;
+  size_t size;
+
+  size = is_leaf ? offsetof(librdf_bptree_node, children) :
+                   sizeof(librdf_bptree_node);
+  node = (librdf_bptree_node*)LIBRDF_MALLOC(librdf_bptree_node, size);
+  if(!node)
+    return NULL;
+
+  node->is_leaf = is_leaf;
+  node->count = 0;
+  node->version = tree->versions ? tree->versions->version + 1 : 0;
+
+  return node;
+}
+
+
+/*
+ * librdf_bptree_reserve:
+ * @tree: tree being written
+ *
+ * INTERNAL - Make sure there are spare nodes for every split an add
+ * can make.  A tree smaller than a node cannot split and gets none.
+ *
+ * Return value: non-0 on failure
+ */
+static int
+librdf_bptree_reserve(librdf_bptree* tree)
+{
+  librdf_bptree_node* node;
+  int branches = 1;
+
+  if(tree->size < LIBRDF_BPTREE_NODE_SIZE)
+    return 0;
+
+  /* one for each branch level and one for a new root */
+  for(node = tree->root; !node->is_leaf; node = node->children[0])
+    branches++;
+  if(branches > LIBRDF_BPTREE_MAX_DEPTH)
+    return 1;
+
+  if(!tree->spare_leaf) {
+    tree->spare_leaf = librdf_bptree_new_node(tree, 1);
+    if(!tree->spare_leaf)
+      return 1;
+  }
+
+  while(tree->spare_branches_count < branches) {
+    node = librdf_bptree_new_node(tree, 0);
+    if(!node)
+      return 1;
+    tree->spare_branches[tree->spare_branches_count++] = node;
+  }
+
+  return 0;
+}
+
+
+/*
+ * librdf_bptree_spare_node:
+ * @tree: tree being written
+ * @is_leaf: non-0 to take the spare leaf
+ *
+ * INTERNAL - Take an empty node reserved by librdf_bptree_reserve()
+ * for the version being written.
+ *
+ * Return value: node
+ */
+static librdf_bptree_node*
+librdf_bptree_spare_node(librdf_bptree* tree, int is_leaf)
+{
+  librdf_bptree_node* node;
+
+  if(is_leaf) {
+    node = tree->spare_leaf;
+    tree->spare_leaf = NULL;
+  } else
+    node = tree->spare_branches[--tree->spare_branches_count];
+
+  node->count = 0;
+  node->version = tree->versions ? tree->versions->version + 1 : 0;
+
+  return node;
+}
+
+
+/* INTERNAL - free the spare nodes of a tree */
+static void
+librdf_bptree_free_spares(librdf_bptree* tree)
+{
+  if(tree->spare_leaf) {
+    LIBRDF_FREE(librdf_bptree_node, tree->spare_leaf);
+    tree->spare_leaf = NULL;
+  }
+  while(tree->spare_branches_count > 0)
+    LIBRDF_FREE(librdf_bptree_node,
+                tree->spare_branches[--tree->spare_branches_count]);
+}
+
+
+/*
+ * librdf_bptree_leaf_position:
+ * @tree: tree
+ * @node: leaf node
+ * @p_data: item or range to look for
+ *
+ * INTERNAL - Binary search a leaf for the first item not less than
+ * @p_data.
+ *
+ * Return value: index in 0..count
+ */
+static int
+librdf_bptree_leaf_position(librdf_bptree* tree, librdf_bptree_node* node,
+                            const void* p_data)
+{
+  int low = 0;
+  int high = node->count;
+
+  while(low < high) {
+    int mid = (low + high) / 2;
+
+    if(tree->compare_fn(p_data, node->items[mid]) > 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  return low;
+}
+
+
+/*
+ * librdf_bptree_branch_position:
+ * @tree: tree
+ * @node: branch node
+ * @p_data: item or range to look for
+ * @strict: non-0 to find the child holding the first item in range
+ *
+ * INTERNAL - Binary search a branch for the child to descend into.
+ *
+ * Returns the last child whose smallest item is not greater than
+ * @p_data.  With @strict, returns the last child whose smallest item
+ * is less than @p_data, which is where the first item matching a
+ * range (or the last item before it) lives.
+ *
+ * Return value: child index
+ */
+static int
+librdf_bptree_branch_position(librdf_bptree* tree, librdf_bptree_node* node,
+                              const void* p_data, int strict)
+{
+  int low = 1;
+  int high = node->count;
+
+  while(low < high) {
+    int mid = (low + high) / 2;
+    int cmp = tree->compare_fn(p_data, node->items[mid]);
+
+    if(cmp > 0 || (!strict && !cmp))
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  return low - 1;
+}
+
+
+static void
+librdf_bptree_node_insert_at(librdf_bptree_node* node, int pos, void* item,
+                             librdf_bptree_node* child)
+{
+  int move = node->count - pos;
+
+  if(move > 0) {
+    memmove(&node->items[pos + 1], &node->items[pos], move * sizeof(void*));
+    if(!node->is_leaf)
+      memmove(&node->children[pos + 1], &node->children[pos],
+              move * sizeof(librdf_bptree_node*));
+  }
+
+  node->items[pos] = item;
+  if(!node->is_leaf)
+    node->children[pos] = child;
+  node->count++;
+}
+
+
+static void
+librdf_bptree_node_remove_at(librdf_bptree_node* node, int pos)
+{
+  int move = node->count - pos - 1;
+
+  if(move > 0) {
+    memmove(&node->items[pos], &node->items[pos + 1], move * sizeof(void*));
+    if(!node->is_leaf)
+      memmove(&node->children[pos], &node->children[pos + 1],
+              move * sizeof(librdf_bptree_node*));
+  }
+
+  node->count--;
+}
+
+
+/*
+ * librdf_bptree_node_split:
+ * @tree: tree
+ * @node: full node
+ * @pos: position to insert at
+ * @item: item to insert
+ * @child: child to insert (branches only)
+ *
+ * INTERNAL - Move the upper half of a full node into a new sibling,
+ * a spare node, and then insert into whichever half @pos falls in.
+ *
+ * Return value: new right sibling
+ */
+static librdf_bptree_node*
+librdf_bptree_node_split(librdf_bptree* tree, librdf_bptree_node* node,
+                         int pos, void* item, librdf_bptree_node* child)
+{
+  librdf_bptree_node* sibling;
+  const int half = LIBRDF_BPTREE_NODE_SIZE / 2;
+  const int move = LIBRDF_BPTREE_NODE_SIZE - half;
+
+  sibling = librdf_bptree_spare_node(tree, node->is_leaf);
+
+  memcpy(sibling->items, &node->items[half], move * sizeof(void*));
+  if(!node->is_leaf)
+    memcpy(sibling->children, &node->children[half],
+           move * sizeof(librdf_bptree_node*));
+  sibling->count = move;
+  node->count = half;
+
+  if(pos <= half)
+    librdf_bptree_node_insert_at(node, pos, item, child);
+  else
+    librdf_bptree_node_insert_at(sibling, pos - half, item, child);
+
+  return sibling;
+}
+
+
+/* @node has been made writable by the caller and the spare nodes
+ * reserved; the tree is unchanged on failure */
+static int
+librdf_bptree_insert_internal(librdf_bptree* tree, librdf_bptree_node* node,
+                              void* p_data, librdf_bptree_node** split_p)
+{
+  librdf_bptree_node* child;
+  librdf_bptree_node* split = NULL;
+  int pos;
+  int rv;
+
+  *split_p = NULL;
+
+  if(node->is_leaf) {
+    pos = librdf_bptree_leaf_position(tree, node, p_data);
+    if(pos < node->count && !tree->compare_fn(p_data, node->items[pos]))
+      return LIBRDF_BPTREE_EXISTS;
+
+    if(node->count < LIBRDF_BPTREE_NODE_SIZE) {
+      librdf_bptree_node_insert_at(node, pos, p_data, NULL);
+      return 0;
+    }
+
+    *split_p = librdf_bptree_node_split(tree, node, pos, p_data, NULL);
+    return 0;
+  }
+
+  pos = librdf_bptree_branch_position(tree, node, p_data, 0);
+  child = librdf_bptree_writable(tree, node->children[pos]);
+  if(!child)
+    return LIBRDF_BPTREE_ENOMEM;
+  node->children[pos] = child;
+
+  rv = librdf_bptree_insert_internal(tree, child, p_data, &split);
+  if(rv)
+    return rv;
+
+  /* only changes when a new smallest item went into the first child */
+  node->items[pos] = child->items[0];
+
+  if(!split)
+    return 0;
+
+  pos++;
+  if(node->count < LIBRDF_BPTREE_NODE_SIZE) {
+    librdf_bptree_node_insert_at(node, pos, split->items[0], split);
+    return 0;
+  }
+
+  *split_p = librdf_bptree_node_split(tree, node, pos, split->items[0], split);
+  return 0;
+}
+
+
+static void*
+librdf_bptree_find(librdf_bptree* tree, const void* p_data)
+{
+  librdf_bptree_node* node = tree->root;
+  int pos;
+
+  if(!node)
+    return NULL;
+
+  while(!node->is_leaf)
+    node = node->children[librdf_bptree_branch_position(tree, node, p_data, 0)];
+
+  pos = librdf_bptree_leaf_position(tree, node, p_data);
+  if(pos < node->count && !tree->compare_fn(p_data, node->items[pos]))
+    return node->items[pos];
+
+  return NULL;
+}
+
+
+/* find an item and return shared pointer to it (still owned by bptree) */
+void*
+librdf_bptree_search(librdf_bptree* tree, const void* p_data)
+{
+  void* rdata;
+
+  librdf_bptree_lock(tree->versions);
+  rdata = librdf_bptree_find(tree, p_data);
+  librdf_bptree_unlock(tree->versions);
+
+  return rdata;
+}
+
+
+/* add an item (becomes owned by bptree).
+ * Return 0 on success.
+ * Return LIBRDF_BPTREE_EXISTS if equivalent item exists
+ *   (the new item is freed and the old one remains in the tree).
+ * Return LIBRDF_BPTREE_ENOMEM if memory is exhausted.
+ */
+int
+librdf_bptree_add(librdf_bptree* tree, void* p_data)
+{
+  librdf_bptree_versions* versions = tree->versions;
+  librdf_bptree_retired* retired;
+  librdf_bptree_node* split = NULL;
+  librdf_bptree_node* root;
+  int rv;
+
+  librdf_bptree_lock(versions);
+
+  /* rather than copy a path down to find it is there */
+  if(versions && versions->pins && librdf_bptree_find(tree, p_data)) {
+    rv = LIBRDF_BPTREE_EXISTS;
+    goto unlock;
+  }
+
+  /* splits must not fail after changing nodes */
+  if(librdf_bptree_reserve(tree)) {
+    rv = LIBRDF_BPTREE_ENOMEM;
+    goto unlock;
+  }
+
+  if(tree->root)
+    root = librdf_bptree_writable(tree, tree->root);
+  else
+    root = librdf_bptree_new_node(tree, 1);
+  if(!root) {
+    rv = LIBRDF_BPTREE_ENOMEM;
+    goto unlock;
+  }
+  tree->root = root;
+
+  rv = librdf_bptree_insert_internal(tree, root, p_data, &split);
+  if(rv)
+    goto unlock;
+
+  if(split) {
+    /* grow a level */
+    root = librdf_bptree_spare_node(tree, 0);
+    librdf_bptree_node_insert_at(root, 0, tree->root->items[0], tree->root);
+    librdf_bptree_node_insert_at(root, 1, split->items[0], split);
+    tree->root = root;
+  }
+
+  tree->size++;
+
+#if LIBRDF_DEBUG > 1
+  librdf_bptree_check(tree);
+#endif
+
+  unlock:
+  retired = librdf_bptree_publish(versions);
+  librdf_bptree_unlock(versions);
+  librdf_bptree_free_retired(retired);
+
+  /* never seen by any reader */
+  if(rv == LIBRDF_BPTREE_EXISTS && tree->free_fn)
+    tree->free_fn(p_data);
+
+  return rv;
+}
+
+
+/*
+ * librdf_bptree_sort:
+ * @tree: tree
+ * @items: items to sort
+ * @buffer: scratch space for @count items
+ * @count: number of items
+ *
+ * INTERNAL - Sort items into tree order with a bottom-up merge sort.
+ * Runs that are already in order are copied across without merging.
+ */
+static void
+librdf_bptree_sort(librdf_bptree* tree, void** items, void** buffer,
+                   size_t count)
+{
+  void** from = items;
+  void** to = buffer;
+  size_t width;
+
+  for(width = 1; width < count; width *= 2) {
+    size_t start;
+    void** swap;
+
+    for(start = 0; start < count; start += 2 * width) {
+      size_t middle = (width < count - start) ? start + width : count;
+      size_t end = (width < count - middle) ? middle + width : count;
+      size_t left = start;
+      size_t right = middle;
+      size_t i;
+
+      if(middle == end ||
+         tree->compare_fn(from[middle - 1], from[middle]) <= 0) {
+        memcpy(&to[start], &from[start], (end - start) * sizeof(void*));
+        continue;
+      }
+
+      for(i = start; i < end; i++) {
+        if(left < middle &&
+           (right == end || tree->compare_fn(from[left], from[right]) <= 0))
+          to[i] = from[left++];
+        else
+          to[i] = from[right++];
+      }
+    }
+
+    swap = from;
+    from = to;
+    to = swap;
+  }
+
+  if(from != items)
+    memcpy(items, from, count * sizeof(void*));
+}
+
+
+/*
+ * librdf_bptree_build:
+ * @tree: tree
+ * @items: items in order with no duplicates
+ * @count: number of items (at least 1)
+ *
+ * INTERNAL - Build a tree bottom-up, a level at a time, spreading the
+ * entries of each level evenly over as few nodes as will hold them,
+ * so every node but the root is at least half full.
+ *
+ * Return value: root node or NULL on failure
+ */
+static librdf_bptree_node*
+librdf_bptree_build(librdf_bptree* tree, void** items, size_t count)
+{
+  librdf_bptree_node** level;
+  librdf_bptree_node* root;
+  size_t nodes;
+  size_t below = 0; /* entries in the level below (branches only) */
+  size_t start = 0;
+  size_t i;
+  size_t j;
+
+  nodes = (count + LIBRDF_BPTREE_NODE_SIZE - 1) / LIBRDF_BPTREE_NODE_SIZE;
+  level = (librdf_bptree_node**)LIBRDF_MALLOC(array, nodes * sizeof(*level));
+  if(!level)
+    return NULL;
+
+  /* leaves */
+  for(j = 0; j < nodes; j++) {
+    librdf_bptree_node* leaf;
+    size_t end = (j + 1) * count / nodes;
+
+    leaf = librdf_bptree_new_node(tree, 1);
+    if(!leaf)
+      goto failed;
+
+    start = j * count / nodes;
+    memcpy(leaf->items, &items[start], (end - start) * sizeof(void*));
+    leaf->count = (int)(end - start);
+
+    level[j] = leaf;
+  }
+
+  /* branches, each level written over the one below as it is used */
+  while(nodes > 1) {
+    below = nodes;
+    nodes = (below + LIBRDF_BPTREE_NODE_SIZE - 1) / LIBRDF_BPTREE_NODE_SIZE;
+
+    for(j = 0; j < nodes; j++) {
+      librdf_bptree_node* branch;
+      size_t end = (j + 1) * below / nodes;
+
+      start = j * below / nodes;
+      branch = librdf_bptree_new_node(tree, 0);
+      if(!branch)
+        goto failed;
+
+      for(i = start; i < end; i++)
+        librdf_bptree_node_insert_at(branch, (int)(i - start),
+                                     level[i]->items[0], level[i]);
+      level[j] = branch;
+    }
+  }
+
+  root = level[0];
+  LIBRDF_FREE(array, level);
+
+  return root;
+
+  failed:
+  /* nodes 0..j-1 of this level are built and cover every entry of the
+   * level below before start */
+  for(i = 0; i < j; i++)
+    librdf_free_bptree_internal(level[i], NULL);
+  for(i = start; i < below; i++)
+    librdf_free_bptree_internal(level[i], NULL);
+  LIBRDF_FREE(array, level);
+
+  return NULL;
+}
+
+
+/* add an array of items in any order (each becomes owned by bptree).
+ * The array is sorted into tree order and the tree is rebuilt from
+ * it and the items already there in linear time, which is much
+ * cheaper than adding a large number of items one at a time.
+ * Items equivalent to one in the tree or to an earlier one in the
+ * array are freed and their places in the array set to NULL.
+ * Return the number of items added.
+ * Return LIBRDF_BPTREE_ENOMEM if memory is exhausted
+ *   (the tree is unchanged and no item is freed).
+ */
+int
+librdf_bptree_add_array(librdf_bptree* tree, void** items, int count)
+{
+  librdf_bptree_versions* versions = tree->versions;
+  librdf_bptree_retired* retired;
+  librdf_bptree_cursor cursor;
+  librdf_bptree_node* root;
+  void** merged;
+  size_t old_size;
+  size_t total = 0;
+  size_t dropped = 0;
+  size_t k;
+  int rv;
+  int i;
+
+  if(count <= 0)
+    return 0;
+
+  librdf_bptree_lock(versions);
+
+  old_size = tree->size;
+  merged = (void**)LIBRDF_MALLOC(array, (old_size + count) * sizeof(void*));
+  if(!merged) {
+    rv = LIBRDF_BPTREE_ENOMEM;
+    goto unlock;
+  }
+
+  librdf_bptree_sort(tree, items, merged, count);
+
+  /* merge with the tree items, keeping the first of equivalent items.
+   * Each array item dropped leaves a free slot at the end of merged,
+   * where the address of its place in the array is kept. */
+  librdf_bptree_cursor_first(&cursor, tree->root);
+
+  for(i = 0; cursor.depth || i < count; ) {
+    if(cursor.depth &&
+       (i == count ||
+        tree->compare_fn(librdf_bptree_cursor_item(&cursor), items[i]) <= 0)) {
+      merged[total++] = librdf_bptree_cursor_item(&cursor);
+      librdf_bptree_cursor_next(&cursor);
+    } else {
+      if(!total || tree->compare_fn(merged[total - 1], items[i]))
+        merged[total++] = items[i];
+      else
+        merged[old_size + count - ++dropped] = &items[i];
+      i++;
+    }
+  }
+
+  root = librdf_bptree_build(tree, merged, total);
+  if(!root) {
+    LIBRDF_FREE(array, merged);
+    rv = LIBRDF_BPTREE_ENOMEM;
+    goto unlock;
+  }
+
+  /* every node of the old tree is replaced, the items are kept */
+  if(tree->root) {
+    if(versions && versions->pins)
+      librdf_bptree_retire(versions, LIBRDF_BPTREE_RETIRED_NODES, tree->root,
+                           NULL);
+    else
+      librdf_free_bptree_internal(tree->root, NULL);
+  }
+  tree->root = root;
+  tree->size = total;
+  rv = (int)(total - old_size);
+
+#if LIBRDF_DEBUG > 1
+  librdf_bptree_check(tree);
+#endif
+
+  unlock:
+  retired = librdf_bptree_publish(versions);
+  librdf_bptree_unlock(versions);
+  librdf_bptree_free_retired(retired);
+
+  if(rv < 0)
+    return rv;
+
+  /* the dropped items were never seen by any reader */
+  for(k = total; k < old_size + count; k++) {
+    void** place = (void**)merged[k];
+
+    if(tree->free_fn)
+      tree->free_fn(*place);
+    *place = NULL;
+  }
+
+  LIBRDF_FREE(array, merged);
+
+  return rv;
+}
+
+
+/*
+ * librdf_bptree_rebalance:
+ * @tree: tree
+ * @parent: writable branch node
+ * @index: index of writable child that has fallen below the minimum
+ *
+ * INTERNAL - Refill a child from a sibling with spare entries, or
+ * merge a sibling into it when neither has any to spare.  If there
+ * is no memory to copy a sibling the child is left one entry short.
+ */
+static void
+librdf_bptree_rebalance(librdf_bptree* tree, librdf_bptree_node* parent,
+                        int index)
+{
+  librdf_bptree_node* child = parent->children[index];
+  librdf_bptree_node* left;
+  librdf_bptree_node* right;
+
+  left = (index > 0) ? parent->children[index - 1] : NULL;
+  right = (index + 1 < parent->count) ? parent->children[index + 1] : NULL;
+
+  if(left && left->count > LIBRDF_BPTREE_NODE_MIN) {
+    int last = left->count - 1;
+
+    left = librdf_bptree_writable(tree, left);
+    if(!left)
+      return;
+    parent->children[index - 1] = left;
+
+    librdf_bptree_node_insert_at(child, 0, left->items[last],
+                                 left->is_leaf ? NULL : left->children[last]);
+    left->count--;
+    parent->items[index] = child->items[0];
+    return;
+  }
+
+  if(right && right->count > LIBRDF_BPTREE_NODE_MIN) {
+    right = librdf_bptree_writable(tree, right);
+    if(!right)
+      return;
+    parent->children[index + 1] = right;
+
+    librdf_bptree_node_insert_at(child, child->count, right->items[0],
+                                 right->is_leaf ? NULL : right->children[0]);
+    librdf_bptree_node_remove_at(right, 0);
+    parent->items[index] = child->items[0];
+    parent->items[index + 1] = right->items[0];
+    return;
+  }
+
+  /* merge the sibling into the child, which is already writable */
+  if(left) {
+    memmove(&child->items[left->count], child->items,
+            child->count * sizeof(void*));
+    memcpy(child->items, left->items, left->count * sizeof(void*));
+    if(!child->is_leaf) {
+      memmove(&child->children[left->count], child->children,
+              child->count * sizeof(librdf_bptree_node*));
+      memcpy(child->children, left->children,
+             left->count * sizeof(librdf_bptree_node*));
+    }
+    child->count += left->count;
+
+    librdf_bptree_free_node(tree, left);
+    librdf_bptree_node_remove_at(parent, index - 1);
+    parent->items[index - 1] = child->items[0];
+  } else {
+    memcpy(&child->items[child->count], right->items,
+           right->count * sizeof(void*));
+    if(!child->is_leaf)
+      memcpy(&child->children[child->count], right->children,
+             right->count * sizeof(librdf_bptree_node*));
+    child->count += right->count;
+
+    librdf_bptree_free_node(tree, right);
+    librdf_bptree_node_remove_at(parent, index + 1);
+  }
+}
+
+
+/* @node has been made writable by the caller */
+static void*
+librdf_bptree_remove_internal(librdf_bptree* tree, librdf_bptree_node* node,
+                              const void* p_data)
+{
+  librdf_bptree_node* child;
+  void* rdata;
+  int pos;
+
+  if(node->is_leaf) {
+    pos = librdf_bptree_leaf_position(tree, node, p_data);
+    if(pos >= node->count || tree->compare_fn(p_data, node->items[pos]))
+      return NULL;
+
+    rdata = node->items[pos];
+    librdf_bptree_node_remove_at(node, pos);
+    return rdata;
+  }
+
+  pos = librdf_bptree_branch_position(tree, node, p_data, 0);
+  child = librdf_bptree_writable(tree, node->children[pos]);
+  if(!child)
+    return NULL;
+  node->children[pos] = child;
+
+  rdata = librdf_bptree_remove_internal(tree, child, p_data);
+  if(!rdata)
+    return NULL;
+
+  /* keep the separator a live item */
+  if(child->count)
+    node->items[pos] = child->items[0];
+
+  if(child->count < LIBRDF_BPTREE_NODE_MIN)
+    librdf_bptree_rebalance(tree, node, pos);
+
+  return rdata;
+}
+
+
+/* remove an item and return it (no longer owned by bptree).
+ * Iterators over pinned versions may still return it, so with
+ * versions free it with librdf_bptree_versions_retire().
+ */
+void*
+librdf_bptree_remove(librdf_bptree* tree, const void* p_data)
+{
+  librdf_bptree_versions* versions = tree->versions;
+  librdf_bptree_retired* retired;
+  librdf_bptree_node* root;
+  void* rdata = NULL;
+
+  librdf_bptree_lock(versions);
+
+  /* rather than copy a path down to find it is not there */
+  if(!tree->root ||
+     (versions && versions->pins && !librdf_bptree_find(tree, p_data)))
+    goto unlock;
+
+  root = librdf_bptree_writable(tree, tree->root);
+  if(!root)
+    goto unlock;
+  tree->root = root;
+
+  rdata = librdf_bptree_remove_internal(tree, root, p_data);
+  if(!rdata)
+    goto unlock;
+
+  tree->size--;
+
+  /* shrink a level */
+  if(!root->is_leaf && root->count == 1) {
+    tree->root = root->children[0];
+    librdf_bptree_free_node(tree, root);
+  } else if(root->is_leaf && !root->count) {
+    tree->root = NULL;
+    librdf_bptree_free_node(tree, root);
+  }
+
+#if LIBRDF_DEBUG > 1
+  librdf_bptree_check(tree);
+#endif
+
+  unlock:
+  retired = librdf_bptree_publish(versions);
+  librdf_bptree_unlock(versions);
+  librdf_bptree_free_retired(retired);
+
+  return rdata;
+}
+
+
+/* remove an item and free it */
+int
+librdf_bptree_delete(librdf_bptree* tree, const void* p_data)
+{
+  void* rdata;
+
+  rdata = librdf_bptree_remove(tree, p_data);
+  if(rdata) {
+    if(tree->free_fn) {
+      if(tree->versions)
+        librdf_bptree_versions_retire(tree->versions, rdata, tree->free_fn);
+      else
+        tree->free_fn(rdata);
+    }
+  }
+
+  return (rdata != NULL);
+}
+
+
+/* get the number of items in the tree */
+int
+librdf_bptree_size(librdf_bptree* tree)
+{
+  int size;
+
+  librdf_bptree_lock(tree->versions);
+  size = (int)tree->size;
+  librdf_bptree_unlock(tree->versions);
+
+  return size;
+}
+
+
+static void*
+librdf_bptree_cursor_item(librdf_bptree_cursor* cursor)
+{
+  int leaf = cursor->depth - 1;
+
+  return cursor->nodes[leaf]->items[cursor->positions[leaf]];
+}
+
+
+/* INTERNAL - Point a cursor at the first item under a node or NULL */
+static void
+librdf_bptree_cursor_first(librdf_bptree_cursor* cursor,
+                           librdf_bptree_node* node)
+{
+  cursor->depth = 0;
+
+  while(node) {
+    cursor->nodes[cursor->depth] = node;
+    cursor->positions[cursor->depth] = 0;
+    cursor->depth++;
+    node = node->is_leaf ? NULL : node->children[0];
+  }
+}
+
+
+/*
+ * librdf_bptree_cursor_lower_bound:
+ * @cursor: cursor
+ * @tree: tree
+ * @node: root of the version to search or NULL
+ * @p_data: item or range
+ *
+ * INTERNAL - Point a cursor at the first item not less than @p_data,
+ * or at the end if there is none.
+ */
+static void
+librdf_bptree_cursor_lower_bound(librdf_bptree_cursor* cursor,
+                                 librdf_bptree* tree, librdf_bptree_node* node,
+                                 const void* p_data)
+{
+  int pos;
+
+  cursor->depth = 0;
+  if(!node)
+    return;
+
+  while(!node->is_leaf) {
+    pos = librdf_bptree_branch_position(tree, node, p_data, 1);
+    cursor->nodes[cursor->depth] = node;
+    cursor->positions[cursor->depth] = pos;
+    cursor->depth++;
+    node = node->children[pos];
+  }
+
+  pos = librdf_bptree_leaf_position(tree, node, p_data);
+  cursor->nodes[cursor->depth] = node;
+  cursor->positions[cursor->depth] = pos;
+  cursor->depth++;
+
+  if(pos == node->count) {
+    /* the first match starts the next leaf */
+    cursor->positions[cursor->depth - 1] = pos - 1;
+    librdf_bptree_cursor_next(cursor);
+  }
+}
+
+
+/*
+ * librdf_bptree_cursor_next:
+ * @cursor: cursor
+ *
+ * INTERNAL - Move a cursor to the next item, climbing up only as far
+ * as the next entry of a branch when a leaf is done.
+ *
+ * Return value: non-0 at the end
+ */
+static int
+librdf_bptree_cursor_next(librdf_bptree_cursor* cursor)
+{
+  int level = cursor->depth - 1;
+
+  while(level >= 0 &&
+        cursor->positions[level] + 1 >= cursor->nodes[level]->count)
+    level--;
+
+  if(level < 0) {
+    cursor->depth = 0;
+    return 1;
+  }
+
+  cursor->positions[level]++;
+
+  /* down to the first item of the leftmost leaf below */
+  while(!cursor->nodes[level]->is_leaf) {
+    librdf_bptree_node* node;
+
+    node = cursor->nodes[level]->children[cursor->positions[level]];
+    level++;
+    cursor->nodes[level] = node;
+    cursor->positions[level] = 0;
+  }
+
+  return 0;
+}
+
+
+typedef struct {
+  librdf_bptree* tree;
+  librdf_bptree_cursor cursor;
+  /* pinned version (trees with versions) */
+  librdf_bptree_versions* versions;
+  librdf_bptree_pin* pin;
+  void* range;
+  librdf_bptree_data_free_function range_free_fn;
+} librdf_bptree_iterator_context;
+
+
+static int
+librdf_bptree_iterator_is_end(void* iterator)
+{
+  librdf_bptree_iterator_context* context;
+
+  context = (librdf_bptree_iterator_context*)iterator;
+
+  return (context->cursor.depth == 0);
+}
+
+
+static int
+librdf_bptree_iterator_next_method(void* iterator)
+{
+  librdf_bptree_iterator_context* context;
+
+  context = (librdf_bptree_iterator_context*)iterator;
+
+  if(!context->cursor.depth)
+    return 1;
+
+  if(librdf_bptree_cursor_next(&context->cursor))
+    return 1;
+
+  if(context->range &&
+     context->tree->compare_fn(context->range,
+                               librdf_bptree_cursor_item(&context->cursor))) {
+    context->cursor.depth = 0;
+    return 1;
+  }
+
+  return 0;
+}
+
+
+static void*
+librdf_bptree_iterator_get_method(void* iterator, int flags)
+{
+  librdf_bptree_iterator_context* context;
+
+  context = (librdf_bptree_iterator_context*)iterator;
+
+  if(!context->cursor.depth)
+    return NULL;
+
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      return librdf_bptree_cursor_item(&context->cursor);
+    default:
+      return NULL;
+  }
+}
+
+
+static void
+librdf_bptree_iterator_finished(void* iterator)
+{
+  librdf_bptree_iterator_context* context;
+
+  context = (librdf_bptree_iterator_context*)iterator;
+
+  if(!context)
+    return;
+
+  if(context->pin)
+    librdf_bptree_versions_unpin(context->versions, context->pin);
+
+  if(context->range && context->range_free_fn)
+    context->range_free_fn(context->range);
+
+  LIBRDF_FREE(librdf_bptree_iterator_context, context);
+}
+
+
+/**
+ * librdf_bptree_get_iterator_start:
+ * @world: #librdf_world object
+ * @tree: #librdf_bptree object
+ * @range: item to match or NULL for the entire tree
+ * @range_free_fn: function to free @range when the iterator is freed or NULL
+ *
+ * Get an (in-order) iterator for the start of a range, or the entire tree
+ * (if range is NULL).  If range specifies a range (i.e. the tree comparison
+ * function will 'match' (return 0 for) range and /several/ items), the
+ * iterator will be placed at the first item matching range and will
+ * iterate over all items (and only items) that match range.
+ *
+ * For a tree with versions, the iterator pins the current version
+ * and returns what the tree held then, however it is written to
+ * while the iterator is in use.
+ *
+ * Return value: a new #librdf_iterator object or NULL on failure
+ **/
+librdf_iterator*
+librdf_bptree_get_iterator_start(librdf_world* world, librdf_bptree* tree,
+                                 void* range,
+                                 librdf_bptree_data_free_function range_free_fn)
+{
+  librdf_bptree_iterator_context* context;
+  librdf_iterator* iterator;
+  librdf_bptree_node* root;
+
+  context = (librdf_bptree_iterator_context*)LIBRDF_CALLOC(librdf_bptree_iterator_context, 1, sizeof(*context));
+  if(!context)
+    return NULL;
+
+  context->tree = tree;
+  context->range = range;
+  context->range_free_fn = range_free_fn;
+  context->versions = tree->versions;
+
+  librdf_bptree_lock(context->versions);
+  root = tree->root;
+  if(context->versions)
+    context->pin = librdf_bptree_pin_version(context->versions);
+  librdf_bptree_unlock(context->versions);
+
+  if(context->versions && !context->pin) {
+    librdf_bptree_iterator_finished(context);
+    return NULL;
+  }
+
+  /* the nodes of a pinned version do not change */
+  if(range) {
+    librdf_bptree_cursor_lower_bound(&context->cursor, tree, root, range);
+    if(context->cursor.depth &&
+       tree->compare_fn(range, librdf_bptree_cursor_item(&context->cursor)))
+      context->cursor.depth = 0;
+  } else
+    librdf_bptree_cursor_first(&context->cursor, root);
+
+  iterator=librdf_new_iterator(world,
+                               (void*)context,
+                               librdf_bptree_iterator_is_end,
+                               librdf_bptree_iterator_next_method,
+                               librdf_bptree_iterator_get_method,
+                               librdf_bptree_iterator_finished);
+
+  if(!iterator) {
+    librdf_bptree_iterator_finished(context);
+  }
+
+  return iterator;
+}
+
+
+#ifdef LIBRDF_DEBUG
+
+static size_t
+librdf_bptree_check_internal(librdf_bptree* tree, librdf_bptree_node* node,
+                             int depth, int* leaf_depth_p)
+{
+  size_t count = 0;
+  int i;
+
+  if(node != tree->root &&
+     (node->count < LIBRDF_BPTREE_NODE_MIN ||
+      node->count > LIBRDF_BPTREE_NODE_SIZE)) {
+    fprintf(stderr, "Tree %p node %p has %d entries\n", tree, node,
+            node->count);
+    abort();
+  }
+
+  for(i = 1; i < node->count; i++) {
+    if(tree->compare_fn(node->items[i - 1], node->items[i]) >= 0) {
+      fprintf(stderr, "Tree %p node %p items %d and %d out of order\n",
+              tree, node, i - 1, i);
+      abort();
+    }
+  }
+
+  if(node->is_leaf) {
+    if(*leaf_depth_p < 0)
+      *leaf_depth_p = depth;
+    if(depth != *leaf_depth_p) {
+      fprintf(stderr, "Tree %p leaf %p is not at depth %d\n",
+              tree, node, *leaf_depth_p);
+      abort();
+    }
+    return node->count;
+  }
+
+  for(i = 0; i < node->count; i++) {
+    if(node->items[i] != node->children[i]->items[0]) {
+      fprintf(stderr, "Tree %p node %p separator %d is not the child minimum\n",
+              tree, node, i);
+      abort();
+    }
+    if(i && tree->compare_fn(node->children[i - 1]->items[node->children[i - 1]->count - 1],
+                             node->items[i]) >= 0) {
+      fprintf(stderr, "Tree %p node %p children %d and %d overlap\n",
+              tree, node, i - 1, i);
+      abort();
+    }
+    count += librdf_bptree_check_internal(tree, node->children[i], depth + 1,
+                                          leaf_depth_p);
+  }
+
+  return count;
+}
+
+
+/* debugging tree check - ordering, fill, depth and counts */
+void
+librdf_bptree_check(librdf_bptree* tree)
+{
+  int leaf_depth = -1;
+  size_t count = 0;
+
+  if(tree->root)
+    count = librdf_bptree_check_internal(tree, tree->root, 0, &leaf_depth);
+  if(count != tree->size || leaf_depth >= LIBRDF_BPTREE_MAX_DEPTH) {
+    fprintf(stderr, "Tree %p items count is %zu.  actual count %zu\n",
+            tree, tree->size, count);
+    abort();
+  }
+}
+
+#endif
+
+
+#ifdef STANDALONE
+
+/* one more prototype */
+int main(int argc, char *argv[]);
+
+
+typedef struct
+{
+  int major;
+  int minor; /* < 0 matches any minor */
+} test_item;
+
+
+static int
+compare_items(const void *l, const void *r)
+{
+  const test_item* a = (const test_item*)l;
+  const test_item* b = (const test_item*)r;
+
+  if(a->major != b->major)
+    return (a->major < b->major) ? -1 : 1;
+  if(a->minor < 0 || b->minor < 0)
+    return 0;
+  return (a->minor > b->minor) - (a->minor < b->minor);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  const char *program = librdf_basename(argv[0]);
+#define MAJOR_COUNT 97
+#define MINOR_COUNT 31
+#define ITEM_COUNT (MAJOR_COUNT * MINOR_COUNT)
+  test_item items[ITEM_COUNT];
+  test_item range;
+  test_item copies[ITEM_COUNT];
+  void* bulk[ITEM_COUNT];
+  librdf_world* world;
+  librdf_bptree* tree;
+  librdf_bptree_versions* versions;
+  librdf_iterator* iter;
+  int present[ITEM_COUNT];
+  int expected;
+  int count;
+  int i;
+
+  world = librdf_new_world();
+  tree = librdf_new_bptree(compare_items,
+                           NULL); /* no free as they are in the array above */
+  if(!tree) {
+    fprintf(stderr, "%s: Failed to create tree\n", program);
+    exit(1);
+  }
+
+  for(i = 0; i < ITEM_COUNT; i++) {
+    items[i].major = i / MINOR_COUNT;
+    items[i].minor = i % MINOR_COUNT;
+    present[i] = 0;
+  }
+
+  /* add in a scattered order (7919 is prime so this visits every item) */
+  for(i = 0; i < ITEM_COUNT; i++) {
+    int j = (int)(((long)i * 7919) % ITEM_COUNT);
+    int rc;
+
+    rc = librdf_bptree_add(tree, &items[j]);
+    if(rc) {
+      fprintf(stderr, "%s: Adding tree item %d failed, returning error %d\n",
+              program, j, rc);
+      exit(1);
+    }
+    present[j] = 1;
+
+    if(librdf_bptree_add(tree, &items[j]) != LIBRDF_BPTREE_EXISTS) {
+      fprintf(stderr, "%s: Adding tree item %d twice did not fail\n",
+              program, j);
+      exit(1);
+    }
+  }
+
+#ifdef LIBRDF_DEBUG
+  librdf_bptree_check(tree);
+#endif
+
+  /* delete every third item */
+  for(i = 0; i < ITEM_COUNT; i += 3) {
+    if(!librdf_bptree_delete(tree, &items[i])) {
+      fprintf(stderr, "%s: Deleting tree item %d failed\n", program, i);
+      exit(1);
+    }
+    present[i] = 0;
+
+    if(librdf_bptree_search(tree, &items[i])) {
+      fprintf(stderr, "%s: Tree still contains deleted item %d\n", program, i);
+      exit(1);
+    }
+  }
+
+#ifdef LIBRDF_DEBUG
+  librdf_bptree_check(tree);
+#endif
+
+  for(expected = 0, i = 0; i < ITEM_COUNT; i++) {
+    if(present[i]) {
+      expected++;
+      if(librdf_bptree_search(tree, &items[i]) != &items[i]) {
+        fprintf(stderr, "%s: Tree did NOT contain item %d as expected\n",
+                program, i);
+        exit(1);
+      }
+    }
+  }
+
+  if(librdf_bptree_size(tree) != expected) {
+    fprintf(stderr, "%s: Tree size is %d, expected %d\n", program,
+            librdf_bptree_size(tree), expected);
+    exit(1);
+  }
+
+  /* walk everything in order */
+  iter = librdf_bptree_get_iterator_start(world, tree, NULL, NULL);
+  for(count = 0, i = 0; !librdf_iterator_end(iter); librdf_iterator_next(iter)) {
+    test_item* item = (test_item*)librdf_iterator_get_object(iter);
+
+    while(i < ITEM_COUNT && !present[i])
+      i++;
+    if(item != &items[i]) {
+      fprintf(stderr, "%s: Iterator returned item %d, expected %d\n",
+              program, (int)(item - items), i);
+      exit(1);
+    }
+    i++;
+    count++;
+  }
+  librdf_free_iterator(iter);
+
+  if(count != expected) {
+    fprintf(stderr, "%s: Iterator returned %d items, expected %d\n",
+            program, count, expected);
+    exit(1);
+  }
+
+  /* walk each range of items sharing a major number */
+  for(range.major = -1; range.major <= MAJOR_COUNT; range.major++) {
+    range.minor = -1;
+
+    expected = 0;
+    if(range.major >= 0 && range.major < MAJOR_COUNT)
+      for(i = 0; i < MINOR_COUNT; i++)
+        expected += present[range.major * MINOR_COUNT + i];
+
+    iter = librdf_bptree_get_iterator_start(world, tree, &range, NULL);
+    for(count = 0; !librdf_iterator_end(iter); librdf_iterator_next(iter)) {
+      test_item* item = (test_item*)librdf_iterator_get_object(iter);
+
+      if(item->major != range.major || !present[item - items]) {
+        fprintf(stderr, "%s: Range %d returned item %d\n", program,
+                range.major, (int)(item - items));
+        exit(1);
+      }
+      count++;
+    }
+    librdf_free_iterator(iter);
+
+    if(count != expected) {
+      fprintf(stderr, "%s: Range %d returned %d items, expected %d\n",
+              program, range.major, count, expected);
+      exit(1);
+    }
+  }
+
+  /* empty the tree */
+  for(i = 0; i < ITEM_COUNT; i++) {
+    if(present[i] && librdf_bptree_remove(tree, &items[i]) != &items[i]) {
+      fprintf(stderr, "%s: remove failed at item %d\n", program, i);
+      exit(1);
+    }
+  }
+
+  if(librdf_bptree_size(tree)) {
+    fprintf(stderr, "%s: Tree not empty after removing all items\n", program);
+    exit(1);
+  }
+
+  /* bulk add the odd items, then all of them in a scattered order */
+  for(count = 0, i = 1; i < ITEM_COUNT; i += 2)
+    bulk[count++] = &items[i];
+
+  if(librdf_bptree_add_array(tree, bulk, count) != count) {
+    fprintf(stderr, "%s: Bulk adding %d items failed\n", program, count);
+    exit(1);
+  }
+
+  for(i = 0; i < ITEM_COUNT; i++) {
+    copies[i] = items[i];
+    bulk[i] = &copies[(int)(((long)i * 7919) % ITEM_COUNT)];
+  }
+
+  expected = ITEM_COUNT - count;
+  count = librdf_bptree_add_array(tree, bulk, ITEM_COUNT);
+  if(count != expected) {
+    fprintf(stderr, "%s: Bulk merge added %d items, expected %d\n", program,
+            count, expected);
+    exit(1);
+  }
+
+#ifdef LIBRDF_DEBUG
+  librdf_bptree_check(tree);
+#endif
+
+  /* the array is now in order with the items already present cleared */
+  for(i = 0; i < ITEM_COUNT; i++) {
+    if(bulk[i] != ((i % 2) ? NULL : &copies[i])) {
+      fprintf(stderr, "%s: Bulk merge left item %d as %p\n", program, i,
+              bulk[i]);
+      exit(1);
+    }
+  }
+
+  if(librdf_bptree_size(tree) != ITEM_COUNT) {
+    fprintf(stderr, "%s: Tree size is %d after bulk merge, expected %d\n",
+            program, librdf_bptree_size(tree), ITEM_COUNT);
+    exit(1);
+  }
+
+  librdf_free_bptree(tree);
+
+  /* a versioned tree: an open iterator keeps seeing its snapshot */
+  versions = librdf_new_bptree_versions();
+  tree = librdf_new_bptree(compare_items, NULL);
+  if(!versions || !tree) {
+    fprintf(stderr, "%s: Failed to create versioned tree\n", program);
+    exit(1);
+  }
+  librdf_bptree_set_versions(tree, versions);
+
+  for(i = 0; i < ITEM_COUNT; i++)
+    bulk[i] = &items[i];
+  librdf_bptree_add_array(tree, bulk, ITEM_COUNT);
+
+  iter = librdf_bptree_get_iterator_start(world, tree, NULL, NULL);
+  for(i = 0; i < ITEM_COUNT; i += 2)
+    librdf_bptree_delete(tree, &items[i]);
+
+#ifdef LIBRDF_DEBUG
+  librdf_bptree_check(tree);
+#endif
+
+  for(count = 0; !librdf_iterator_end(iter); librdf_iterator_next(iter)) {
+    test_item* item = (test_item*)librdf_iterator_get_object(iter);
+
+    if(item != &items[count]) {
+      fprintf(stderr, "%s: Snapshot returned item %d, expected %d\n",
+              program, (int)(item - items), count);
+      exit(1);
+    }
+    count++;
+  }
+  librdf_free_iterator(iter);
+
+  if(count != ITEM_COUNT) {
+    fprintf(stderr, "%s: Snapshot returned %d items, expected %d\n",
+            program, count, ITEM_COUNT);
+    exit(1);
+  }
+
+  if(librdf_bptree_size(tree) != ITEM_COUNT / 2) {
+    fprintf(stderr, "%s: Versioned tree size is %d, expected %d\n",
+            program, librdf_bptree_size(tree), ITEM_COUNT / 2);
+    exit(1);
+  }
+
+  librdf_free_bptree(tree);
+  librdf_free_bptree_versions(versions);
+  librdf_free_world(world);
+
+  /* keep gcc -Wall happy */
+  return(0);
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef LIBRDF_BPTREE_H
+#define LIBRDF_BPTREE_H
+
+#ifndef LIBRDF_OBJC_FRAMEWORK
+#include <rdf_uri.h>
+#else
+#include <Redland/rdf_uri.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LIBRDF_BPTREE_ENOMEM -1
+#define LIBRDF_BPTREE_EXISTS 1
+
+typedef struct librdf_bptree_s librdf_bptree;
+typedef struct librdf_bptree_versions_s librdf_bptree_versions;
+typedef struct librdf_bptree_pin_s librdf_bptree_pin;
+
+typedef int (*librdf_bptree_data_compare_function)(const void* data1, const void* data2);
+typedef void (*librdf_bptree_data_free_function)(void* data);
+
+/* constructor / destructor */
+librdf_bptree* librdf_new_bptree(librdf_bptree_data_compare_function compare_fn, librdf_bptree_data_free_function free_fn);
+void librdf_free_bptree(librdf_bptree* tree);
+librdf_bptree_versions* librdf_new_bptree_versions(void);
+void librdf_free_bptree_versions(librdf_bptree_versions* versions);
+
+/* methods */
+int librdf_bptree_add(librdf_bptree* tree, void* p_data);
+int librdf_bptree_add_array(librdf_bptree* tree, void** items, int count);
+void* librdf_bptree_remove(librdf_bptree* tree, const void* p_data);
+int librdf_bptree_delete(librdf_bptree* tree, const void* p_data);
+void* librdf_bptree_search(librdf_bptree* tree, const void* p_data);
+int librdf_bptree_size(librdf_bptree* tree);
+void librdf_bptree_set_versions(librdf_bptree* tree, librdf_bptree_versions* versions);
+void librdf_bptree_versions_retire(librdf_bptree_versions* versions, void* data, librdf_bptree_data_free_function free_fn);
+librdf_bptree_pin* librdf_bptree_versions_pin(librdf_bptree_versions* versions);
+void librdf_bptree_versions_unpin(librdf_bptree_versions* versions, librdf_bptree_pin* pin);
+
+#ifdef LIBRDF_DEBUG
+void librdf_bptree_check(librdf_bptree* tree);
+#endif
+
+librdf_iterator* librdf_bptree_get_iterator_start(librdf_world* world,
+                                                  librdf_bptree* tree, void* range,
+                                                  librdf_bptree_data_free_function range_free_fn);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -87,6 +87,12 @@ librdf_init_hash(librdf_world *world)
   librdf_init_hash_datums(world);
 #ifdef HAVE_BDB_HASH
   librdf_init_hash_bdb(world);
+#endif
+#ifdef HAVE_MMAP_HASH
+  librdf_init_hash_mmap(world);
+#endif
+#ifdef HAVE_LSM_HASH
+  librdf_init_hash_lsm(world);
 #endif
   /* Always have hash in memory implementation available */
   librdf_init_hash_memory(world);
@@ -553,6 +559,12 @@ librdf_free_hash(librdf_hash* hash)
  * 
  * This method opens and/or creates a new hash with any resources it
  * needs.
+ *
+ * Option <literal>bloom-filter</literal> set to yes keeps a bloom
+ * filter of the pairs in the hash so that most lookups of missing
+ * pairs with librdf_hash_exists() do not reach the hash implementation.
+ * It is ignored for a hash that other processes may change while it
+ * is open.
  * 
  * Return value: non 0 on failure
  **/
@@ -572,9 +584,20 @@ librdf_hash_open(librdf_hash* hash, const char *identifier,
   status=hash->factory->open(hash->context, identifier, 
                              mode, is_writable, is_new, 
                              options);
-  if(!status)
-    hash->is_open=1;
-  return status;
+  if(status)
+    return status;
+  hash->is_open=1;
+
+  if(options && librdf_hash_get_as_boolean(options, "bloom-filter") > 0) {
+    /* the filter would miss pairs added by the other processes */
+    if(hash->factory->is_shared && hash->factory->is_shared(hash->context))
+      librdf_log(hash->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_HASH, NULL,
+                 "Hash is shared with other processes, lookups are not filtered");
+    else if(librdf_hash_filter_open(hash, identifier, is_writable, is_new))
+      librdf_log(hash->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_HASH, NULL,
+                 "Failed to make hash filter, lookups are not filtered");
+  }
+  return 0;
 }
 
 
@@ -590,6 +613,8 @@ int
 librdf_hash_close(librdf_hash* hash)
 {
   hash->is_open=0;
+  if(hash->filter)
+    librdf_hash_filter_close(hash);
   if(hash->identifier) {
     LIBRDF_FREE(cstring,hash->identifier);
     hash->identifier=NULL;
@@ -613,6 +638,51 @@ librdf_hash_values_count(librdf_hash* hash)
 }
 
 
+/**
+ * librdf_hash_key_values_count:
+ * @hash: hash object
+ * @key: pointer to key
+ *
+ * Get the number of values of one key in the hash.
+ * 
+ * Uses the hash factory count if it has one, otherwise the values
+ * are counted with a cursor.
+ * 
+ * Return value: number of values of the key or <0 on failure
+ **/
+int
+librdf_hash_key_values_count(librdf_hash* hash, librdf_hash_datum *key)
+{
+  librdf_hash_cursor* cursor;
+  librdf_hash_datum cursor_key, value; /* on stack */
+  int count=0;
+  int status;
+  
+  if(hash->factory->key_values_count)
+    return hash->factory->key_values_count(hash->context, key);
+
+  cursor=librdf_new_hash_cursor(hash);
+  if(!cursor)
+    return -1;
+
+  /* the cursor points the key at its own copy */
+  cursor_key.data=key->data;
+  cursor_key.size=key->size;
+  value.data=NULL;
+  value.size=0;
+
+  status=librdf_hash_cursor_set(cursor, &cursor_key, &value);
+  while(!status) {
+    count++;
+    status=librdf_hash_cursor_get_next_value(cursor, &cursor_key, &value);
+  }
+
+  librdf_free_hash_cursor(cursor);
+
+  return count;
+}
+
+
 /**
  * librdf_hash_get:
  * @hash: hash object
@@ -712,6 +782,43 @@ librdf_hash_get_one(librdf_hash* hash, librdf_hash_datum *key)
 }
 
 
+/**
+ * librdf_hash_get_one_pointer:
+ * @hash: hash object
+ * @key: pointer to key
+ *
+ * INTERNAL - Retrieve the pointer stored as the one value of a key.
+ * 
+ * For hashes of pointers such as the node and URI interning tables.
+ * Unlike librdf_hash_get_one() no datum is taken from the shared
+ * free list, so lookups in different hashes from different threads
+ * do not contend on the world's hash datums mutex.
+ * 
+ * Return value: the pointer or NULL if the key was not found
+ **/
+void*
+librdf_hash_get_one_pointer(librdf_hash* hash, librdf_hash_datum *key)
+{
+  librdf_hash_datum value; /* on stack - never on the free list */
+  librdf_hash_cursor *cursor;
+  void* pointer=NULL;
+  
+  cursor=librdf_new_hash_cursor(hash);
+  if(!cursor)
+    return NULL;
+
+  memset(&value, 0, sizeof(value));
+  if(!librdf_hash_cursor_set(cursor, key, &value) &&
+     value.size == sizeof(void*))
+    /* value.data points to SHARED area until the cursor is freed */
+    memcpy(&pointer, value.data, sizeof(void*));
+
+  librdf_free_hash_cursor(cursor);
+
+  return pointer;
+}
+
+
 typedef struct {
   librdf_hash* hash;
   librdf_hash_cursor* cursor;
@@ -722,6 +829,7 @@ typedef struct {
   librdf_hash_datum next_value;
   int is_end;
   int one_key;
+  int range; /* keys starting with key, see librdf_hash_get_range() */
 } librdf_hash_get_all_iterator_context;
 
 
@@ -784,6 +892,62 @@ librdf_hash_get_all(librdf_hash* hash,
 }
 
 
+/**
+ * librdf_hash_get_range:
+ * @hash: hash object
+ * @key: pointer to key prefix
+ * @value: pointer to value
+ *
+ * Retrieve all key/value pairs from hash with keys starting with a prefix.
+ * 
+ * For ordered (BTree) hashes this is a seek and a scan over the
+ * matching keys in key order, other hashes walk every key.
+ * The iterator returns #librdf_hash_datum objects containing the
+ * keys and values in shared memory which the caller must not free.
+ * 
+ * Return value: a #librdf_iterator of the matching pairs or NULL on failure
+ **/
+librdf_iterator*
+librdf_hash_get_range(librdf_hash* hash, 
+                      librdf_hash_datum *key, librdf_hash_datum *value)
+{
+  librdf_hash_get_all_iterator_context* context;
+  int status;
+  librdf_iterator* iterator;
+  
+  context=(librdf_hash_get_all_iterator_context*)LIBRDF_CALLOC(librdf_hash_get_all_iterator_context, 1, sizeof(librdf_hash_get_all_iterator_context));
+  if(!context)
+    return NULL;
+
+  if(!(context->cursor=librdf_new_hash_cursor(hash))) {
+    librdf_hash_get_all_iterator_finished(context);
+    return NULL;
+  }
+
+  context->range=1;
+  context->hash=hash;
+  context->key=key;
+  context->value=value;
+
+  context->next_key.data=key->data;
+  context->next_key.size=key->size;
+  status=librdf_hash_cursor_set_range(context->cursor, &context->next_key,
+                                      &context->next_value);
+
+  context->is_end=(status != 0);
+  
+  iterator=librdf_new_iterator(hash->world,
+                               (void*)context,
+                               librdf_hash_get_all_iterator_is_end,
+                               librdf_hash_get_all_iterator_next_method,
+                               librdf_hash_get_all_iterator_get_method,
+                               librdf_hash_get_all_iterator_finished);
+  if(!iterator)
+    librdf_hash_get_all_iterator_finished(context);
+  return iterator;
+}
+
+
 static int
 librdf_hash_get_all_iterator_is_end(void* iterator)
 {
@@ -804,7 +968,11 @@ librdf_hash_get_all_iterator_next_method(void* iterator)
   
   /* move on */
   
-  if(context->one_key)
+  if(context->range)
+    status=librdf_hash_cursor_get_next_range(context->cursor, 
+                                             &context->next_key,
+                                             &context->next_value);
+  else if(context->one_key)
     status=librdf_hash_cursor_get_next_value(context->cursor, 
                                              &context->next_key,
                                              &context->next_value);
@@ -929,7 +1097,12 @@ int
 librdf_hash_put(librdf_hash* hash, librdf_hash_datum *key, 
                 librdf_hash_datum *value)
 {
-  return hash->factory->put(hash->context, key, value);
+  int status;
+
+  status=hash->factory->put(hash->context, key, value);
+  if(!status && hash->filter)
+    librdf_hash_filter_add(hash, key, value);
+  return status;
 }
 
 
@@ -947,6 +1120,10 @@ int
 librdf_hash_exists(librdf_hash* hash, librdf_hash_datum *key,
                    librdf_hash_datum *value)
 {
+  /* most lookups of missing pairs end here */
+  if(hash->filter && !librdf_hash_filter_test(hash, key, value))
+    return 0;
+
   return hash->factory->exists(hash->context, key, value);
 }
 
@@ -965,7 +1142,12 @@ int
 librdf_hash_delete(librdf_hash* hash, librdf_hash_datum *key,
                    librdf_hash_datum *value)
 {
-  return hash->factory->delete_key_value(hash->context, key, value);
+  int status;
+
+  status=hash->factory->delete_key_value(hash->context, key, value);
+  if(!status && hash->filter)
+    librdf_hash_filter_delete(hash);
+  return status;
 }
 
 
@@ -981,7 +1163,12 @@ librdf_hash_delete(librdf_hash* hash, librdf_hash_datum *key,
 int
 librdf_hash_delete_all(librdf_hash* hash, librdf_hash_datum *key)
 {
-  return hash->factory->delete_key(hash->context, key);
+  int status;
+
+  status=hash->factory->delete_key(hash->context, key);
+  if(!status && hash->filter)
+    librdf_hash_filter_delete(hash);
+  return status;
 }
 
 
@@ -1143,6 +1330,106 @@ librdf_hash_sync(librdf_hash* hash)
 }
 
 
+/**
+ * librdf_hash_compact:
+ * @hash: hash object
+ *
+ * Reclaim space left unused in the hash file by deletions.
+ *
+ * Hashes that cannot do this are synced.
+ * 
+ * Return value: non 0 on failure
+ **/
+int
+librdf_hash_compact(librdf_hash* hash)
+{
+  if(hash->factory->compact)
+    return hash->factory->compact(hash->context);
+
+  return librdf_hash_sync(hash);
+}
+
+
+/**
+ * librdf_hash_transaction_start:
+ * @hash: hash object
+ *
+ * Start making changes to the hash in a transaction.
+ *
+ * Other hashes can make their changes in the same transaction with
+ * librdf_hash_transaction_join().
+ * 
+ * Return value: non 0 on failure or if transactions are not supported
+ **/
+int
+librdf_hash_transaction_start(librdf_hash* hash)
+{
+  if(hash->factory->transaction_start)
+    return hash->factory->transaction_start(hash->context);
+
+  return 1;
+}
+
+
+/**
+ * librdf_hash_transaction_join:
+ * @hash: hash object
+ * @leader: hash of the same type that started the transaction
+ *
+ * Make changes to the hash in the transaction started by @leader.
+ *
+ * The changes commit or roll back when @leader does, so @hash must
+ * be committed or rolled back first, which only ends its part.
+ * 
+ * Return value: non 0 on failure, including if the hashes cannot share
+ * a transaction
+ **/
+int
+librdf_hash_transaction_join(librdf_hash* hash, librdf_hash* leader)
+{
+  if(hash->factory == leader->factory && hash->factory->transaction_join)
+    return hash->factory->transaction_join(hash->context, leader->context);
+
+  return 1;
+}
+
+
+/**
+ * librdf_hash_transaction_commit:
+ * @hash: hash object
+ *
+ * Commit the transaction of the hash.
+ * 
+ * Return value: non 0 on failure, when the changes are rolled back
+ **/
+int
+librdf_hash_transaction_commit(librdf_hash* hash)
+{
+  if(hash->factory->transaction_commit)
+    return hash->factory->transaction_commit(hash->context);
+
+  return 1;
+}
+
+
+/**
+ * librdf_hash_transaction_rollback:
+ * @hash: hash object
+ *
+ * Roll back the transaction of the hash.
+ * 
+ * Return value: non 0 on failure
+ **/
+int
+librdf_hash_transaction_rollback(librdf_hash* hash)
+{
+  if(hash->factory->transaction_rollback)
+    return hash->factory->transaction_rollback(hash->context);
+
+  return 1;
+}
+
+
 /**
  * librdf_hash_get_fd:
  * @hash: hash object
@@ -1868,11 +2155,25 @@ librdf_hash_interpret_template(const unsigned char* template_string,
 int main(int argc, char *argv[]);
 
 
+/* non 0 if the hash has the key, with the value if it is not NULL */
+static int
+test_hash_has(librdf_hash* h, const char *key, const char *value)
+{
+  librdf_hash_datum hd_key, hd_value; /* on stack */
+
+  hd_key.data=(char*)key;
+  hd_key.size=strlen(key);
+  hd_value.data=(char*)value;
+  hd_value.size=value ? strlen(value) : 0;
+  return librdf_hash_exists(h, &hd_key, value ? &hd_value : NULL) > 0;
+}
+
+
 int
 main(int argc, char *argv[]) 
 {
   librdf_hash *h, *h2, *ch;
-  const char *test_hash_types[]={"bdb", "memory", NULL};
+  const char *test_hash_types[]={"bdb", "mmap", "lsm", "memory", NULL};
   const char *test_hash_values[]={"colour","yellow", /* Made in UK, can you guess? */
 			    "age", "new",
 			    "size", "large",
@@ -1975,6 +2276,63 @@ main(int argc, char *argv[])
     librdf_hash_print_values(h, test_duplicate_key, stdout);
     fputc('\n', stdout);
 
+    {
+      librdf_hash_datum hd_key; /* on stack */
+      hd_key.data=(char*)test_duplicate_key;
+      hd_key.size=strlen(test_duplicate_key);
+      fprintf(stdout, "%s: key '%s' has %d values\n", program,
+              test_duplicate_key, librdf_hash_key_values_count(h, &hd_key));
+    }
+
+    /* a prefix of test_duplicate_key only matches that key */
+    {
+      librdf_iterator* iterator;
+      librdf_hash_datum *key_hd, *value_hd;
+      int count=0;
+      int range_count=0;
+
+      key_hd=librdf_new_hash_datum(world, NULL, 0);
+      value_hd=librdf_new_hash_datum(world, NULL, 0);
+
+      key_hd->data=(char*)test_duplicate_key;
+      key_hd->size=strlen(test_duplicate_key);
+      iterator=librdf_hash_get_all(h, key_hd, value_hd);
+      for(; iterator && !librdf_iterator_end(iterator); librdf_iterator_next(iterator))
+        count++;
+      if(iterator)
+        librdf_free_iterator(iterator);
+
+      key_hd->data=(char*)test_duplicate_key;
+      key_hd->size=strlen(test_duplicate_key)-2;
+      iterator=librdf_hash_get_range(h, key_hd, value_hd);
+      for(; iterator && !librdf_iterator_end(iterator); librdf_iterator_next(iterator)) {
+        librdf_hash_datum *k=(librdf_hash_datum*)librdf_iterator_get_key(iterator);
+        if(k->size != strlen(test_duplicate_key) ||
+           memcmp(k->data, test_duplicate_key, k->size)) {
+          fprintf(stderr, "%s: %s hash range returned wrong key\n", program,
+                  type);
+          exit(1);
+        }
+        range_count++;
+      }
+      if(iterator)
+        librdf_free_iterator(iterator);
+
+      key_hd->data=NULL;
+      value_hd->data=NULL;
+      librdf_free_hash_datum(key_hd);
+      librdf_free_hash_datum(value_hd);
+
+      fprintf(stdout, "%s: %d values with key prefix '%.*s'\n", program,
+              range_count, (int)strlen(test_duplicate_key)-2,
+              test_duplicate_key);
+      if(range_count != count) {
+        fprintf(stderr, "%s: %s hash range returned %d values, expected %d\n",
+                program, type, range_count, count);
+        exit(1);
+      }
+    }
+
     fprintf(stdout, "%s: cloning %s hash\n", program, type);
     ch=librdf_new_hash_from_hash(h);
     if(ch) {
@@ -2132,6 +2490,191 @@ main(int argc, char *argv[])
 
   librdf_free_hash(h2);
 
+
+  /* a hash with a bloom filter still finds every pair it has */
+  {
+    librdf_hash *options;
+
+    fprintf(stdout, "%s: Trying a memory hash with a bloom filter\n", program);
+    options=librdf_new_hash(world, NULL);
+    librdf_hash_from_string(options, "bloom-filter='yes'");
+    h2=librdf_new_hash(world, "memory");
+    if(librdf_hash_open(h2, NULL, 0644, 1, 1, options) || !h2->filter) {
+      fprintf(stderr, "%s: Failed to open memory hash with a bloom filter\n",
+              program);
+      exit(1);
+    }
+
+    for(j=0; test_hash_values[j]; j+=2) {
+      hd_key.data=(char*)test_hash_values[j];
+      hd_key.size=strlen((char*)hd_key.data);
+      hd_value.data=(char*)test_hash_values[j+1];
+      hd_value.size=strlen((char*)hd_value.data);
+      librdf_hash_put(h2, &hd_key, &hd_value);
+    }
+
+    hd_key.data=(char*)"fruit";
+    hd_key.size=5;
+    hd_value.data=(char*)"banana";
+    hd_value.size=6;
+    librdf_hash_delete(h2, &hd_key, &hd_value);
+
+    for(j=0; test_hash_values[j]; j+=2) {
+      int expected=strcmp(test_hash_values[j], "fruit") ? 1 : 0;
+
+      hd_key.data=(char*)test_hash_values[j];
+      hd_key.size=strlen((char*)hd_key.data);
+      hd_value.data=(char*)test_hash_values[j+1];
+      hd_value.size=strlen((char*)hd_value.data);
+      if((librdf_hash_exists(h2, &hd_key, &hd_value) > 0) != expected ||
+         (librdf_hash_exists(h2, &hd_key, NULL) > 0) != expected) {
+        fprintf(stderr, "%s: Filtered hash lookup of %s=%s failed\n",
+                program, test_hash_values[j], test_hash_values[j+1]);
+        exit(1);
+      }
+    }
+
+    librdf_free_hash(h2);
+    librdf_free_hash(options);
+  }
+
+
+  /* a memory hash key with many values gets a value set, which is
+   * dropped again when few values are left */
+  {
+    char value_buffer[16];
+    int phase;
+
+    fprintf(stdout, "%s: Trying a memory hash key with many values\n", program);
+    h2=librdf_new_hash(world, "memory");
+    if(librdf_hash_open(h2, NULL, 0644, 1, 1, NULL)) {
+      fprintf(stderr, "%s: Failed to open memory hash\n", program);
+      exit(1);
+    }
+
+    hd_key.data=(char*)"type";
+    hd_key.size=4;
+    for(j=0; j < 100; j++) {
+      sprintf(value_buffer, "class%d", j);
+      hd_value.data=value_buffer;
+      hd_value.size=strlen(value_buffer);
+      librdf_hash_put(h2, &hd_key, &hd_value);
+    }
+
+    /* phase 0: all values, 1: even ones deleted, 2: 95, 97 and 99 left */
+    for(phase=0; phase < 3; phase++) {
+      int count=0;
+
+      if(phase) {
+        for(j=(phase == 1) ? 0 : 1; j < ((phase == 1) ? 100 : 95); j+= 2) {
+          sprintf(value_buffer, "class%d", j);
+          hd_value.data=value_buffer;
+          hd_value.size=strlen(value_buffer);
+          if(librdf_hash_delete(h2, &hd_key, &hd_value)) {
+            fprintf(stderr, "%s: Failed to delete value %s\n", program,
+                    value_buffer);
+            exit(1);
+          }
+        }
+      }
+
+      for(j=0; j < 100; j++) {
+        int expected=(phase == 0) || (phase == 1 && (j & 1)) || (j >= 95 && (j & 1));
+
+        sprintf(value_buffer, "class%d", j);
+        if(test_hash_has(h2, "type", value_buffer) != expected) {
+          fprintf(stderr, "%s: Memory hash lookup of type=%s failed\n",
+                  program, value_buffer);
+          exit(1);
+        }
+        count+= expected;
+      }
+
+      if(librdf_hash_key_values_count(h2, &hd_key) != count) {
+        fprintf(stderr, "%s: Memory hash key has %d values, expected %d\n",
+                program, librdf_hash_key_values_count(h2, &hd_key), count);
+        exit(1);
+      }
+    }
+
+    librdf_free_hash(h2);
+  }
+
+
+  /* memory hash keys are found while they are moved into a grown
+   * table, and when a cursor held open stops the moving while the
+   * table grows twice after many deletes */
+  {
+    char key_buffer[16];
+    librdf_hash_cursor* cursor;
+    int expected;
+
+    fprintf(stdout, "%s: Trying a growing memory hash\n", program);
+    h2=librdf_new_hash(world, "memory");
+    if(librdf_hash_open(h2, NULL, 0644, 1, 1, NULL)) {
+      fprintf(stderr, "%s: Failed to open memory hash\n", program);
+      exit(1);
+    }
+
+    for(j=0; j < 1000; j++) {
+      sprintf(key_buffer, "key%d", j);
+      hd_key.data=key_buffer;
+      hd_key.size=strlen(key_buffer);
+      librdf_hash_put(h2, &hd_key, &hd_key);
+
+      sprintf(key_buffer, "key%d", j / 2);
+      if(!test_hash_has(h2, key_buffer, key_buffer)) {
+        fprintf(stderr, "%s: Memory hash lost %s while growing\n", program,
+                key_buffer);
+        exit(1);
+      }
+    }
+
+    for(j=0; j < 900; j++) {
+      sprintf(key_buffer, "key%d", j);
+      hd_key.data=key_buffer;
+      hd_key.size=strlen(key_buffer);
+      librdf_hash_delete_all(h2, &hd_key);
+    }
+
+    cursor=librdf_new_hash_cursor(h2);
+    if(!cursor || librdf_hash_cursor_get_first(cursor, &hd_key, &hd_value)) {
+      fprintf(stderr, "%s: Failed to start memory hash cursor\n", program);
+      exit(1);
+    }
+
+    for(j=1000; j < 7000; j++) {
+      sprintf(key_buffer, "key%d", j);
+      hd_key.data=key_buffer;
+      hd_key.size=strlen(key_buffer);
+      if(librdf_hash_put(h2, &hd_key, &hd_key)) {
+        fprintf(stderr, "%s: Failed to add %s with a cursor open\n", program,
+                key_buffer);
+        exit(1);
+      }
+    }
+
+    librdf_free_hash_cursor(cursor);
+
+    for(j=0; j < 7000; j++) {
+      expected=(j >= 900);
+      sprintf(key_buffer, "key%d", j);
+      if(test_hash_has(h2, key_buffer, NULL) != expected) {
+        fprintf(stderr, "%s: Memory hash lookup of %s failed\n", program,
+                key_buffer);
+        exit(1);
+      }
+    }
+
+    if(librdf_hash_values_count(h2) != 7000 - 900) {
+      fprintf(stderr, "%s: Memory hash has %d values, expected %d\n",
+              program, librdf_hash_values_count(h2), 7000 - 900);
+      exit(1);
+    }
+
+    librdf_free_hash(h2);
+  }
+
    
   librdf_free_world(world);
   
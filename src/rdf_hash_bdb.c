@@ -40,6 +40,13 @@
 #ifdef HAVE_STDLIB_H
 #include <stdlib.h>
 #endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h> /* for getcwd() */
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <time.h>
 
 
 #ifdef HAVE_DB_H
@@ -50,6 +57,65 @@
 #include <rdf_hash.h>
 
 
+/* BDB 4.0+ environments with 4 argument DB_ENV->open() */
+#if defined(HAVE_BDB_OPEN_6_ARGS) || defined(HAVE_BDB_OPEN_7_ARGS)
+#define LIBRDF_HASH_BDB_ENV 1
+#endif
+
+/* BDB 4.1+ transactional environments, needing DB_AUTO_COMMIT opens */
+#if defined(HAVE_BDB_OPEN_7_ARGS) && defined(DB_INIT_TXN) && defined(DB_AUTO_COMMIT)
+#define LIBRDF_HASH_BDB_TRANSACTIONS 1
+#endif
+
+#define LIBRDF_HASH_BDB_GIGABYTE (1024L * 1024L * 1024L)
+
+/* cursors read pairs in bulk with DB_MULTIPLE_KEY (BDB 3.2+) */
+#if defined(HAVE_BDB_CURSOR) && defined(DB_MULTIPLE_KEY)
+#define LIBRDF_HASH_BDB_BULK 1
+/* starting bulk buffer size, a multiple of 1024 */
+#define LIBRDF_HASH_BDB_BULK_SIZE (64 * 1024)
+#endif
+
+#ifdef LIBRDF_HASH_BDB_ENV
+/*
+ * Hashes opened with option bdb-env-dir share one BDB environment
+ * per directory and so one buffer pool, sized by option cache-size
+ * when the first hash opens it.  The environments are kept in a list
+ * on the world, locked by the world mutex, and closed when their last
+ * hash is closed.  They are opened with DB_THREAD since hashes of
+ * storages used in different threads share them.
+ */
+struct librdf_hash_bdb_env_s
+{
+  struct librdf_hash_bdb_env_s* next;
+  char *dir;
+  DB_ENV *env;
+  /* non 0 for Concurrent Data Store locking */
+  int is_concurrent;
+  /* non 0 for a transactional environment (option transactions) */
+  int is_transactional;
+  /* number of open hashes using it (locked by the world mutex) */
+  int usage;
+};
+
+/* non 0 if other processes may write the hash while it is open */
+#define LIBRDF_HASH_BDB_IS_SHARED(bdb_context) \
+  ((bdb_context)->env && \
+   ((bdb_context)->env->is_concurrent || (bdb_context)->env->is_transactional))
+#else
+#define LIBRDF_HASH_BDB_IS_SHARED(bdb_context) 0
+#endif
+typedef struct librdf_hash_bdb_env_s librdf_hash_bdb_env;
+
+#ifdef LIBRDF_HASH_BDB_TRANSACTIONS
+/* the transaction of the hash if any, passed to every BDB call */
+#define LIBRDF_HASH_BDB_TXN(bdb_context) \
+  ((bdb_context)->in_transaction ? (bdb_context)->txn : NULL)
+#else
+#define LIBRDF_HASH_BDB_TXN(bdb_context) NULL
+#endif
+
+
 typedef struct 
 {
   librdf_hash *hash;
@@ -59,9 +125,51 @@ typedef struct
   /* for BerkeleyDB only */
   DB* db;
   char* file_name;
+  /* number of key/value pairs or <0 if not known */
+  long values_count;
+  /* generation of the stored pairs or <0 if not known */
+  long generation;
+  /* non 0 once the pairs were changed since the hash was opened */
+  int changed;
+  /* shared environment or NULL */
+  librdf_hash_bdb_env* env;
+  /* non 0 while changes are made in txn */
+  int in_transaction;
+#ifdef LIBRDF_HASH_BDB_TRANSACTIONS
+  /* The transaction begun by this hash in transaction_start or joined
+   * from the hash that did, usually another index of one storage.
+   * Transactions only exist in shared environments so no count is
+   * kept that would need restoring on rollback. */
+  DB_TXN* txn;
+  /* non 0 if this hash began txn and so ends it */
+  int owns_txn;
+#endif
 } librdf_hash_bdb_context;
 
 
+/*
+ * The number of key/value pairs is kept in a metadata record with
+ * this key, which sorts before any text key and is skipped by cursors.
+ * Its value is the count, 'c' if the hash was closed cleanly or 'o'
+ * while it is open for writing, and the generation of the pairs; after
+ * a crash neither is trusted and the pairs are counted again.
+ *
+ * The generation goes up by one when a hash opened for writing is
+ * first changed, or starts from the time if it was not known, so a
+ * cleanly closed hash with the same generation has the same pairs.
+ * It stamps files derived from the pairs such as saved bloom filters.
+ *
+ * A hash in a concurrent or transactional environment may be written
+ * by other processes, so it keeps no count: the record is marked open
+ * and the pairs are counted each time the count is asked for.
+ */
+static const char librdf_hash_bdb_meta_key[]="\0redland:count";
+
+#define LIBRDF_HASH_BDB_IS_META_KEY(dbt) \
+  ((dbt).size == sizeof(librdf_hash_bdb_meta_key)-1 && \
+   !memcmp((dbt).data, librdf_hash_bdb_meta_key, (dbt).size))
+
+
 /* Implementing the hash cursor */
 static int librdf_hash_bdb_cursor_init(void *cursor_context, void *hash_context);
 static int librdf_hash_bdb_cursor_get(void *context, librdf_hash_datum* key, librdf_hash_datum* value, unsigned int flags);
@@ -75,12 +183,34 @@ static int librdf_hash_bdb_open(void* context, const char *identifier, int mode,
 static int librdf_hash_bdb_close(void* context);
 static int librdf_hash_bdb_clone(librdf_hash* new_hash, void *new_context, char *new_identifier, void* old_context);
 static int librdf_hash_bdb_values_count(void *context);
+#ifdef HAVE_BDB_CURSOR_COUNT
+static int librdf_hash_bdb_key_values_count(void *context, librdf_hash_datum *key);
+#endif
+static int librdf_hash_bdb_read_meta(librdf_hash_bdb_context* bdb_context, long *count_p, int *is_clean_p, long *generation_p);
+static int librdf_hash_bdb_write_meta(librdf_hash_bdb_context* bdb_context, int is_clean);
+static long librdf_hash_bdb_count_values(librdf_hash_bdb_context* bdb_context);
+static int librdf_hash_bdb_open_count(librdf_hash_bdb_context* bdb_context);
+static void librdf_hash_bdb_changed(librdf_hash_bdb_context* bdb_context);
+static long librdf_hash_bdb_generation(void* context);
+static int librdf_hash_bdb_is_shared(void* context);
+#ifdef LIBRDF_HASH_BDB_ENV
+static int librdf_hash_bdb_open_env(librdf_hash_bdb_context* bdb_context, librdf_hash* options);
+static void librdf_hash_bdb_close_env(librdf_hash_bdb_context* bdb_context);
+#endif
+static char* librdf_hash_bdb_file_name(librdf_hash_bdb_context* bdb_context, const char *identifier);
 static int librdf_hash_bdb_put(void* context, librdf_hash_datum *key, librdf_hash_datum *data);
 static int librdf_hash_bdb_exists(void* context, librdf_hash_datum *key, librdf_hash_datum *value);
 static int librdf_hash_bdb_delete_key(void* context, librdf_hash_datum *key);
 static int librdf_hash_bdb_delete_key_value(void* context, librdf_hash_datum *key, librdf_hash_datum *value);
 static int librdf_hash_bdb_sync(void* context);
 static int librdf_hash_bdb_get_fd(void* context);
+#ifdef LIBRDF_HASH_BDB_TRANSACTIONS
+static int librdf_hash_bdb_transaction_start(void* context);
+static int librdf_hash_bdb_transaction_join(void* context, void* leader_context);
+static int librdf_hash_bdb_transaction_end(librdf_hash_bdb_context* bdb_context, int commit);
+static int librdf_hash_bdb_transaction_commit(void* context);
+static int librdf_hash_bdb_transaction_rollback(void* context);
+#endif
 
 static void librdf_hash_bdb_register_factory(librdf_hash_factory *factory);
 
@@ -117,7 +247,10 @@ librdf_hash_bdb_create(librdf_hash* hash, void* context)
 static int
 librdf_hash_bdb_destroy(void* context) 
 {
-  /* NOP */
+#ifdef LIBRDF_HASH_BDB_ENV
+  /* when an open failed */
+  librdf_hash_bdb_close_env((librdf_hash_bdb_context*)context);
+#endif
   return 0;
 }
 
@@ -129,10 +262,21 @@ librdf_hash_bdb_destroy(void* context)
  * @mode: file creation mode
  * @is_writable: is hash writable?
  * @is_new: is hash new?
- * @options: hash options (currently unused)
+ * @options: hash options
  *
  * Open and maybe create a BerkeleyDB hash.
  * 
+ * Option <literal>bdb-env-dir</literal> opens the hash inside the
+ * BDB environment in that directory, shared with the other hashes
+ * using it; options <literal>cache-size</literal> and
+ * <literal>mmap-size</literal> (bytes) and boolean
+ * <literal>concurrent</literal> (Concurrent Data Store locking) or
+ * <literal>transactions</literal> set it up when it is first opened.
+ * Without an environment
+ * <literal>cache-size</literal> sizes the cache of this hash alone.
+ * Option <literal>page-size</literal> sets the page size of a new
+ * file.
+ * 
  * Return value: non 0 on failure.
  **/
 static int
@@ -141,10 +285,13 @@ librdf_hash_bdb_open(void* context, const char *identifier,
                      librdf_hash* options) 
 {
   librdf_hash_bdb_context* bdb_context=(librdf_hash_bdb_context*)context;
-  DB* bdb;
-  char *file;
+  DB* bdb=NULL;
+  char *file=NULL;
   int ret;
   int flags;
+#ifdef HAVE_DB_CREATE
+  long size;
+#endif
 
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(identifier, cstring, 1);
   
@@ -152,34 +299,62 @@ librdf_hash_bdb_open(void* context, const char *identifier,
   DB_INFO bdb_info;
 #endif
   
-  /* NOTE: If the options parameter is ever used here, the data must be
-   * copied into a private part of the context so that the clone
-   * method can access them
+  /* NOTE: Options used here must be copied into a private part of
+   * the context so that the clone method can access them; the
+   * environment is.
    */
   bdb_context->mode=mode;
   bdb_context->is_writable=is_writable;
   bdb_context->is_new=is_new;
-  
-  file=(char*)LIBRDF_MALLOC(cstring, strlen(identifier)+4);
-  if(!file)
+
+#ifdef LIBRDF_HASH_BDB_ENV
+  if(options && librdf_hash_bdb_open_env(bdb_context, options))
     return 1;
-  sprintf(file, "%s.db", identifier);
+#endif
+
+  file=librdf_hash_bdb_file_name(bdb_context, identifier);
+  if(!file)
+    goto failed;
 
 #ifdef HAVE_DB_CREATE
   /* V3 prototype:
    * int db_create(DB **dbp, DB_ENV *dbenv, u_int32_t flags);
    */
-  if((ret=db_create(&bdb, NULL, 0))) {
+#ifdef LIBRDF_HASH_BDB_ENV
+  ret=db_create(&bdb, bdb_context->env ? bdb_context->env->env : NULL, 0);
+#else
+  ret=db_create(&bdb, NULL, 0);
+#endif
+  if(ret) {
     LIBRDF_DEBUG2("Failed to create BDB context - %d\n", ret);
-    return 1;
+    bdb=NULL;
+    goto failed;
   }
   
 #ifdef HAVE_BDB_SET_FLAGS
   if((ret=bdb->set_flags(bdb, DB_DUP))) {
     LIBRDF_DEBUG2("Failed to set BDB duplicate flag - %d\n", ret);
-    return 1;
+    goto failed;
   }
 #endif
+
+  /* only used when the file is created */
+  size=options ? librdf_hash_get_as_long(options, "page-size") : -1;
+  if(size > 0 && (ret=bdb->set_pagesize(bdb, (u_int32_t)size))) {
+    librdf_log(bdb_context->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+               "BDB page size %ld failed - %s", size, db_strerror(ret));
+    goto failed;
+  }
+
+  /* a cache for this file alone, otherwise the environment has one */
+  size=(options && !bdb_context->env) ? librdf_hash_get_as_long(options, "cache-size") : -1;
+  if(size > 0 &&
+     (ret=bdb->set_cachesize(bdb, (u_int32_t)(size / LIBRDF_HASH_BDB_GIGABYTE),
+                             (u_int32_t)(size % LIBRDF_HASH_BDB_GIGABYTE), 1))) {
+    librdf_log(bdb_context->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+               "BDB cache size %ld failed - %s", size, db_strerror(ret));
+    goto failed;
+  }
   
   /* V3 prototype:
    * int DB->open(DB *db, const char *file, const char *database,
@@ -190,6 +365,28 @@ librdf_hash_bdb_open(void* context, const char *identifier,
     flags |= DB_TRUNCATE;
 #endif
 
+#if defined(LIBRDF_HASH_BDB_ENV) && defined(HAVE_BDB_OPEN_7_ARGS)
+  if(bdb_context->env &&
+     (bdb_context->env->is_concurrent || bdb_context->env->is_transactional)) {
+    /* DB_TRUNCATE is not allowed with locking, so remove the file;
+     * DB_ENV->dbremove is BDB 4.1+ */
+    if(is_new && is_writable) {
+      flags &= ~DB_TRUNCATE;
+      ret=bdb_context->env->env->dbremove(bdb_context->env->env, NULL, file, NULL,
+                                          bdb_context->env->is_transactional ? DB_AUTO_COMMIT : 0);
+      if(ret && ret != ENOENT) {
+        librdf_log(bdb_context->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+                   "BDB remove of '%s' failed - %s", file, db_strerror(ret));
+        goto failed;
+      }
+    }
+#ifdef LIBRDF_HASH_BDB_TRANSACTIONS
+    if(bdb_context->env->is_transactional)
+      flags |= DB_AUTO_COMMIT;
+#endif
+  }
+#endif
+
 #if defined(HAVE_BDB_OPEN_6_ARGS) || defined(HAVE_BDB_OPEN_7_ARGS)
 
 #ifdef HAVE_BDB_OPEN_6_ARGS  
@@ -200,8 +397,7 @@ librdf_hash_bdb_open(void* context, const char *identifier,
   if((ret=bdb->open(bdb, file, NULL, DB_BTREE, flags, mode))) {
     librdf_log(bdb_context->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
                "BDB V4.0+ open of '%s' failed - %s", file, db_strerror(ret));
-    LIBRDF_FREE(cstring, file);
-    return 1;
+    goto failed;
   }
 #else
 /* Must be HAVE_BDB_OPEN_7_ARGS */
@@ -213,8 +409,7 @@ librdf_hash_bdb_open(void* context, const char *identifier,
   if((ret=bdb->open(bdb, NULL, file, NULL, DB_BTREE, flags, mode))) {
     librdf_log(bdb_context->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
                "BDB V4.1+ open of '%s' failed - %s", file, db_strerror(ret));
-    LIBRDF_FREE(cstring, file);
-    return 1;
+    goto failed;
   }
 #endif
 
@@ -235,8 +430,8 @@ librdf_hash_bdb_open(void* context, const char *identifier,
   if((ret=db_open(file, DB_BTREE, flags, mode, NULL, &bdb_info, &bdb))) {
     librdf_log(bdb_context->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
                "BDB V2 open of '%s' failed - %d", file, ret);
-    LIBRDF_FREE(cstring, file);
-    return 1;
+    bdb=NULL;
+    goto failed;
   }
 #else
 #ifdef HAVE_DBOPEN
@@ -254,8 +449,8 @@ librdf_hash_bdb_open(void* context, const char *identifier,
   if((bdb=dbopen(file, flags, mode, DB_BTREE, NULL)) == 0) {
     librdf_log(bdb_context->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
                "BDB V1 open of '%s' failed - %d", file, ret);
-    LIBRDF_FREE(cstring, file);
-    return 1;
+    bdb=NULL;
+    goto failed;
   }
   ret=0;
 #else
@@ -270,7 +465,27 @@ ERROR - no idea how to use Berkeley DB
 
   bdb_context->db=bdb;
   bdb_context->file_name=file;
-  return 0;
+
+  if(!librdf_hash_bdb_open_count(bdb_context))
+    return 0;
+
+  bdb_context->db=NULL;
+  bdb_context->file_name=NULL;
+
+  failed:
+  if(bdb) {
+#ifdef HAVE_BDB_CLOSE_2_ARGS
+    bdb->close(bdb, 0);
+#else
+    bdb->close(bdb);
+#endif
+  }
+  if(file)
+    LIBRDF_FREE(cstring, file);
+#ifdef LIBRDF_HASH_BDB_ENV
+  librdf_hash_bdb_close_env(bdb_context);
+#endif
+  return 1;
 }
 
 
@@ -292,6 +507,17 @@ librdf_hash_bdb_close(void* context)
   DB* db=bdb_context->db;
   int ret;
   
+#ifdef LIBRDF_HASH_BDB_TRANSACTIONS
+  /* an unfinished transaction is lost */
+  if(bdb_context->in_transaction)
+    librdf_hash_bdb_transaction_end(bdb_context, 0);
+#endif
+
+  /* the count can be trusted on the next open; never set when shared */
+  if(bdb_context->is_writable && bdb_context->values_count >= 0 &&
+     !LIBRDF_HASH_BDB_IS_SHARED(bdb_context))
+    librdf_hash_bdb_write_meta(bdb_context, 1);
+
 #ifdef HAVE_BDB_CLOSE_2_ARGS
   /* V2/V3 */
   ret=db->close(db, 0);
@@ -300,6 +526,11 @@ librdf_hash_bdb_close(void* context)
   ret=db->close(db);
 #endif
   LIBRDF_FREE(cstring, bdb_context->file_name);
+
+#ifdef LIBRDF_HASH_BDB_ENV
+  librdf_hash_bdb_close_env(bdb_context);
+#endif
+
   return ret;
 }
 
@@ -331,8 +562,19 @@ librdf_hash_bdb_clone(librdf_hash *hash, void* context, char *new_identifier,
   /* copy data fields that might change */
   hcontext->hash=hash;
 
-  /* Note: The options are not used at present, so no need to make a copy 
-   */
+#ifdef LIBRDF_HASH_BDB_ENV
+  /* Note: Only the environment is kept from the options */
+  if(old_hcontext->env) {
+#ifdef WITH_THREADS
+    pthread_mutex_lock(hash->world->mutex);
+#endif
+    hcontext->env=old_hcontext->env;
+    hcontext->env->usage++;
+#ifdef WITH_THREADS
+    pthread_mutex_unlock(hash->world->mutex);
+#endif
+  }
+#endif
   if(librdf_hash_bdb_open(context, new_identifier,
                           old_hcontext->mode, old_hcontext->is_writable,
                           old_hcontext->is_new, NULL))
@@ -379,7 +621,568 @@ librdf_hash_bdb_clone(librdf_hash *hash, void* context, char *new_identifier,
 static int
 librdf_hash_bdb_values_count(void *context) 
 {
-  return -1;
+  librdf_hash_bdb_context* bdb_context=(librdf_hash_bdb_context*)context;
+
+  /* other processes may have changed it since the last count */
+  if(LIBRDF_HASH_BDB_IS_SHARED(bdb_context))
+    return (int)librdf_hash_bdb_count_values(bdb_context);
+
+  /* not trusted when opened read-only after a crash, so count once */
+  if(bdb_context->values_count < 0)
+    bdb_context->values_count=librdf_hash_bdb_count_values(bdb_context);
+
+  return (int)bdb_context->values_count;
+}
+
+
+#ifdef HAVE_BDB_CURSOR_COUNT
+/**
+ * librdf_hash_bdb_key_values_count:
+ * @context: BerkeleyDB hash context
+ * @key: pointer to key
+ *
+ * Get the number of values of one key in the hash.
+ * 
+ * Return value: number of values of the key or <0 on failure
+ **/
+static int
+librdf_hash_bdb_key_values_count(void *context, librdf_hash_datum *key) 
+{
+  librdf_hash_bdb_context* bdb_context=(librdf_hash_bdb_context*)context;
+  DB* bdb=bdb_context->db;
+  DBC* dbc;
+  DBT bdb_key, bdb_value;
+  db_recno_t count=0;
+  int ret;
+
+  memset(&bdb_key, 0, sizeof(DBT));
+  memset(&bdb_value, 0, sizeof(DBT));
+
+  bdb_key.data = (char*)key->data;
+  bdb_key.size = key->size;
+
+#ifdef HAVE_BDB_CURSOR_4_ARGS
+  if(bdb->cursor(bdb, LIBRDF_HASH_BDB_TXN(bdb_context), &dbc, 0))
+    return -1;
+#else
+  if(bdb->cursor(bdb, NULL, &dbc))
+    return -1;
+#endif
+
+  ret=dbc->c_get(dbc, &bdb_key, &bdb_value, DB_SET);
+  if(!ret)
+    ret=dbc->c_count(dbc, &count, 0);
+  else if(ret == DB_NOTFOUND)
+    ret=0;
+
+  dbc->c_close(dbc);
+
+  return ret ? -1 : (int)count;
+}
+#endif
+
+
+/*
+ * librdf_hash_bdb_read_meta:
+ * @bdb_context: BerkeleyDB hash context
+ * @count_p: pointer to store the number of key/value pairs
+ * @is_clean_p: pointer to store non 0 if the hash was closed cleanly
+ * @generation_p: pointer to store the generation, <0 if not recorded
+ *
+ * INTERNAL - Read the metadata record
+ *
+ * Return value: non 0 if there is no valid metadata record
+ **/
+static int
+librdf_hash_bdb_read_meta(librdf_hash_bdb_context* bdb_context,
+                          long *count_p, int *is_clean_p, long *generation_p)
+{
+  DB* db=bdb_context->db;
+  DBT bdb_key, bdb_value;
+  char buffer[64];
+  char state;
+  int ret;
+
+  memset(&bdb_key, 0, sizeof(DBT));
+  memset(&bdb_value, 0, sizeof(DBT));
+
+  bdb_key.data = (char*)librdf_hash_bdb_meta_key;
+  bdb_key.size = sizeof(librdf_hash_bdb_meta_key)-1;
+
+#ifdef HAVE_BDB_DB_TXN
+  /* V2/V3 */
+  ret=db->get(db, LIBRDF_HASH_BDB_TXN(bdb_context), &bdb_key, &bdb_value, 0);
+#else
+  /* V1 */
+  ret=db->get(db, &bdb_key, &bdb_value, 0);
+#endif
+  if(ret || bdb_value.size >= sizeof(buffer))
+    return 1;
+
+  memcpy(buffer, bdb_value.data, bdb_value.size);
+  buffer[bdb_value.size]='\0';
+  /* records written before generations were kept have two fields */
+  *generation_p= -1;
+  if(sscanf(buffer, "%ld %c %ld", count_p, &state, generation_p) < 2)
+    return 1;
+
+  *is_clean_p=(state == 'c');
+  return 0;
+}
+
+
+/*
+ * librdf_hash_bdb_write_meta:
+ * @bdb_context: BerkeleyDB hash context
+ * @is_clean: non 0 if the hash is being closed
+ *
+ * INTERNAL - Write the metadata record with the current count and generation
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_bdb_write_meta(librdf_hash_bdb_context* bdb_context, int is_clean)
+{
+  DB* db=bdb_context->db;
+  DBT bdb_key, bdb_value;
+  char buffer[64];
+  int ret;
+
+  memset(&bdb_key, 0, sizeof(DBT));
+  memset(&bdb_value, 0, sizeof(DBT));
+
+  bdb_key.data = (char*)librdf_hash_bdb_meta_key;
+  bdb_key.size = sizeof(librdf_hash_bdb_meta_key)-1;
+
+  sprintf(buffer, "%ld %c %ld", bdb_context->values_count,
+          is_clean ? 'c' : 'o', bdb_context->generation);
+  bdb_value.data = buffer;
+  bdb_value.size = strlen(buffer);
+
+  /* keys may have duplicate values so replace the record */
+#ifdef HAVE_BDB_DB_TXN
+  /* V2/V3 */
+  db->del(db, LIBRDF_HASH_BDB_TXN(bdb_context), &bdb_key, 0);
+  ret=db->put(db, LIBRDF_HASH_BDB_TXN(bdb_context), &bdb_key, &bdb_value, 0);
+#else
+  /* V1 */
+  db->del(db, &bdb_key, 0);
+  ret=db->put(db, &bdb_key, &bdb_value, 0);
+#endif
+  if(ret)
+    LIBRDF_DEBUG2("BDB metadata put failed - %d\n", ret);
+
+  return (ret != 0);
+}
+
+
+/*
+ * librdf_hash_bdb_count_values:
+ * @bdb_context: BerkeleyDB hash context
+ *
+ * INTERNAL - Count the key/value pairs by walking the hash
+ *
+ * Return value: number of key/value pairs or <0 on failure
+ **/
+static long
+librdf_hash_bdb_count_values(librdf_hash_bdb_context* bdb_context)
+{
+  librdf_hash_cursor* cursor;
+  librdf_hash_datum key, value; /* on stack */
+  long count=0;
+  int status;
+
+  cursor=librdf_new_hash_cursor(bdb_context->hash);
+  if(!cursor)
+    return -1;
+
+  key.data=NULL; key.size=0;
+  value.data=NULL; value.size=0;
+
+  status=librdf_hash_cursor_get_first(cursor, &key, &value);
+  while(!status) {
+    count++;
+    status=librdf_hash_cursor_get_next(cursor, &key, &value);
+  }
+
+  librdf_free_hash_cursor(cursor);
+
+  return count;
+}
+
+
+/*
+ * librdf_hash_bdb_open_count:
+ * @bdb_context: BerkeleyDB hash context
+ *
+ * INTERNAL - Get the number of key/value pairs when opening the hash
+ *
+ * When opened for writing, the metadata record is marked as open so
+ * that a crash before close makes the next open count again.  A
+ * shared hash leaves the count unknown and keeps the record marked
+ * open, since other writers do not update this count.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_bdb_open_count(librdf_hash_bdb_context* bdb_context)
+{
+  long count;
+  long generation;
+  int is_clean=0;
+
+  bdb_context->values_count= -1;
+  bdb_context->generation= -1;
+  bdb_context->changed=0;
+
+  if(LIBRDF_HASH_BDB_IS_SHARED(bdb_context))
+    return bdb_context->is_writable ? librdf_hash_bdb_write_meta(bdb_context, 0) : 0;
+
+  if(bdb_context->is_new)
+    bdb_context->values_count=0;
+  else if(!librdf_hash_bdb_read_meta(bdb_context, &count, &is_clean,
+                                     &generation) &&
+          is_clean) {
+    bdb_context->values_count=count;
+    bdb_context->generation=generation;
+  } else if(bdb_context->is_writable)
+    bdb_context->values_count=librdf_hash_bdb_count_values(bdb_context);
+
+  if(bdb_context->is_writable && bdb_context->values_count >= 0)
+    return librdf_hash_bdb_write_meta(bdb_context, 0);
+
+  return 0;
+}
+
+
+/*
+ * librdf_hash_bdb_changed:
+ * @bdb_context: BerkeleyDB hash context
+ *
+ * INTERNAL - Start a new generation on the first change since open
+ **/
+static void
+librdf_hash_bdb_changed(librdf_hash_bdb_context* bdb_context)
+{
+  if(bdb_context->changed)
+    return;
+  bdb_context->changed=1;
+
+  if(bdb_context->generation >= 0)
+    bdb_context->generation++;
+  else
+    bdb_context->generation=(long)time(NULL);
+}
+
+
+/**
+ * librdf_hash_bdb_generation:
+ * @context: BerkeleyDB hash context
+ *
+ * Get the generation of the pairs in the hash.
+ * 
+ * Return value: generation or <0 if not known
+ **/
+static long
+librdf_hash_bdb_generation(void* context)
+{
+  librdf_hash_bdb_context* bdb_context=(librdf_hash_bdb_context*)context;
+
+  if(LIBRDF_HASH_BDB_IS_SHARED(bdb_context))
+    return -1;
+
+  return bdb_context->generation;
+}
+
+
+/**
+ * librdf_hash_bdb_is_shared:
+ * @context: BerkeleyDB hash context
+ *
+ * Check if other processes may change the hash while it is open.
+ * 
+ * Return value: non 0 for a hash in a concurrent or transactional
+ * environment
+ **/
+static int
+librdf_hash_bdb_is_shared(void* context)
+{
+  return LIBRDF_HASH_BDB_IS_SHARED((librdf_hash_bdb_context*)context);
+}
+
+
+#ifdef LIBRDF_HASH_BDB_ENV
+/*
+ * librdf_hash_bdb_open_env:
+ * @bdb_context: BerkeleyDB hash context
+ * @options: hash options
+ *
+ * INTERNAL - Join or open the environment named by option bdb-env-dir
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_bdb_open_env(librdf_hash_bdb_context* bdb_context,
+                         librdf_hash* options)
+{
+  librdf_world* world=bdb_context->hash->world;
+  librdf_hash_bdb_env* env;
+  char *dir;
+  long size;
+  u_int32_t flags;
+  int ret;
+
+  if(bdb_context->env)
+    return 0;
+
+  dir=librdf_hash_get(options, "bdb-env-dir");
+  if(!dir)
+    return 0;
+
+  /* held while opening so only one thread opens an environment */
+#ifdef WITH_THREADS
+  pthread_mutex_lock(world->mutex);
+#endif
+
+  for(env=world->bdb_envs; env; env=env->next)
+    if(!strcmp(env->dir, dir)) {
+      LIBRDF_FREE(cstring, dir);
+      env->usage++;
+      bdb_context->env=env;
+#ifdef WITH_THREADS
+      pthread_mutex_unlock(world->mutex);
+#endif
+      return 0;
+    }
+
+  env=(librdf_hash_bdb_env*)LIBRDF_CALLOC(librdf_hash_bdb_env, 1,
+                                          sizeof(librdf_hash_bdb_env));
+  if(!env) {
+    LIBRDF_FREE(cstring, dir);
+#ifdef WITH_THREADS
+    pthread_mutex_unlock(world->mutex);
+#endif
+    return 1;
+  }
+  env->dir=dir;
+
+  /* V4 prototype:
+   * int db_env_create(DB_ENV **dbenvp, u_int32_t flags);
+   */
+  if((ret=db_env_create(&env->env, 0))) {
+    env->env=NULL;
+    goto failed;
+  }
+
+  size=librdf_hash_get_as_long(options, "cache-size");
+  if(size > 0 &&
+     (ret=env->env->set_cachesize(env->env,
+                                  (u_int32_t)(size / LIBRDF_HASH_BDB_GIGABYTE),
+                                  (u_int32_t)(size % LIBRDF_HASH_BDB_GIGABYTE),
+                                  1)))
+    goto failed;
+
+  /* read only files up to this size are mapped rather than cached */
+  size=librdf_hash_get_as_long(options, "mmap-size");
+  if(size > 0 && (ret=env->env->set_mp_mmapsize(env->env, (size_t)size)))
+    goto failed;
+
+  flags=DB_CREATE | DB_INIT_MPOOL | DB_THREAD;
+  if(librdf_hash_get_as_boolean(options, "concurrent") > 0) {
+    flags|= DB_INIT_CDB;
+    env->is_concurrent=1;
+  }
+
+  if(librdf_hash_get_as_boolean(options, "transactions") > 0) {
+#ifdef LIBRDF_HASH_BDB_TRANSACTIONS
+    char *sync;
+
+    if(env->is_concurrent) {
+      librdf_log(world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+                 "BDB environment '%s' cannot be both concurrent and transactional",
+                 dir);
+      ret=EINVAL;
+      goto failed;
+    }
+
+    /* Logged and locked; recovery brings the files back to the last
+     * commit after a crash and must only be run by a process that has
+     * the environment to itself, so it is asked for with recover='yes' */
+    flags|= DB_INIT_LOCK | DB_INIT_LOG | DB_INIT_TXN;
+    if(librdf_hash_get_as_boolean(options, "recover") > 0)
+      flags|= DB_RECOVER;
+    env->is_transactional=1;
+
+    /* operations outside a transaction commit on their own */
+    if((ret=env->env->set_flags(env->env, DB_AUTO_COMMIT, 1)))
+      goto failed;
+
+    /* break deadlocks between processes */
+    if((ret=env->env->set_lk_detect(env->env, DB_LOCK_DEFAULT)))
+      goto failed;
+
+    /* Commits flush the log by default and BDB flushes it once for
+     * all the transactions committing at that moment (group commit).
+     * txn-sync='write' only writes it to the OS, 'no' leaves it in
+     * the log buffer; both lose the last commits on a system crash
+     * but keep the indexes consistent. */
+    sync=librdf_hash_get(options, "txn-sync");
+    if(sync) {
+      if(!strcmp(sync, "write"))
+        ret=env->env->set_flags(env->env, DB_TXN_WRITE_NOSYNC, 1);
+      else if(!strcmp(sync, "no"))
+        ret=env->env->set_flags(env->env, DB_TXN_NOSYNC, 1);
+      LIBRDF_FREE(cstring, sync);
+      if(ret)
+        goto failed;
+    }
+
+#ifdef DB_LOG_AUTOREMOVE
+    /* remove log files no longer needed for recovery (BDB 4.2 - 4.6) */
+    env->env->set_flags(env->env, DB_LOG_AUTOREMOVE, 1);
+#else
+#ifdef DB_LOG_AUTO_REMOVE
+    /* BDB 4.7+ */
+    env->env->log_set_config(env->env, DB_LOG_AUTO_REMOVE, 1);
+#endif
+#endif
+#else
+    librdf_log(world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_HASH, NULL,
+               "BDB transactions need Berkeley DB 4.1 or newer, ignoring option transactions");
+#endif
+  }
+
+  /* V4 prototype:
+   * int DB_ENV->open(DB_ENV *, char *db_home, u_int32_t flags, int mode);
+   */
+  if((ret=env->env->open(env->env, dir, flags, bdb_context->mode)))
+    goto failed;
+
+  env->usage=1;
+  env->next=world->bdb_envs;
+  world->bdb_envs=env;
+  bdb_context->env=env;
+#ifdef WITH_THREADS
+  pthread_mutex_unlock(world->mutex);
+#endif
+  return 0;
+
+  failed:
+  librdf_log(world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+             "BDB environment open of '%s' failed - %s", dir,
+             db_strerror(ret));
+  if(env->env)
+    env->env->close(env->env, 0);
+  LIBRDF_FREE(cstring, env->dir);
+  LIBRDF_FREE(librdf_hash_bdb_env, env);
+#ifdef WITH_THREADS
+  pthread_mutex_unlock(world->mutex);
+#endif
+  return 1;
+}
+
+
+/*
+ * librdf_hash_bdb_close_env:
+ * @bdb_context: BerkeleyDB hash context
+ *
+ * INTERNAL - Stop using the environment, closing it after the last hash
+ **/
+static void
+librdf_hash_bdb_close_env(librdf_hash_bdb_context* bdb_context)
+{
+  librdf_world* world=bdb_context->hash->world;
+  librdf_hash_bdb_env* env=bdb_context->env;
+  librdf_hash_bdb_env** prev;
+
+  if(!env)
+    return;
+  bdb_context->env=NULL;
+
+#ifdef WITH_THREADS
+  pthread_mutex_lock(world->mutex);
+#endif
+  if(--env->usage > 0) {
+#ifdef WITH_THREADS
+    pthread_mutex_unlock(world->mutex);
+#endif
+    return;
+  }
+
+  for(prev=&world->bdb_envs; *prev; prev=&(*prev)->next)
+    if(*prev == env) {
+      *prev=env->next;
+      break;
+    }
+
+  /* still locked so that the environment is not opened again while
+   * this handle is being closed */
+#ifdef LIBRDF_HASH_BDB_TRANSACTIONS
+  /* recovery on the next open has no log to replay */
+  if(env->is_transactional)
+    env->env->txn_checkpoint(env->env, 0, 0, 0);
+#endif
+
+  env->env->close(env->env, 0);
+#ifdef WITH_THREADS
+  pthread_mutex_unlock(world->mutex);
+#endif
+  LIBRDF_FREE(cstring, env->dir);
+  LIBRDF_FREE(librdf_hash_bdb_env, env);
+}
+#endif
+
+
+/*
+ * librdf_hash_bdb_file_name:
+ * @bdb_context: BerkeleyDB hash context
+ * @identifier: hash identifier
+ *
+ * INTERNAL - Make the BDB file name of a hash
+ *
+ * Relative names are made absolute inside an environment, which
+ * would otherwise look for them in its own directory.
+ *
+ * Return value: new file name or NULL on failure
+ **/
+static char*
+librdf_hash_bdb_file_name(librdf_hash_bdb_context* bdb_context,
+                          const char *identifier)
+{
+  char *file;
+  size_t len=strlen(identifier) + 4;
+#ifdef HAVE_GETCWD
+  char *cwd=NULL;
+  size_t cwd_size;
+
+  if(bdb_context->env && *identifier != '/') {
+    /* grow the buffer until the directory name fits */
+    for(cwd_size=256; ; cwd_size*= 2) {
+      cwd=(char*)LIBRDF_MALLOC(cstring, cwd_size);
+      if(!cwd)
+        return NULL;
+      if(getcwd(cwd, cwd_size))
+        break;
+      LIBRDF_FREE(cstring, cwd);
+      cwd=NULL;
+      if(errno != ERANGE)
+        break;
+    }
+
+    if(cwd) {
+      file=(char*)LIBRDF_MALLOC(cstring, strlen(cwd) + 1 + len);
+      if(file)
+        sprintf(file, "%s/%s.db", cwd, identifier);
+      LIBRDF_FREE(cstring, cwd);
+      return file;
+    }
+  }
+#endif
+
+  file=(char*)LIBRDF_MALLOC(cstring, len);
+  if(file)
+    sprintf(file, "%s.db", identifier);
+  return file;
 }
 
 
@@ -388,52 +1191,397 @@ typedef struct {
   librdf_hash_bdb_context* hash;
   void *last_key;
   void *last_value;
+  /* key prefix for SET_RANGE / NEXT_RANGE */
+  void *range_key;
+  size_t range_key_len;
 #ifdef HAVE_BDB_CURSOR
   DBC* cursor;
 #endif
+#ifdef LIBRDF_HASH_BDB_BULK
+  /* pairs (DB_MULTIPLE_KEY) or values of key_copy (DB_MULTIPLE) read
+   * ahead, returned values point into it until it is refilled */
+  DBT bulk;
+  /* next entry in bulk or NULL when it is used up */
+  void *bulk_pointer;
+  /* non 0 if bulk holds values */
+  int bulk_is_values;
+  /* the current key, returned keys point to it */
+  void *key_copy;
+  size_t key_copy_len;
+  size_t key_copy_size;
+#endif
 } librdf_hash_bdb_cursor_context;
 
 
+#ifdef LIBRDF_HASH_BDB_BULK
+static int librdf_hash_bdb_cursor_fill(librdf_hash_bdb_cursor_context* cursor, DBT* bdb_key, u_int32_t flags);
+static int librdf_hash_bdb_cursor_set_key(librdf_hash_bdb_cursor_context* cursor, void *data, size_t size);
+static int librdf_hash_bdb_cursor_next_pair(librdf_hash_bdb_cursor_context* cursor, DBT* bdb_key, DBT* bdb_value);
+static int librdf_hash_bdb_cursor_next_value(librdf_hash_bdb_cursor_context* cursor, DBT* bdb_value);
+#endif
+
+
+/**
+ * librdf_hash_bdb_cursor_init:
+ * @cursor_context: hash cursor context
+ * @hash_context: hash to operate over
+ *
+ * Initialise a new bdb cursor.
+ * 
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_bdb_cursor_init(void *cursor_context, void *hash_context)
+{
+  librdf_hash_bdb_cursor_context *cursor=(librdf_hash_bdb_cursor_context*)cursor_context;
+#ifdef HAVE_BDB_CURSOR
+  DB* db;
+#endif
+
+  cursor->hash=(librdf_hash_bdb_context*)hash_context;
+
+#ifdef HAVE_BDB_CURSOR
+  db=cursor->hash->db;
+#ifdef HAVE_BDB_CURSOR_4_ARGS
+  /* V3 prototype:
+   * int DB->cursor(DB *db, DB_TXN *txnid, DBC **cursorp, u_int32_t flags);
+   */
+  if(db->cursor(db, LIBRDF_HASH_BDB_TXN(cursor->hash), &cursor->cursor, 0))
+    return 1;
+#else
+  /* V2 prototype:
+   * int DB->cursor(DB *db, DB_TXN *txnid, DBC **cursorp);
+   */
+  if(db->cursor(db, NULL, &cursor->cursor))
+    return 1;
+#endif
+#endif
+
+  return 0;
+}
+
+
+#ifdef LIBRDF_HASH_BDB_BULK
+/*
+ * librdf_hash_bdb_cursor_fill:
+ * @cursor: BerkeleyDB hash cursor context
+ * @bdb_key: key for DB_SET and DB_SET_RANGE, otherwise not used
+ * @flags: BDB cursor flags with DB_MULTIPLE or DB_MULTIPLE_KEY
+ *
+ * INTERNAL - Read the next pairs or values into the bulk buffer
+ *
+ * The buffer grows when one record does not fit.
+ *
+ * Return value: 0 on success or BDB error such as DB_NOTFOUND
+ **/
+static int
+librdf_hash_bdb_cursor_fill(librdf_hash_bdb_cursor_context* cursor,
+                            DBT* bdb_key, u_int32_t flags)
+{
+  DBC *bdb_cursor=cursor->cursor;
+  size_t size=LIBRDF_HASH_BDB_BULK_SIZE;
+  int ret;
+
+  cursor->bulk_pointer=NULL;
+  cursor->bulk_is_values=!(flags & DB_MULTIPLE_KEY);
+
+  while(1) {
+    if(!cursor->bulk.data) {
+      cursor->bulk.data=LIBRDF_MALLOC(cstring, size);
+      if(!cursor->bulk.data)
+        return 1;
+      cursor->bulk.ulen=(u_int32_t)size;
+      cursor->bulk.flags=DB_DBT_USERMEM;
+    }
+
+    ret=bdb_cursor->c_get(bdb_cursor, bdb_key, &cursor->bulk, flags);
+#ifdef DB_BUFFER_SMALL
+    if(ret != DB_BUFFER_SMALL)
+      break;
+#else
+    if(ret != ENOMEM)
+      break;
+#endif
+
+    /* bulk.size is the space the record needs */
+    size=((size_t)cursor->bulk.size + 1023) & ~(size_t)1023;
+    if(size <= cursor->bulk.ulen)
+      size=2 * (size_t)cursor->bulk.ulen;
+    LIBRDF_FREE(cstring, cursor->bulk.data);
+    cursor->bulk.data=NULL;
+  }
+
+  if(ret)
+    return ret;
+
+  DB_MULTIPLE_INIT(cursor->bulk_pointer, &cursor->bulk);
+  return 0;
+}
+
+
+/*
+ * librdf_hash_bdb_cursor_set_key:
+ * @cursor: BerkeleyDB hash cursor context
+ * @data: key bytes
+ * @size: key length
+ *
+ * INTERNAL - Make a key the current key, copying it if it changed
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_bdb_cursor_set_key(librdf_hash_bdb_cursor_context* cursor,
+                               void *data, size_t size)
+{
+  if(cursor->key_copy && size == cursor->key_copy_len &&
+     (data == cursor->key_copy || !memcmp(data, cursor->key_copy, size)))
+    return 0;
+
+  if(size > cursor->key_copy_size || !cursor->key_copy) {
+    void *new_copy=LIBRDF_MALLOC(cstring, size ? 2 * size : 1);
+    if(!new_copy)
+      return 1;
+    if(cursor->key_copy)
+      LIBRDF_FREE(cstring, cursor->key_copy);
+    cursor->key_copy=new_copy;
+    cursor->key_copy_size=size ? 2 * size : 1;
+  }
+
+  memcpy(cursor->key_copy, data, size);
+  cursor->key_copy_len=size;
+  return 0;
+}
+
+
+/*
+ * librdf_hash_bdb_cursor_next_pair:
+ * @cursor: BerkeleyDB hash cursor context
+ * @bdb_key: DBT to point at the key
+ * @bdb_value: DBT to point at the value
+ *
+ * INTERNAL - Get the next pair from the bulk buffer, refilling it
+ *
+ * Return value: 0 on success or BDB error such as DB_NOTFOUND
+ **/
+static int
+librdf_hash_bdb_cursor_next_pair(librdf_hash_bdb_cursor_context* cursor,
+                                 DBT* bdb_key, DBT* bdb_value)
+{
+  DBT unused_key;
+  int ret;
+
+  while(1) {
+    if(cursor->bulk_pointer && !cursor->bulk_is_values) {
+      DB_MULTIPLE_KEY_NEXT(cursor->bulk_pointer, &cursor->bulk,
+                           bdb_key->data, bdb_key->size,
+                           bdb_value->data, bdb_value->size);
+      if(cursor->bulk_pointer)
+        return 0;
+    }
+
+    memset(&unused_key, 0, sizeof(DBT));
+    if((ret=librdf_hash_bdb_cursor_fill(cursor, &unused_key,
+                                        DB_NEXT | DB_MULTIPLE_KEY)))
+      return ret;
+  }
+}
+
+
+/*
+ * librdf_hash_bdb_cursor_next_value:
+ * @cursor: BerkeleyDB hash cursor context
+ * @bdb_value: DBT to point at the value
+ *
+ * INTERNAL - Get the next value of the current key from the bulk buffer
+ *
+ * Return value: 0 on success or BDB error such as DB_NOTFOUND
+ **/
+static int
+librdf_hash_bdb_cursor_next_value(librdf_hash_bdb_cursor_context* cursor,
+                                  DBT* bdb_value)
+{
+  DBT unused_key;
+  int ret;
+
+  while(1) {
+    if(cursor->bulk_pointer) {
+      DB_MULTIPLE_NEXT(cursor->bulk_pointer, &cursor->bulk,
+                       bdb_value->data, bdb_value->size);
+      if(cursor->bulk_pointer)
+        return 0;
+    }
+
+    memset(&unused_key, 0, sizeof(DBT));
+    if((ret=librdf_hash_bdb_cursor_fill(cursor, &unused_key,
+                                        DB_NEXT_DUP | DB_MULTIPLE)))
+      return ret;
+  }
+}
+
+
 /**
- * librdf_hash_bdb_cursor_init:
- * @cursor_context: hash cursor context
- * @hash_context: hash to operate over
+ * librdf_hash_bdb_cursor_get:
+ * @context: BerkeleyDB hash cursor context
+ * @key: pointer to key to use
+ * @value: pointer to value to use
+ * @flags: flags
  *
- * Initialise a new bdb cursor.
+ * Retrieve a hash value for the given key.
+ * 
+ * Pairs are read ahead in bulk and the key and value returned point
+ * into the cursor until the next call.  A pair deleted after it was
+ * read ahead may still be returned, deleting the pair just returned
+ * is safe.  Walking keys only reads one pair per key.
  * 
  * Return value: non 0 on failure
  **/
 static int
-librdf_hash_bdb_cursor_init(void *cursor_context, void *hash_context)
+librdf_hash_bdb_cursor_get(void* context, 
+                           librdf_hash_datum *key, librdf_hash_datum *value,
+                           unsigned int flags)
 {
-  librdf_hash_bdb_cursor_context *cursor=(librdf_hash_bdb_cursor_context*)cursor_context;
-#ifdef HAVE_BDB_CURSOR
-  DB* db;
+  librdf_hash_bdb_cursor_context *cursor=(librdf_hash_bdb_cursor_context*)context;
+  DBC *bdb_cursor=cursor->cursor;
+  DBT bdb_key;
+  DBT bdb_value;
+  int ret;
+
+  memset(&bdb_key, 0, sizeof(DBT));
+  memset(&bdb_value, 0, sizeof(DBT));
+
+#ifdef DB_DBT_PARTIAL
+  /* walking keys only, do not read the values */
+  if(!value) {
+    bdb_value.flags=DB_DBT_PARTIAL;
+    bdb_value.dlen=0;
+  }
 #endif
 
-  cursor->hash=(librdf_hash_bdb_context*)hash_context;
+  switch(flags) {
+    case LIBRDF_HASH_CURSOR_SET:
+      bdb_key.data = (char*)key->data;
+      bdb_key.size = key->size;
+      ret=librdf_hash_bdb_cursor_fill(cursor, &bdb_key, DB_SET | DB_MULTIPLE);
+      if(!ret && librdf_hash_bdb_cursor_set_key(cursor, key->data, key->size))
+        return 1;
+      if(!ret)
+        ret=librdf_hash_bdb_cursor_next_value(cursor, &bdb_value);
+      bdb_key.data=NULL;
+      break;
 
-#ifdef HAVE_BDB_CURSOR
-  db=cursor->hash->db;
-#ifdef HAVE_BDB_CURSOR_4_ARGS
-  /* V3 prototype:
-   * int DB->cursor(DB *db, DB_TXN *txnid, DBC **cursorp, u_int32_t flags);
-   */
-  if(db->cursor(db, NULL, &cursor->cursor, 0))
-    return 1;
-#else
-  /* V2 prototype:
-   * int DB->cursor(DB *db, DB_TXN *txnid, DBC **cursorp);
-   */
-  if(db->cursor(db, NULL, &cursor->cursor))
+    case LIBRDF_HASH_CURSOR_NEXT_VALUE:
+      if(cursor->bulk_is_values) {
+        ret=librdf_hash_bdb_cursor_next_value(cursor, &bdb_value);
+      } else {
+        /* after FIRST or NEXT: the next pair if it has the same key */
+        ret=librdf_hash_bdb_cursor_next_pair(cursor, &bdb_key, &bdb_value);
+        if(!ret &&
+           (bdb_key.size != cursor->key_copy_len ||
+            memcmp(bdb_key.data, cursor->key_copy, bdb_key.size)))
+          ret=DB_NOTFOUND;
+      }
+      bdb_key.data=NULL;
+      break;
+
+    case LIBRDF_HASH_CURSOR_FIRST:
+      if(!value)
+        ret=bdb_cursor->c_get(bdb_cursor, &bdb_key, &bdb_value, DB_FIRST);
+      else {
+        ret=librdf_hash_bdb_cursor_fill(cursor, &bdb_key, DB_FIRST | DB_MULTIPLE_KEY);
+        if(!ret)
+          ret=librdf_hash_bdb_cursor_next_pair(cursor, &bdb_key, &bdb_value);
+      }
+      break;
+
+    case LIBRDF_HASH_CURSOR_SET_RANGE:
+      /* Remember the prefix; BTree keys are sorted so the first key
+       * >= prefix is the first one starting with it, if any */
+      if(cursor->range_key)
+        LIBRDF_FREE(cstring, cursor->range_key);
+      cursor->range_key=LIBRDF_MALLOC(cstring, key->size ? key->size : 1);
+      if(!cursor->range_key)
+        return 1;
+      memcpy(cursor->range_key, key->data, key->size);
+      cursor->range_key_len=key->size;
+
+      bdb_key.data = (char*)cursor->range_key;
+      bdb_key.size = (u_int32_t)cursor->range_key_len;
+      if(!value)
+        ret=bdb_cursor->c_get(bdb_cursor, &bdb_key, &bdb_value, DB_SET_RANGE);
+      else {
+        ret=librdf_hash_bdb_cursor_fill(cursor, &bdb_key, DB_SET_RANGE | DB_MULTIPLE_KEY);
+        if(!ret)
+          ret=librdf_hash_bdb_cursor_next_pair(cursor, &bdb_key, &bdb_value);
+      }
+      break;
+
+    case LIBRDF_HASH_CURSOR_NEXT_RANGE:
+      if(!cursor->range_key)
+        return 1;
+      /* FALLTHROUGH */
+    case LIBRDF_HASH_CURSOR_NEXT:
+      if(!value)
+        ret=bdb_cursor->c_get(bdb_cursor, &bdb_key, &bdb_value, DB_NEXT_NODUP);
+      else
+        ret=librdf_hash_bdb_cursor_next_pair(cursor, &bdb_key, &bdb_value);
+      break;
+
+    default:
+      librdf_log(cursor->hash->hash->world,
+                 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+                 "Unknown hash method flag %d", flags);
+      return 1;
+  }
+
+  /* a single pair was read, the bulk buffer is out of step */
+  if(!value && bdb_key.data) {
+    cursor->bulk_pointer=NULL;
+    cursor->bulk_is_values=0;
+  }
+
+  /* If succeeded and key is past the prefix, end */
+  if(!ret &&
+     (flags == LIBRDF_HASH_CURSOR_SET_RANGE ||
+      flags == LIBRDF_HASH_CURSOR_NEXT_RANGE) &&
+     (bdb_key.size < cursor->range_key_len ||
+      memcmp(cursor->range_key, bdb_key.data, cursor->range_key_len)))
+    ret=DB_NOTFOUND;
+
+  /* Step over the metadata record when walking keys */
+  if(!ret && bdb_key.data && LIBRDF_HASH_BDB_IS_META_KEY(bdb_key)) {
+    if(flags == LIBRDF_HASH_CURSOR_SET_RANGE ||
+       flags == LIBRDF_HASH_CURSOR_NEXT_RANGE)
+      flags=LIBRDF_HASH_CURSOR_NEXT_RANGE;
+    else
+      flags=LIBRDF_HASH_CURSOR_NEXT;
+    return librdf_hash_bdb_cursor_get(context, key, value, flags);
+  }
+
+  if(ret) {
+    if(ret != DB_NOTFOUND)
+      LIBRDF_DEBUG2("BDB cursor error - %d\n", ret);
+    key->data=NULL;
+    return ret;
+  }
+
+  /* SET and NEXT_VALUE keep the current key */
+  if(bdb_key.data &&
+     librdf_hash_bdb_cursor_set_key(cursor, bdb_key.data, bdb_key.size))
     return 1;
-#endif
-#endif
+
+  key->data=cursor->key_copy;
+  key->size=cursor->key_copy_len;
+
+  if(value) {
+    value->data=bdb_value.data;
+    value->size=bdb_value.size;
+  }
 
   return 0;
 }
 
 
+#else
 /**
  * librdf_hash_bdb_cursor_get:
  * @context: BerkeleyDB hash cursor context
@@ -523,6 +1671,65 @@ librdf_hash_bdb_cursor_get(void* context,
         SYSTEM_FREE(bdb_key.data);
         SYSTEM_FREE(bdb_value.data);
 
+#ifdef DB_NOTFOUND
+        /* V2 and V3 */
+        ret=DB_NOTFOUND;
+#else
+        ret=1;
+#endif
+      }
+      
+      break;
+      
+    case LIBRDF_HASH_CURSOR_SET_RANGE:
+    case LIBRDF_HASH_CURSOR_NEXT_RANGE:
+      if(flags == LIBRDF_HASH_CURSOR_SET_RANGE) {
+        /* Remember the prefix; the key DBT is overwritten with the
+         * key found */
+        if(cursor->range_key)
+          LIBRDF_FREE(cstring, cursor->range_key);
+        cursor->range_key=LIBRDF_MALLOC(cstring, key->size ? key->size : 1);
+        if(!cursor->range_key)
+          return 1;
+        memcpy(cursor->range_key, key->data, key->size);
+        cursor->range_key_len=key->size;
+
+        /* BTree keys are sorted so the first key >= prefix is the
+         * first one starting with it, if any */
+#ifdef HAVE_BDB_CURSOR
+        /* V2/V3 */
+        ret=bdb_cursor->c_get(bdb_cursor, &bdb_key, &bdb_value, DB_SET_RANGE);
+#else
+        /* V1 */
+        ret=db->seq(db, &bdb_key, &bdb_value, R_CURSOR);
+#endif
+      } else {
+        if(!cursor->range_key)
+          return 1;
+#ifdef HAVE_BDB_CURSOR
+#ifdef DB_NEXT_NODUP
+        /* V3 */
+        ret=bdb_cursor->c_get(bdb_cursor, &bdb_key, &bdb_value,
+                              (value) ? DB_NEXT : DB_NEXT_NODUP);
+#else
+        /* V2 */
+        ret=bdb_cursor->c_get(bdb_cursor, &bdb_key, &bdb_value, DB_NEXT);
+#endif
+#else
+        /* V1 */
+        ret=db->seq(db, &bdb_key, &bdb_value, R_NEXT);
+#endif
+      }
+
+      /* If succeeded and key is past the prefix, end */
+      if(!ret &&
+         (bdb_key.size < cursor->range_key_len ||
+          memcmp(cursor->range_key, bdb_key.data, cursor->range_key_len))) {
+        
+        /* always allocated by BDB using system malloc */
+        SYSTEM_FREE(bdb_key.data);
+        SYSTEM_FREE(bdb_value.data);
+
 #ifdef DB_NOTFOUND
         /* V2 and V3 */
         ret=DB_NOTFOUND;
@@ -576,6 +1783,22 @@ librdf_hash_bdb_cursor_get(void* context,
       return 1;
   }
 
+  /* Step over the metadata record when walking keys */
+  if(!ret && flags != LIBRDF_HASH_CURSOR_SET &&
+     flags != LIBRDF_HASH_CURSOR_NEXT_VALUE &&
+     LIBRDF_HASH_BDB_IS_META_KEY(bdb_key)) {
+    /* always allocated by BDB using system malloc */
+    SYSTEM_FREE(bdb_key.data);
+    SYSTEM_FREE(bdb_value.data);
+
+    if(flags == LIBRDF_HASH_CURSOR_SET_RANGE ||
+       flags == LIBRDF_HASH_CURSOR_NEXT_RANGE)
+      flags=LIBRDF_HASH_CURSOR_NEXT_RANGE;
+    else
+      flags=LIBRDF_HASH_CURSOR_NEXT;
+    return librdf_hash_bdb_cursor_get(context, key, value, flags);
+  }
+
 
   /* Free previous key and values */
   if(cursor->last_key) {
@@ -633,6 +1856,7 @@ librdf_hash_bdb_cursor_get(void* context,
 
   return 0;
 }
+#endif
 
 
 /**
@@ -657,6 +1881,17 @@ librdf_hash_bdb_cursor_finish(void* context)
     
   if(cursor->last_value)
     LIBRDF_FREE(cstring, cursor->last_value);
+
+  if(cursor->range_key)
+    LIBRDF_FREE(cstring, cursor->range_key);
+
+#ifdef LIBRDF_HASH_BDB_BULK
+  if(cursor->bulk.data)
+    LIBRDF_FREE(cstring, cursor->bulk.data);
+
+  if(cursor->key_copy)
+    LIBRDF_FREE(cstring, cursor->key_copy);
+#endif
 }
 
 
@@ -696,13 +1931,18 @@ librdf_hash_bdb_put(void* context, librdf_hash_datum *key,
   /* V2/V3 prototype:
    * int DB->put(DB *db, DB_TXN *txnid, DBT *key, DBT *data, u_int32_t flags); 
    */
-  ret=db->put(db, NULL, &bdb_key, &bdb_value, 0);
+  ret=db->put(db, LIBRDF_HASH_BDB_TXN(bdb_context), &bdb_key, &bdb_value, 0);
 #else
   /* V1 */
   ret=db->put(db, &bdb_key, &bdb_value, 0);
 #endif
   if(ret)
     LIBRDF_DEBUG2("BDB put failed - %d\n", ret);
+  else {
+    if(bdb_context->values_count >= 0)
+      bdb_context->values_count++;
+    librdf_hash_bdb_changed(bdb_context);
+  }
 
   return (ret != 0);
 }
@@ -747,7 +1987,8 @@ librdf_hash_bdb_exists(void* context, librdf_hash_datum *key,
 #ifdef HAVE_BDB_DB_TXN
 #ifdef DB_GET_BOTH
   /* later V2 (sigh)/V3 */
-  ret=db->get(db, NULL, &bdb_key, &bdb_value, (value ? DB_GET_BOTH : 0));
+  ret=db->get(db, LIBRDF_HASH_BDB_TXN(bdb_context), &bdb_key, &bdb_value,
+              (value ? DB_GET_BOTH : 0));
   if(ret == DB_NOTFOUND)
     ret= 0;
   else if(ret) /* failed */
@@ -868,6 +2109,10 @@ librdf_hash_bdb_delete_key(void* context, librdf_hash_datum *key)
   DB* bdb=bdb_context->db;
   DBT bdb_key;
   int ret;
+  int removed=0;
+
+  if(bdb_context->values_count >= 0)
+    removed=librdf_hash_key_values_count(bdb_context->hash, key);
 
   memset(&bdb_key, 0, sizeof(DBT));
 
@@ -877,13 +2122,19 @@ librdf_hash_bdb_delete_key(void* context, librdf_hash_datum *key)
   
 #ifdef HAVE_BDB_DB_TXN
   /* V2/V3 */
-  ret=bdb->del(bdb, NULL, &bdb_key, 0);
+  ret=bdb->del(bdb, LIBRDF_HASH_BDB_TXN(bdb_context), &bdb_key, 0);
 #else
   /* V1 */
   ret=bdb->del(bdb, &bdb_key, 0);
 #endif
   if(ret)
     LIBRDF_DEBUG2("BDB del failed - %d\n", ret);
+  else {
+    if(bdb_context->values_count >= 0)
+      bdb_context->values_count=(removed >= 0) ?
+        bdb_context->values_count - removed : -1;
+    librdf_hash_bdb_changed(bdb_context);
+  }
 
   return (ret != 0);
 }
@@ -926,8 +2177,15 @@ librdf_hash_bdb_delete_key_value(void* context,
   /* V3 prototype:
    * int DB->cursor(DB *db, DB_TXN *txnid, DBC **cursorp, u_int32_t flags);
    */
+#ifdef LIBRDF_HASH_BDB_ENV
+  /* Concurrent Data Store cursors must say they write */
+  if(bdb->cursor(bdb, LIBRDF_HASH_BDB_TXN(bdb_context), &dbc,
+                 (bdb_context->env && bdb_context->env->is_concurrent) ? DB_WRITECURSOR : 0))
+    return 1;
+#else
   if(bdb->cursor(bdb, NULL, &dbc, 0))
     return 1;
+#endif
 #else
   /* V2 prototype:
    * int DB->cursor(DB *db, DB_TXN *txnid, DBC **cursorp);
@@ -971,6 +2229,11 @@ librdf_hash_bdb_delete_key_value(void* context,
 
   if(ret)
     LIBRDF_DEBUG2("BDB del failed - %d\n", ret);
+  else {
+    if(bdb_context->values_count > 0)
+      bdb_context->values_count--;
+    librdf_hash_bdb_changed(bdb_context);
+  }
 
   return (ret != 0);
 }
@@ -991,8 +2254,217 @@ librdf_hash_bdb_sync(void* context)
   DB* db=bdb_context->db;
   int ret;
 
-  return (ret=db->sync(db, 0));
+  ret=db->sync(db, 0);
+
+#ifdef LIBRDF_HASH_BDB_TRANSACTIONS
+  /* keep recovery short; once per environment is enough but cheap */
+  if(!ret && bdb_context->env && bdb_context->env->is_transactional)
+    ret=bdb_context->env->env->txn_checkpoint(bdb_context->env->env, 0, 0, 0);
+#endif
+
+  return ret;
+}
+
+
+#ifdef HAVE_BDB_COMPACT
+/**
+ * librdf_hash_bdb_compact:
+ * @context: BerkeleyDB hash context
+ *
+ * Compact the hash pages and return free pages to the file system.
+ *
+ * Runs on the open database, other handles on it may carry on.
+ * 
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_bdb_compact(void* context) 
+{
+  librdf_hash_bdb_context* bdb_context=(librdf_hash_bdb_context*)context;
+  DB* db=bdb_context->db;
+  DB_COMPACT c_data; /* on stack */
+  int ret;
+
+  if(!bdb_context->is_writable)
+    return 1;
+
+  memset(&c_data, 0, sizeof(DB_COMPACT));
+
+  /* V4.4+ prototype:
+   * int DB->compact(DB *db, DB_TXN *txnid, DBT *start, DBT *stop,
+   *                 DB_COMPACT *c_data, u_int32_t flags, DBT *end);
+   */
+  ret=db->compact(db, LIBRDF_HASH_BDB_TXN(bdb_context), NULL, NULL, &c_data,
+                  DB_FREE_SPACE, NULL);
+  if(ret) {
+    librdf_log(bdb_context->hash->world, 0, LIBRDF_LOG_ERROR,
+               LIBRDF_FROM_HASH, NULL,
+               "BDB compact of '%s' failed - %s",
+               bdb_context->file_name, db_strerror(ret));
+    return 1;
+  }
+
+  LIBRDF_DEBUG4("BDB compact of '%s' freed %d pages, truncated %d pages\n",
+                bdb_context->file_name,
+                (int)c_data.compact_pages_free,
+                (int)c_data.compact_pages_truncated);
+
+  return (db->sync(db, 0) != 0);
+}
+#endif
+
+
+#ifdef LIBRDF_HASH_BDB_TRANSACTIONS
+/**
+ * librdf_hash_bdb_transaction_start:
+ * @context: BerkeleyDB hash context
+ *
+ * Begin a transaction for this hash.
+ *
+ * Other hashes in the same environment, such as the other indexes of
+ * a storage, can join it so that their changes commit or roll back
+ * with those of this hash.
+ * 
+ * Return value: non 0 on failure, including if the environment is not
+ * transactional or this hash is already in a transaction
+ **/
+static int
+librdf_hash_bdb_transaction_start(void* context) 
+{
+  librdf_hash_bdb_context* bdb_context=(librdf_hash_bdb_context*)context;
+  librdf_hash_bdb_env* env=bdb_context->env;
+  int ret;
+
+  if(!env || !env->is_transactional || bdb_context->in_transaction)
+    return 1;
+
+  /* V4 prototype:
+   * int DB_ENV->txn_begin(DB_ENV *env, DB_TXN *parent, DB_TXN **tid,
+   *                       u_int32_t flags);
+   */
+  if((ret=env->env->txn_begin(env->env, NULL, &bdb_context->txn, 0))) {
+    bdb_context->txn=NULL;
+    librdf_log(bdb_context->hash->world, 0, LIBRDF_LOG_ERROR,
+               LIBRDF_FROM_HASH, NULL,
+               "BDB transaction begin failed - %s", db_strerror(ret));
+    return 1;
+  }
+
+  bdb_context->owns_txn=1;
+  bdb_context->in_transaction=1;
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_bdb_transaction_join:
+ * @context: BerkeleyDB hash context
+ * @leader_context: BerkeleyDB hash context that began the transaction
+ *
+ * Make the changes to this hash in the transaction of another hash.
+ *
+ * Return value: non 0 on failure, including if the hashes are not in
+ * the same environment or this hash is already in a transaction
+ **/
+static int
+librdf_hash_bdb_transaction_join(void* context, void* leader_context)
+{
+  librdf_hash_bdb_context* bdb_context=(librdf_hash_bdb_context*)context;
+  librdf_hash_bdb_context* leader=(librdf_hash_bdb_context*)leader_context;
+
+  if(bdb_context->in_transaction || !leader->in_transaction ||
+     !leader->owns_txn || bdb_context->env != leader->env)
+    return 1;
+
+  bdb_context->txn=leader->txn;
+  bdb_context->owns_txn=0;
+  bdb_context->in_transaction=1;
+
+  return 0;
+}
+
+
+/*
+ * librdf_hash_bdb_transaction_end:
+ * @bdb_context: BerkeleyDB hash context
+ * @commit: non 0 to commit, 0 to roll back
+ *
+ * INTERNAL - Leave the transaction, ending it if this hash began it
+ *
+ * Cursors opened in the transaction must be closed first and the
+ * hashes that joined it must have left.
+ *
+ * Return value: non 0 if the transaction did not commit
+ **/
+static int
+librdf_hash_bdb_transaction_end(librdf_hash_bdb_context* bdb_context,
+                                int commit)
+{
+  DB_TXN* txn=bdb_context->txn;
+  int ret;
+
+  if(!bdb_context->in_transaction)
+    return 1;
+
+  bdb_context->txn=NULL;
+  bdb_context->in_transaction=0;
+
+  /* the hash that began the transaction ends it */
+  if(!bdb_context->owns_txn)
+    return !commit;
+  bdb_context->owns_txn=0;
+
+  if(!commit) {
+    txn->abort(txn);
+    return 1;
+  }
+
+  ret=txn->commit(txn, 0);
+  if(ret)
+    librdf_log(bdb_context->hash->world, 0, LIBRDF_LOG_ERROR,
+               LIBRDF_FROM_HASH, NULL,
+               "BDB transaction commit failed - %s", db_strerror(ret));
+
+  return (ret != 0);
+}
+
+
+/**
+ * librdf_hash_bdb_transaction_commit:
+ * @context: BerkeleyDB hash context
+ *
+ * Commit the transaction this hash began, or leave the one it joined.
+ * 
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_bdb_transaction_commit(void* context) 
+{
+  return librdf_hash_bdb_transaction_end((librdf_hash_bdb_context*)context, 1);
+}
+
+
+/**
+ * librdf_hash_bdb_transaction_rollback:
+ * @context: BerkeleyDB hash context
+ *
+ * Roll back the transaction this hash began, or leave the one it joined.
+ * 
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_bdb_transaction_rollback(void* context) 
+{
+  librdf_hash_bdb_context* bdb_context=(librdf_hash_bdb_context*)context;
+
+  if(!bdb_context->in_transaction)
+    return 1;
+
+  librdf_hash_bdb_transaction_end(bdb_context, 0);
+  return 0;
 }
+#endif
 
 
 /**
@@ -1044,12 +2516,26 @@ librdf_hash_bdb_register_factory(librdf_hash_factory *factory)
   factory->clone   = librdf_hash_bdb_clone;
 
   factory->values_count = librdf_hash_bdb_values_count;
+  factory->generation   = librdf_hash_bdb_generation;
+  factory->is_shared    = librdf_hash_bdb_is_shared;
+#ifdef HAVE_BDB_CURSOR_COUNT
+  factory->key_values_count = librdf_hash_bdb_key_values_count;
+#endif
 
   factory->put     = librdf_hash_bdb_put;
   factory->exists  = librdf_hash_bdb_exists;
   factory->delete_key  = librdf_hash_bdb_delete_key;
   factory->delete_key_value  = librdf_hash_bdb_delete_key_value;
   factory->sync    = librdf_hash_bdb_sync;
+#ifdef HAVE_BDB_COMPACT
+  factory->compact = librdf_hash_bdb_compact;
+#endif
+#ifdef LIBRDF_HASH_BDB_TRANSACTIONS
+  factory->transaction_start    = librdf_hash_bdb_transaction_start;
+  factory->transaction_join     = librdf_hash_bdb_transaction_join;
+  factory->transaction_commit   = librdf_hash_bdb_transaction_commit;
+  factory->transaction_rollback = librdf_hash_bdb_transaction_rollback;
+#endif
   factory->get_fd  = librdf_hash_bdb_get_fd;
 
   factory->cursor_init   = librdf_hash_bdb_cursor_init;
@@ -143,3 +143,22 @@ librdf_hash_cursor_get_next(librdf_hash_cursor *cursor, librdf_hash_datum *key,
   return cursor->hash->factory->cursor_get(cursor->context, key, value, 
                                            LIBRDF_HASH_CURSOR_NEXT);
 }
+
+
+int
+librdf_hash_cursor_set_range(librdf_hash_cursor *cursor,
+                             librdf_hash_datum *key, librdf_hash_datum *value)
+{
+  return cursor->hash->factory->cursor_get(cursor->context, key, value, 
+                                           LIBRDF_HASH_CURSOR_SET_RANGE);
+}
+
+
+int
+librdf_hash_cursor_get_next_range(librdf_hash_cursor *cursor,
+                                  librdf_hash_datum *key,
+                                  librdf_hash_datum *value)
+{
+  return cursor->hash->factory->cursor_get(cursor->context, key, value, 
+                                           LIBRDF_HASH_CURSOR_NEXT_RANGE);
+}
@@ -0,0 +1,515 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_hash_filter.c - RDF Hash bloom filter for missing pairs
+ *
+ * Copyright (C) 2000-2008, David Beckett http://www.dajobe.org/
+ * Copyright (C) 2000-2004, University of Bristol, UK http://www.bristol.ac.uk/
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <sys/types.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h> /* for unlink() */
+#endif
+
+#include <redland.h>
+#include <rdf_types.h>
+
+
+/*
+ * A hash opened with option bloom-filter='yes' keeps a bloom filter
+ * of its keys and of its key/value pairs so that librdf_hash_exists()
+ * can answer most lookups of missing pairs without reaching the hash
+ * implementation, which for a persistent hash means a file read.
+ *
+ * A bloom filter never misses a pair that was added, so a pair that
+ * is deleted or added in a transaction that is rolled back only costs
+ * a lookup that the filter passes on.  The filter is not made smaller
+ * by deletions; when more pairs have been deleted than remain it is
+ * built again the next time the hash is opened.
+ *
+ * The filter is built with a cursor walk of the hash and, when the
+ * hash has an identifier and a generation, saved in
+ * "<identifier>.bloom" by a close, stamped with the generation.  An
+ * open only reads a saved filter with the current generation of the
+ * hash, so one made before the hash was changed without it is never
+ * used; a writable open also removes the file after reading it.
+ * Hashes that other processes may change while open get no filter,
+ * see librdf_hash_open().
+ */
+
+#define LIBRDF_HASH_FILTER_MAGIC "RDFBLOOM"
+#define LIBRDF_HASH_FILTER_VERSION 2
+#define LIBRDF_HASH_FILTER_BYTE_ORDER 0x01020304U
+
+/* pairs a new filter is sized for at least */
+#define LIBRDF_HASH_FILTER_MIN_CAPACITY 4096
+/* bits per filter entry and probes per entry, about 1% false hits;
+ * each pair adds two entries, one for its key */
+#define LIBRDF_HASH_FILTER_BITS 10
+#define LIBRDF_HASH_FILTER_PROBES 7
+#define LIBRDF_HASH_FILTER_KEY_SEED 0x2545f491U
+#define LIBRDF_HASH_FILTER_PAIR_SEED 0x68e31da4U
+
+
+/* saved filter header, followed by the filter words */
+typedef struct
+{
+  char magic[8];
+  u32 version;
+  /* LIBRDF_HASH_FILTER_BYTE_ORDER as stored by the writer */
+  u32 byte_order;
+  u64 words;
+  u64 capacity;
+  u64 entries;
+  u64 deleted;
+  /* generation of the hash when the filter was saved */
+  u64 generation;
+} librdf_hash_filter_header;
+
+
+struct librdf_hash_filter_s
+{
+  u64 *bits;
+  u64 words;
+  /* pairs the bits are sized for */
+  size_t capacity;
+  /* pairs added and deleted since the filter was built */
+  size_t entries;
+  size_t deleted;
+  /* file the filter is saved in or NULL */
+  char *file_name;
+  int is_writable;
+};
+
+
+/* prototypes for local functions */
+static void librdf_hash_filter_hashes(librdf_hash_datum *key, librdf_hash_datum *value, u32 *h1, u32 *h2);
+static void librdf_hash_filter_set(librdf_hash_filter* filter, librdf_hash_datum *key, librdf_hash_datum *value);
+static int librdf_hash_filter_get(librdf_hash_filter* filter, librdf_hash_datum *key, librdf_hash_datum *value);
+static int librdf_hash_filter_alloc(librdf_hash_filter* filter, size_t capacity);
+static int librdf_hash_filter_build(librdf_hash* hash, size_t capacity);
+static int librdf_hash_filter_load(librdf_hash* hash);
+static int librdf_hash_filter_save(librdf_hash* hash);
+static void librdf_hash_filter_free(librdf_hash* hash);
+
+
+/*
+ * librdf_hash_filter_hashes:
+ * @key: key
+ * @value: value or NULL for the key entry
+ * @h1: pointer to store the first hash
+ * @h2: pointer to store the probe step, always odd
+ *
+ * INTERNAL - Hash a key or a key/value pair for the filter
+ **/
+static void
+librdf_hash_filter_hashes(librdf_hash_datum *key, librdf_hash_datum *value,
+                          u32 *h1, u32 *h2)
+{
+  u32 seed=value ? LIBRDF_HASH_FILTER_PAIR_SEED : LIBRDF_HASH_FILTER_KEY_SEED;
+
+  *h1=librdf_hash_memory_murmur64(key->data, key->size, seed);
+  *h2=librdf_hash_memory_murmur64(key->data, key->size, ~seed);
+  if(value) {
+    *h1=librdf_hash_memory_murmur64(value->data, value->size, *h1);
+    *h2=librdf_hash_memory_murmur64(value->data, value->size, *h2);
+  }
+  *h2|= 1;
+}
+
+
+static void
+librdf_hash_filter_set(librdf_hash_filter* filter,
+                       librdf_hash_datum *key, librdf_hash_datum *value)
+{
+  u64 bits=filter->words * 64;
+  u32 h1, h2;
+  int i;
+
+  librdf_hash_filter_hashes(key, value, &h1, &h2);
+  for(i=0; i < LIBRDF_HASH_FILTER_PROBES; i++) {
+    u64 bit=(u64)(u32)(h1 + (u32)i * h2) % bits;
+
+    filter->bits[bit >> 6]|= (u64)1 << (bit & 63);
+  }
+}
+
+
+static int
+librdf_hash_filter_get(librdf_hash_filter* filter,
+                       librdf_hash_datum *key, librdf_hash_datum *value)
+{
+  u64 bits=filter->words * 64;
+  u32 h1, h2;
+  int i;
+
+  librdf_hash_filter_hashes(key, value, &h1, &h2);
+  for(i=0; i < LIBRDF_HASH_FILTER_PROBES; i++) {
+    u64 bit=(u64)(u32)(h1 + (u32)i * h2) % bits;
+
+    if(!(filter->bits[bit >> 6] & ((u64)1 << (bit & 63))))
+      return 0;
+  }
+
+  return 1;
+}
+
+
+/*
+ * librdf_hash_filter_alloc:
+ * @filter: filter
+ * @capacity: number of pairs
+ *
+ * INTERNAL - Replace the filter bits with empty ones sized for a number of pairs
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_filter_alloc(librdf_hash_filter* filter, size_t capacity)
+{
+  u64 *bits;
+  u64 words;
+
+  if(capacity < LIBRDF_HASH_FILTER_MIN_CAPACITY)
+    capacity=LIBRDF_HASH_FILTER_MIN_CAPACITY;
+
+  words=((u64)capacity * 2 * LIBRDF_HASH_FILTER_BITS + 63) / 64;
+  if((u64)(size_t)words != words)
+    return 1;
+  bits=(u64*)LIBRDF_CALLOC(u64, (size_t)words, sizeof(u64));
+  if(!bits)
+    return 1;
+
+  if(filter->bits)
+    LIBRDF_FREE(u64, filter->bits);
+  filter->bits=bits;
+  filter->words=words;
+  filter->capacity=capacity;
+  filter->entries=0;
+  filter->deleted=0;
+  return 0;
+}
+
+
+/*
+ * librdf_hash_filter_build:
+ * @hash: hash object with a filter
+ * @capacity: number of pairs to size the filter for at least
+ *
+ * INTERNAL - Build the filter from a walk of all the pairs of the hash
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_filter_build(librdf_hash* hash, size_t capacity)
+{
+  librdf_hash_filter* filter=hash->filter;
+  librdf_hash_cursor* cursor;
+  librdf_hash_datum hd_key, hd_value; /* on stack */
+  int values;
+  int status;
+
+  /* leave room to grow before the next build */
+  values=hash->factory->values_count(hash->context);
+  if(values > 0 && (size_t)values * 2 > capacity)
+    capacity=(size_t)values * 2;
+
+  if(librdf_hash_filter_alloc(filter, capacity))
+    return 1;
+
+  cursor=librdf_new_hash_cursor(hash);
+  if(!cursor)
+    return 1;
+
+  hd_key.data=NULL;
+  status=librdf_hash_cursor_get_first(cursor, &hd_key, &hd_value);
+  while(!status) {
+    librdf_hash_filter_set(filter, &hd_key, NULL);
+    librdf_hash_filter_set(filter, &hd_key, &hd_value);
+    filter->entries++;
+    status=librdf_hash_cursor_get_next(cursor, &hd_key, &hd_value);
+  }
+  librdf_free_hash_cursor(cursor);
+
+  LIBRDF_DEBUG3("Built hash filter of %d bits for %d pairs\n",
+                (int)(filter->words * 64), (int)filter->entries);
+  return 0;
+}
+
+
+/*
+ * librdf_hash_filter_load:
+ * @hash: hash object with a filter
+ *
+ * INTERNAL - Read the saved filter of a hash
+ *
+ * Return value: non 0 if there is no usable saved filter
+ **/
+static int
+librdf_hash_filter_load(librdf_hash* hash)
+{
+  librdf_hash_filter* filter=hash->filter;
+  librdf_hash_filter_header header;
+  FILE *fh;
+  long generation;
+  int status=1;
+
+  if(!hash->factory->generation)
+    return 1;
+  generation=hash->factory->generation(hash->context);
+  if(generation < 0)
+    return 1;
+
+  fh=fopen(filter->file_name, "rb");
+  if(!fh)
+    return 1;
+
+  if(fread(&header, sizeof(header), 1, fh) != 1 ||
+     memcmp(header.magic, LIBRDF_HASH_FILTER_MAGIC, sizeof(header.magic)) ||
+     header.version != LIBRDF_HASH_FILTER_VERSION ||
+     header.byte_order != LIBRDF_HASH_FILTER_BYTE_ORDER ||
+     header.generation != (u64)generation ||
+     header.deleted * 2 > header.entries ||
+     (u64)(size_t)header.capacity != header.capacity ||
+     librdf_hash_filter_alloc(filter, (size_t)header.capacity) ||
+     header.words != filter->words)
+    goto tidy;
+
+  if(fread(filter->bits, sizeof(u64), (size_t)filter->words, fh) != (size_t)filter->words)
+    goto tidy;
+
+  filter->entries=(size_t)header.entries;
+  filter->deleted=(size_t)header.deleted;
+  status=0;
+
+  tidy:
+  fclose(fh);
+  return status;
+}
+
+
+/*
+ * librdf_hash_filter_save:
+ * @hash: hash object with a filter
+ *
+ * INTERNAL - Save the filter of a hash
+ *
+ * A hash without a known generation has nothing to stamp the file
+ * with, so the filter is not saved.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_filter_save(librdf_hash* hash)
+{
+  librdf_hash_filter* filter=hash->filter;
+  librdf_hash_filter_header header;
+  FILE *fh;
+  long generation;
+
+  if(!hash->factory->generation)
+    return 0;
+  generation=hash->factory->generation(hash->context);
+  if(generation < 0)
+    return 0;
+
+  memset(&header, '\0', sizeof(header));
+  memcpy(header.magic, LIBRDF_HASH_FILTER_MAGIC, sizeof(header.magic));
+  header.version=LIBRDF_HASH_FILTER_VERSION;
+  header.byte_order=LIBRDF_HASH_FILTER_BYTE_ORDER;
+  header.words=filter->words;
+  header.capacity=filter->capacity;
+  header.entries=filter->entries;
+  header.deleted=filter->deleted;
+  header.generation=(u64)generation;
+
+  fh=fopen(filter->file_name, "wb");
+  if(!fh)
+    return 1;
+  if(fwrite(&header, sizeof(header), 1, fh) != 1 ||
+     fwrite(filter->bits, sizeof(u64), (size_t)filter->words, fh) != (size_t)filter->words) {
+    fclose(fh);
+    unlink(filter->file_name);
+    return 1;
+  }
+  if(fclose(fh)) {
+    unlink(filter->file_name);
+    return 1;
+  }
+
+  return 0;
+}
+
+
+static void
+librdf_hash_filter_free(librdf_hash* hash)
+{
+  librdf_hash_filter* filter=hash->filter;
+
+  if(filter->bits)
+    LIBRDF_FREE(u64, filter->bits);
+  if(filter->file_name)
+    LIBRDF_FREE(cstring, filter->file_name);
+  LIBRDF_FREE(librdf_hash_filter, filter);
+  hash->filter=NULL;
+}
+
+
+/**
+ * librdf_hash_filter_open:
+ * @hash: open hash object
+ * @identifier: hash identifier or NULL
+ * @is_writable: is hash writable?
+ * @is_new: is hash new?
+ *
+ * INTERNAL - Start filtering lookups of a hash
+ *
+ * The saved filter is used if it matches the hash, otherwise the
+ * filter is built.
+ *
+ * Return value: non 0 on failure
+ **/
+int
+librdf_hash_filter_open(librdf_hash* hash, const char *identifier,
+                        int is_writable, int is_new)
+{
+  librdf_hash_filter* filter;
+  int status=0;
+
+  filter=(librdf_hash_filter*)LIBRDF_CALLOC(librdf_hash_filter, 1,
+                                            sizeof(librdf_hash_filter));
+  if(!filter)
+    return 1;
+  hash->filter=filter;
+  filter->is_writable=is_writable;
+
+  if(identifier) {
+    filter->file_name=(char*)LIBRDF_MALLOC(cstring, strlen(identifier) + 7);
+    if(!filter->file_name) {
+      librdf_hash_filter_free(hash);
+      return 1;
+    }
+    sprintf(filter->file_name, "%s.bloom", identifier);
+  }
+
+  if(is_new || !filter->file_name || librdf_hash_filter_load(hash))
+    status=librdf_hash_filter_build(hash, 0);
+
+  /* the saved filter goes stale as soon as the hash is changed */
+  if(!status && is_writable && filter->file_name)
+    unlink(filter->file_name);
+
+  if(status)
+    librdf_hash_filter_free(hash);
+  return status;
+}
+
+
+/**
+ * librdf_hash_filter_close:
+ * @hash: hash object with a filter
+ *
+ * INTERNAL - Save the filter of a writable hash and free it
+ *
+ * Called before the hash is closed.
+ **/
+void
+librdf_hash_filter_close(librdf_hash* hash)
+{
+  librdf_hash_filter* filter=hash->filter;
+
+  if(filter->is_writable && filter->file_name && librdf_hash_filter_save(hash))
+    librdf_log(hash->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_HASH, NULL,
+               "Failed to save hash filter '%s'", filter->file_name);
+
+  librdf_hash_filter_free(hash);
+}
+
+
+/**
+ * librdf_hash_filter_add:
+ * @hash: hash object with a filter
+ * @key: key
+ * @value: value
+ *
+ * INTERNAL - Add a pair put in the hash to its filter
+ *
+ * The filter is built again twice the size once it holds more pairs
+ * than it was sized for.  If that fails the filter is dropped.
+ **/
+void
+librdf_hash_filter_add(librdf_hash* hash,
+                       librdf_hash_datum *key, librdf_hash_datum *value)
+{
+  librdf_hash_filter* filter=hash->filter;
+
+  librdf_hash_filter_set(filter, key, NULL);
+  librdf_hash_filter_set(filter, key, value);
+
+  if(++filter->entries > filter->capacity &&
+     librdf_hash_filter_build(hash, 2 * filter->capacity)) {
+    librdf_log(hash->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_HASH, NULL,
+               "Failed to grow hash filter, lookups are no longer filtered");
+    librdf_hash_filter_free(hash);
+  }
+}
+
+
+/**
+ * librdf_hash_filter_delete:
+ * @hash: hash object with a filter
+ *
+ * INTERNAL - Count a deletion from the hash
+ **/
+void
+librdf_hash_filter_delete(librdf_hash* hash)
+{
+  hash->filter->deleted++;
+}
+
+
+/**
+ * librdf_hash_filter_test:
+ * @hash: hash object with a filter
+ * @key: key
+ * @value: value or NULL to test for the key
+ *
+ * INTERNAL - Test if the hash may have a key or key/value pair
+ *
+ * Return value: 0 if the hash certainly does not have it
+ **/
+int
+librdf_hash_filter_test(librdf_hash* hash,
+                        librdf_hash_datum *key, librdf_hash_datum *value)
+{
+  return librdf_hash_filter_get(hash->filter, key, value);
+}
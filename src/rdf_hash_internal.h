@@ -26,6 +26,12 @@
 #ifndef LIBRDF_HASH_INTERNAL_H
 #define LIBRDF_HASH_INTERNAL_H
 
+#ifndef LIBRDF_OBJC_FRAMEWORK
+#include <rdf_types.h>
+#else
+#include <Redland/rdf_types.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -47,6 +53,8 @@ void librdf_free_hash_datum(librdf_hash_datum *ptr);
   
 
 
+typedef struct librdf_hash_filter_s librdf_hash_filter;
+
 /** A hash object */
 struct librdf_hash_s
 {
@@ -55,6 +63,8 @@ struct librdf_hash_s
   void* context;
   int   is_open;
   struct librdf_hash_factory_s* factory;
+  /* bloom filter of missing pairs or NULL, see rdf_hash_filter.c */
+  librdf_hash_filter* filter;
 };
 
 
@@ -85,6 +95,17 @@ struct librdf_hash_factory_s {
   /* hoe many values? */
   int (*values_count)(void* context);
 
+  /* how many values for one key? (optional) */
+  int (*key_values_count)(void* context, librdf_hash_datum *key);
+
+  /* number that changes whenever the stored pairs change, <0 if not
+   * known; stamps saved bloom filters (optional) */
+  long (*generation)(void* context);
+
+  /* non 0 if other processes may change the pairs while the hash is
+   * open (optional) */
+  int (*is_shared)(void* context);
+
   /* insert key/value pairs according to flags */
   int (*put)(void* context, librdf_hash_datum *key, librdf_hash_datum *data);
 
@@ -97,6 +118,16 @@ struct librdf_hash_factory_s {
   /* flush any cached information to disk */
   int (*sync)(void* context);
 
+  /* reclaim unused file space (optional) */
+  int (*compact)(void* context);
+
+  /* make changes in a transaction, committed or rolled back together
+   * with those of other hashes that joined it (optional) */
+  int (*transaction_start)(void* context);
+  int (*transaction_join)(void* context, void* leader_context);
+  int (*transaction_commit)(void* context);
+  int (*transaction_rollback)(void* context);
+
   /* get the file descriptor for the hash, if it is file based (for locking) */
   int (*get_fd)(void* context);
 
@@ -123,6 +154,10 @@ void librdf_finish_hash(librdf_world *world);
 #define LIBRDF_HASH_CURSOR_NEXT_VALUE 1
 #define LIBRDF_HASH_CURSOR_FIRST 2
 #define LIBRDF_HASH_CURSOR_NEXT 3
+/* first / next key/value pair with a key starting with the given key
+ * bytes; in key order for ordered (BTree) hashes */
+#define LIBRDF_HASH_CURSOR_SET_RANGE 4
+#define LIBRDF_HASH_CURSOR_NEXT_RANGE 5
 
 
 /* constructors */
@@ -138,13 +173,19 @@ int librdf_hash_close(librdf_hash* hash);
 
 /* how many values */
 int librdf_hash_values_count(librdf_hash* hash);
+int librdf_hash_key_values_count(librdf_hash* hash, librdf_hash_datum *key);
 
 /* retrieve one value for a given hash key as a hash datum */
 librdf_hash_datum* librdf_hash_get_one(librdf_hash* hash, librdf_hash_datum *key);
+/* retrieve one value for a given hash key holding a pointer */
+void* librdf_hash_get_one_pointer(librdf_hash* hash, librdf_hash_datum *key);
 
 /* retrieve all values for a given hash key according to flags */
 librdf_iterator* librdf_hash_get_all(librdf_hash* hash, librdf_hash_datum *key, librdf_hash_datum *value);
 
+/* retrieve all key/value pairs with keys starting with a given prefix */
+librdf_iterator* librdf_hash_get_range(librdf_hash* hash, librdf_hash_datum *key, librdf_hash_datum *value);
+
 /* insert a key/value pair */
 int librdf_hash_put(librdf_hash* hash, librdf_hash_datum *key, librdf_hash_datum *value);
 
@@ -157,6 +198,14 @@ librdf_iterator* librdf_hash_keys(librdf_hash* hash, librdf_hash_datum *key);
 
 /* flush any cached information to disk */
 int librdf_hash_sync(librdf_hash* hash);
+/* reclaim unused file space */
+int librdf_hash_compact(librdf_hash* hash);
+
+/* transactions */
+int librdf_hash_transaction_start(librdf_hash* hash);
+int librdf_hash_transaction_join(librdf_hash* hash, librdf_hash* leader);
+int librdf_hash_transaction_commit(librdf_hash* hash);
+int librdf_hash_transaction_rollback(librdf_hash* hash);
 /* get the file descriptor for the hash, if it is file based (for locking) */
 int librdf_hash_get_fd(librdf_hash* hash);
 
@@ -172,12 +221,30 @@ int librdf_hash_cursor_set(librdf_hash_cursor *cursor, librdf_hash_datum *key,li
 int librdf_hash_cursor_get_next_value(librdf_hash_cursor *cursor, librdf_hash_datum *key,librdf_hash_datum *value);
 int librdf_hash_cursor_get_first(librdf_hash_cursor *cursor, librdf_hash_datum *key, librdf_hash_datum *value);
 int librdf_hash_cursor_get_next(librdf_hash_cursor *cursor, librdf_hash_datum *key, librdf_hash_datum *value);
+int librdf_hash_cursor_set_range(librdf_hash_cursor *cursor, librdf_hash_datum *key, librdf_hash_datum *value);
+int librdf_hash_cursor_get_next_range(librdf_hash_cursor *cursor, librdf_hash_datum *key, librdf_hash_datum *value);
+
+/* filter methods from rdf_hash_filter.c */
+int librdf_hash_filter_open(librdf_hash* hash, const char *identifier, int is_writable, int is_new);
+void librdf_hash_filter_close(librdf_hash* hash);
+void librdf_hash_filter_add(librdf_hash* hash, librdf_hash_datum *key, librdf_hash_datum *value);
+void librdf_hash_filter_delete(librdf_hash* hash);
+int librdf_hash_filter_test(librdf_hash* hash, librdf_hash_datum *key, librdf_hash_datum *value);
 
 #ifdef HAVE_BDB_HASH
 void librdf_init_hash_bdb(librdf_world *world);
 #endif
+#ifdef HAVE_MMAP_HASH
+void librdf_init_hash_mmap(librdf_world *world);
+#endif
+#ifdef HAVE_LSM_HASH
+void librdf_init_hash_lsm(librdf_world *world);
+#endif
 void librdf_init_hash_memory(librdf_world *world);
 
+/* from rdf_hash_memory.c */
+u32 librdf_hash_memory_murmur64(const void *data, size_t size, u32 seed);
+
 
 #ifdef __cplusplus
 }
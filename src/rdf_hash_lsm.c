@@ -0,0 +1,2977 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_hash_lsm.c - RDF hash log structured merge implementation
+ *
+ * Copyright (C) 2000-2008, David Beckett http://www.dajobe.org/
+ * Copyright (C) 2000-2004, University of Bristol, UK http://www.bristol.ac.uk/
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h> /* for qsort() */
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h> /* for close(), unlink(), fsync(), ftruncate() */
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
+
+#include <redland.h>
+#include <rdf_types.h>
+
+
+/*
+ * The lsm hash is a log structured merge tree for hashes that are
+ * mostly written to.  Nothing is ever updated in place: every change
+ * is appended to a log and applied to a memory hash, the memtable, and
+ * when the memtable grows past its size it is written out in one
+ * sequential pass as a new sorted segment file.
+ *
+ * A segment is immutable and mapped read only.  It holds entries of
+ * a key, a value and a flag saying if the pair was put or deleted
+ * (a tombstone), sorted by key then value, followed by an index of
+ * entry offsets for binary search and a bloom filter of its keys so
+ * that most lookups of a key a segment does not have never touch its
+ * entries.  As with the mmap hash, numbers are in host byte order and
+ * offsets are from the start of the file.
+ *
+ * The newest entry for a pair decides if it is in the hash, the
+ * memtable being newer than every segment and newer segments newer
+ * than older ones.  Lookups and cursors merge the memtable with the
+ * segments; a cursor walks all of them in key order so SET_RANGE is a
+ * real range.  Pairs are stored once, adding a pair that is already
+ * present does nothing.
+ *
+ * After each memtable write the newest segments are merged while
+ * together they are at least as large as the next older one, so
+ * segment sizes roughly double going back in time, there are about
+ * log2(n) of them and a pair is rewritten about as often.  Tombstones
+ * are dropped when the oldest segment is part of a merge.
+ *
+ * One merge runs at a time and no change waits for it: with threads
+ * it runs in a thread of its own, otherwise each change merges a few
+ * more entries.  It reads copies of the segments it merges, which only
+ * it replaces, so new segments can be written in front of them
+ * meanwhile; its segment is installed by the next change after it is
+ * done.
+ *
+ * The manifest file, "<identifier>.lsm", lists the live segments
+ * newest first and is replaced by rename so it always names complete
+ * segments.  Segments are "<identifier>.lsm-<n>" and the log is
+ * "<identifier>.lsm-log".  The log is replayed into the memtable on
+ * open; replaying a change already written to a segment does nothing.
+ */
+
+#define LIBRDF_HASH_LSM_MAGIC "RDFLSM"
+#define LIBRDF_HASH_LSM_VERSION 1
+#define LIBRDF_HASH_LSM_BYTE_ORDER 0x01020304U
+
+/* entries start at 8 byte boundaries */
+#define LIBRDF_HASH_LSM_ALIGN(n) (((n) + 7) & ~(u64)7)
+
+/* entry flags, also the first byte of memtable values and log ops */
+#define LIBRDF_HASH_LSM_PUT 1
+#define LIBRDF_HASH_LSM_TOMBSTONE 2
+/* log only - delete all values of a key */
+#define LIBRDF_HASH_LSM_DELETE_KEY 3
+
+/* default memtable size in bytes before it is written to a segment */
+#define LIBRDF_HASH_LSM_MEMTABLE_SIZE (4 * 1024 * 1024)
+/* approximate memtable bytes used by a pair beyond its data */
+#define LIBRDF_HASH_LSM_PAIR_OVERHEAD 48
+
+/* entries merged for each change, or between checks for cancelling
+ * by a merge thread */
+#define LIBRDF_HASH_LSM_MERGE_STEP 64
+
+/* bloom filter bits per entry and probes per key, about 1% false hits */
+#define LIBRDF_HASH_LSM_BLOOM_BITS 10
+#define LIBRDF_HASH_LSM_BLOOM_PROBES 7
+#define LIBRDF_HASH_LSM_BLOOM_SEED1 0x5bd1e995U
+#define LIBRDF_HASH_LSM_BLOOM_SEED2 0x9e3779b9U
+
+
+/* private structures, the first three laid out as in the files */
+typedef struct
+{
+  char magic[8];
+  u32 version;
+  /* LIBRDF_HASH_LSM_BYTE_ORDER as stored by the writer */
+  u32 byte_order;
+  u64 entries;
+  /* entries u64 entry offsets in order */
+  u64 index_offset;
+  /* bloom_words u64 words of bloom filter bits */
+  u64 bloom_offset;
+  u64 bloom_words;
+  /* file size */
+  u64 size;
+} librdf_hash_lsm_header;
+
+
+typedef struct
+{
+  u32 key_len;
+  u32 value_len;
+  /* LIBRDF_HASH_LSM_PUT or LIBRDF_HASH_LSM_TOMBSTONE */
+  u32 flag;
+  u32 reserved;
+  /* key_len key bytes then value_len value bytes follow */
+} librdf_hash_lsm_entry;
+
+#define LIBRDF_HASH_LSM_ENTRY_KEY(entry) \
+  ((unsigned char*)(entry) + sizeof(librdf_hash_lsm_entry))
+
+
+typedef struct
+{
+  u32 op;
+  u32 key_len;
+  u32 value_len;
+  /* hash of op, key and value to find a partly written last record */
+  u32 check;
+  /* key_len key bytes then value_len value bytes follow */
+} librdf_hash_lsm_log_record;
+
+
+/* a pair from the memtable or a segment */
+typedef struct
+{
+  const unsigned char *key;
+  size_t key_len;
+  const unsigned char *value;
+  size_t value_len;
+  int flag;
+  /* 0 for the memtable, 1 + segment index for a segment; lower is newer */
+  int source;
+} librdf_hash_lsm_item;
+
+
+typedef struct
+{
+  /* n of the "<identifier>.lsm-<n>" file */
+  unsigned int number;
+  int fd;
+  unsigned char *map;
+  size_t map_size;
+  /* entry offsets inside the mapping */
+  u64 *index;
+  u64 entries;
+  u64 *bloom;
+  u64 bloom_words;
+} librdf_hash_lsm_segment;
+
+
+/* a sorted run of pairs being merged */
+typedef struct
+{
+  /* the segment or NULL for sorted items */
+  librdf_hash_lsm_segment* segment;
+  librdf_hash_lsm_item* items;
+  u64 position;
+  u64 count;
+} librdf_hash_lsm_source;
+
+
+/* segment writer state */
+typedef struct
+{
+  FILE *fh;
+  u64 offset;
+  int failed;
+  /* offsets of the entries written */
+  u64 *index;
+  u64 entries;
+  u64 index_size;
+  u64 *bloom;
+  u64 bloom_words;
+} librdf_hash_lsm_writer;
+
+
+/* state of a merge of the newest segments at its start */
+typedef struct
+{
+  /* copies of the merged segments, newest first, and their sources */
+  librdf_hash_lsm_segment* segments;
+  librdf_hash_lsm_source* sources;
+  int count;
+  int drop_tombstones;
+  /* the new segment, its file name and writer */
+  librdf_hash_lsm_segment segment;
+  char *name;
+  librdf_hash_lsm_writer writer;
+  /* 0 while merging, 1 when written, -1 if writing failed */
+  int status;
+#ifdef WITH_THREADS
+  /* non 0 while the merge thread runs */
+  int threaded;
+  pthread_t thread;
+  /* guards running and cancel */
+  pthread_mutex_t lock;
+  int running;
+  int cancel;
+#endif
+} librdf_hash_lsm_merger;
+
+
+typedef struct
+{
+  /* the hash object */
+  librdf_hash* hash;
+  /* manifest and log file names */
+  char *file_name;
+  char *log_name;
+  int mode;
+  int is_writable;
+
+  /* live segments, newest first */
+  librdf_hash_lsm_segment* segments;
+  int segments_count;
+  /* number of the next segment file */
+  unsigned int next_segment;
+
+  /* pairs changed since the newest segment, values are a flag byte
+   * followed by the value bytes */
+  librdf_hash* memtable;
+  /* approximate memtable bytes and the size it is written at */
+  size_t memtable_bytes;
+  size_t memtable_size;
+  /* this many values */
+  int values;
+  /* values in the segments, as recorded by the manifest */
+  int segment_values;
+
+  /* change log, NULL when read only */
+  FILE *log;
+  /* non 0 while the log is being replayed */
+  int replaying;
+
+  /* number of open cursors, segments are not replaced while >0 */
+  int cursors;
+
+  /* the running merge or NULL */
+  librdf_hash_lsm_merger* merger;
+
+  /* a flag byte and value for memtable lookups */
+  unsigned char *buffer;
+  size_t buffer_size;
+  /* pairs being gathered */
+  librdf_hash_lsm_item* items;
+  size_t items_size;
+} librdf_hash_lsm_context;
+
+
+/* prototypes for local functions */
+static int librdf_hash_lsm_compare(const void *data1, size_t size1, const void *data2, size_t size2);
+static int librdf_hash_lsm_compare_pairs(const librdf_hash_lsm_item* item1, const librdf_hash_lsm_item* item2);
+static int librdf_hash_lsm_compare_items(const void *a, const void *b);
+static char* librdf_hash_lsm_segment_name(librdf_hash_lsm_context* hash, unsigned int number);
+static int librdf_hash_lsm_bloom_test(librdf_hash_lsm_segment* segment, const void *key, size_t key_len);
+static void librdf_hash_lsm_bloom_add(u64 *bloom, u64 bloom_words, const void *key, size_t key_len);
+static void librdf_hash_lsm_segment_item(librdf_hash_lsm_segment* segment, u64 i, librdf_hash_lsm_item* item);
+static void librdf_hash_lsm_source_item(librdf_hash_lsm_source* source, u64 i, librdf_hash_lsm_item* item);
+static u64 librdf_hash_lsm_source_seek(librdf_hash_lsm_source* source, const void *key, size_t key_len, const void *value, size_t value_len);
+static int librdf_hash_lsm_merge_next(librdf_hash_lsm_source* sources, int count, librdf_hash_lsm_item* item);
+static int librdf_hash_lsm_map_segment(librdf_hash_lsm_context* hash, librdf_hash_lsm_segment* segment);
+static void librdf_hash_lsm_unmap_segment(librdf_hash_lsm_segment* segment);
+static int librdf_hash_lsm_add_item(librdf_hash_lsm_context* hash, librdf_hash_lsm_item* item, size_t *count_p);
+static int librdf_hash_lsm_copy_items(librdf_hash_lsm_item* items, size_t count, unsigned char **block_p);
+static int librdf_hash_lsm_flag_value(librdf_hash_lsm_context* hash, int flag, librdf_hash_datum *value, librdf_hash_datum *flag_value);
+static int librdf_hash_lsm_new_memtable(librdf_hash_lsm_context* hash);
+static int librdf_hash_lsm_memtable_items(librdf_hash_lsm_context* hash, size_t *count_p);
+static int librdf_hash_lsm_memtable_set(librdf_hash_lsm_context* hash, librdf_hash_datum *key, librdf_hash_datum *value, int flag);
+static int librdf_hash_lsm_find(librdf_hash_lsm_context* hash, librdf_hash_datum *key, librdf_hash_datum *value, int segments_only);
+static int librdf_hash_lsm_gather(librdf_hash_lsm_context* hash, const void *key, size_t key_len, size_t *count_p);
+static void librdf_hash_lsm_emit(librdf_hash_lsm_writer* writer, const void *data, size_t size);
+static int librdf_hash_lsm_writer_start(librdf_hash_lsm_context* hash, librdf_hash_lsm_writer* writer, const char *file_name, u64 max_entries);
+static void librdf_hash_lsm_writer_add(librdf_hash_lsm_writer* writer, librdf_hash_lsm_item* item);
+static int librdf_hash_lsm_writer_finish(librdf_hash_lsm_writer* writer, const char *file_name);
+static int librdf_hash_lsm_write_manifest(librdf_hash_lsm_context* hash, librdf_hash_lsm_segment* segments, int count);
+static int librdf_hash_lsm_read_manifest(librdf_hash_lsm_context* hash);
+static int librdf_hash_lsm_install(librdf_hash_lsm_context* hash, int first, int merged, librdf_hash_lsm_segment* segment);
+static int librdf_hash_lsm_write_segment(librdf_hash_lsm_context* hash, librdf_hash_lsm_source* sources, int count, u64 max_entries, int drop_tombstones);
+static int librdf_hash_lsm_open_log(librdf_hash_lsm_context* hash, int truncate_log);
+static int librdf_hash_lsm_log(librdf_hash_lsm_context* hash, int op, librdf_hash_datum *key, librdf_hash_datum *value);
+static int librdf_hash_lsm_replay(librdf_hash_lsm_context* hash);
+static int librdf_hash_lsm_flush(librdf_hash_lsm_context* hash);
+static void librdf_hash_lsm_free_merger(librdf_hash_lsm_merger* merger);
+static int librdf_hash_lsm_merge_run(librdf_hash_lsm_merger* merger, u64 limit);
+#ifdef WITH_THREADS
+static void* librdf_hash_lsm_merge_thread(void* arg);
+#endif
+static int librdf_hash_lsm_merge_start(librdf_hash_lsm_context* hash, int count, int background);
+static int librdf_hash_lsm_merge_step(librdf_hash_lsm_context* hash, int wait);
+static int librdf_hash_lsm_merge(librdf_hash_lsm_context* hash, int count);
+static int librdf_hash_lsm_merge_segments(librdf_hash_lsm_context* hash);
+static void librdf_hash_lsm_changed(librdf_hash_lsm_context* hash);
+
+
+/* Implementing the hash cursor */
+static int librdf_hash_lsm_cursor_init(void *cursor_context, void *hash_context);
+static int librdf_hash_lsm_cursor_get(void* context, librdf_hash_datum* key, librdf_hash_datum* value, unsigned int flags);
+static void librdf_hash_lsm_cursor_finish(void* context);
+
+
+/* prototypes for local functions */
+static int librdf_hash_lsm_create(librdf_hash* new_hash, void* context);
+static int librdf_hash_lsm_destroy(void* context);
+static int librdf_hash_lsm_open(void* context, const char *identifier, int mode, int is_writable, int is_new, librdf_hash* options);
+static int librdf_hash_lsm_close(void* context);
+static int librdf_hash_lsm_clone(librdf_hash* new_hash, void *new_context, char *new_identifier, void* old_context);
+static int librdf_hash_lsm_values_count(void *context);
+static int librdf_hash_lsm_key_values_count(void *context, librdf_hash_datum *key);
+static int librdf_hash_lsm_put(void* context, librdf_hash_datum *key, librdf_hash_datum *data);
+static int librdf_hash_lsm_exists(void* context, librdf_hash_datum *key, librdf_hash_datum *value);
+static int librdf_hash_lsm_delete_key(void* context, librdf_hash_datum *key);
+static int librdf_hash_lsm_delete_key_value(void* context, librdf_hash_datum *key, librdf_hash_datum *value);
+static int librdf_hash_lsm_sync(void* context);
+static int librdf_hash_lsm_compact(void* context);
+static int librdf_hash_lsm_get_fd(void* context);
+
+static void librdf_hash_lsm_register_factory(librdf_hash_factory *factory);
+
+
+
+/* helper functions */
+
+
+/*
+ * librdf_hash_lsm_compare:
+ * @data1: first bytes
+ * @size1: first length
+ * @data2: second bytes
+ * @size2: second length
+ *
+ * INTERNAL - Order two byte strings, a prefix first
+ *
+ * Return value: <0, 0 or >0 like memcmp()
+ **/
+static int
+librdf_hash_lsm_compare(const void *data1, size_t size1,
+                        const void *data2, size_t size2)
+{
+  size_t size=(size1 < size2) ? size1 : size2;
+  int rc=size ? memcmp(data1, data2, size) : 0;
+
+  if(rc)
+    return rc;
+  return (size1 > size2) - (size1 < size2);
+}
+
+
+static int
+librdf_hash_lsm_compare_pairs(const librdf_hash_lsm_item* item1,
+                              const librdf_hash_lsm_item* item2)
+{
+  int rc=librdf_hash_lsm_compare(item1->key, item1->key_len,
+                                 item2->key, item2->key_len);
+  if(rc)
+    return rc;
+  return librdf_hash_lsm_compare(item1->value, item1->value_len,
+                                 item2->value, item2->value_len);
+}
+
+
+/* qsort() order of pairs, the newest of equal pairs first */
+static int
+librdf_hash_lsm_compare_items(const void *a, const void *b)
+{
+  const librdf_hash_lsm_item* item1=(const librdf_hash_lsm_item*)a;
+  const librdf_hash_lsm_item* item2=(const librdf_hash_lsm_item*)b;
+  int rc=librdf_hash_lsm_compare_pairs(item1, item2);
+
+  if(rc)
+    return rc;
+  return (item1->source > item2->source) - (item1->source < item2->source);
+}
+
+
+static char*
+librdf_hash_lsm_segment_name(librdf_hash_lsm_context* hash,
+                             unsigned int number)
+{
+  char *name;
+
+  name=(char*)LIBRDF_MALLOC(cstring, strlen(hash->file_name) + 12);
+  if(name)
+    sprintf(name, "%s-%u", hash->file_name, number);
+  return name;
+}
+
+
+/*
+ * librdf_hash_lsm_bloom_test:
+ * @segment: segment
+ * @key: key bytes
+ * @key_len: key length
+ *
+ * INTERNAL - Test if a segment may have a key
+ *
+ * Return value: 0 if the segment certainly does not have the key
+ **/
+static int
+librdf_hash_lsm_bloom_test(librdf_hash_lsm_segment* segment,
+                           const void *key, size_t key_len)
+{
+  u64 bits=segment->bloom_words * 64;
+  u32 h1, h2;
+  int i;
+
+  if(!segment->entries)
+    return 0;
+
+  h1=librdf_hash_memory_murmur64(key, key_len, LIBRDF_HASH_LSM_BLOOM_SEED1);
+  h2=librdf_hash_memory_murmur64(key, key_len, LIBRDF_HASH_LSM_BLOOM_SEED2) | 1;
+  for(i=0; i < LIBRDF_HASH_LSM_BLOOM_PROBES; i++) {
+    u64 bit=(u64)(u32)(h1 + (u32)i * h2) % bits;
+
+    if(!(segment->bloom[bit >> 6] & ((u64)1 << (bit & 63))))
+      return 0;
+  }
+
+  return 1;
+}
+
+
+static void
+librdf_hash_lsm_bloom_add(u64 *bloom, u64 bloom_words,
+                          const void *key, size_t key_len)
+{
+  u64 bits=bloom_words * 64;
+  u32 h1, h2;
+  int i;
+
+  h1=librdf_hash_memory_murmur64(key, key_len, LIBRDF_HASH_LSM_BLOOM_SEED1);
+  h2=librdf_hash_memory_murmur64(key, key_len, LIBRDF_HASH_LSM_BLOOM_SEED2) | 1;
+  for(i=0; i < LIBRDF_HASH_LSM_BLOOM_PROBES; i++) {
+    u64 bit=(u64)(u32)(h1 + (u32)i * h2) % bits;
+
+    bloom[bit >> 6]|= (u64)1 << (bit & 63);
+  }
+}
+
+
+static void
+librdf_hash_lsm_segment_item(librdf_hash_lsm_segment* segment, u64 i,
+                             librdf_hash_lsm_item* item)
+{
+  librdf_hash_lsm_entry* entry;
+
+  entry=(librdf_hash_lsm_entry*)(segment->map + segment->index[i]);
+  item->key=LIBRDF_HASH_LSM_ENTRY_KEY(entry);
+  item->key_len=entry->key_len;
+  item->value=item->key + entry->key_len;
+  item->value_len=entry->value_len;
+  item->flag=(int)entry->flag;
+}
+
+
+static void
+librdf_hash_lsm_source_item(librdf_hash_lsm_source* source, u64 i,
+                            librdf_hash_lsm_item* item)
+{
+  if(source->segment)
+    librdf_hash_lsm_segment_item(source->segment, i, item);
+  else
+    *item=source->items[i];
+}
+
+
+/*
+ * librdf_hash_lsm_source_seek:
+ * @source: sorted source
+ * @key: key bytes
+ * @key_len: key length
+ * @value: value bytes or NULL
+ * @value_len: value length
+ *
+ * INTERNAL - Binary search a source for the first pair not before a key or pair
+ *
+ * With no value this finds the first pair with a key not ordered
+ * before @key, which is also the start of the keys @key prefixes.
+ *
+ * Return value: position, the source count if there is none
+ **/
+static u64
+librdf_hash_lsm_source_seek(librdf_hash_lsm_source* source,
+                            const void *key, size_t key_len,
+                            const void *value, size_t value_len)
+{
+  u64 low=0;
+  u64 high=source->count;
+
+  while(low < high) {
+    u64 middle=low + (high - low) / 2;
+    librdf_hash_lsm_item item;
+    int rc;
+
+    librdf_hash_lsm_source_item(source, middle, &item);
+    rc=librdf_hash_lsm_compare(item.key, item.key_len, key, key_len);
+    if(!rc && value)
+      rc=librdf_hash_lsm_compare(item.value, item.value_len, value, value_len);
+    if(rc < 0)
+      low=middle + 1;
+    else
+      high=middle;
+  }
+
+  return low;
+}
+
+
+/*
+ * librdf_hash_lsm_merge_next:
+ * @sources: sources, newest first
+ * @count: number of sources
+ * @item: pointer to store the next pair
+ *
+ * INTERNAL - Get the next pair in order from merged sources
+ *
+ * A pair in several sources is returned once with the flag of the
+ * newest source.
+ *
+ * Return value: non 0 when all sources are done
+ **/
+static int
+librdf_hash_lsm_merge_next(librdf_hash_lsm_source* sources, int count,
+                           librdf_hash_lsm_item* item)
+{
+  librdf_hash_lsm_item head;
+  int best= -1;
+  int i;
+
+  for(i=0; i < count; i++) {
+    if(sources[i].position >= sources[i].count)
+      continue;
+    librdf_hash_lsm_source_item(&sources[i], sources[i].position, &head);
+    if(best < 0 || librdf_hash_lsm_compare_pairs(&head, item) < 0) {
+      *item=head;
+      best=i;
+    }
+  }
+
+  if(best < 0)
+    return 1;
+
+  for(i=best; i < count; i++) {
+    if(sources[i].position >= sources[i].count)
+      continue;
+    librdf_hash_lsm_source_item(&sources[i], sources[i].position, &head);
+    if(!librdf_hash_lsm_compare_pairs(&head, item))
+      sources[i].position++;
+  }
+
+  return 0;
+}
+
+
+/*
+ * librdf_hash_lsm_map_segment:
+ * @hash: the lsm hash context
+ * @segment: segment with the number set
+ *
+ * INTERNAL - Map a segment file and check its header
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_map_segment(librdf_hash_lsm_context* hash,
+                            librdf_hash_lsm_segment* segment)
+{
+  librdf_world* world=hash->hash->world;
+  librdf_hash_lsm_header* header;
+  struct stat buf;
+  char *name;
+  void *map;
+  int status=1;
+
+  segment->fd= -1;
+  segment->map=NULL;
+
+  name=librdf_hash_lsm_segment_name(hash, segment->number);
+  if(!name)
+    return 1;
+
+  segment->fd=open(name, O_RDONLY);
+  if(segment->fd < 0) {
+    librdf_log(world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+               "Failed to open lsm hash segment '%s' - %s", name,
+               strerror(errno));
+    goto tidy;
+  }
+
+  if(fstat(segment->fd, &buf) ||
+     (size_t)buf.st_size < sizeof(librdf_hash_lsm_header) ||
+     (off_t)(size_t)buf.st_size != buf.st_size) {
+    librdf_log(world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+               "lsm hash file '%s' is not a segment", name);
+    goto tidy;
+  }
+
+  map=mmap(NULL, (size_t)buf.st_size, PROT_READ, MAP_SHARED, segment->fd, 0);
+  if(map == MAP_FAILED) {
+    librdf_log(world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+               "Failed to map lsm hash segment '%s' - %s", name,
+               strerror(errno));
+    goto tidy;
+  }
+  segment->map=(unsigned char*)map;
+  segment->map_size=(size_t)buf.st_size;
+
+  header=(librdf_hash_lsm_header*)segment->map;
+  if(memcmp(header->magic, LIBRDF_HASH_LSM_MAGIC, sizeof(LIBRDF_HASH_LSM_MAGIC)) ||
+     header->version != LIBRDF_HASH_LSM_VERSION ||
+     header->byte_order != LIBRDF_HASH_LSM_BYTE_ORDER ||
+     header->size != (u64)segment->map_size ||
+     header->index_offset > header->size ||
+     header->entries > (header->size - header->index_offset) / sizeof(u64) ||
+     header->bloom_offset > header->size ||
+     !header->bloom_words ||
+     header->bloom_words > (header->size - header->bloom_offset) / sizeof(u64)) {
+    librdf_log(world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+               "lsm hash file '%s' is not a segment of this version and byte order",
+               name);
+    goto tidy;
+  }
+
+  segment->index=(u64*)(segment->map + header->index_offset);
+  segment->entries=header->entries;
+  segment->bloom=(u64*)(segment->map + header->bloom_offset);
+  segment->bloom_words=header->bloom_words;
+  status=0;
+
+  tidy:
+  if(status)
+    librdf_hash_lsm_unmap_segment(segment);
+  LIBRDF_FREE(cstring, name);
+
+  return status;
+}
+
+
+static void
+librdf_hash_lsm_unmap_segment(librdf_hash_lsm_segment* segment)
+{
+  if(segment->map) {
+    munmap((void*)segment->map, segment->map_size);
+    segment->map=NULL;
+    segment->map_size=0;
+  }
+  segment->index=NULL;
+  segment->entries=0;
+  segment->bloom=NULL;
+  segment->bloom_words=0;
+
+  if(segment->fd >= 0) {
+    close(segment->fd);
+    segment->fd= -1;
+  }
+}
+
+
+/*
+ * librdf_hash_lsm_add_item:
+ * @hash: the lsm hash context
+ * @item: pair
+ * @count_p: pointer to the number of pairs gathered
+ *
+ * INTERNAL - Add a pair to those being gathered
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_add_item(librdf_hash_lsm_context* hash,
+                         librdf_hash_lsm_item* item, size_t *count_p)
+{
+  if(*count_p == hash->items_size) {
+    librdf_hash_lsm_item* new_items;
+    size_t new_size=hash->items_size ? 2 * hash->items_size : 64;
+
+    new_items=(librdf_hash_lsm_item*)LIBRDF_REALLOC(librdf_hash_lsm_item,
+                                                    hash->items,
+                                                    new_size * sizeof(librdf_hash_lsm_item));
+    if(!new_items)
+      return 1;
+    hash->items=new_items;
+    hash->items_size=new_size;
+  }
+
+  hash->items[(*count_p)++]=*item;
+  return 0;
+}
+
+
+/*
+ * librdf_hash_lsm_copy_items:
+ * @items: pairs
+ * @count: number of pairs
+ * @block_p: pointer to store the block of copied bytes
+ *
+ * INTERNAL - Copy the keys and values of pairs into one new block
+ *
+ * The pairs are changed to point at the copies.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_copy_items(librdf_hash_lsm_item* items, size_t count,
+                           unsigned char **block_p)
+{
+  unsigned char *p;
+  size_t size=1;
+  size_t i;
+
+  for(i=0; i < count; i++)
+    size+= items[i].key_len + items[i].value_len;
+
+  p=(unsigned char*)LIBRDF_MALLOC(bytes, size);
+  if(!p)
+    return 1;
+  *block_p=p;
+
+  for(i=0; i < count; i++) {
+    memcpy(p, items[i].key, items[i].key_len);
+    items[i].key=p;
+    p+= items[i].key_len;
+    memcpy(p, items[i].value, items[i].value_len);
+    items[i].value=p;
+    p+= items[i].value_len;
+  }
+
+  return 0;
+}
+
+
+/*
+ * librdf_hash_lsm_flag_value:
+ * @hash: the lsm hash context
+ * @flag: entry flag
+ * @value: value
+ * @flag_value: datum to point at the flag byte and value
+ *
+ * INTERNAL - Make the memtable value of a pair
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_flag_value(librdf_hash_lsm_context* hash, int flag,
+                           librdf_hash_datum *value,
+                           librdf_hash_datum *flag_value)
+{
+  if(value->size + 1 > hash->buffer_size) {
+    unsigned char *new_buffer;
+    size_t new_size=hash->buffer_size ? hash->buffer_size : 64;
+
+    while(new_size < value->size + 1)
+      new_size<<= 1;
+    new_buffer=(unsigned char*)LIBRDF_REALLOC(bytes, hash->buffer, new_size);
+    if(!new_buffer)
+      return 1;
+    hash->buffer=new_buffer;
+    hash->buffer_size=new_size;
+  }
+
+  hash->buffer[0]=(unsigned char)flag;
+  if(value->size)
+    memcpy(hash->buffer + 1, value->data, value->size);
+  flag_value->data=hash->buffer;
+  flag_value->size=value->size + 1;
+  return 0;
+}
+
+
+static int
+librdf_hash_lsm_new_memtable(librdf_hash_lsm_context* hash)
+{
+  librdf_hash* memtable;
+
+  memtable=librdf_new_hash(hash->hash->world, "memory");
+  if(!memtable)
+    return 1;
+  if(librdf_hash_open(memtable, NULL, 0, 1, 1, NULL)) {
+    librdf_free_hash(memtable);
+    return 1;
+  }
+
+  if(hash->memtable)
+    librdf_free_hash(hash->memtable);
+  hash->memtable=memtable;
+  hash->memtable_bytes=0;
+  return 0;
+}
+
+
+/*
+ * librdf_hash_lsm_memtable_items:
+ * @hash: the lsm hash context
+ * @count_p: pointer to store the number of pairs
+ *
+ * INTERNAL - Gather the memtable pairs in order
+ *
+ * The pairs point into the memtable until it is next changed.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_memtable_items(librdf_hash_lsm_context* hash, size_t *count_p)
+{
+  librdf_hash_cursor* cursor;
+  librdf_hash_datum hd_key, hd_value; /* on stack */
+  librdf_hash_lsm_item item;
+  size_t count=0;
+  int status;
+
+  cursor=librdf_new_hash_cursor(hash->memtable);
+  if(!cursor)
+    return 1;
+
+  item.source=0;
+  hd_key.data=NULL;
+  status=librdf_hash_cursor_get_first(cursor, &hd_key, &hd_value);
+  while(!status) {
+    item.key=(const unsigned char*)hd_key.data;
+    item.key_len=hd_key.size;
+    item.flag=((unsigned char*)hd_value.data)[0];
+    item.value=(const unsigned char*)hd_value.data + 1;
+    item.value_len=hd_value.size - 1;
+    if(librdf_hash_lsm_add_item(hash, &item, &count)) {
+      librdf_free_hash_cursor(cursor);
+      return 1;
+    }
+    status=librdf_hash_cursor_get_next(cursor, &hd_key, &hd_value);
+  }
+  librdf_free_hash_cursor(cursor);
+
+  if(count > 1)
+    qsort(hash->items, count, sizeof(librdf_hash_lsm_item),
+          librdf_hash_lsm_compare_items);
+
+  *count_p=count;
+  return 0;
+}
+
+
+/*
+ * librdf_hash_lsm_memtable_set:
+ * @hash: the lsm hash context
+ * @key: key
+ * @value: value
+ * @flag: entry flag or 0 to forget the pair
+ *
+ * INTERNAL - Set the memtable entry of a pair
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_memtable_set(librdf_hash_lsm_context* hash,
+                            librdf_hash_datum *key, librdf_hash_datum *value,
+                            int flag)
+{
+  librdf_hash_datum hd_value; /* on stack */
+  int old_flag;
+
+  for(old_flag=LIBRDF_HASH_LSM_PUT; old_flag <= LIBRDF_HASH_LSM_TOMBSTONE;
+      old_flag++) {
+    if(librdf_hash_lsm_flag_value(hash, old_flag, value, &hd_value))
+      return 1;
+    if(librdf_hash_exists(hash->memtable, key, &hd_value) > 0) {
+      if(old_flag == flag)
+        return 0;
+      if(librdf_hash_delete(hash->memtable, key, &hd_value))
+        return 1;
+      break;
+    }
+  }
+
+  if(!flag)
+    return 0;
+
+  if(librdf_hash_lsm_flag_value(hash, flag, value, &hd_value) ||
+     librdf_hash_put(hash->memtable, key, &hd_value))
+    return 1;
+
+  hash->memtable_bytes+= key->size + value->size + LIBRDF_HASH_LSM_PAIR_OVERHEAD;
+  return 0;
+}
+
+
+/*
+ * librdf_hash_lsm_find:
+ * @hash: the lsm hash context
+ * @key: key
+ * @value: value
+ * @segments_only: non 0 to ignore the memtable
+ *
+ * INTERNAL - Find the newest entry of a pair
+ *
+ * Return value: LIBRDF_HASH_LSM_PUT, LIBRDF_HASH_LSM_TOMBSTONE or 0 if there is none
+ **/
+static int
+librdf_hash_lsm_find(librdf_hash_lsm_context* hash,
+                     librdf_hash_datum *key, librdf_hash_datum *value,
+                     int segments_only)
+{
+  librdf_hash_lsm_source source;
+  librdf_hash_lsm_item item;
+  librdf_hash_datum hd_value; /* on stack */
+  int i;
+
+  if(!segments_only) {
+    if(librdf_hash_lsm_flag_value(hash, LIBRDF_HASH_LSM_PUT, value, &hd_value))
+      return 0;
+    if(librdf_hash_exists(hash->memtable, key, &hd_value) > 0)
+      return LIBRDF_HASH_LSM_PUT;
+    hash->buffer[0]=LIBRDF_HASH_LSM_TOMBSTONE;
+    if(librdf_hash_exists(hash->memtable, key, &hd_value) > 0)
+      return LIBRDF_HASH_LSM_TOMBSTONE;
+  }
+
+  source.items=NULL;
+  for(i=0; i < hash->segments_count; i++) {
+    source.segment=&hash->segments[i];
+    if(!librdf_hash_lsm_bloom_test(source.segment, key->data, key->size))
+      continue;
+
+    source.count=source.segment->entries;
+    source.position=librdf_hash_lsm_source_seek(&source, key->data, key->size,
+                                                value->data, value->size);
+    if(source.position < source.count) {
+      librdf_hash_lsm_segment_item(source.segment, source.position, &item);
+      if(!librdf_hash_lsm_compare(item.key, item.key_len, key->data, key->size) &&
+         !librdf_hash_lsm_compare(item.value, item.value_len, value->data, value->size))
+        return item.flag;
+    }
+  }
+
+  return 0;
+}
+
+
+/*
+ * librdf_hash_lsm_gather:
+ * @hash: the lsm hash context
+ * @key: key bytes
+ * @key_len: key length
+ * @count_p: pointer to store the number of values
+ *
+ * INTERNAL - Gather the values of a key that are in the hash
+ *
+ * The pairs are left sorted by value in the hash items and point into
+ * the memtable until it is next changed.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_gather(librdf_hash_lsm_context* hash,
+                       const void *key, size_t key_len, size_t *count_p)
+{
+  librdf_hash_cursor* cursor;
+  librdf_hash_lsm_source source;
+  librdf_hash_lsm_item item;
+  librdf_hash_datum hd_key, hd_value; /* on stack */
+  size_t count=0;
+  size_t i, j;
+  int status;
+
+  cursor=librdf_new_hash_cursor(hash->memtable);
+  if(!cursor)
+    return 1;
+
+  item.source=0;
+  hd_key.data=(void*)key;
+  hd_key.size=key_len;
+  status=librdf_hash_cursor_set(cursor, &hd_key, &hd_value);
+  while(!status) {
+    item.key=(const unsigned char*)key;
+    item.key_len=key_len;
+    item.flag=((unsigned char*)hd_value.data)[0];
+    item.value=(const unsigned char*)hd_value.data + 1;
+    item.value_len=hd_value.size - 1;
+    if(librdf_hash_lsm_add_item(hash, &item, &count)) {
+      librdf_free_hash_cursor(cursor);
+      return 1;
+    }
+    status=librdf_hash_cursor_get_next_value(cursor, &hd_key, &hd_value);
+  }
+  librdf_free_hash_cursor(cursor);
+
+  source.items=NULL;
+  for(i=0; i < (size_t)hash->segments_count; i++) {
+    source.segment=&hash->segments[i];
+    if(!librdf_hash_lsm_bloom_test(source.segment, key, key_len))
+      continue;
+
+    source.count=source.segment->entries;
+    source.position=librdf_hash_lsm_source_seek(&source, key, key_len, NULL, 0);
+    for(; source.position < source.count; source.position++) {
+      librdf_hash_lsm_segment_item(source.segment, source.position, &item);
+      if(librdf_hash_lsm_compare(item.key, item.key_len, key, key_len))
+        break;
+      item.source=(int)i + 1;
+      if(librdf_hash_lsm_add_item(hash, &item, &count))
+        return 1;
+    }
+  }
+
+  if(count > 1)
+    qsort(hash->items, count, sizeof(librdf_hash_lsm_item),
+          librdf_hash_lsm_compare_items);
+
+  /* keep the newest entry of each value if it is not a tombstone */
+  for(i=0, j=0; i < count; i++) {
+    if(i && !librdf_hash_lsm_compare_pairs(&hash->items[i], &item))
+      continue;
+    item=hash->items[i];
+    if(item.flag == LIBRDF_HASH_LSM_PUT)
+      hash->items[j++]=item;
+  }
+
+  *count_p=j;
+  return 0;
+}
+
+
+/*
+ * librdf_hash_lsm_emit:
+ * @writer: segment writer
+ * @data: bytes or NULL for zeros
+ * @size: number of bytes
+ *
+ * INTERNAL - Write bytes to a segment
+ *
+ * Failures are remembered in the writer.
+ **/
+static void
+librdf_hash_lsm_emit(librdf_hash_lsm_writer* writer,
+                     const void *data, size_t size)
+{
+  static const unsigned char zeros[8]={0, 0, 0, 0, 0, 0, 0, 0};
+
+  if(!size || writer->failed)
+    return;
+
+  if(!data) {
+    /* only used to pad to the next 8 byte boundary */
+    if(fwrite(zeros, 1, size, writer->fh) != size)
+      writer->failed=1;
+  } else if(fwrite(data, 1, size, writer->fh) != size)
+    writer->failed=1;
+
+  writer->offset+= size;
+}
+
+
+/*
+ * librdf_hash_lsm_writer_start:
+ * @hash: the lsm hash context
+ * @writer: segment writer
+ * @file_name: segment file name
+ * @max_entries: most entries that will be written
+ *
+ * INTERNAL - Start writing a segment
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_writer_start(librdf_hash_lsm_context* hash,
+                             librdf_hash_lsm_writer* writer,
+                             const char *file_name, u64 max_entries)
+{
+  librdf_hash_lsm_header header;
+  int fd;
+
+  memset(writer, '\0', sizeof(*writer));
+
+  writer->bloom_words=(max_entries * LIBRDF_HASH_LSM_BLOOM_BITS + 63) / 64;
+  if(!writer->bloom_words)
+    writer->bloom_words=1;
+  if((u64)(size_t)writer->bloom_words != writer->bloom_words)
+    return 1;
+  writer->bloom=(u64*)LIBRDF_CALLOC(u64, (size_t)writer->bloom_words,
+                                    sizeof(u64));
+  if(!writer->bloom)
+    return 1;
+
+  fd=open(file_name, O_WRONLY | O_CREAT | O_TRUNC,
+          hash->mode ? hash->mode : 0644);
+  writer->fh=(fd < 0) ? NULL : fdopen(fd, "wb");
+  if(!writer->fh) {
+    if(fd >= 0)
+      close(fd);
+    librdf_log(hash->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+               "Failed to create lsm hash segment '%s' - %s", file_name,
+               strerror(errno));
+    LIBRDF_FREE(u64, writer->bloom);
+    writer->bloom=NULL;
+    return 1;
+  }
+
+  /* written again once the entries are known */
+  memset(&header, '\0', sizeof(header));
+  librdf_hash_lsm_emit(writer, &header, sizeof(header));
+
+  return writer->failed;
+}
+
+
+/*
+ * librdf_hash_lsm_writer_add:
+ * @writer: segment writer
+ * @item: pair, after the pairs already written
+ *
+ * INTERNAL - Write an entry to a segment
+ *
+ * Failures are remembered in the writer.
+ **/
+static void
+librdf_hash_lsm_writer_add(librdf_hash_lsm_writer* writer,
+                           librdf_hash_lsm_item* item)
+{
+  librdf_hash_lsm_entry entry;
+
+  if(writer->failed)
+    return;
+
+  if(item->key_len > 0xffffffffU || item->value_len > 0xffffffffU) {
+    writer->failed=1;
+    return;
+  }
+
+  if(writer->entries == writer->index_size) {
+    u64* new_index;
+    u64 new_size=writer->index_size ? 2 * writer->index_size : 1024;
+
+    new_index=(u64*)LIBRDF_REALLOC(u64, writer->index,
+                                   (size_t)new_size * sizeof(u64));
+    if(!new_index) {
+      writer->failed=1;
+      return;
+    }
+    writer->index=new_index;
+    writer->index_size=new_size;
+  }
+  writer->index[writer->entries++]=writer->offset;
+
+  entry.key_len=(u32)item->key_len;
+  entry.value_len=(u32)item->value_len;
+  entry.flag=(u32)item->flag;
+  entry.reserved=0;
+  librdf_hash_lsm_emit(writer, &entry, sizeof(entry));
+  librdf_hash_lsm_emit(writer, item->key, item->key_len);
+  librdf_hash_lsm_emit(writer, item->value, item->value_len);
+  librdf_hash_lsm_emit(writer, NULL,
+                       (size_t)(LIBRDF_HASH_LSM_ALIGN(writer->offset) - writer->offset));
+
+  librdf_hash_lsm_bloom_add(writer->bloom, writer->bloom_words,
+                            item->key, item->key_len);
+}
+
+
+/*
+ * librdf_hash_lsm_writer_finish:
+ * @writer: segment writer
+ * @file_name: segment file name
+ *
+ * INTERNAL - Write the index, bloom filter and header of a segment and close it
+ *
+ * On failure the file is removed; the caller logs it.  Does not use
+ * the hash so it can be called by a merge thread.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_writer_finish(librdf_hash_lsm_writer* writer,
+                              const char *file_name)
+{
+  librdf_hash_lsm_header header;
+
+  memset(&header, '\0', sizeof(header));
+  memcpy(header.magic, LIBRDF_HASH_LSM_MAGIC, sizeof(LIBRDF_HASH_LSM_MAGIC));
+  header.version=LIBRDF_HASH_LSM_VERSION;
+  header.byte_order=LIBRDF_HASH_LSM_BYTE_ORDER;
+  header.entries=writer->entries;
+
+  header.index_offset=writer->offset;
+  librdf_hash_lsm_emit(writer, writer->index,
+                       (size_t)writer->entries * sizeof(u64));
+  header.bloom_offset=writer->offset;
+  header.bloom_words=writer->bloom_words;
+  librdf_hash_lsm_emit(writer, writer->bloom,
+                       (size_t)writer->bloom_words * sizeof(u64));
+  header.size=writer->offset;
+
+  if(writer->index) {
+    LIBRDF_FREE(u64, writer->index);
+    writer->index=NULL;
+  }
+  LIBRDF_FREE(u64, writer->bloom);
+  writer->bloom=NULL;
+
+  if(writer->failed || fseek(writer->fh, 0L, SEEK_SET))
+    goto failed;
+  librdf_hash_lsm_emit(writer, &header, sizeof(header));
+  if(writer->failed || fflush(writer->fh))
+    goto failed;
+#ifdef HAVE_FSYNC
+  /* the segment must be complete before the manifest names it */
+  if(fsync(fileno(writer->fh)))
+    goto failed;
+#endif
+  if(fclose(writer->fh)) {
+    writer->fh=NULL;
+    goto failed;
+  }
+  writer->fh=NULL;
+  return 0;
+
+  failed:
+  if(writer->fh) {
+    fclose(writer->fh);
+    writer->fh=NULL;
+  }
+  unlink(file_name);
+  return 1;
+}
+
+
+/*
+ * librdf_hash_lsm_write_manifest:
+ * @hash: the lsm hash context
+ * @segments: live segments, newest first
+ * @count: number of segments
+ *
+ * INTERNAL - Replace the manifest
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_write_manifest(librdf_hash_lsm_context* hash,
+                               librdf_hash_lsm_segment* segments, int count)
+{
+  char *new_file_name;
+  FILE *fh=NULL;
+  int fd;
+  int i;
+  int status=1;
+
+  new_file_name=(char*)LIBRDF_MALLOC(cstring, strlen(hash->file_name) + 5);
+  if(!new_file_name)
+    return 1;
+  sprintf(new_file_name, "%s.new", hash->file_name);
+
+  fd=open(new_file_name, O_WRONLY | O_CREAT | O_TRUNC,
+          hash->mode ? hash->mode : 0644);
+  if(fd >= 0)
+    fh=fdopen(fd, "w");
+  if(!fh) {
+    if(fd >= 0)
+      close(fd);
+    goto tidy;
+  }
+
+  fprintf(fh, "%s %d\nvalues %d\nnext %u\n", LIBRDF_HASH_LSM_MAGIC,
+          LIBRDF_HASH_LSM_VERSION, hash->segment_values, hash->next_segment);
+  for(i=0; i < count; i++)
+    fprintf(fh, "segment %u\n", segments[i].number);
+
+  if(fflush(fh))
+    goto tidy;
+#ifdef HAVE_FSYNC
+  if(fsync(fileno(fh)))
+    goto tidy;
+#endif
+  status=fclose(fh);
+  fh=NULL;
+  if(!status && rename(new_file_name, hash->file_name))
+    status=1;
+
+  tidy:
+  if(fh)
+    fclose(fh);
+  if(status) {
+    librdf_log(hash->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+               "Failed to write lsm hash manifest '%s'", new_file_name);
+    unlink(new_file_name);
+  }
+  LIBRDF_FREE(cstring, new_file_name);
+
+  return status;
+}
+
+
+/*
+ * librdf_hash_lsm_read_manifest:
+ * @hash: the lsm hash context
+ *
+ * INTERNAL - Read the manifest and map the segments it lists
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_read_manifest(librdf_hash_lsm_context* hash)
+{
+  librdf_world* world=hash->hash->world;
+  FILE *fh;
+  int version;
+  unsigned int number;
+  int size=0;
+  int status=0;
+
+  fh=fopen(hash->file_name, "r");
+  if(!fh) {
+    librdf_log(world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+               "Failed to open lsm hash manifest '%s' - %s", hash->file_name,
+               strerror(errno));
+    return 1;
+  }
+
+  if(fscanf(fh, LIBRDF_HASH_LSM_MAGIC " %d values %d next %u",
+            &version, &hash->values, &hash->next_segment) != 3 ||
+     version != LIBRDF_HASH_LSM_VERSION) {
+    librdf_log(world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+               "lsm hash file '%s' is not a manifest of this version",
+               hash->file_name);
+    fclose(fh);
+    return 1;
+  }
+
+  while(fscanf(fh, " segment %u", &number) == 1) {
+    if(hash->segments_count == size) {
+      librdf_hash_lsm_segment* new_segments;
+
+      size=size ? 2 * size : 8;
+      new_segments=(librdf_hash_lsm_segment*)LIBRDF_REALLOC(librdf_hash_lsm_segment,
+                                                            hash->segments,
+                                                            size * sizeof(librdf_hash_lsm_segment));
+      if(!new_segments) {
+        status=1;
+        break;
+      }
+      hash->segments=new_segments;
+    }
+
+    hash->segments[hash->segments_count].number=number;
+    if(librdf_hash_lsm_map_segment(hash, &hash->segments[hash->segments_count])) {
+      status=1;
+      break;
+    }
+    hash->segments_count++;
+  }
+  fclose(fh);
+  hash->segment_values=hash->values;
+
+  return status;
+}
+
+
+/*
+ * librdf_hash_lsm_install:
+ * @hash: the lsm hash context
+ * @first: index of the first segment replaced
+ * @merged: number of segments replaced from @first on
+ * @segment: new mapped segment or NULL if it had no entries
+ *
+ * INTERNAL - Replace a run of segments with a new one
+ *
+ * The manifest is written first, then the replaced segments are
+ * unmapped and removed.  On failure the segments are unchanged and
+ * the new segment is removed.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_install(librdf_hash_lsm_context* hash, int first, int merged,
+                        librdf_hash_lsm_segment* segment)
+{
+  librdf_hash_lsm_segment* new_segments;
+  int new_count=hash->segments_count - merged + (segment ? 1 : 0);
+  int rest=hash->segments_count - first - merged;
+  int i;
+
+  new_segments=(librdf_hash_lsm_segment*)LIBRDF_MALLOC(librdf_hash_lsm_segment,
+                                                       (new_count + 1) * sizeof(librdf_hash_lsm_segment));
+  if(new_segments) {
+    if(first)
+      memcpy(new_segments, hash->segments,
+             first * sizeof(librdf_hash_lsm_segment));
+    i=first;
+    if(segment)
+      new_segments[i++]=*segment;
+    if(rest)
+      memcpy(&new_segments[i], &hash->segments[first + merged],
+             rest * sizeof(librdf_hash_lsm_segment));
+  }
+
+  if(!new_segments ||
+     librdf_hash_lsm_write_manifest(hash, new_segments, new_count)) {
+    if(new_segments)
+      LIBRDF_FREE(librdf_hash_lsm_segment, new_segments);
+    if(segment) {
+      char *name=librdf_hash_lsm_segment_name(hash, segment->number);
+
+      librdf_hash_lsm_unmap_segment(segment);
+      if(name) {
+        unlink(name);
+        LIBRDF_FREE(cstring, name);
+      }
+    }
+    return 1;
+  }
+
+  for(i=first; i < first + merged; i++) {
+    char *name=librdf_hash_lsm_segment_name(hash, hash->segments[i].number);
+
+    librdf_hash_lsm_unmap_segment(&hash->segments[i]);
+    if(name) {
+      unlink(name);
+      LIBRDF_FREE(cstring, name);
+    }
+  }
+
+  if(hash->segments)
+    LIBRDF_FREE(librdf_hash_lsm_segment, hash->segments);
+  hash->segments=new_segments;
+  hash->segments_count=new_count;
+
+  return 0;
+}
+
+
+/*
+ * librdf_hash_lsm_write_segment:
+ * @hash: the lsm hash context
+ * @sources: sorted sources to merge, newest first
+ * @count: number of sources
+ * @max_entries: most entries the merge gives
+ * @drop_tombstones: non 0 if there are no segments
+ *
+ * INTERNAL - Write merged sources to a new newest segment and install it
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_write_segment(librdf_hash_lsm_context* hash,
+                              librdf_hash_lsm_source* sources, int count,
+                              u64 max_entries, int drop_tombstones)
+{
+  librdf_hash_lsm_writer writer;
+  librdf_hash_lsm_segment segment;
+  librdf_hash_lsm_item item;
+  char *name;
+  int segment_values=hash->segment_values;
+  int status;
+
+  segment.number=hash->next_segment;
+  name=librdf_hash_lsm_segment_name(hash, segment.number);
+  if(!name)
+    return 1;
+
+  if(librdf_hash_lsm_writer_start(hash, &writer, name, max_entries)) {
+    if(writer.fh) {
+      fclose(writer.fh);
+      unlink(name);
+    }
+    if(writer.bloom)
+      LIBRDF_FREE(u64, writer.bloom);
+    LIBRDF_FREE(cstring, name);
+    return 1;
+  }
+
+  while(!librdf_hash_lsm_merge_next(sources, count, &item)) {
+    if(drop_tombstones && item.flag == LIBRDF_HASH_LSM_TOMBSTONE)
+      continue;
+    librdf_hash_lsm_writer_add(&writer, &item);
+  }
+
+  if(librdf_hash_lsm_writer_finish(&writer, name)) {
+    librdf_log(hash->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+               "Failed to write lsm hash segment '%s'", name);
+    LIBRDF_FREE(cstring, name);
+    return 1;
+  }
+  hash->next_segment++;
+
+  /* the segments now hold every value */
+  hash->segment_values=hash->values;
+
+  if(!writer.entries) {
+    /* nothing left - only the manifest changes */
+    unlink(name);
+    LIBRDF_FREE(cstring, name);
+    status=librdf_hash_lsm_install(hash, 0, 0, NULL);
+  } else {
+    LIBRDF_FREE(cstring, name);
+    status=librdf_hash_lsm_map_segment(hash, &segment);
+    if(!status)
+      status=librdf_hash_lsm_install(hash, 0, 0, &segment);
+    if(!status)
+      LIBRDF_DEBUG3("Wrote lsm hash segment %u with %d entries\n",
+                    segment.number, (int)segment.entries);
+  }
+
+  if(status)
+    hash->segment_values=segment_values;
+  return status;
+}
+
+
+/*
+ * librdf_hash_lsm_open_log:
+ * @hash: the lsm hash context
+ * @truncate_log: non 0 to empty the log
+ *
+ * INTERNAL - Open the log for appending changes
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_open_log(librdf_hash_lsm_context* hash, int truncate_log)
+{
+  int fd;
+
+  if(hash->log) {
+    fclose(hash->log);
+    hash->log=NULL;
+  }
+
+  fd=open(hash->log_name, O_WRONLY | O_CREAT | O_APPEND |
+          (truncate_log ? O_TRUNC : 0), hash->mode ? hash->mode : 0644);
+  if(fd >= 0)
+    hash->log=fdopen(fd, "ab");
+  if(!hash->log) {
+    if(fd >= 0)
+      close(fd);
+    librdf_log(hash->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+               "Failed to open lsm hash log '%s' - %s", hash->log_name,
+               strerror(errno));
+    return 1;
+  }
+
+  return 0;
+}
+
+
+static u32
+librdf_hash_lsm_log_check(librdf_hash_lsm_log_record* record,
+                          const void *key, const void *value)
+{
+  return librdf_hash_memory_murmur64(key, record->key_len, record->op) ^
+         librdf_hash_memory_murmur64(value, record->value_len, record->key_len);
+}
+
+
+/*
+ * librdf_hash_lsm_log:
+ * @hash: the lsm hash context
+ * @op: LIBRDF_HASH_LSM_PUT, LIBRDF_HASH_LSM_TOMBSTONE or LIBRDF_HASH_LSM_DELETE_KEY
+ * @key: key
+ * @value: value or NULL
+ *
+ * INTERNAL - Append a change to the log
+ *
+ * The log is buffered and only flushed to disk by a sync.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_log(librdf_hash_lsm_context* hash, int op,
+                   librdf_hash_datum *key, librdf_hash_datum *value)
+{
+  librdf_hash_lsm_log_record record;
+  const void *value_data=value ? value->data : NULL;
+
+  if(hash->replaying)
+    return 0;
+
+  if(key->size > 0xffffffffU || (value && value->size > 0xffffffffU))
+    return 1;
+
+  record.op=(u32)op;
+  record.key_len=(u32)key->size;
+  record.value_len=value ? (u32)value->size : 0;
+  record.check=librdf_hash_lsm_log_check(&record, key->data, value_data);
+
+  if(fwrite(&record, sizeof(record), 1, hash->log) != 1 ||
+     (record.key_len &&
+      fwrite(key->data, 1, record.key_len, hash->log) != record.key_len) ||
+     (record.value_len &&
+      fwrite(value_data, 1, record.value_len, hash->log) != record.value_len)) {
+    librdf_log(hash->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+               "Failed to write lsm hash log '%s'", hash->log_name);
+    return 1;
+  }
+
+  return 0;
+}
+
+
+/*
+ * librdf_hash_lsm_replay:
+ * @hash: the lsm hash context
+ *
+ * INTERNAL - Apply the changes in the log to the memtable
+ *
+ * A partly written last record is ignored and, when writable, cut
+ * from the log.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_replay(librdf_hash_lsm_context* hash)
+{
+  librdf_hash_lsm_log_record record;
+  librdf_hash_datum hd_key, hd_value; /* on stack */
+  unsigned char *data=NULL;
+  size_t data_size=0;
+  long valid=0;
+  int changes=0;
+  int torn=0;
+  FILE *fh;
+
+  fh=fopen(hash->log_name, "rb");
+  if(!fh)
+    return 0;
+
+  hash->replaying=1;
+  while(fread(&record, sizeof(record), 1, fh) == 1) {
+    size_t size=(size_t)record.key_len + record.value_len;
+
+    if(record.op < LIBRDF_HASH_LSM_PUT || record.op > LIBRDF_HASH_LSM_DELETE_KEY) {
+      torn=1;
+      break;
+    }
+
+    if(size + 1 > data_size) {
+      unsigned char *new_data;
+
+      new_data=(unsigned char*)LIBRDF_REALLOC(bytes, data, size + 1);
+      if(!new_data) {
+        hash->replaying=0;
+        fclose(fh);
+        if(data)
+          LIBRDF_FREE(bytes, data);
+        return 1;
+      }
+      data=new_data;
+      data_size=size + 1;
+    }
+
+    if((size && fread(data, 1, size, fh) != size) ||
+       record.check != librdf_hash_lsm_log_check(&record, data,
+                                                 data + record.key_len)) {
+      torn=1;
+      break;
+    }
+
+    hd_key.data=data;
+    hd_key.size=record.key_len;
+    hd_value.data=data + record.key_len;
+    hd_value.size=record.value_len;
+
+    /* changes already in a segment are not made again */
+    if(record.op == LIBRDF_HASH_LSM_PUT)
+      librdf_hash_lsm_put(hash, &hd_key, &hd_value);
+    else if(record.op == LIBRDF_HASH_LSM_TOMBSTONE)
+      librdf_hash_lsm_delete_key_value(hash, &hd_key, &hd_value);
+    else
+      librdf_hash_lsm_delete_key(hash, &hd_key);
+
+    valid=ftell(fh);
+    changes++;
+  }
+  hash->replaying=0;
+
+  if(!torn && !feof(fh))
+    torn=1;
+  fclose(fh);
+  if(data)
+    LIBRDF_FREE(bytes, data);
+
+  if(torn) {
+    librdf_log(hash->hash->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_HASH, NULL,
+               "lsm hash log '%s' ends with a partly written change, ignored",
+               hash->log_name);
+    if(hash->is_writable && truncate(hash->log_name, (off_t)valid))
+      return 1;
+  }
+
+  LIBRDF_DEBUG3("Replayed %d changes from lsm hash log '%s'\n", changes,
+                hash->log_name);
+  return 0;
+}
+
+
+/*
+ * librdf_hash_lsm_flush:
+ * @hash: the lsm hash context
+ *
+ * INTERNAL - Write the memtable to a new segment and empty it and the log
+ *
+ * Must not be called while cursors are open.  On failure the hash is
+ * unchanged.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_flush(librdf_hash_lsm_context* hash)
+{
+  librdf_hash_lsm_source source;
+  size_t count;
+
+  if(librdf_hash_values_count(hash->memtable) > 0) {
+    if(librdf_hash_lsm_memtable_items(hash, &count))
+      return 1;
+
+    source.segment=NULL;
+    source.items=hash->items;
+    source.position=0;
+    source.count=count;
+    if(librdf_hash_lsm_write_segment(hash, &source, 1, (u64)count,
+                                     !hash->segments_count))
+      return 1;
+
+    if(librdf_hash_lsm_new_memtable(hash))
+      return 1;
+  }
+
+  /* every change in the log is now in a segment */
+  return librdf_hash_lsm_open_log(hash, 1);
+}
+
+
+/*
+ * librdf_hash_lsm_free_merger:
+ * @merger: merge state
+ *
+ * INTERNAL - Stop a merge and free it
+ *
+ * A merge thread is cancelled and waited for.  The new segment file is
+ * removed unless it has been installed.
+ **/
+static void
+librdf_hash_lsm_free_merger(librdf_hash_lsm_merger* merger)
+{
+#ifdef WITH_THREADS
+  if(merger->threaded) {
+    pthread_mutex_lock(&merger->lock);
+    merger->cancel=1;
+    pthread_mutex_unlock(&merger->lock);
+    pthread_join(merger->thread, NULL);
+  }
+  pthread_mutex_destroy(&merger->lock);
+#endif
+
+  if(merger->writer.fh)
+    fclose(merger->writer.fh);
+  if(merger->writer.index)
+    LIBRDF_FREE(u64, merger->writer.index);
+  if(merger->writer.bloom)
+    LIBRDF_FREE(u64, merger->writer.bloom);
+
+  if(merger->name) {
+    unlink(merger->name);
+    LIBRDF_FREE(cstring, merger->name);
+  }
+  if(merger->sources)
+    LIBRDF_FREE(librdf_hash_lsm_source, merger->sources);
+  if(merger->segments)
+    LIBRDF_FREE(librdf_hash_lsm_segment, merger->segments);
+  LIBRDF_FREE(librdf_hash_lsm_merger, merger);
+}
+
+
+/*
+ * librdf_hash_lsm_merge_run:
+ * @merger: merge state
+ * @limit: most entries to merge
+ *
+ * INTERNAL - Merge more entries and finish the segment after the last
+ *
+ * Does not use the hash so it can be called by a merge thread.
+ *
+ * Return value: non 0 when the segment is finished
+ **/
+static int
+librdf_hash_lsm_merge_run(librdf_hash_lsm_merger* merger, u64 limit)
+{
+  librdf_hash_lsm_item item;
+
+  for(; limit > 0; limit--) {
+    if(librdf_hash_lsm_merge_next(merger->sources, merger->count, &item)) {
+      merger->status=librdf_hash_lsm_writer_finish(&merger->writer,
+                                                   merger->name) ? -1 : 1;
+      return 1;
+    }
+    if(merger->drop_tombstones && item.flag == LIBRDF_HASH_LSM_TOMBSTONE)
+      continue;
+    librdf_hash_lsm_writer_add(&merger->writer, &item);
+  }
+
+  return 0;
+}
+
+
+#ifdef WITH_THREADS
+/*
+ * librdf_hash_lsm_merge_thread:
+ * @arg: merge state
+ *
+ * INTERNAL - Merge thread, runs a merge until it is finished or cancelled
+ *
+ * Return value: NULL
+ **/
+static void*
+librdf_hash_lsm_merge_thread(void* arg)
+{
+  librdf_hash_lsm_merger* merger=(librdf_hash_lsm_merger*)arg;
+  int cancel=0;
+
+  while(!cancel &&
+        !librdf_hash_lsm_merge_run(merger, LIBRDF_HASH_LSM_MERGE_STEP)) {
+    pthread_mutex_lock(&merger->lock);
+    cancel=merger->cancel;
+    pthread_mutex_unlock(&merger->lock);
+  }
+
+  pthread_mutex_lock(&merger->lock);
+  merger->running=0;
+  pthread_mutex_unlock(&merger->lock);
+
+  return NULL;
+}
+#endif
+
+
+/*
+ * librdf_hash_lsm_merge_start:
+ * @hash: the lsm hash context
+ * @count: number of newest segments to merge
+ * @background: non 0 to merge in a thread if there are threads
+ *
+ * INTERNAL - Start merging the newest segments into one
+ *
+ * Only one merge may run at a time.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_merge_start(librdf_hash_lsm_context* hash, int count,
+                            int background)
+{
+  librdf_hash_lsm_merger* merger;
+  u64 max_entries=0;
+  int i;
+
+  merger=(librdf_hash_lsm_merger*)LIBRDF_CALLOC(librdf_hash_lsm_merger, 1,
+                                                sizeof(librdf_hash_lsm_merger));
+  if(!merger)
+    return 1;
+#ifdef WITH_THREADS
+  pthread_mutex_init(&merger->lock, NULL);
+#endif
+
+  merger->segments=(librdf_hash_lsm_segment*)LIBRDF_MALLOC(librdf_hash_lsm_segment,
+                                                           count * sizeof(librdf_hash_lsm_segment));
+  merger->sources=(librdf_hash_lsm_source*)LIBRDF_CALLOC(librdf_hash_lsm_source,
+                                                         count,
+                                                         sizeof(librdf_hash_lsm_source));
+  if(!merger->segments || !merger->sources)
+    goto failed;
+
+  merger->count=count;
+  for(i=0; i < count; i++) {
+    merger->segments[i]=hash->segments[i];
+    merger->sources[i].segment=&merger->segments[i];
+    merger->sources[i].count=hash->segments[i].entries;
+    max_entries+= hash->segments[i].entries;
+  }
+  merger->drop_tombstones=(count == hash->segments_count);
+
+  merger->segment.number=hash->next_segment;
+  merger->name=librdf_hash_lsm_segment_name(hash, merger->segment.number);
+  if(!merger->name ||
+     librdf_hash_lsm_writer_start(hash, &merger->writer, merger->name,
+                                  max_entries))
+    goto failed;
+  hash->next_segment++;
+
+#ifdef WITH_THREADS
+  if(background) {
+    merger->running=1;
+    if(!pthread_create(&merger->thread, NULL, librdf_hash_lsm_merge_thread,
+                       merger))
+      merger->threaded=1;
+    else
+      /* merged a step for each change instead */
+      merger->running=0;
+  }
+#endif
+
+  hash->merger=merger;
+  return 0;
+
+  failed:
+  librdf_hash_lsm_free_merger(merger);
+  return 1;
+}
+
+
+/*
+ * librdf_hash_lsm_merge_step:
+ * @hash: the lsm hash context
+ * @wait: non 0 to finish the merge, else merge a step if there is no thread
+ *
+ * INTERNAL - Advance the running merge and install its segment when done
+ *
+ * Must not be called while cursors are open.  After this, there is no
+ * running merge unless it is still going.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_merge_step(librdf_hash_lsm_context* hash, int wait)
+{
+  librdf_hash_lsm_merger* merger=hash->merger;
+  int first;
+  int status=0;
+
+  if(!merger)
+    return 0;
+
+#ifdef WITH_THREADS
+  if(merger->threaded) {
+    if(!wait) {
+      int running;
+
+      pthread_mutex_lock(&merger->lock);
+      running=merger->running;
+      pthread_mutex_unlock(&merger->lock);
+      if(running)
+        return 0;
+    }
+    pthread_join(merger->thread, NULL);
+    merger->threaded=0;
+  }
+#endif
+  if(!merger->status &&
+     !librdf_hash_lsm_merge_run(merger, wait ? ~(u64)0 : LIBRDF_HASH_LSM_MERGE_STEP))
+    return 0;
+
+  hash->merger=NULL;
+
+  if(merger->status < 0) {
+    librdf_log(hash->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+               "Failed to write lsm hash segment '%s'", merger->name);
+    status=1;
+    goto tidy;
+  }
+
+  /* the merged run has only had newer segments written in front of it */
+  for(first=0; first < hash->segments_count; first++)
+    if(hash->segments[first].number == merger->segments[0].number)
+      break;
+  if(first + merger->count > hash->segments_count) {
+    status=1;
+    goto tidy;
+  }
+
+  if(!merger->writer.entries)
+    /* nothing left - the segments are replaced by none */
+    status=librdf_hash_lsm_install(hash, first, merger->count, NULL);
+  else if(librdf_hash_lsm_map_segment(hash, &merger->segment))
+    status=1;
+  else {
+    /* installed or removed by the install */
+    LIBRDF_FREE(cstring, merger->name);
+    merger->name=NULL;
+    status=librdf_hash_lsm_install(hash, first, merger->count,
+                                   &merger->segment);
+    if(!status)
+      LIBRDF_DEBUG3("Wrote lsm hash segment %u with %d entries\n",
+                    merger->segment.number, (int)merger->segment.entries);
+  }
+
+  tidy:
+  librdf_hash_lsm_free_merger(merger);
+  return status;
+}
+
+
+/*
+ * librdf_hash_lsm_merge:
+ * @hash: the lsm hash context
+ * @count: number of newest segments to merge
+ *
+ * INTERNAL - Merge the newest segments into one now
+ *
+ * Must not be called while a merge is running.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_merge(librdf_hash_lsm_context* hash, int count)
+{
+  if(librdf_hash_lsm_merge_start(hash, count, 0))
+    return 1;
+
+  return librdf_hash_lsm_merge_step(hash, 1);
+}
+
+
+/*
+ * librdf_hash_lsm_merge_segments:
+ * @hash: the lsm hash context
+ *
+ * INTERNAL - Start a merge of the newest segments if they outgrow the next older one
+ *
+ * Does nothing while a merge is running; the next is started when it
+ * is done.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_merge_segments(librdf_hash_lsm_context* hash)
+{
+  u64 total;
+  int count=1;
+
+  if(hash->merger || hash->segments_count < 2)
+    return 0;
+
+  total=hash->segments[0].entries;
+  while(count < hash->segments_count &&
+        total >= hash->segments[count].entries)
+    total+= hash->segments[count++].entries;
+
+  if(count == 1)
+    return 0;
+
+  return librdf_hash_lsm_merge_start(hash, count, 1);
+}
+
+
+/*
+ * librdf_hash_lsm_changed:
+ * @hash: the lsm hash context
+ *
+ * INTERNAL - Advance merging and write out the memtable if it has grown past its size
+ *
+ * Failures are logged; the changes stay in the memtable and the log.
+ **/
+static void
+librdf_hash_lsm_changed(librdf_hash_lsm_context* hash)
+{
+  if(hash->replaying || hash->cursors)
+    return;
+
+  if(hash->merger && !librdf_hash_lsm_merge_step(hash, 0) && !hash->merger)
+    librdf_hash_lsm_merge_segments(hash);
+
+  if(hash->memtable_bytes >= hash->memtable_size &&
+     !librdf_hash_lsm_flush(hash))
+    librdf_hash_lsm_merge_segments(hash);
+}
+
+
+
+/* functions implementing the API */
+
+/**
+ * librdf_hash_lsm_create:
+ * @hash: #librdf_hash hash
+ * @context: lsm hash context
+ *
+ * Create a new lsm hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_create(librdf_hash* hash, void* context)
+{
+  librdf_hash_lsm_context* hcontext=(librdf_hash_lsm_context*)context;
+
+  hcontext->hash=hash;
+  hcontext->memtable_size=LIBRDF_HASH_LSM_MEMTABLE_SIZE;
+  return 0;
+}
+
+
+/**
+ * librdf_hash_lsm_destroy:
+ * @context: lsm hash context
+ *
+ * Destroy a lsm hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_destroy(void* context)
+{
+  librdf_hash_lsm_context* hcontext=(librdf_hash_lsm_context*)context;
+  int i;
+
+  /* before the segments it reads are unmapped */
+  if(hcontext->merger) {
+    librdf_hash_lsm_free_merger(hcontext->merger);
+    hcontext->merger=NULL;
+  }
+
+  for(i=0; i < hcontext->segments_count; i++)
+    librdf_hash_lsm_unmap_segment(&hcontext->segments[i]);
+  if(hcontext->segments) {
+    LIBRDF_FREE(librdf_hash_lsm_segment, hcontext->segments);
+    hcontext->segments=NULL;
+  }
+  hcontext->segments_count=0;
+
+  if(hcontext->memtable) {
+    librdf_free_hash(hcontext->memtable);
+    hcontext->memtable=NULL;
+  }
+  if(hcontext->log) {
+    fclose(hcontext->log);
+    hcontext->log=NULL;
+  }
+
+  if(hcontext->file_name) {
+    LIBRDF_FREE(cstring, hcontext->file_name);
+    hcontext->file_name=NULL;
+  }
+  if(hcontext->log_name) {
+    LIBRDF_FREE(cstring, hcontext->log_name);
+    hcontext->log_name=NULL;
+  }
+  if(hcontext->buffer) {
+    LIBRDF_FREE(bytes, hcontext->buffer);
+    hcontext->buffer=NULL;
+    hcontext->buffer_size=0;
+  }
+  if(hcontext->items) {
+    LIBRDF_FREE(librdf_hash_lsm_item, hcontext->items);
+    hcontext->items=NULL;
+    hcontext->items_size=0;
+  }
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_lsm_open:
+ * @context: lsm hash context
+ * @identifier: filename to use for the manifest, with .lsm appended
+ * @mode: file creation mode
+ * @is_writable: is hash writable?
+ * @is_new: is hash new?
+ * @options: #librdf_hash of options
+ *
+ * Open and maybe create a new lsm hash.
+ *
+ * Option <literal>memtable-size</literal> sets the bytes of changes
+ * kept in memory before they are written to a new segment.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_open(void* context, const char *identifier,
+                     int mode, int is_writable, int is_new,
+                     librdf_hash* options)
+{
+  librdf_hash_lsm_context* hash=(librdf_hash_lsm_context*)context;
+  struct stat buf;
+  long size;
+
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(identifier, cstring, 1);
+
+  hash->mode=mode;
+  hash->is_writable=is_writable;
+
+  size=options ? librdf_hash_get_as_long(options, "memtable-size") : -1;
+  if(size > 0)
+    hash->memtable_size=(size_t)size;
+
+  hash->file_name=(char*)LIBRDF_MALLOC(cstring, strlen(identifier) + 5);
+  hash->log_name=(char*)LIBRDF_MALLOC(cstring, strlen(identifier) + 9);
+  if(!hash->file_name || !hash->log_name)
+    return 1;
+  sprintf(hash->file_name, "%s.lsm", identifier);
+  sprintf(hash->log_name, "%s.lsm-log", identifier);
+
+  if(librdf_hash_lsm_new_memtable(hash))
+    return 1;
+
+  if(is_writable && (is_new || stat(hash->file_name, &buf))) {
+    /* remove the segments of an old hash */
+    if(!stat(hash->file_name, &buf)) {
+      if(librdf_hash_lsm_read_manifest(hash) ||
+         librdf_hash_lsm_install(hash, 0, hash->segments_count, NULL))
+        return 1;
+    }
+    hash->values=0;
+    hash->segment_values=0;
+    if(librdf_hash_lsm_write_manifest(hash, NULL, 0))
+      return 1;
+    return librdf_hash_lsm_open_log(hash, 1);
+  }
+
+  if(librdf_hash_lsm_read_manifest(hash) ||
+     librdf_hash_lsm_replay(hash))
+    return 1;
+
+  if(!is_writable)
+    return 0;
+
+  if(librdf_hash_lsm_open_log(hash, 0))
+    return 1;
+  librdf_hash_lsm_changed(hash);
+  /* segments the last session left unmerged */
+  librdf_hash_lsm_merge_segments(hash);
+  return 0;
+}
+
+
+/**
+ * librdf_hash_lsm_close:
+ * @context: lsm hash context
+ *
+ * Close the hash, finishing a running merge and writing the memtable
+ * to a segment.  Further merges wait for the next open.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_close(void* context)
+{
+  librdf_hash_lsm_context* hash=(librdf_hash_lsm_context*)context;
+  int status=0;
+
+  if(hash->is_writable && hash->log) {
+    status=librdf_hash_lsm_merge_step(hash, 1);
+    if(librdf_hash_lsm_flush(hash))
+      status=1;
+  }
+
+  librdf_hash_lsm_destroy(hash);
+
+  return status;
+}
+
+
+static int
+librdf_hash_lsm_clone(librdf_hash *hash, void* context, char *new_identifier,
+                      void *old_context)
+{
+  librdf_hash_lsm_context* hcontext=(librdf_hash_lsm_context*)context;
+  librdf_hash_lsm_context* old_hcontext=(librdf_hash_lsm_context*)old_context;
+  librdf_hash_datum *key, *value;
+  librdf_iterator *iterator;
+  int status=0;
+
+  /* copy data fields that might change */
+  hcontext->hash=hash;
+  hcontext->memtable_size=old_hcontext->memtable_size;
+
+  if(librdf_hash_lsm_open(context, new_identifier,
+                          old_hcontext->mode, 1, 1, NULL))
+    return 1;
+
+  /* Use higher level functions to iterator this data
+   * on the other hand, maybe this is a good idea since that
+   * code is tested and works
+   */
+
+  key=librdf_new_hash_datum(hash->world, NULL, 0);
+  value=librdf_new_hash_datum(hash->world, NULL, 0);
+
+  iterator=librdf_hash_get_all(old_hcontext->hash, key, value);
+  while(!librdf_iterator_end(iterator)) {
+    librdf_hash_datum* k= (librdf_hash_datum*)librdf_iterator_get_key(iterator);
+    librdf_hash_datum* v= (librdf_hash_datum*)librdf_iterator_get_value(iterator);
+
+    if(librdf_hash_lsm_put(hcontext, k, v)) {
+      status=1;
+      break;
+    }
+    librdf_iterator_next(iterator);
+  }
+  if(iterator)
+    librdf_free_iterator(iterator);
+
+  librdf_free_hash_datum(value);
+  librdf_free_hash_datum(key);
+
+  hcontext->is_writable=old_hcontext->is_writable;
+
+  return status;
+}
+
+
+/**
+ * librdf_hash_lsm_values_count:
+ * @context: lsm hash context
+ *
+ * Get the number of values in the hash.
+ *
+ * Return value: number of values in the hash or <0 on failure
+ **/
+static int
+librdf_hash_lsm_values_count(void *context)
+{
+  librdf_hash_lsm_context* hash=(librdf_hash_lsm_context*)context;
+
+  return hash->values;
+}
+
+
+/**
+ * librdf_hash_lsm_key_values_count:
+ * @context: lsm hash context
+ * @key: pointer to key
+ *
+ * Get the number of values of one key in the hash.
+ *
+ * Return value: number of values of the key or <0 on failure
+ **/
+static int
+librdf_hash_lsm_key_values_count(void *context, librdf_hash_datum *key)
+{
+  librdf_hash_lsm_context* hash=(librdf_hash_lsm_context*)context;
+  size_t count;
+
+  if(librdf_hash_lsm_gather(hash, key->data, key->size, &count))
+    return -1;
+  return (int)count;
+}
+
+
+
+/*
+ * A cursor walk merges a copy of the memtable taken when the walk
+ * starts with the segments, so it is not disturbed by changes made
+ * while it is open.  SET copies the values of the key.  Segments are
+ * not replaced while a cursor is open.
+ */
+typedef struct {
+  librdf_hash_lsm_context* hash;
+  /* walk sources, the memtable copy first */
+  librdf_hash_lsm_source* sources;
+  int sources_count;
+  /* copied memtable pairs of a walk or values of the SET key */
+  librdf_hash_lsm_item* items;
+  size_t items_count;
+  unsigned char *block;
+  /* index of the next value of the SET key */
+  size_t current_value;
+  /* last key returned by a keys only walk */
+  const unsigned char *last_key;
+  size_t last_key_len;
+  int has_last_key;
+  /* key prefix for SET_RANGE / NEXT_RANGE */
+  void *range_key;
+  size_t range_key_len;
+} librdf_hash_lsm_cursor_context;
+
+
+static void
+librdf_hash_lsm_cursor_reset(librdf_hash_lsm_cursor_context* cursor)
+{
+  if(cursor->sources) {
+    LIBRDF_FREE(librdf_hash_lsm_source, cursor->sources);
+    cursor->sources=NULL;
+  }
+  cursor->sources_count=0;
+  if(cursor->items) {
+    LIBRDF_FREE(librdf_hash_lsm_item, cursor->items);
+    cursor->items=NULL;
+  }
+  cursor->items_count=0;
+  if(cursor->block) {
+    LIBRDF_FREE(bytes, cursor->block);
+    cursor->block=NULL;
+  }
+  cursor->current_value=0;
+  cursor->has_last_key=0;
+}
+
+
+/*
+ * librdf_hash_lsm_cursor_copy:
+ * @cursor: lsm hash cursor context
+ * @count: number of hash items
+ *
+ * INTERNAL - Copy the gathered hash items into the cursor
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_cursor_copy(librdf_hash_lsm_cursor_context* cursor,
+                            size_t count)
+{
+  librdf_hash_lsm_context* hash=cursor->hash;
+
+  librdf_hash_lsm_cursor_reset(cursor);
+
+  cursor->items=(librdf_hash_lsm_item*)LIBRDF_MALLOC(librdf_hash_lsm_item,
+                                                     (count + 1) * sizeof(librdf_hash_lsm_item));
+  if(!cursor->items)
+    return 1;
+  if(count)
+    memcpy(cursor->items, hash->items, count * sizeof(librdf_hash_lsm_item));
+  cursor->items_count=count;
+
+  return librdf_hash_lsm_copy_items(cursor->items, count, &cursor->block);
+}
+
+
+/*
+ * librdf_hash_lsm_cursor_walk:
+ * @cursor: lsm hash cursor context
+ * @prefix: key prefix to start at or NULL for the first key
+ * @prefix_len: prefix length
+ *
+ * INTERNAL - Start a walk of the pairs in key order
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_cursor_walk(librdf_hash_lsm_cursor_context* cursor,
+                            const void *prefix, size_t prefix_len)
+{
+  librdf_hash_lsm_context* hash=cursor->hash;
+  size_t count;
+  int i;
+
+  if(librdf_hash_lsm_memtable_items(hash, &count) ||
+     librdf_hash_lsm_cursor_copy(cursor, count))
+    return 1;
+
+  cursor->sources_count=hash->segments_count + 1;
+  cursor->sources=(librdf_hash_lsm_source*)LIBRDF_CALLOC(librdf_hash_lsm_source,
+                                                         cursor->sources_count,
+                                                         sizeof(librdf_hash_lsm_source));
+  if(!cursor->sources)
+    return 1;
+
+  cursor->sources[0].items=cursor->items;
+  cursor->sources[0].count=cursor->items_count;
+  for(i=0; i < hash->segments_count; i++) {
+    cursor->sources[i + 1].segment=&hash->segments[i];
+    cursor->sources[i + 1].count=hash->segments[i].entries;
+  }
+
+  if(prefix)
+    for(i=0; i < cursor->sources_count; i++)
+      cursor->sources[i].position=librdf_hash_lsm_source_seek(&cursor->sources[i],
+                                                              prefix, prefix_len,
+                                                              NULL, 0);
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_lsm_cursor_init:
+ * @cursor_context: hash cursor context
+ * @hash_context: hash to operate over
+ *
+ * Initialise a new hash cursor.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_cursor_init(void *cursor_context, void *hash_context)
+{
+  librdf_hash_lsm_cursor_context *cursor=(librdf_hash_lsm_cursor_context*)cursor_context;
+
+  cursor->hash=(librdf_hash_lsm_context*)hash_context;
+  cursor->hash->cursors++;
+  return 0;
+}
+
+
+/**
+ * librdf_hash_lsm_cursor_get:
+ * @context: lsm hash cursor context
+ * @key: pointer to key to use
+ * @value: pointer to value to use
+ * @flags: flags
+ *
+ * Retrieve a hash value for the given key.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_cursor_get(void* context,
+                           librdf_hash_datum *key,
+                           librdf_hash_datum *value,
+                           unsigned int flags)
+{
+  librdf_hash_lsm_cursor_context *cursor=(librdf_hash_lsm_cursor_context*)context;
+  librdf_hash_lsm_context* hash=cursor->hash;
+  librdf_hash_lsm_item item;
+  size_t count;
+
+  switch(flags) {
+    case LIBRDF_HASH_CURSOR_SET:
+      if(!key || !key->data)
+        return 1;
+      if(librdf_hash_lsm_gather(hash, key->data, key->size, &count) ||
+         librdf_hash_lsm_cursor_copy(cursor, count))
+        return 1;
+      /* FALLTHROUGH */
+
+    case LIBRDF_HASH_CURSOR_NEXT_VALUE:
+      if(cursor->sources || cursor->current_value >= cursor->items_count)
+        return 1;
+      if(value) {
+        value->data=(void*)cursor->items[cursor->current_value].value;
+        value->size=cursor->items[cursor->current_value].value_len;
+      }
+      cursor->current_value++;
+      return 0;
+
+    case LIBRDF_HASH_CURSOR_SET_RANGE:
+      if(cursor->range_key)
+        LIBRDF_FREE(cstring, cursor->range_key);
+      cursor->range_key=LIBRDF_MALLOC(cstring, key->size ? key->size : 1);
+      if(!cursor->range_key)
+        return 1;
+      memcpy(cursor->range_key, key->data, key->size);
+      cursor->range_key_len=key->size;
+      if(librdf_hash_lsm_cursor_walk(cursor, cursor->range_key,
+                                     cursor->range_key_len))
+        return 1;
+      break;
+
+    case LIBRDF_HASH_CURSOR_FIRST:
+      if(cursor->range_key) {
+        LIBRDF_FREE(cstring, cursor->range_key);
+        cursor->range_key=NULL;
+      }
+      if(librdf_hash_lsm_cursor_walk(cursor, NULL, 0))
+        return 1;
+      break;
+
+    case LIBRDF_HASH_CURSOR_NEXT_RANGE:
+      if(!cursor->range_key)
+        return 1;
+      /* FALLTHROUGH */
+
+    case LIBRDF_HASH_CURSOR_NEXT:
+      if(!cursor->sources)
+        return 1;
+      break;
+
+    default:
+      librdf_log(hash->hash->world,
+                 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+                 "Unknown hash method flag %d", flags);
+      return 1;
+  }
+
+
+  /* walk LIBRDF_HASH_CURSOR_FIRST, NEXT, SET_RANGE or NEXT_RANGE */
+  while(!librdf_hash_lsm_merge_next(cursor->sources, cursor->sources_count,
+                                    &item)) {
+    /* pairs are in key order so the range ends at the first key
+     * without the prefix */
+    if(cursor->range_key &&
+       (item.key_len < cursor->range_key_len ||
+        memcmp(item.key, cursor->range_key, cursor->range_key_len)))
+      return 1;
+
+    if(item.flag != LIBRDF_HASH_LSM_PUT)
+      continue;
+
+    if(!value) {
+      /* keys only - skip the other values of the last key */
+      if(cursor->has_last_key &&
+         !librdf_hash_lsm_compare(item.key, item.key_len,
+                                  cursor->last_key, cursor->last_key_len))
+        continue;
+      cursor->last_key=item.key;
+      cursor->last_key_len=item.key_len;
+      cursor->has_last_key=1;
+    } else {
+      value->data=(void*)item.value;
+      value->size=item.value_len;
+    }
+
+    key->data=(void*)item.key;
+    key->size=item.key_len;
+    return 0;
+  }
+
+  return 1;
+}
+
+
+/**
+ * librdf_hash_lsm_cursor_finished:
+ * @context: hash lsm get iterator context
+ *
+ * Finish the serialisation of the hash lsm get.
+ *
+ **/
+static void
+librdf_hash_lsm_cursor_finish(void* context)
+{
+  librdf_hash_lsm_cursor_context *cursor=(librdf_hash_lsm_cursor_context*)context;
+
+  librdf_hash_lsm_cursor_reset(cursor);
+  if(cursor->range_key)
+    LIBRDF_FREE(cstring, cursor->range_key);
+
+  if(cursor->hash)
+    cursor->hash->cursors--;
+}
+
+
+/**
+ * librdf_hash_lsm_put:
+ * @context: lsm hash context
+ * @key: pointer to key to store
+ * @value: pointer to value to store
+ *
+ * - Store a key/value pair in the hash.
+ *
+ * Storing a pair already in the hash does nothing.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_put(void* context, librdf_hash_datum *key,
+                    librdf_hash_datum *value)
+{
+  librdf_hash_lsm_context* hash=(librdf_hash_lsm_context*)context;
+
+  if(!hash->is_writable && !hash->replaying)
+    return 1;
+
+  if(librdf_hash_lsm_find(hash, key, value, 0) == LIBRDF_HASH_LSM_PUT)
+    return 0;
+
+  if(librdf_hash_lsm_log(hash, LIBRDF_HASH_LSM_PUT, key, value) ||
+     librdf_hash_lsm_memtable_set(hash, key, value, LIBRDF_HASH_LSM_PUT))
+    return 1;
+
+  hash->values++;
+  librdf_hash_lsm_changed(hash);
+  return 0;
+}
+
+
+/**
+ * librdf_hash_lsm_exists:
+ * @context: lsm hash context
+ * @key: key
+ * @value: value
+ *
+ * Test the existence of a key in the hash.
+ *
+ * Return value: >0 if the key/value exists in the hash, 0 if not, <0 on failure
+ **/
+static int
+librdf_hash_lsm_exists(void* context,
+                       librdf_hash_datum *key, librdf_hash_datum *value)
+{
+  librdf_hash_lsm_context* hash=(librdf_hash_lsm_context*)context;
+  size_t count;
+
+  if(!value) {
+    if(librdf_hash_lsm_gather(hash, key->data, key->size, &count))
+      return -1;
+    return count > 0;
+  }
+
+  return librdf_hash_lsm_find(hash, key, value, 0) == LIBRDF_HASH_LSM_PUT;
+}
+
+
+/*
+ * librdf_hash_lsm_remove:
+ * @hash: the lsm hash context
+ * @key: key
+ * @value: value in the hash
+ *
+ * INTERNAL - Remove a pair from the memtable, hiding it in the segments
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_remove(librdf_hash_lsm_context* hash,
+                       librdf_hash_datum *key, librdf_hash_datum *value)
+{
+  int flag=0;
+
+  if(librdf_hash_lsm_find(hash, key, value, 1) == LIBRDF_HASH_LSM_PUT)
+    flag=LIBRDF_HASH_LSM_TOMBSTONE;
+
+  if(librdf_hash_lsm_memtable_set(hash, key, value, flag))
+    return 1;
+
+  hash->values--;
+  return 0;
+}
+
+
+/**
+ * librdf_hash_lsm_delete_key_value:
+ * @context: lsm hash context
+ * @key: pointer to key to delete
+ * @value: pointer to value to delete
+ *
+ * - Delete a key/value pair from the hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_delete_key_value(void* context, librdf_hash_datum *key,
+                                 librdf_hash_datum *value)
+{
+  librdf_hash_lsm_context* hash=(librdf_hash_lsm_context*)context;
+
+  if(!hash->is_writable && !hash->replaying)
+    return 1;
+
+  if(librdf_hash_lsm_find(hash, key, value, 0) != LIBRDF_HASH_LSM_PUT)
+    return 1;
+
+  if(librdf_hash_lsm_log(hash, LIBRDF_HASH_LSM_TOMBSTONE, key, value) ||
+     librdf_hash_lsm_remove(hash, key, value))
+    return 1;
+
+  librdf_hash_lsm_changed(hash);
+  return 0;
+}
+
+
+/**
+ * librdf_hash_lsm_delete_key:
+ * @context: lsm hash context
+ * @key: pointer to key to delete
+ *
+ * - Delete a key and all its values from the hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_delete_key(void* context, librdf_hash_datum *key)
+{
+  librdf_hash_lsm_context* hash=(librdf_hash_lsm_context*)context;
+  librdf_hash_lsm_item* items;
+  librdf_hash_datum hd_value; /* on stack */
+  unsigned char *block;
+  size_t count;
+  size_t i;
+  int status=0;
+
+  if(!hash->is_writable && !hash->replaying)
+    return 1;
+
+  if(librdf_hash_lsm_gather(hash, key->data, key->size, &count) || !count)
+    return 1;
+
+  if(librdf_hash_lsm_log(hash, LIBRDF_HASH_LSM_DELETE_KEY, key, NULL))
+    return 1;
+
+  /* the values point into the memtable that is about to change */
+  items=(librdf_hash_lsm_item*)LIBRDF_MALLOC(librdf_hash_lsm_item,
+                                             count * sizeof(librdf_hash_lsm_item));
+  if(!items)
+    return 1;
+  memcpy(items, hash->items, count * sizeof(librdf_hash_lsm_item));
+  if(librdf_hash_lsm_copy_items(items, count, &block)) {
+    LIBRDF_FREE(librdf_hash_lsm_item, items);
+    return 1;
+  }
+
+  for(i=0; i < count; i++) {
+    hd_value.data=(void*)items[i].value;
+    hd_value.size=items[i].value_len;
+    if(librdf_hash_lsm_remove(hash, key, &hd_value)) {
+      status=1;
+      break;
+    }
+  }
+
+  LIBRDF_FREE(bytes, block);
+  LIBRDF_FREE(librdf_hash_lsm_item, items);
+
+  librdf_hash_lsm_changed(hash);
+  return status;
+}
+
+
+/**
+ * librdf_hash_lsm_sync:
+ * @context: lsm hash context
+ *
+ * Flush the log of changes to disk.
+ *
+ * The memtable stays in memory; it is written to a segment when it
+ * grows past its size or the hash is closed or compacted.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_sync(void* context)
+{
+  librdf_hash_lsm_context* hash=(librdf_hash_lsm_context*)context;
+
+  if(!hash->log)
+    return 0;
+
+  if(fflush(hash->log))
+    return 1;
+#ifdef HAVE_FSYNC
+  if(fsync(fileno(hash->log)))
+    return 1;
+#endif
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_lsm_compact:
+ * @context: lsm hash context
+ *
+ * Write the memtable to a segment and merge all segments into one,
+ * dropping tombstones.
+ *
+ * Does nothing while cursors are open.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_lsm_compact(void* context)
+{
+  librdf_hash_lsm_context* hash=(librdf_hash_lsm_context*)context;
+
+  if(!hash->is_writable || hash->cursors)
+    return 0;
+
+  /* all segments are merged below */
+  if(hash->merger) {
+    librdf_hash_lsm_free_merger(hash->merger);
+    hash->merger=NULL;
+  }
+
+  if(librdf_hash_lsm_flush(hash))
+    return 1;
+
+  if(hash->segments_count > 1)
+    return librdf_hash_lsm_merge(hash, hash->segments_count);
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_lsm_get_fd:
+ * @context: lsm hash context
+ *
+ * Get the file descriptor of the log.
+ *
+ * Return value: the file descriptor or -1
+ **/
+static int
+librdf_hash_lsm_get_fd(void* context)
+{
+  librdf_hash_lsm_context* hash=(librdf_hash_lsm_context*)context;
+
+  return hash->log ? fileno(hash->log) : -1;
+}
+
+
+/* local function to register lsm hash functions */
+
+/**
+ * librdf_hash_lsm_register_factory:
+ * @factory: hash factory prototype
+ *
+ * Register the lsm hash module with the hash factory.
+ *
+ **/
+static void
+librdf_hash_lsm_register_factory(librdf_hash_factory *factory)
+{
+  factory->context_length = sizeof(librdf_hash_lsm_context);
+  factory->cursor_context_length = sizeof(librdf_hash_lsm_cursor_context);
+
+  factory->create  = librdf_hash_lsm_create;
+  factory->destroy = librdf_hash_lsm_destroy;
+
+  factory->open    = librdf_hash_lsm_open;
+  factory->close   = librdf_hash_lsm_close;
+  factory->clone   = librdf_hash_lsm_clone;
+
+  factory->values_count = librdf_hash_lsm_values_count;
+  factory->key_values_count = librdf_hash_lsm_key_values_count;
+
+  factory->put     = librdf_hash_lsm_put;
+  factory->exists  = librdf_hash_lsm_exists;
+  factory->delete_key  = librdf_hash_lsm_delete_key;
+  factory->delete_key_value  = librdf_hash_lsm_delete_key_value;
+  factory->sync    = librdf_hash_lsm_sync;
+  factory->compact = librdf_hash_lsm_compact;
+  factory->get_fd  = librdf_hash_lsm_get_fd;
+
+  factory->cursor_init   = librdf_hash_lsm_cursor_init;
+  factory->cursor_get    = librdf_hash_lsm_cursor_get;
+  factory->cursor_finish = librdf_hash_lsm_cursor_finish;
+}
+
+
+/**
+ * librdf_init_hash_lsm:
+ * @world: redland world object
+ *
+ * Initialise the log structured merge hash module.
+ **/
+void
+librdf_init_hash_lsm(librdf_world *world)
+{
+  librdf_hash_register_factory(world,
+                               "lsm", &librdf_hash_lsm_register_factory);
+}
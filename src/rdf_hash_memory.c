@@ -39,53 +39,153 @@
 #ifdef HAVE_STDLIB_H
 #include <stdlib.h> /* for abort() as used in errors */
 #endif
+#include <time.h>
 
 #include <redland.h>
 #include <rdf_types.h>
 
 
+/*
+ * The memory hash is an open addressing table with linear probing.
+ * Each table entry has a 32 bit hash tag kept in its own array, so
+ * that a probe only touches the key bytes when the tags match, and a
+ * slot with the key and its values.  Key and value bytes are copied
+ * into a bump allocated arena of large chunks, a key with one value
+ * stores it in the slot and more values are kept in one array.
+ *
+ * Deleted slots are marked with a tombstone tag and their arena bytes
+ * are only given back when the arena is compacted, which happens when
+ * more than half of it is dead and no cursor is open.
+ *
+ * The table grows without stopping the world: a new table is made
+ * and keys are moved into it from the old one a few slots at a time
+ * by each later put, exists or delete while lookups check both.
+ * Moving is deferred while cursors are open, as it would change the
+ * slots they walk.
+ *
+ * Keys are hashed with a seeded function picked by name with hash
+ * open option hash-function, see librdf_hash_memory_hash_functions.
+ * The seed is different for each hash so that keys chosen to collide
+ * cannot be precomputed.
+ *
+ * A key with many values (such as the rdf:type predicate in an index)
+ * also gets a value set, an open addressing table of positions in its
+ * values array, so that finding or deleting one value does not scan
+ * them all.
+ */
+
+/* slot tags; a real tag is a hash value of at least 2 */
+#define LIBRDF_HASH_MEMORY_TAG_EMPTY 0
+#define LIBRDF_HASH_MEMORY_TAG_DELETED 1
+#define LIBRDF_HASH_MEMORY_TAG_IS_LIVE(tag) ((tag) > LIBRDF_HASH_MEMORY_TAG_DELETED)
+
 /* private structures */
-struct librdf_hash_memory_node_value_s
+typedef struct
 {
-  struct librdf_hash_memory_node_value_s* next;
-  void *value;
-  size_t value_len;
-};
-typedef struct librdf_hash_memory_node_value_s librdf_hash_memory_node_value;
+  unsigned char *data;
+  size_t size;
+} librdf_hash_memory_value;
+
+
+/* value set entry index values that are not array positions */
+#define LIBRDF_HASH_MEMORY_VALUE_EMPTY (-1)
+#define LIBRDF_HASH_MEMORY_VALUE_DELETED (-2)
+
+typedef struct
+{
+  /* hash of the value bytes */
+  u32 tag;
+  /* position in the values array or EMPTY or DELETED */
+  int index;
+} librdf_hash_memory_value_entry;
+
+
+typedef struct
+{
+  /* number of entries - power of 2 */
+  int capacity;
+  /* this many entries used by values or tombstones */
+  int used;
+  /* capacity entries follow */
+} librdf_hash_memory_value_set;
 
 
-struct librdf_hash_memory_node_s
+typedef struct
 {
-  struct librdf_hash_memory_node_s* next;
-  void *key;
+  unsigned char *key;
   size_t key_len;
-  u32 hash_key;
-  librdf_hash_memory_node_value *values;
+  /* only value when values is NULL */
+  librdf_hash_memory_value value;
+  /* array of values_capacity values or NULL */
+  librdf_hash_memory_value *values;
   int values_count;
+  int values_capacity;
+  /* value set when there are many values or NULL */
+  librdf_hash_memory_value_set *value_set;
+} librdf_hash_memory_slot;
+
+
+struct librdf_hash_memory_chunk_s
+{
+  struct librdf_hash_memory_chunk_s* next;
+  size_t size;
+  size_t used;
+  /* size bytes follow */
 };
-typedef struct librdf_hash_memory_node_s librdf_hash_memory_node;
+typedef struct librdf_hash_memory_chunk_s librdf_hash_memory_chunk;
+
+
+typedef struct
+{
+  /* array of capacity tags */
+  u32 *tags;
+  /* array of capacity slots */
+  librdf_hash_memory_slot *slots;
+  /* total array size */
+  int capacity;
+  /* this many slots used by keys or tombstones */
+  int used;
+  /* used must stay below this for the load factor */
+  int max_used;
+} librdf_hash_memory_table;
+
+
+/* hash function over bytes with a seed */
+typedef u32 (*librdf_hash_memory_function)(const void *data, size_t size, u32 seed);
 
 
 typedef struct
 {
   /* the hash object */
   librdf_hash* hash;
-  /* An array pointing to a list of nodes (buckets) */
-  librdf_hash_memory_node** nodes;
-  /* this many buckets used */
-  int size;
+  /* hash function for keys and values and its seed */
+  librdf_hash_memory_function hash_function;
+  u32 seed;
+  /* table new keys are added to */
+  librdf_hash_memory_table table;
+  /* table keys are being moved from or capacity 0 */
+  librdf_hash_memory_table old_table;
+  /* next old table slot to move */
+  int move_slot;
   /* this many keys */
   int keys;
   /* this many values */
   int values;
-  /* total array size */
-  int capacity;
 
   /* array load factor expressed out of 1000.
-   * Always true: (size/capacity * 1000) < load_factor,
-   * or in the code: size * 1000 < load_factor * capacity
+   * Always true: (used/capacity * 1000) < load_factor,
+   * or in the code: used < max_used
    */
   int load_factor;
+
+  /* arena chunks, newest first */
+  librdf_hash_memory_chunk* chunks;
+  /* arena bytes in use by keys and values and those deleted */
+  size_t live_bytes;
+  size_t dead_bytes;
+
+  /* number of open cursors, the arena is not moved while >0 */
+  int cursors;
 } librdf_hash_memory_context;
 
 
@@ -96,10 +196,47 @@ static const int librdf_hash_default_load_factor=750;
 /* starting capacity - MUST BE POWER OF 2 */
 static const int librdf_hash_initial_capacity=8;
 
+/* old table slots moved per operation while the table grows */
+#define LIBRDF_HASH_MEMORY_MOVE_SLOTS 64
+
+/* first arena chunk size and largest size the chunks double up to */
+#define LIBRDF_HASH_MEMORY_CHUNK_MIN_SIZE 4096
+#define LIBRDF_HASH_MEMORY_CHUNK_MAX_SIZE (1024 * 1024)
+
+/* arena dead bytes below which compacting is not worth it */
+#define LIBRDF_HASH_MEMORY_COMPACT_MIN_SIZE (64 * 1024)
+
+/* number of slots in the table and old table */
+#define LIBRDF_HASH_MEMORY_SLOTS(hash) \
+  ((hash)->old_table.capacity + (hash)->table.capacity)
+
+/* number of values of a key above which a value set is built; it is
+ * dropped again below half of this */
+#define LIBRDF_HASH_MEMORY_VALUE_SET_MIN_VALUES 32
+
 
 /* prototypes for local functions */
-static librdf_hash_memory_node* librdf_hash_memory_find_node(librdf_hash_memory_context* hash, void *key, size_t key_len, int *bucket, librdf_hash_memory_node** prev);
-static void librdf_free_hash_memory_node(librdf_hash_memory_node* node);
+static u32 librdf_hash_memory_one_at_a_time(const void *data, size_t size, u32 seed);
+static librdf_hash_memory_function librdf_hash_memory_get_function(const char *name);
+static u32 librdf_hash_memory_new_seed(void *context);
+static u32 librdf_hash_memory_tag(librdf_hash_memory_context* hash, const void *key, size_t key_len);
+static int librdf_hash_memory_probe(librdf_hash_memory_table* table, const void *key, size_t key_len, u32 tag, int *insert_p);
+static int librdf_hash_memory_find_slot(librdf_hash_memory_context* hash, const void *key, size_t key_len, librdf_hash_memory_table** table_p);
+static librdf_hash_memory_slot* librdf_hash_memory_get_slot(librdf_hash_memory_context* hash, int i);
+static librdf_hash_memory_value* librdf_hash_memory_slot_values(librdf_hash_memory_slot* slot);
+static int librdf_hash_memory_value_set_resize(librdf_hash_memory_context* hash, librdf_hash_memory_slot* slot, int capacity);
+static int librdf_hash_memory_value_set_add(librdf_hash_memory_context* hash, librdf_hash_memory_slot* slot, int index);
+static int librdf_hash_memory_find_value(librdf_hash_memory_context* hash, librdf_hash_memory_slot* slot, const void *data, size_t size, int *entry_p);
+static void librdf_hash_memory_remove_value(librdf_hash_memory_context* hash, librdf_hash_memory_slot* slot, int index, int entry);
+static unsigned char* librdf_hash_memory_arena_alloc(librdf_hash_memory_context* hash, const void *data, size_t size);
+static void librdf_hash_memory_arena_free(librdf_hash_memory_context* hash);
+static void librdf_hash_memory_arena_compact(librdf_hash_memory_context* hash);
+static void librdf_hash_memory_free_slot(librdf_hash_memory_context* hash, librdf_hash_memory_table* table, int i);
+static void librdf_hash_memory_free_table(librdf_hash_memory_table* table, int free_values);
+static void librdf_hash_memory_table_add(librdf_hash_memory_table* table, u32 tag, librdf_hash_memory_slot* slot);
+static void librdf_hash_memory_move_slots(librdf_hash_memory_context* hash, int count);
+static int librdf_hash_memory_resize(librdf_hash_memory_context* hash, int capacity);
+static void librdf_hash_memory_step(librdf_hash_memory_context* hash);
 static int librdf_hash_memory_expand_size(librdf_hash_memory_context* hash);
 
 /* Implementing the hash cursor */
@@ -118,6 +255,7 @@ static int librdf_hash_memory_open(void* context, const char *identifier, int mo
 static int librdf_hash_memory_close(void* context);
 static int librdf_hash_memory_clone(librdf_hash* new_hash, void *new_context, char *new_identifier, void* old_context);
 static int librdf_hash_memory_values_count(void *context);
+static int librdf_hash_memory_key_values_count(void *context, librdf_hash_datum *key);
 static int librdf_hash_memory_put(void* context, librdf_hash_datum *key, librdf_hash_datum *data);
 static int librdf_hash_memory_exists(void* context, librdf_hash_datum *key, librdf_hash_datum *value);
 static int librdf_hash_memory_delete_key(void* context, librdf_hash_datum *key);
@@ -142,11 +280,11 @@ static void librdf_hash_memory_register_factory(librdf_hash_factory *factory);
  *
  */
 
-#define ONE_AT_A_TIME_HASH(hash,str,len) \
+#define ONE_AT_A_TIME_HASH(hash,str,len,seed) \
      do { \
         register const unsigned char *c_oneat = (unsigned char*)str+len-1; \
         register int i_oneat = len; \
-        register u32 hash_oneat = 0; \
+        register u32 hash_oneat = seed; \
         while (i_oneat--) { \
             hash_oneat += *c_oneat--; \
             hash_oneat += (hash_oneat << 10); \
@@ -159,147 +297,923 @@ static void librdf_hash_memory_register_factory(librdf_hash_factory *factory);
 
 
 
+/* hash functions */
+
+
+/*
+ * librdf_hash_memory_one_at_a_time:
+ * @data: bytes
+ * @size: number of bytes
+ * @seed: seed
+ *
+ * INTERNAL - One-at-a-Time hash, a byte at a time
+ *
+ * Return value: hash value
+ **/
+static u32
+librdf_hash_memory_one_at_a_time(const void *data, size_t size, u32 seed)
+{
+  u32 hash_value;
+
+  ONE_AT_A_TIME_HASH(hash_value, data, size, seed);
+  return hash_value;
+}
+
+
+/*
+ * librdf_hash_memory_murmur64:
+ * @data: bytes
+ * @size: number of bytes
+ * @seed: seed
+ *
+ * INTERNAL - MurmurHash64A by Austin Appleby, eight bytes at a time
+ *
+ * The 64 bit result is folded to 32 bits.  Words are read with
+ * memcpy() so keys need not be aligned and the result is the same on
+ * all little endian hosts.  Also used by the mmap hash.
+ *
+ * Return value: hash value
+ **/
+u32
+librdf_hash_memory_murmur64(const void *data, size_t size, u32 seed)
+{
+  const u64 m=((u64)0xc6a4a793UL << 32) | (u64)0x5bd1e995UL;
+  const int r=47;
+  const unsigned char *p=(const unsigned char*)data;
+  const unsigned char *end=p + (size & ~(size_t)7);
+  u64 h=(u64)seed ^ ((u64)size * m);
+
+  for(; p < end; p+= 8) {
+    u64 k;
+
+    memcpy(&k, p, sizeof(k));
+    k*= m;
+    k^= k >> r;
+    k*= m;
+
+    h^= k;
+    h*= m;
+  }
+
+  switch(size & 7) {
+    case 7: h^= (u64)p[6] << 48; /* FALLTHROUGH */
+    case 6: h^= (u64)p[5] << 40; /* FALLTHROUGH */
+    case 5: h^= (u64)p[4] << 32; /* FALLTHROUGH */
+    case 4: h^= (u64)p[3] << 24; /* FALLTHROUGH */
+    case 3: h^= (u64)p[2] << 16; /* FALLTHROUGH */
+    case 2: h^= (u64)p[1] << 8; /* FALLTHROUGH */
+    case 1: h^= (u64)p[0];
+      h*= m;
+      break;
+    default:
+      break;
+  }
+
+  h^= h >> r;
+  h*= m;
+  h^= h >> r;
+
+  return (u32)(h ^ (h >> 32));
+}
+
+
+/*
+ * Hash functions by name for hash open option hash-function; the
+ * first is the default.  The choice was made by running
+ * rdf_hash_memory_bench (rdf_hash_memory.c compiled with STANDALONE)
+ * over encoded statement keys: murmur64 hashes long URI keys several
+ * times faster with the same probe lengths.
+ */
+static const struct {
+  const char *name;
+  librdf_hash_memory_function function;
+} librdf_hash_memory_functions[]={
+  { "murmur64",      librdf_hash_memory_murmur64 },
+  { "one-at-a-time", librdf_hash_memory_one_at_a_time },
+  { NULL, NULL }
+};
+
+
+/*
+ * librdf_hash_memory_get_function:
+ * @name: hash function name or NULL for the default
+ *
+ * INTERNAL - Get a hash function by name
+ *
+ * Return value: hash function or NULL if the name is not known
+ **/
+static librdf_hash_memory_function
+librdf_hash_memory_get_function(const char *name)
+{
+  int i;
+
+  if(!name)
+    return librdf_hash_memory_functions[0].function;
+
+  for(i=0; librdf_hash_memory_functions[i].name; i++)
+    if(!strcmp(librdf_hash_memory_functions[i].name, name))
+      return librdf_hash_memory_functions[i].function;
+
+  return NULL;
+}
+
+
+/*
+ * librdf_hash_memory_new_seed:
+ * @context: memory hash context
+ *
+ * INTERNAL - Make a seed for a new hash
+ *
+ * Mixes the time, the context address (randomised on systems with
+ * address space layout randomisation) and a counter.
+ *
+ * Return value: seed
+ **/
+static u32
+librdf_hash_memory_new_seed(void *context)
+{
+  static u32 counter=0;
+  u32 bits[3];
+
+  bits[0]=(u32)time(NULL);
+  bits[1]=(u32)(size_t)context;
+  bits[2]=++counter;
+
+  return librdf_hash_memory_murmur64(bits, sizeof(bits), bits[2] * 0x9e3779b9U);
+}
+
+
+
 /* helper functions */
 
 
-/**
- * librdf_hash_memory_find_node:
+/*
+ * librdf_hash_memory_tag:
  * @hash: the memory hash context
- * @key: key string
- * @key_len: key string length
- * @user_bucket: pointer to store bucket
- * @prev: pointer to store previous node
+ * @key: key bytes
+ * @key_len: key length
  *
- * Find the node for the given key or value.
- * 
- * If value is not NULL and value_len is non 0, the value will also be
- * compared in the search.
+ * INTERNAL - Get the hash tag of a key
  *
- * If user_bucket is not NULL, the bucket used will be returned.  if
- * prev is no NULL, the previous node in the list will be returned.
- * 
- * Return value: #librdf_hash_memory_node of content or NULL on failure
+ * Return value: hash tag, never EMPTY or DELETED
  **/
-static librdf_hash_memory_node*
-librdf_hash_memory_find_node(librdf_hash_memory_context* hash, 
-			     void *key, size_t key_len,
-			     int *user_bucket,
-			     librdf_hash_memory_node** prev) 
+static u32
+librdf_hash_memory_tag(librdf_hash_memory_context* hash,
+                       const void *key, size_t key_len)
 {
-  librdf_hash_memory_node* node;
-  int bucket;
   u32 hash_key;
 
-  /* empty hash */
-  if(!hash->capacity)
+  hash_key=hash->hash_function(key, key_len, hash->seed);
+
+  if(!LIBRDF_HASH_MEMORY_TAG_IS_LIVE(hash_key))
+    hash_key+=2;
+  return hash_key;
+}
+
+
+/*
+ * librdf_hash_memory_probe:
+ * @table: table
+ * @key: key bytes
+ * @key_len: key length
+ * @tag: hash tag of key
+ * @insert_p: pointer to store the slot to insert the key at or NULL
+ *
+ * INTERNAL - Find the slot of a key
+ *
+ * Walks the probe sequence of the key until an empty slot, comparing
+ * the key bytes only for slots with the same tag.  The first
+ * tombstone or empty slot seen is where the key would be inserted.
+ *
+ * Return value: slot index or <0 if the key is not in the table
+ **/
+static int
+librdf_hash_memory_probe(librdf_hash_memory_table* table,
+                         const void *key, size_t key_len, u32 tag,
+                         int *insert_p)
+{
+  u32 mask;
+  u32 i;
+
+  if(insert_p)
+    *insert_p= -1;
+
+  /* no table */
+  if(!table->capacity)
+    return -1;
+
+  mask=(u32)table->capacity - 1;
+  for(i=tag & mask; 1; i=(i + 1) & mask) {
+    u32 slot_tag=table->tags[i];
+
+    if(slot_tag == LIBRDF_HASH_MEMORY_TAG_EMPTY) {
+      if(insert_p && *insert_p < 0)
+        *insert_p=(int)i;
+      return -1;
+    }
+
+    if(slot_tag == LIBRDF_HASH_MEMORY_TAG_DELETED) {
+      if(insert_p && *insert_p < 0)
+        *insert_p=(int)i;
+    } else if(slot_tag == tag) {
+      librdf_hash_memory_slot* slot=&table->slots[i];
+      if(slot->key_len == key_len && !memcmp(slot->key, key, key_len))
+        return (int)i;
+    }
+  }
+
+  /* NOTREACHED - the load factor keeps empty slots in the table */
+  return -1;
+}
+
+
+/*
+ * librdf_hash_memory_find_slot:
+ * @hash: the memory hash context
+ * @key: key bytes
+ * @key_len: key length
+ * @table_p: pointer to store the table the key is in
+ *
+ * INTERNAL - Find the slot of a key in the table or the old table
+ *
+ * Return value: slot index or <0 if the key is not in the hash
+ **/
+static int
+librdf_hash_memory_find_slot(librdf_hash_memory_context* hash,
+                             const void *key, size_t key_len,
+                             librdf_hash_memory_table** table_p)
+{
+  u32 tag=librdf_hash_memory_tag(hash, key, key_len);
+  int i;
+
+  *table_p=&hash->table;
+  i=librdf_hash_memory_probe(&hash->table, key, key_len, tag, NULL);
+  if(i < 0 && hash->old_table.capacity) {
+    *table_p=&hash->old_table;
+    i=librdf_hash_memory_probe(&hash->old_table, key, key_len, tag, NULL);
+  }
+
+  return i;
+}
+
+
+/*
+ * librdf_hash_memory_get_slot:
+ * @hash: the memory hash context
+ * @i: slot index counting the old table slots first
+ *
+ * INTERNAL - Get a slot by cursor position
+ *
+ * Return value: slot or NULL if there is no key in it
+ **/
+static librdf_hash_memory_slot*
+librdf_hash_memory_get_slot(librdf_hash_memory_context* hash, int i)
+{
+  librdf_hash_memory_table* table=&hash->old_table;
+
+  if(i >= table->capacity) {
+    i-= table->capacity;
+    table=&hash->table;
+    if(i >= table->capacity)
+      return NULL;
+  }
+
+  if(!LIBRDF_HASH_MEMORY_TAG_IS_LIVE(table->tags[i]))
     return NULL;
+  return &table->slots[i];
+}
+
+
+/*
+ * librdf_hash_memory_slot_values:
+ * @slot: slot
+ *
+ * INTERNAL - Get the array of values of a slot
+ *
+ * Return value: pointer to slot->values_count values
+ **/
+static librdf_hash_memory_value*
+librdf_hash_memory_slot_values(librdf_hash_memory_slot* slot)
+{
+  return slot->values ? slot->values : &slot->value;
+}
+
+
+#define LIBRDF_HASH_MEMORY_VALUE_SET_ENTRIES(set) \
+  ((librdf_hash_memory_value_entry*)((set) + 1))
+
+
+/*
+ * librdf_hash_memory_value_set_resize:
+ * @hash: the memory hash context
+ * @slot: slot
+ * @capacity: number of entries - MUST BE POWER OF 2
+ *
+ * INTERNAL - Build the value set of a slot with the given size, dropping tombstones
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_value_set_resize(librdf_hash_memory_context* hash,
+                                    librdf_hash_memory_slot* slot,
+                                    int capacity)
+{
+  librdf_hash_memory_value_set *set;
+  librdf_hash_memory_value_entry *entries;
+  librdf_hash_memory_value *values=librdf_hash_memory_slot_values(slot);
+  u32 mask=(u32)capacity - 1;
+  int i;
+
+  set=(librdf_hash_memory_value_set*)LIBRDF_MALLOC(librdf_hash_memory_value_set,
+                                                   sizeof(librdf_hash_memory_value_set) +
+                                                   capacity * sizeof(librdf_hash_memory_value_entry));
+  if(!set)
+    return 1;
+  set->capacity=capacity;
+  set->used=0;
+
+  entries=LIBRDF_HASH_MEMORY_VALUE_SET_ENTRIES(set);
+  for(i=0; i < capacity; i++)
+    entries[i].index=LIBRDF_HASH_MEMORY_VALUE_EMPTY;
+
+  for(i=0; i < slot->values_count; i++) {
+    u32 tag;
+    u32 j;
+
+    tag=hash->hash_function(values[i].data, values[i].size, hash->seed);
+    for(j=tag & mask; entries[j].index != LIBRDF_HASH_MEMORY_VALUE_EMPTY;
+        j=(j + 1) & mask)
+      ;
+    entries[j].tag=tag;
+    entries[j].index=i;
+    set->used++;
+  }
+
+  if(slot->value_set)
+    LIBRDF_FREE(librdf_hash_memory_value_set, slot->value_set);
+  slot->value_set=set;
+
+  return 0;
+}
+
+
+/*
+ * librdf_hash_memory_value_set_add:
+ * @hash: the memory hash context
+ * @slot: slot
+ * @index: position of the new value in the values array
+ *
+ * INTERNAL - Add the value at a position to the value set of a slot, if it has one
+ *
+ * Builds the value set when the key reaches
+ * LIBRDF_HASH_MEMORY_VALUE_SET_MIN_VALUES values.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_value_set_add(librdf_hash_memory_context* hash,
+                                 librdf_hash_memory_slot* slot, int index)
+{
+  librdf_hash_memory_value_set *set=slot->value_set;
+  librdf_hash_memory_value_entry *entries;
+  librdf_hash_memory_value *value;
+  u32 mask;
+  u32 tag;
+  u32 j;
   
-  ONE_AT_A_TIME_HASH(hash_key, key, key_len);
+  if(!set) {
+    int capacity=LIBRDF_HASH_MEMORY_VALUE_SET_MIN_VALUES << 1;
 
-  if(prev)
-    *prev=NULL;
+    if(slot->values_count <= LIBRDF_HASH_MEMORY_VALUE_SET_MIN_VALUES)
+      return 0;
+    while(4 * slot->values_count >= 3 * capacity)
+      capacity<<= 1;
+    return librdf_hash_memory_value_set_resize(hash, slot, capacity);
+  }
 
-  /* find slot in table */
-  bucket=hash_key & (hash->capacity - 1);
-  if(user_bucket)
-    *user_bucket=bucket;
+  /* keep the set under 3/4 full, dropping tombstones or doubling */
+  if(4 * (set->used + 1) >= 3 * set->capacity) {
+    int capacity=set->capacity;
 
-  /* check if there is a list present */ 
-  node=hash->nodes[bucket];
-  if(!node)
-    /* no list there */
-    return NULL;
-    
-  /* walk the list */
-  while(node) {
-    if(key_len == node->key_len && !memcmp(key, node->key, key_len))
-      break;
-    if(prev)
-      *prev=node;
-    node=node->next;
+    if(4 * (slot->values_count + 1) >= 3 * (capacity >> 1))
+      capacity<<= 1;
+    /* the new value is already in the array */
+    return librdf_hash_memory_value_set_resize(hash, slot, capacity);
   }
 
-  return node;
+  value=&librdf_hash_memory_slot_values(slot)[index];
+  tag=hash->hash_function(value->data, value->size, hash->seed);
+
+  entries=LIBRDF_HASH_MEMORY_VALUE_SET_ENTRIES(set);
+  mask=(u32)set->capacity - 1;
+  for(j=tag & mask; entries[j].index >= 0; j=(j + 1) & mask)
+    ;
+  if(entries[j].index == LIBRDF_HASH_MEMORY_VALUE_EMPTY)
+    set->used++;
+  entries[j].tag=tag;
+  entries[j].index=index;
+
+  return 0;
 }
 
 
+/*
+ * librdf_hash_memory_find_value:
+ * @hash: the memory hash context
+ * @slot: slot
+ * @data: value bytes
+ * @size: value length
+ * @entry_p: pointer to store the value set entry or NULL
+ *
+ * INTERNAL - Find a value of a key
+ *
+ * Uses the value set if the key has one, otherwise scans the values.
+ *
+ * Return value: position in the values array or <0 if not found
+ **/
+static int
+librdf_hash_memory_find_value(librdf_hash_memory_context* hash,
+                              librdf_hash_memory_slot* slot,
+                              const void *data, size_t size, int *entry_p)
+{
+  librdf_hash_memory_value *values=librdf_hash_memory_slot_values(slot);
+  librdf_hash_memory_value_set *set=slot->value_set;
+  librdf_hash_memory_value_entry *entries;
+  u32 mask;
+  u32 tag;
+  u32 j;
+  int i;
+
+  if(entry_p)
+    *entry_p= -1;
+
+  if(!set) {
+    for(i=0; i < slot->values_count; i++) {
+      if(size == values[i].size && !memcmp(data, values[i].data, size))
+        return i;
+    }
+    return -1;
+  }
+
+  tag=hash->hash_function(data, size, hash->seed);
+
+  entries=LIBRDF_HASH_MEMORY_VALUE_SET_ENTRIES(set);
+  mask=(u32)set->capacity - 1;
+  for(j=tag & mask; entries[j].index != LIBRDF_HASH_MEMORY_VALUE_EMPTY;
+      j=(j + 1) & mask) {
+    i=entries[j].index;
+    if(i >= 0 && entries[j].tag == tag &&
+       size == values[i].size && !memcmp(data, values[i].data, size)) {
+      if(entry_p)
+        *entry_p=(int)j;
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+
+/*
+ * librdf_hash_memory_remove_value:
+ * @hash: the memory hash context
+ * @slot: slot with more than one value
+ * @index: position of the value in the values array
+ * @entry: value set entry of the value or <0 if there is no value set
+ *
+ * INTERNAL - Delete one value of a key by moving the last value into its place
+ *
+ **/
 static void
-librdf_free_hash_memory_node(librdf_hash_memory_node* node) 
+librdf_hash_memory_remove_value(librdf_hash_memory_context* hash,
+                                librdf_hash_memory_slot* slot,
+                                int index, int entry)
 {
-  if(node->key)
-    LIBRDF_FREE(cstring, node->key);
-  if(node->values) {
-    librdf_hash_memory_node_value *vnode, *next;
-
-    /* Empty the list of values */
-    for(vnode=node->values; vnode; vnode=next) {
-      next=vnode->next;
-      if(vnode->value)
-        LIBRDF_FREE(cstring, vnode->value);
-      LIBRDF_FREE(librdf_hash_memory_node_value, vnode);
+  librdf_hash_memory_value *values=librdf_hash_memory_slot_values(slot);
+  librdf_hash_memory_value_set *set=slot->value_set;
+  int last=slot->values_count - 1;
+
+  hash->live_bytes-= values[index].size;
+  hash->dead_bytes+= values[index].size;
+
+  if(set) {
+    librdf_hash_memory_value_entry *entries;
+
+    entries=LIBRDF_HASH_MEMORY_VALUE_SET_ENTRIES(set);
+    entries[entry].index=LIBRDF_HASH_MEMORY_VALUE_DELETED;
+
+    /* the entry of the last value now points at the hole */
+    if(index != last) {
+      u32 mask=(u32)set->capacity - 1;
+      u32 tag;
+      u32 j;
+
+      tag=hash->hash_function(values[last].data, values[last].size,
+                              hash->seed);
+      for(j=tag & mask; entries[j].index != last; j=(j + 1) & mask)
+        ;
+      entries[j].index=index;
     }
   }
-  LIBRDF_FREE(librdf_hash_memory_node, node);
+
+  /* move the last value into the hole */
+  values[index]=values[last];
+  slot->values_count--;
+  hash->values--;
+
+  /* few values left so scanning them is cheaper than the set */
+  if(set &&
+     slot->values_count < (LIBRDF_HASH_MEMORY_VALUE_SET_MIN_VALUES >> 1)) {
+    LIBRDF_FREE(librdf_hash_memory_value_set, set);
+    slot->value_set=NULL;
+  }
 }
 
 
-static int
-librdf_hash_memory_expand_size(librdf_hash_memory_context* hash) {
-  int required_capacity=0;
-  librdf_hash_memory_node **new_nodes;
+/*
+ * librdf_hash_memory_arena_alloc:
+ * @hash: the memory hash context
+ * @data: bytes to copy
+ * @size: number of bytes
+ *
+ * INTERNAL - Copy bytes into the arena
+ *
+ * Return value: pointer to the copy or NULL on failure
+ **/
+static unsigned char*
+librdf_hash_memory_arena_alloc(librdf_hash_memory_context* hash,
+                               const void *data, size_t size)
+{
+  librdf_hash_memory_chunk* chunk=hash->chunks;
+  unsigned char *p;
+
+  if(!chunk || chunk->size - chunk->used < size) {
+    size_t chunk_size=LIBRDF_HASH_MEMORY_CHUNK_MIN_SIZE;
+
+    /* double the chunks while the arena grows */
+    if(chunk) {
+      chunk_size=chunk->size << 1;
+      if(chunk_size > LIBRDF_HASH_MEMORY_CHUNK_MAX_SIZE)
+        chunk_size=LIBRDF_HASH_MEMORY_CHUNK_MAX_SIZE;
+    }
+    if(chunk_size < size)
+      chunk_size=size;
+
+    chunk=(librdf_hash_memory_chunk*)LIBRDF_MALLOC(librdf_hash_memory_chunk,
+                                                   sizeof(librdf_hash_memory_chunk) + chunk_size);
+    if(!chunk)
+      return NULL;
+    chunk->size=chunk_size;
+    chunk->used=0;
+    chunk->next=hash->chunks;
+    hash->chunks=chunk;
+  }
+
+  p=(unsigned char*)(chunk + 1) + chunk->used;
+  chunk->used+= size;
+  if(size)
+    memcpy(p, data, size);
+
+  hash->live_bytes+= size;
+  return p;
+}
+
+
+/*
+ * librdf_hash_memory_arena_free:
+ * @hash: the memory hash context
+ *
+ * INTERNAL - Free all arena chunks
+ *
+ **/
+static void
+librdf_hash_memory_arena_free(librdf_hash_memory_context* hash)
+{
+  librdf_hash_memory_chunk *chunk, *next;
+
+  for(chunk=hash->chunks; chunk; chunk=next) {
+    next=chunk->next;
+    LIBRDF_FREE(librdf_hash_memory_chunk, chunk);
+  }
+  hash->chunks=NULL;
+  hash->live_bytes=0;
+  hash->dead_bytes=0;
+}
+
+
+/*
+ * librdf_hash_memory_arena_compact:
+ * @hash: the memory hash context
+ *
+ * INTERNAL - Copy the live keys and values into a new arena when most of the arena is deleted
+ *
+ * Does nothing while cursors are open since they return pointers into
+ * the arena.  On allocation failure the old arena is kept.
+ **/
+static void
+librdf_hash_memory_arena_compact(librdf_hash_memory_context* hash)
+{
+  librdf_hash_memory_chunk *old_chunks;
+  size_t live_bytes;
   int i;
 
-  if (hash->capacity) {
-    /* big enough */
-    if((1000 * hash->keys) < (hash->load_factor * hash->capacity))
-      return 0;
-    /* grow hash (keeping it a power of two) */
-    required_capacity=hash->capacity << 1;
-  } else {
-    required_capacity=librdf_hash_initial_capacity;
+  if(hash->cursors ||
+     hash->dead_bytes < LIBRDF_HASH_MEMORY_COMPACT_MIN_SIZE ||
+     hash->dead_bytes < hash->live_bytes)
+    return;
+
+  old_chunks=hash->chunks;
+  live_bytes=hash->live_bytes;
+
+  /* one chunk for all the live bytes */
+  if(live_bytes) {
+    librdf_hash_memory_chunk* chunk;
+    size_t chunk_size=live_bytes;
+
+    if(chunk_size < LIBRDF_HASH_MEMORY_CHUNK_MIN_SIZE)
+      chunk_size=LIBRDF_HASH_MEMORY_CHUNK_MIN_SIZE;
+    chunk=(librdf_hash_memory_chunk*)LIBRDF_MALLOC(librdf_hash_memory_chunk,
+                                                   sizeof(librdf_hash_memory_chunk) + chunk_size);
+    if(!chunk)
+      return;
+    chunk->size=chunk_size;
+    chunk->used=0;
+    chunk->next=NULL;
+    hash->chunks=chunk;
+  } else
+    hash->chunks=NULL;
+  hash->live_bytes=0;
+
+  for(i=0; i < LIBRDF_HASH_MEMORY_SLOTS(hash); i++) {
+    librdf_hash_memory_slot* slot=librdf_hash_memory_get_slot(hash, i);
+    librdf_hash_memory_value* values;
+    int j;
+
+    if(!slot)
+      continue;
+
+    slot->key=librdf_hash_memory_arena_alloc(hash, slot->key, slot->key_len);
+    values=librdf_hash_memory_slot_values(slot);
+    for(j=0; j < slot->values_count; j++)
+      values[j].data=librdf_hash_memory_arena_alloc(hash, values[j].data,
+                                                    values[j].size);
+  }
+  hash->dead_bytes=0;
+
+  /* now free old arena */
+  while(old_chunks) {
+    librdf_hash_memory_chunk* next=old_chunks->next;
+    LIBRDF_FREE(librdf_hash_memory_chunk, old_chunks);
+    old_chunks=next;
+  }
+}
+
+
+/*
+ * librdf_hash_memory_free_slot:
+ * @hash: the memory hash context
+ * @table: table
+ * @i: slot index
+ *
+ * INTERNAL - Delete the key and all values in a slot, leaving a tombstone
+ *
+ **/
+static void
+librdf_hash_memory_free_slot(librdf_hash_memory_context* hash,
+                             librdf_hash_memory_table* table, int i)
+{
+  librdf_hash_memory_slot* slot=&table->slots[i];
+  librdf_hash_memory_value* values=librdf_hash_memory_slot_values(slot);
+  size_t bytes=slot->key_len;
+  int j;
+
+  for(j=0; j < slot->values_count; j++)
+    bytes+= values[j].size;
+  hash->live_bytes-= bytes;
+  hash->dead_bytes+= bytes;
+
+  if(slot->values)
+    LIBRDF_FREE(librdf_hash_memory_value, slot->values);
+  if(slot->value_set)
+    LIBRDF_FREE(librdf_hash_memory_value_set, slot->value_set);
+
+  hash->keys--;
+  hash->values-= slot->values_count;
+
+  memset(slot, 0, sizeof(*slot));
+  table->tags[i]=LIBRDF_HASH_MEMORY_TAG_DELETED;
+}
+
+
+/*
+ * librdf_hash_memory_free_table:
+ * @table: table
+ * @free_values: non 0 to also free the value arrays of the keys
+ *
+ * INTERNAL - Free the arrays of a table
+ *
+ **/
+static void
+librdf_hash_memory_free_table(librdf_hash_memory_table* table,
+                              int free_values)
+{
+  if(table->slots) {
+    int i;
+  
+    for(i=0; free_values && i < table->capacity; i++) {
+      if(table->slots[i].values)
+        LIBRDF_FREE(librdf_hash_memory_value, table->slots[i].values);
+      if(table->slots[i].value_set)
+        LIBRDF_FREE(librdf_hash_memory_value_set, table->slots[i].value_set);
+    }
+    LIBRDF_FREE(librdf_hash_memory_slot, table->slots);
   }
+  if(table->tags)
+    LIBRDF_FREE(u32, table->tags);
+
+  memset(table, 0, sizeof(*table));
+}
+
+
+/*
+ * librdf_hash_memory_table_add:
+ * @table: table with room for one more slot
+ * @tag: hash tag of the key
+ * @slot: slot to copy in
+ *
+ * INTERNAL - Put a moved key into a table without comparing keys
+ *
+ **/
+static void
+librdf_hash_memory_table_add(librdf_hash_memory_table* table, u32 tag,
+                             librdf_hash_memory_slot* slot)
+{
+  u32 mask=(u32)table->capacity - 1;
+  u32 j;
+
+  /* the tag is the hash of the key so no key is hashed again */
+  for(j=tag & mask; LIBRDF_HASH_MEMORY_TAG_IS_LIVE(table->tags[j]);
+      j=(j + 1) & mask)
+    ;
+  if(table->tags[j] == LIBRDF_HASH_MEMORY_TAG_EMPTY)
+    table->used++;
+  table->tags[j]=tag;
+  table->slots[j]=*slot;
+}
+
+
+/*
+ * librdf_hash_memory_move_slots:
+ * @hash: the memory hash context
+ * @count: number of old table slots to move or <0 for all
+ *
+ * INTERNAL - Move keys from the old table into the table
+ *
+ * The old table slots are left as tombstones so that lookups of the
+ * keys not yet moved still find them.  Moving stops while the table
+ * is at its load factor; the next put then starts a new table and
+ * moves the rest there.  The old table is freed once it is empty.
+ *
+ **/
+static void
+librdf_hash_memory_move_slots(librdf_hash_memory_context* hash, int count)
+{
+  librdf_hash_memory_table* old_table=&hash->old_table;
+  librdf_hash_memory_table* table=&hash->table;
+
+  if(!old_table->capacity)
+    return;
+
+  for(; count && hash->move_slot < old_table->capacity; count--) {
+    int i=hash->move_slot;
+    u32 tag=old_table->tags[i];
+
+    if(LIBRDF_HASH_MEMORY_TAG_IS_LIVE(tag)) {
+      if(table->used + 1 >= table->max_used)
+        break;
+      librdf_hash_memory_table_add(table, tag, &old_table->slots[i]);
+      old_table->tags[i]=LIBRDF_HASH_MEMORY_TAG_DELETED;
+    }
+    hash->move_slot++;
+  }
+
+  if(hash->move_slot >= old_table->capacity) {
+    librdf_hash_memory_free_table(old_table, 0);
+    hash->move_slot=0;
+  }
+}
+
+
+/*
+ * librdf_hash_memory_resize:
+ * @hash: the memory hash context
+ * @capacity: new capacity - MUST BE POWER OF 2
+ *
+ * INTERNAL - Start moving all keys into a new table, dropping tombstones
+ *
+ * Keys left in the old table of an earlier move go straight into the
+ * new table, which is sized for all keys.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_resize(librdf_hash_memory_context* hash, int capacity)
+{
+  librdf_hash_memory_table new_table;
+  librdf_hash_memory_table* old_table=&hash->old_table;
 
   /* allocate new table */
-  new_nodes=(librdf_hash_memory_node**)LIBRDF_CALLOC(librdf_hash_memory_nodes, 
-						     required_capacity,
-						     sizeof(librdf_hash_memory_node*));
-  if(!new_nodes)
+  new_table.tags=(u32*)LIBRDF_CALLOC(u32, capacity, sizeof(u32));
+  if(!new_table.tags)
     return 1;
+  new_table.slots=(librdf_hash_memory_slot*)LIBRDF_CALLOC(librdf_hash_memory_slot,
+                                                          capacity,
+                                                          sizeof(librdf_hash_memory_slot));
+  if(!new_table.slots) {
+    LIBRDF_FREE(u32, new_table.tags);
+    return 1;
+  }
+  new_table.capacity=capacity;
+  new_table.used=0;
+  new_table.max_used=(int)((double)capacity * hash->load_factor / 1000);
 
+  if(old_table->capacity) {
+    int i;
 
-  /* it is a new hash empty hash - we are done */
-  if(!hash->size) {
-    hash->capacity=required_capacity;
-    hash->nodes=new_nodes;
-    return 0;
+    for(i=hash->move_slot; i < old_table->capacity; i++) {
+      if(LIBRDF_HASH_MEMORY_TAG_IS_LIVE(old_table->tags[i]))
+        librdf_hash_memory_table_add(&new_table, old_table->tags[i],
+                                     &old_table->slots[i]);
+    }
+    librdf_hash_memory_free_table(old_table, 0);
   }
-  
 
-  for(i=0; i<hash->capacity; i++) {
-    librdf_hash_memory_node *node=hash->nodes[i];
-      
-    /* walk all attached nodes */
-    while(node) {
-      librdf_hash_memory_node *next;
-      int bucket;
-
-      next=node->next;
-      /* find slot in new table */
-      bucket=node->hash_key & (required_capacity - 1);
-      node->next=new_nodes[bucket];
-      new_nodes[bucket]=node;
-
-      node=next;
-    }
-  }
+  /* the current table becomes the old one */
+  hash->old_table=hash->table;
+  hash->table=new_table;
+  hash->move_slot=0;
+
+  /* nothing to move */
+  if(!hash->keys)
+    librdf_hash_memory_move_slots(hash, -1);
+
+  return 0;
+}
+
+
+/*
+ * librdf_hash_memory_step:
+ * @hash: the memory hash context
+ *
+ * INTERNAL - Move a few keys into the new table, if the table is growing and no cursor is open
+ *
+ **/
+static void
+librdf_hash_memory_step(librdf_hash_memory_context* hash)
+{
+  if(hash->old_table.capacity && !hash->cursors)
+    librdf_hash_memory_move_slots(hash, LIBRDF_HASH_MEMORY_MOVE_SLOTS);
+}
+
+
+/*
+ * librdf_hash_memory_expand_size:
+ * @hash: the memory hash context
+ *
+ * INTERNAL - Make room for one more key
+ *
+ * When the table is full mostly of tombstones a new table of the
+ * same size is started, otherwise one of double the size.  The new
+ * table has room for all keys and those added while the old table is
+ * moved, so it only fills up first if cursors stay open meanwhile;
+ * then the keys still in the old table go straight into the next new
+ * table, which is sized for all keys.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_expand_size(librdf_hash_memory_context* hash) {
+  int required_capacity;
+
+  if(!hash->table.capacity)
+    return librdf_hash_memory_resize(hash, librdf_hash_initial_capacity);
+
+  librdf_hash_memory_step(hash);
+
+  /* big enough */
+  if(hash->table.used + 1 < hash->table.max_used)
+    return 0;
 
-  /* now free old table */
-  LIBRDF_FREE(librdf_hash_memory_nodes, hash->nodes);
+  /* grow hash (keeping it a power of two) unless the keys would fit
+   * in half of it */
+  required_capacity=hash->table.capacity;
+  while(2.0 * (hash->keys + 1) >= (double)required_capacity * hash->load_factor / 1000)
+    required_capacity<<= 1;
 
-  /* attach new one */
-  hash->capacity=required_capacity;
-  hash->nodes=new_nodes;
+  if(librdf_hash_memory_resize(hash, required_capacity))
+    return 1;
 
+  librdf_hash_memory_step(hash);
   return 0;
 }
 
@@ -322,7 +1236,11 @@ librdf_hash_memory_create(librdf_hash* hash, void* context)
   librdf_hash_memory_context* hcontext=(librdf_hash_memory_context*)context;
 
   hcontext->hash=hash;
-  hcontext->load_factor=librdf_hash_default_load_factor;
+  hcontext->load_factor=hash->world->hash_load_factor;
+  if(hcontext->load_factor <= 0 || hcontext->load_factor > 999)
+    hcontext->load_factor=librdf_hash_default_load_factor;
+  hcontext->hash_function=librdf_hash_memory_get_function(NULL);
+  hcontext->seed=librdf_hash_memory_new_seed(hcontext);
   return librdf_hash_memory_expand_size(hcontext);
 }
 
@@ -340,25 +1258,10 @@ librdf_hash_memory_destroy(void* context)
 {
   librdf_hash_memory_context* hcontext=(librdf_hash_memory_context*)context;
 
-  if(hcontext->nodes) {
-    int i;
-  
-    for(i=0; i<hcontext->capacity; i++) {
-      librdf_hash_memory_node *node=hcontext->nodes[i];
-      
-      /* this entry is used */
-      if(node) {
-        librdf_hash_memory_node *next;
-        /* free all attached nodes */
-        while(node) {
-          next=node->next;
-          librdf_free_hash_memory_node(node);
-          node=next;
-        }
-      }
-    }
-    LIBRDF_FREE(librdf_hash_memory_nodes, hcontext->nodes);
-  }
+  librdf_hash_memory_free_table(&hcontext->table, 1);
+  librdf_hash_memory_free_table(&hcontext->old_table, 1);
+
+  librdf_hash_memory_arena_free(hcontext);
 
   return 0;
 }
@@ -371,10 +1274,15 @@ librdf_hash_memory_destroy(void* context)
  * @mode: access mode - not used
  * @is_writable: is hash writable? - not used
  * @is_new: is hash new? - not used
- * @options: #librdf_hash of options - not used
+ * @options: #librdf_hash of options
  *
  * Open memory hash with given parameters.
  * 
+ * Option <literal>expected-size</literal> sizes the table for that
+ * many keys up front so that loading them never grows it.  Option
+ * <literal>hash-function</literal> names the key hash function,
+ * <literal>murmur64</literal> (default) or <literal>one-at-a-time</literal>.
+ *
  * Return value: non 0 on failure
  **/
 static int
@@ -382,8 +1290,41 @@ librdf_hash_memory_open(void* context, const char *identifier,
                         int mode, int is_writable, int is_new,
                         librdf_hash* options) 
 {
-  /* NOP */
-  return 0;
+  librdf_hash_memory_context* hash=(librdf_hash_memory_context*)context;
+  char *name;
+  long expected_size;
+  int required_capacity;
+
+  if(!options || hash->keys)
+    return 0;
+
+  name=librdf_hash_get(options, "hash-function");
+  if(name) {
+    librdf_hash_memory_function hash_function;
+
+    hash_function=librdf_hash_memory_get_function(name);
+    if(!hash_function)
+      librdf_log(hash->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH,
+                 NULL, "Unknown hash function %s", name);
+    LIBRDF_FREE(cstring, name);
+    if(!hash_function)
+      return 1;
+    hash->hash_function=hash_function;
+  }
+
+  expected_size=librdf_hash_get_as_long(options, "expected-size");
+  if(expected_size <= 0)
+    return 0;
+
+  required_capacity=hash->table.capacity;
+  while((double)expected_size >= (double)required_capacity * hash->load_factor / 1000 &&
+        required_capacity < (1 << 30))
+    required_capacity<<= 1;
+
+  if(required_capacity == hash->table.capacity)
+    return 0;
+
+  return librdf_hash_memory_resize(hash, required_capacity);
 }
 
 
@@ -416,6 +1357,8 @@ librdf_hash_memory_clone(librdf_hash *hash, void* context, char *new_identifer,
   /* copy data fields that might change */
   hcontext->hash=hash;
   hcontext->load_factor=old_hcontext->load_factor;
+  hcontext->hash_function=old_hcontext->hash_function;
+  hcontext->seed=librdf_hash_memory_new_seed(hcontext);
 
   /* Don't need to deal with new_identifier - not used for memory hashes */
 
@@ -465,12 +1408,46 @@ librdf_hash_memory_values_count(void *context)
 }
 
 
+/**
+ * librdf_hash_memory_key_values_count:
+ * @context: memory hash context
+ * @key: pointer to key
+ *
+ * Get the number of values of one key in the hash.
+ * 
+ * Return value: number of values of the key
+ **/
+static int
+librdf_hash_memory_key_values_count(void *context, librdf_hash_datum *key) 
+{
+  librdf_hash_memory_context* hash=(librdf_hash_memory_context*)context;
+  librdf_hash_memory_table* table;
+  int i;
+
+  i=librdf_hash_memory_find_slot(hash, key->data, key->size, &table);
+  return (i < 0) ? 0 : table->slots[i].values_count;
+}
+
+
 
+/*
+ * The cursor walks the slots in table order, those of the old table
+ * first if there is one, and the values of a key
+ * from the last one back to the first.  A value is deleted by moving
+ * the last value into its place, so deleting the value just returned
+ * does not make the cursor skip or repeat any value.
+ */
 typedef struct {
   librdf_hash_memory_context* hash;
-  int current_bucket;
-  librdf_hash_memory_node* current_node;
-  librdf_hash_memory_node_value *current_value;
+  /* non 0 when current_slot is set */
+  int is_positioned;
+  /* slot of the next key or LIBRDF_HASH_MEMORY_SLOTS() at the end */
+  int current_slot;
+  /* index of the next value of that key, counting down */
+  int current_value;
+  /* key prefix for SET_RANGE / NEXT_RANGE */
+  void *range_key;
+  size_t range_key_len;
 } librdf_hash_memory_cursor_context;
 
 
@@ -490,6 +1467,37 @@ librdf_hash_memory_cursor_init(void *cursor_context, void *hash_context)
   librdf_hash_memory_cursor_context *cursor=(librdf_hash_memory_cursor_context*)cursor_context;
 
   cursor->hash = (librdf_hash_memory_context*)hash_context;
+  cursor->hash->cursors++;
+  return 0;
+}
+
+
+/*
+ * librdf_hash_memory_cursor_seek:
+ * @cursor: memory hash cursor context
+ * @i: slot index to start from
+ *
+ * INTERNAL - Move the cursor to the first key at or after a slot
+ *
+ * Return value: non 0 if there are no more keys
+ **/
+static int
+librdf_hash_memory_cursor_seek(librdf_hash_memory_cursor_context *cursor,
+                               int i)
+{
+  librdf_hash_memory_context* hash=cursor->hash;
+  librdf_hash_memory_slot* slot=NULL;
+
+  for(; i < LIBRDF_HASH_MEMORY_SLOTS(hash); i++)
+    if((slot=librdf_hash_memory_get_slot(hash, i)))
+      break;
+
+  cursor->is_positioned=1;
+  cursor->current_slot=i;
+  if(!slot)
+    return 1;
+
+  cursor->current_value=slot->values_count - 1;
   return 0;
 }
 
@@ -512,141 +1520,138 @@ librdf_hash_memory_cursor_get(void* context,
                               unsigned int flags)
 {
   librdf_hash_memory_cursor_context *cursor=(librdf_hash_memory_cursor_context*)context;
-  librdf_hash_memory_node_value *vnode=NULL;
-  librdf_hash_memory_node *node;
+  librdf_hash_memory_context* hash=cursor->hash;
+  librdf_hash_memory_slot* slot;
+  librdf_hash_memory_value* vnode;
+  int i;
   
 
-  /* First step, make sure cursor->current_node points to a valid node,
-     if possible */
-
-  /* Move to start of hash if necessary  */
-  if(flags == LIBRDF_HASH_CURSOR_FIRST) {
-    int i;
-    
-    cursor->current_node=NULL;
-    /* find first used bucket (with keys) */
-    cursor->current_bucket=0;
-
-    for(i=0; i< cursor->hash->capacity; i++)
-      if((cursor->current_node=cursor->hash->nodes[i])) {
-        cursor->current_bucket=i;
-        break;
-      }
-
-    if(cursor->current_node)
-      cursor->current_value=cursor->current_node->values;
-  }
+  if(flags == LIBRDF_HASH_CURSOR_SET_RANGE ||
+     flags == LIBRDF_HASH_CURSOR_NEXT_RANGE) {
+    /* Keys are not ordered so walk all pairs from the start and skip
+     * those with keys not starting with the prefix */
+    if(flags == LIBRDF_HASH_CURSOR_SET_RANGE) {
+      if(cursor->range_key)
+        LIBRDF_FREE(cstring, cursor->range_key);
+      cursor->range_key=LIBRDF_MALLOC(cstring, key->size ? key->size : 1);
+      if(!cursor->range_key)
+        return 1;
+      memcpy(cursor->range_key, key->data, key->size);
+      cursor->range_key_len=key->size;
+      flags=LIBRDF_HASH_CURSOR_FIRST;
+    } else {
+      if(!cursor->range_key)
+        return 1;
+      flags=LIBRDF_HASH_CURSOR_NEXT;
+    }
 
-  /* If still have no current node, try to find it from the key */
-  if(!cursor->current_node && key && key->data) {
-    cursor->current_node=librdf_hash_memory_find_node(cursor->hash,
-                                                      (char*)key->data,
-                                                      key->size,
-                                                      NULL, NULL);
-    if(cursor->current_node)
-      cursor->current_value=cursor->current_node->values;
+    while(1) {
+      /* a key given with NEXT would restart from that key */
+      key->data=NULL;
+      if(librdf_hash_memory_cursor_get(context, key, value, flags))
+        return 1;
+      if(key->size >= cursor->range_key_len &&
+         !memcmp(key->data, cursor->range_key, cursor->range_key_len))
+        return 0;
+      flags=LIBRDF_HASH_CURSOR_NEXT;
+    }
   }
 
-
-  /* If still have no node, failed */
-  if(!cursor->current_node)
-    return 1;
-
-  /* Check for end of values */
+  /* First step, make sure the cursor is at a slot, if possible */
 
   switch(flags) {
     case LIBRDF_HASH_CURSOR_SET:
-      /* If key does not exist, failed above, so test if there are values */
-
-      /* FALLTHROUGH */
-    case LIBRDF_HASH_CURSOR_NEXT_VALUE:
-      /* If want values and have reached end of values list, end */
-      if(!cursor->current_value)
-        return 1;
+      cursor->is_positioned=0;
       break;
-      
+
     case LIBRDF_HASH_CURSOR_FIRST:
+      librdf_hash_memory_cursor_seek(cursor, 0);
+      break;
+
+    case LIBRDF_HASH_CURSOR_NEXT_VALUE:
     case LIBRDF_HASH_CURSOR_NEXT:
-      /* If have reached last bucket, end */
-      if(cursor->current_bucket >= cursor->hash->capacity)
-        return 1;
-      
       break;
+
     default:
-      librdf_log(cursor->hash->hash->world,
+      librdf_log(hash->hash->world,
                  0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
                  "Unknown hash method flag %d", flags);
       return 1;
   }
-  
 
-  /* Ok, there is data, retrieve it */
+  /* If still have no slot, try to find it from the key */
+  if(!cursor->is_positioned) {
+    librdf_hash_memory_table* table;
 
-  switch(flags) {
-    case LIBRDF_HASH_CURSOR_SET:
+    if(!key || !key->data)
+      return 1;
+    i=librdf_hash_memory_find_slot(hash, key->data, key->size, &table);
+    if(i < 0)
+      return 1;
+    cursor->is_positioned=1;
+    cursor->current_value=table->slots[i].values_count - 1;
+    if(table == &hash->table)
+      i+= hash->old_table.capacity;
+    cursor->current_slot=i;
+  }
 
-      /* FALLTHROUGH */
-    case LIBRDF_HASH_CURSOR_NEXT_VALUE:
-      vnode=cursor->current_value;
-      
-      /* copy value */
-      value->data=vnode->value;
-      value->size=vnode->value_len;
-      
-      /* move on */
-      cursor->current_value=vnode->next;
-      break;
-      
-    case LIBRDF_HASH_CURSOR_FIRST:
-    case LIBRDF_HASH_CURSOR_NEXT:
-      node=cursor->current_node;
 
-      /* get key */
-      key->data= node->key;
-      key->size= node->key_len;
+  if(flags == LIBRDF_HASH_CURSOR_SET ||
+     flags == LIBRDF_HASH_CURSOR_NEXT_VALUE) {
+    /* the key may since have been deleted or lost values */
+    slot=librdf_hash_memory_get_slot(hash, cursor->current_slot);
+    if(!slot)
+      return 1;
+    if(cursor->current_value >= slot->values_count)
+      cursor->current_value=slot->values_count - 1;
+    if(cursor->current_value < 0)
+      return 1;
 
-      /* if want values, walk through them */
-      if(value) {
-        vnode=cursor->current_value;
-        
-        /* get value */
-        value->data=vnode->value;
-        value->size=vnode->value_len;
+    /* copy value */
+    vnode=&librdf_hash_memory_slot_values(slot)[cursor->current_value--];
+    value->data=vnode->data;
+    value->size=vnode->size;
 
-        /* move on */
-        cursor->current_value=vnode->next;
-        
-        /* stop here if there are more values, otherwise need next
-         * key & values so drop through and move to the next node
-         */
-        if(cursor->current_value)
-          break;
-      }
-      
-      /* move on to next node in current bucket */
-      if(!(node=cursor->current_node->next)) {
-        int i;
-        
-        /* end of list - move to next used bucket */
-        for(i=cursor->current_bucket+1; i< cursor->hash->capacity; i++)
-          if((node=cursor->hash->nodes[i])) {
-            cursor->current_bucket=i;
-            break;
-          }
-        
-      }
-      
-      if((cursor->current_node=node))
-        cursor->current_value=node->values;
-      
-      break;
-    default:
-      librdf_log(cursor->hash->hash->world,
-                 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
-                 "Unknown hash method flag %d", flags);
+    return 0;
+  }
+
+
+  /* LIBRDF_HASH_CURSOR_FIRST or LIBRDF_HASH_CURSOR_NEXT: skip keys
+   * deleted since the last call */
+  while(1) {
+    i=cursor->current_slot;
+    if(i >= LIBRDF_HASH_MEMORY_SLOTS(hash))
       return 1;
+
+    if((slot=librdf_hash_memory_get_slot(hash, i))) {
+      if(cursor->current_value >= slot->values_count)
+        cursor->current_value=slot->values_count - 1;
+      if(cursor->current_value >= 0)
+        break;
+    }
+    librdf_hash_memory_cursor_seek(cursor, i + 1);
   }
-  
+
+  /* get key */
+  key->data=slot->key;
+  key->size=slot->key_len;
+
+  /* if want values, walk through them */
+  if(value) {
+    vnode=&librdf_hash_memory_slot_values(slot)[cursor->current_value--];
+
+    /* get value */
+    value->data=vnode->data;
+    value->size=vnode->size;
+
+    /* stop here if there are more values, otherwise need next
+     * key & values so move to the next slot
+     */
+    if(cursor->current_value >= 0)
+      return 0;
+  }
+
+  librdf_hash_memory_cursor_seek(cursor, i + 1);
 
   return 0;
 }
@@ -662,8 +1667,13 @@ librdf_hash_memory_cursor_get(void* context,
 static void
 librdf_hash_memory_cursor_finish(void* context)
 {
-/* librdf_hash_memory_cursor_context *cursor=(librdf_hash_memory_cursor_context*)context; */
+  librdf_hash_memory_cursor_context *cursor=(librdf_hash_memory_cursor_context*)context;
+
+  if(cursor->range_key)
+    LIBRDF_FREE(cstring, cursor->range_key);
 
+  if(cursor->hash)
+    cursor->hash->cursors--;
 }
 
 
@@ -682,106 +1692,99 @@ librdf_hash_memory_put(void* context, librdf_hash_datum *key,
 		       librdf_hash_datum *value) 
 {
   librdf_hash_memory_context* hash=(librdf_hash_memory_context*)context;
-  librdf_hash_memory_node *node;
-  librdf_hash_memory_node_value *vnode;
-  u32 hash_key;
-  void *new_key=NULL;
-  void *new_value;
-  int bucket= (-1);
-  int is_new_node;
+  librdf_hash_memory_table* table=&hash->table;
+  librdf_hash_memory_slot *slot;
+  librdf_hash_memory_value new_value;
+  u32 tag;
+  int i;
+  int insert_at;
 
   /* ensure there is enough space in the hash */
-  if (librdf_hash_memory_expand_size(hash))
+  if(librdf_hash_memory_expand_size(hash))
     return 1;
   
-  /* find node for key */
-  node=librdf_hash_memory_find_node(hash,
-				    key->data, key->size,
-				    NULL, NULL);
-
-  is_new_node=(node == NULL);
-  
-  /* not found - new key */
-  if(is_new_node) {
-    ONE_AT_A_TIME_HASH(hash_key, key->data, key->size);
+  /* find slot for key, new keys always go in the table */
+  tag=librdf_hash_memory_tag(hash, key->data, key->size);
+  i=librdf_hash_memory_probe(table, key->data, key->size, tag, &insert_at);
+  if(i < 0 && hash->old_table.capacity) {
+    i=librdf_hash_memory_probe(&hash->old_table, key->data, key->size, tag,
+                               NULL);
+    if(i >= 0)
+      table=&hash->old_table;
+  }
 
-    bucket=hash_key & (hash->capacity - 1);
+  /* always copy new value */
+  new_value.data=librdf_hash_memory_arena_alloc(hash, value->data,
+                                                value->size);
+  if(!new_value.data)
+    return 1;
+  new_value.size=value->size;
 
-    /* allocate new node */
-    node=(librdf_hash_memory_node*)LIBRDF_CALLOC(librdf_hash_memory_node, 1,
-                                                 sizeof(librdf_hash_memory_node));
-    if(!node)
-      return 1;
+  /* not found - new key */
+  if(i < 0) {
+    unsigned char *new_key;
 
-    node->hash_key=hash_key;
-    
-    /* allocate key for new node */
-    new_key=LIBRDF_MALLOC(cstring, key->size);
+    new_key=librdf_hash_memory_arena_alloc(hash, key->data, key->size);
     if(!new_key) {
-      LIBRDF_FREE(librdf_hash_memory_node, node);
+      hash->live_bytes-= new_value.size;
+      hash->dead_bytes+= new_value.size;
       return 1;
     }
 
-    /* copy new key */
-    memcpy(new_key, key->data, key->size);
-    node->key=new_key;
-    node->key_len=key->size;
-  }
-  
-  
-  /* always allocate new value */
-  new_value=LIBRDF_MALLOC(cstring, value->size);
-  if(!new_value) {
-    if(is_new_node) {
-      LIBRDF_FREE(cstring, new_key);
-      LIBRDF_FREE(librdf_hash_memory_node, node);
-    }
-    return 1;
-  }
-
-  /* always allocate new librdf_hash_memory_node_value */
-  vnode=(librdf_hash_memory_node_value*)LIBRDF_CALLOC(librdf_hash_memory_node_value, 1, sizeof(librdf_hash_memory_node_value));
-  if(!vnode) {
-    LIBRDF_FREE(cstring, new_value);
-    if(is_new_node) {
-      LIBRDF_FREE(cstring, new_key);
-      LIBRDF_FREE(librdf_hash_memory_node, node);
-    }
-    return 1;
-  }
-
-  /* if we get here, all allocations succeeded */
-
+    /* a tombstone slot is reused without changing used */
+    if(table->tags[insert_at] == LIBRDF_HASH_MEMORY_TAG_EMPTY)
+      table->used++;
+    table->tags[insert_at]=tag;
 
-  /* put new value node in list */
-  vnode->next=node->values;
-  node->values=vnode;
+    slot=&table->slots[insert_at];
+    slot->key=new_key;
+    slot->key_len=key->size;
+    slot->value=new_value;
+    slot->values=NULL;
+    slot->values_count=1;
+    slot->values_capacity=0;
+    slot->value_set=NULL;
 
-  /* note that in counter */
-  node->values_count++;
- 
-  /* copy new value */
-  memcpy(new_value, value->data, value->size);
-  vnode->value=new_value;
-  vnode->value_len=value->size;
-
-
-  /* now update buckets and hash counts */
-  if(is_new_node) {
-    node->next=hash->nodes[bucket];
-    hash->nodes[bucket]=node;
-  
     hash->keys++;
+    hash->values++;
+    return 0;
   }
-  
 
-  hash->values++;
+  slot=&table->slots[i];
+
+  /* second value - move the first one into an array */
+  if(!slot->values) {
+    slot->values=(librdf_hash_memory_value*)LIBRDF_MALLOC(librdf_hash_memory_value,
+                                                          4 * sizeof(librdf_hash_memory_value));
+    if(!slot->values)
+      goto failed;
+    slot->values[0]=slot->value;
+    slot->values_capacity=4;
+  } else if(slot->values_count == slot->values_capacity) {
+    librdf_hash_memory_value* new_values;
+    
+    new_values=(librdf_hash_memory_value*)LIBRDF_REALLOC(librdf_hash_memory_value,
+                                                         slot->values,
+                                                         2 * slot->values_capacity * sizeof(librdf_hash_memory_value));
+    if(!new_values)
+      goto failed;
+    slot->values=new_values;
+    slot->values_capacity*= 2;
+  }
 
-  /* Only increase bucket count use when previous value was NULL */
-  if(!node->next)
-    hash->size++;
+  slot->values[slot->values_count++]=new_value;
+  if(librdf_hash_memory_value_set_add(hash, slot, slot->values_count - 1)) {
+    slot->values_count--;
+    goto failed;
+  }
 
+  hash->values++;
   return 0;
+
+  failed:
+  hash->live_bytes-= new_value.size;
+  hash->dead_bytes+= new_value.size;
+  return 1;
 }
 
 
@@ -800,14 +1803,14 @@ librdf_hash_memory_exists(void* context,
                           librdf_hash_datum *key, librdf_hash_datum *value)
 {
   librdf_hash_memory_context* hash=(librdf_hash_memory_context*)context;
-  librdf_hash_memory_node* node;
-  librdf_hash_memory_node_value *vnode;
+  librdf_hash_memory_table* table;
+  int i;
   
-  node=librdf_hash_memory_find_node(hash,
-				    (char*)key->data, key->size,
-				    NULL, NULL);
+  librdf_hash_memory_step(hash);
+
+  i=librdf_hash_memory_find_slot(hash, key->data, key->size, &table);
   /* key not found */
-  if(!node)
+  if(i < 0)
     return 0;
   
   /* no value wanted */
@@ -815,13 +1818,8 @@ librdf_hash_memory_exists(void* context,
     return 1;
 
   /* search for value in list of values */
-  for(vnode=node->values; vnode; vnode=vnode->next) {
-    if(value->size == vnode->value_len && 
-       !memcmp(value->data, vnode->value, value->size))
-      break;
-  }
-
-  return (vnode != NULL);
+  return librdf_hash_memory_find_value(hash, &table->slots[i],
+                                       value->data, value->size, NULL) >= 0;
 }
 
 
@@ -841,87 +1839,35 @@ librdf_hash_memory_delete_key_value(void* context, librdf_hash_datum *key,
                                     librdf_hash_datum *value)
 {
   librdf_hash_memory_context* hash=(librdf_hash_memory_context*)context;
-  librdf_hash_memory_node *node, *prev, *next;
-  librdf_hash_memory_node_value *vnode, *vprev;
-  int bucket;
+  librdf_hash_memory_table* table;
+  librdf_hash_memory_slot *slot;
+  int i;
+  int j;
+  int entry;
   
-  node=librdf_hash_memory_find_node(hash, 
-				    (char*)key->data, key->size,
-				    &bucket, &prev);
+  librdf_hash_memory_step(hash);
+
+  i=librdf_hash_memory_find_slot(hash, key->data, key->size, &table);
   /* key not found anywhere */
-  if(!node)
+  if(i < 0)
     return 1;
 
   /* search for value in list of values */
-  vnode=node->values;
-  vprev=NULL;
-  while(vnode) {
-    if(value->size == vnode->value_len && 
-       !memcmp(value->data, vnode->value, value->size))
-      break;
-    vprev=vnode;
-    vnode=vnode->next;
-  }
+  slot=&table->slots[i];
+  j=librdf_hash_memory_find_value(hash, slot, value->data, value->size,
+                                  &entry);
 
   /* key/value combination not found */
-  if(!vnode)
+  if(j < 0)
     return 1;
 
-  /* found - delete it from list */
-  if(!vprev) {
-    /* at start of list so delete from there */
-    node->values=vnode->next;
-  } else
-    vprev->next=vnode->next;
-
-  /* free value and value node */
-  if(vnode->value)
-    LIBRDF_FREE(librdf_hash_memory_node_value, vnode->value);
-  LIBRDF_FREE(librdf_hash_memory_node_value, vnode);
-
-  /* update hash counts */
-  hash->values--;
-
-  /* check if last value was removed */
-  if(node->values)
-    /* no, so return success */
-    return 0;
-  
-
-  /* yes - all values gone so need to delete entire key node */
+  if(slot->values_count == 1)
+    /* last value removed so delete the key */
+    librdf_hash_memory_free_slot(hash, table, i);
+  else
+    librdf_hash_memory_remove_value(hash, slot, j, entry);
 
-  if(!prev) {
-    /* is at start of list, so delete from there */
-    if(!(hash->nodes[bucket]=node->next))
-      /* hash bucket occupancy is one less if bucket is now empty */
-      hash->size--;
-    next=NULL;
-  } else
-    next=prev->next=node->next;
-  
-  /* free node */
-  librdf_free_hash_memory_node(node);
-  
-  /* see if there are remaining values for this key */
-  if(!next) {
-    /* no - so was last value for that key, reduce key count */
-    hash->keys--;
-  } else {
-    int found=0;
-    
-    node=next;
-    while(node) {
-      if(key->size == node->key_len && !memcmp(key, node->key, key->size)){
-        found=1;
-        break;
-      }
-      node=node->next;
-    }
-    
-    /* no further key values found - so was last value for that key */
-    if(!found)
-      hash->keys--;
-  }
+  librdf_hash_memory_arena_compact(hash);
 
   return 0;
 }
@@ -940,31 +1886,20 @@ static int
 librdf_hash_memory_delete_key(void* context, librdf_hash_datum *key) 
 {
   librdf_hash_memory_context* hash=(librdf_hash_memory_context*)context;
-  librdf_hash_memory_node *node, *prev;
-  int bucket;
+  librdf_hash_memory_table* table;
+  int i;
   
-  node=librdf_hash_memory_find_node(hash, 
-				    (char*)key->data, key->size,
-				    &bucket, &prev);
+  librdf_hash_memory_step(hash);
+
+  i=librdf_hash_memory_find_slot(hash, key->data, key->size, &table);
   /* not found anywhere */
-  if(!node)
+  if(i < 0)
     return 1;
 
-  /* search list from here */
-  if(!prev) {
-    /* is at start of list, so delete from there */
-    if(!(hash->nodes[bucket]=node->next))
-      /* hash bucket occupancy is one less if bucket is now empty */
-      hash->size--;
-  } else
-    prev->next=node->next;
+  librdf_hash_memory_free_slot(hash, table, i);
+
+  librdf_hash_memory_arena_compact(hash);
 
-  /* update hash counts */
-  hash->keys--;
-  hash->values-= node->values_count;
-  
-  /* free node */
-  librdf_free_hash_memory_node(node);
   return 0;
 }
 
@@ -1028,6 +1963,7 @@ librdf_hash_memory_register_factory(librdf_hash_factory *factory)
   factory->clone   = librdf_hash_memory_clone;
 
   factory->values_count = librdf_hash_memory_values_count;
+  factory->key_values_count = librdf_hash_memory_key_values_count;
 
   factory->put     = librdf_hash_memory_put;
   factory->exists  = librdf_hash_memory_exists;
@@ -1062,3 +1998,246 @@ librdf_init_hash_memory(librdf_world *world)
   librdf_hash_register_factory(world,
                                "memory", &librdf_hash_memory_register_factory);
 }
+
+
+
+
+/* TEST CODE */
+
+
+#ifdef STANDALONE
+
+/*
+ * Hash function benchmark: hashes the keys that the default hashes
+ * storage indexes would store for the statements in an RDF file (or
+ * generated ones) with each hash function, reporting the throughput
+ * and the linear probe lengths in a table at the default load factor.
+ *
+ *   rdf_hash_memory_bench [RDF-FILE [SYNTAX]]
+ */
+
+/* one more prototype */
+int main(int argc, char *argv[]);
+
+
+typedef struct {
+  unsigned char *data;
+  size_t size;
+} librdf_hash_memory_bench_key;
+
+
+static int
+librdf_hash_memory_bench_key_compare(const void *a, const void *b)
+{
+  const librdf_hash_memory_bench_key* ka=(const librdf_hash_memory_bench_key*)a;
+  const librdf_hash_memory_bench_key* kb=(const librdf_hash_memory_bench_key*)b;
+  size_t len=(ka->size < kb->size) ? ka->size : kb->size;
+  int rc=memcmp(ka->data, kb->data, len);
+
+  if(rc)
+    return rc;
+  return (ka->size < kb->size) ? -1 : (ka->size > kb->size);
+}
+
+
+/* key parts of the default sp2o, po2s and so2p indexes */
+static const librdf_statement_part librdf_hash_memory_bench_fields[]={
+  (librdf_statement_part)(LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_PREDICATE),
+  (librdf_statement_part)(LIBRDF_STATEMENT_PREDICATE|LIBRDF_STATEMENT_OBJECT),
+  (librdf_statement_part)(LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_OBJECT)
+};
+
+#define BENCH_GENERATED_STATEMENTS 100000
+#define BENCH_BYTES (256 * 1024 * 1024)
+
+
+int
+main(int argc, char *argv[]) 
+{
+  const char *program=librdf_basename((const char*)argv[0]);
+  librdf_world *world;
+  librdf_stream *stream=NULL;
+  librdf_parser *parser=NULL;
+  librdf_uri *uri=NULL;
+  librdf_hash_memory_bench_key *keys=NULL;
+  int keys_count=0;
+  int keys_size=0;
+  size_t total_bytes=0;
+  int statements_count=0;
+  int i;
+  int j;
+  int status=0;
+
+  world=librdf_new_world();
+  librdf_world_open(world);
+
+  if(argc > 1) {
+    const char *syntax=(argc > 2) ? argv[2] : 
+      librdf_parser_guess_name2(world, NULL, NULL, (const unsigned char*)argv[1]);
+
+    uri=librdf_new_uri_from_filename(world, argv[1]);
+    parser=librdf_new_parser(world, syntax, NULL, NULL);
+    if(!uri || !parser) {
+      fprintf(stderr, "%s: Failed to create parser for %s\n", program, argv[1]);
+      status=1;
+      goto tidy;
+    }
+    stream=librdf_parser_parse_as_stream(parser, uri, NULL);
+    if(!stream) {
+      fprintf(stderr, "%s: Failed to parse %s\n", program, argv[1]);
+      status=1;
+      goto tidy;
+    }
+  }
+
+  /* collect the encoded keys */
+  while(1) {
+    librdf_statement *statement;
+    librdf_statement *generated=NULL;
+
+    if(stream) {
+      if(librdf_stream_end(stream))
+        break;
+      statement=librdf_stream_get_object(stream);
+    } else {
+      char buffer[64];
+
+      if(statements_count == BENCH_GENERATED_STATEMENTS)
+        break;
+      generated=librdf_new_statement(world);
+      sprintf(buffer, "http://example.org/resource/%d", statements_count / 8);
+      librdf_statement_set_subject(generated, librdf_new_node_from_uri_string(world, (const unsigned char*)buffer));
+      sprintf(buffer, "http://example.org/vocabulary#property%d", statements_count % 20);
+      librdf_statement_set_predicate(generated, librdf_new_node_from_uri_string(world, (const unsigned char*)buffer));
+      sprintf(buffer, "value %d", statements_count);
+      librdf_statement_set_object(generated, librdf_new_node_from_literal(world, (const unsigned char*)buffer, NULL, 0));
+      statement=generated;
+    }
+
+    for(j=0; j < 3; j++) {
+      size_t size;
+
+      if(keys_count == keys_size) {
+        librdf_hash_memory_bench_key* new_keys;
+        
+        keys_size=keys_size ? keys_size * 2 : 1024;
+        new_keys=(librdf_hash_memory_bench_key*)LIBRDF_REALLOC(librdf_hash_memory_bench_key, keys, keys_size * sizeof(librdf_hash_memory_bench_key));
+        if(!new_keys) {
+          status=1;
+          goto tidy;
+        }
+        keys=new_keys;
+      }
+
+      size=librdf_statement_encode_parts2(world, statement, NULL, NULL, 0,
+                                          librdf_hash_memory_bench_fields[j]);
+      keys[keys_count].data=(unsigned char*)LIBRDF_MALLOC(cstring, size ? size : 1);
+      if(!keys[keys_count].data) {
+        status=1;
+        goto tidy;
+      }
+      keys[keys_count].size=librdf_statement_encode_parts2(world, statement,
+                                                           NULL,
+                                                           keys[keys_count].data,
+                                                           size,
+                                                           librdf_hash_memory_bench_fields[j]);
+      keys_count++;
+    }
+
+    statements_count++;
+    if(generated)
+      librdf_free_statement(generated);
+    else
+      librdf_stream_next(stream);
+  }
+
+  if(!keys_count) {
+    fprintf(stderr, "%s: No statements\n", program);
+    status=1;
+    goto tidy;
+  }
+
+  /* the tables hold distinct keys */
+  qsort(keys, keys_count, sizeof(librdf_hash_memory_bench_key),
+        librdf_hash_memory_bench_key_compare);
+  for(i=1, j=0; i < keys_count; i++) {
+    if(librdf_hash_memory_bench_key_compare(&keys[j], &keys[i]))
+      keys[++j]=keys[i];
+    else
+      LIBRDF_FREE(cstring, keys[i].data);
+  }
+  keys_count=j + 1;
+  for(i=0; i < keys_count; i++)
+    total_bytes+= keys[i].size;
+
+  fprintf(stdout, "%s: %d statements, %d distinct keys, mean key length %.1f bytes\n",
+          program, statements_count, keys_count,
+          (double)total_bytes / keys_count);
+
+  for(i=0; librdf_hash_memory_functions[i].name; i++) {
+    librdf_hash_memory_function hash_function=librdf_hash_memory_functions[i].function;
+    int rounds=(int)(BENCH_BYTES / total_bytes) + 1;
+    int capacity=librdf_hash_initial_capacity;
+    u32 mask;
+    u32 *tags;
+    u32 check=0;
+    long probes=0;
+    int max_probes=0;
+    clock_t start;
+    double seconds;
+    int round;
+
+    start=clock();
+    for(round=0; round < rounds; round++)
+      for(j=0; j < keys_count; j++)
+        check+= hash_function(keys[j].data, keys[j].size, (u32)round);
+    seconds=(double)(clock() - start) / CLOCKS_PER_SEC;
+
+    /* linear probing as in librdf_hash_memory_probe() */
+    while((double)keys_count >= (double)capacity * librdf_hash_default_load_factor / 1000)
+      capacity<<= 1;
+    mask=(u32)capacity - 1;
+    tags=(u32*)LIBRDF_CALLOC(u32, capacity, sizeof(u32));
+    if(!tags) {
+      status=1;
+      goto tidy;
+    }
+    for(j=0; j < keys_count; j++) {
+      u32 tag=hash_function(keys[j].data, keys[j].size, 0x5eed) | 2;
+      u32 k;
+      int n=1;
+
+      for(k=tag & mask; tags[k]; k=(k + 1) & mask)
+        n++;
+      tags[k]=tag;
+      probes+= n;
+      if(n > max_probes)
+        max_probes=n;
+    }
+    LIBRDF_FREE(u32, tags);
+
+    fprintf(stdout, "%s: %-14s %8.1f MB/s  mean probe %.3f  max probe %d  (check %08x)\n",
+            program, librdf_hash_memory_functions[i].name,
+            seconds > 0 ? (double)total_bytes * rounds / seconds / (1024 * 1024) : 0.0,
+            (double)probes / keys_count, max_probes, (unsigned int)check);
+  }
+
+  tidy:
+  if(keys) {
+    for(i=0; i < keys_count; i++)
+      LIBRDF_FREE(cstring, keys[i].data);
+    LIBRDF_FREE(librdf_hash_memory_bench_key, keys);
+  }
+  if(stream)
+    librdf_free_stream(stream);
+  if(parser)
+    librdf_free_parser(parser);
+  if(uri)
+    librdf_free_uri(uri);
+
+  librdf_free_world(world);
+
+  return status;
+}
+
+#endif
@@ -0,0 +1,1659 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_hash_mmap.c - RDF hash memory mapped snapshot implementation
+ *
+ * Copyright (C) 2000-2008, David Beckett http://www.dajobe.org/
+ * Copyright (C) 2000-2004, University of Bristol, UK http://www.bristol.ac.uk/
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h> /* for qsort() */
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h> /* for close(), unlink(), fsync() */
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include <redland.h>
+#include <rdf_types.h>
+
+
+/*
+ * The mmap hash keeps its pairs in a snapshot file that is mapped
+ * read only when the hash is opened, so a large hash is ready as soon
+ * as the file is mapped and its pages are read in by the system as
+ * lookups touch them.
+ *
+ * The snapshot holds only offsets from the start of the file, never
+ * pointers, so it can be mapped at any address.  It starts with a
+ * header, then for each key a record of the key bytes and the
+ * offsets of its values, sorted by value bytes so that one value is
+ * found by binary search, and ends with an open addressing table of
+ * key hash tags and record offsets.  Numbers are in host byte order
+ * and a snapshot written on a host of the other order is refused.
+ *
+ * Changes are never written into the map.  Added pairs go into a
+ * memory hash overlay and deleted snapshot pairs into a second memory
+ * hash; lookups and cursors see the snapshot minus the deletions plus
+ * the overlay.  Syncing or closing a changed writable hash writes a
+ * new compacted snapshot beside the old one, renames it into place
+ * and maps it in place of the overlay.  A pair in the snapshot is
+ * stored only once.
+ */
+
+#define LIBRDF_HASH_MMAP_MAGIC "RDFSNAP"
+#define LIBRDF_HASH_MMAP_VERSION 1
+#define LIBRDF_HASH_MMAP_BYTE_ORDER 0x01020304U
+
+/* records and values start at 8 byte boundaries */
+#define LIBRDF_HASH_MMAP_ALIGN(n) (((n) + 7) & ~(u64)7)
+
+/* snapshot table sizes - MUST BE POWER OF 2 */
+#define LIBRDF_HASH_MMAP_MIN_CAPACITY 8
+
+
+/* private structures, all laid out as in the snapshot file */
+typedef struct
+{
+  char magic[8];
+  u32 version;
+  /* LIBRDF_HASH_MMAP_BYTE_ORDER as stored by the writer */
+  u32 byte_order;
+  /* key hash seed */
+  u32 seed;
+  u32 reserved;
+  u64 keys;
+  u64 values;
+  /* number of table entries */
+  u64 capacity;
+  u64 table_offset;
+  /* file size */
+  u64 size;
+} librdf_hash_mmap_header;
+
+
+typedef struct
+{
+  /* key hash tag, 0 for an empty entry */
+  u32 tag;
+  u32 reserved;
+  /* offset of the key record */
+  u64 offset;
+} librdf_hash_mmap_entry;
+
+
+typedef struct
+{
+  u32 key_len;
+  u32 values_count;
+  /* key_len key bytes follow then values_count u64 value offsets at
+   * the next 8 byte boundary */
+} librdf_hash_mmap_record;
+
+#define LIBRDF_HASH_MMAP_RECORD_KEY(record) \
+  ((unsigned char*)(record) + sizeof(librdf_hash_mmap_record))
+#define LIBRDF_HASH_MMAP_RECORD_VALUES(record) \
+  ((u64*)((unsigned char*)(record) + \
+          LIBRDF_HASH_MMAP_ALIGN(sizeof(librdf_hash_mmap_record) + (record)->key_len)))
+
+
+typedef struct
+{
+  u32 size;
+  /* size value bytes follow */
+} librdf_hash_mmap_value_record;
+
+#define LIBRDF_HASH_MMAP_VALUE_DATA(value_record) \
+  ((unsigned char*)(value_record) + sizeof(librdf_hash_mmap_value_record))
+
+
+/* a value gathered for writing */
+typedef struct
+{
+  void *data;
+  size_t size;
+} librdf_hash_mmap_value;
+
+
+typedef struct
+{
+  /* the hash object */
+  librdf_hash* hash;
+  /* snapshot file name */
+  char *file_name;
+  int mode;
+  int is_writable;
+
+  /* snapshot file descriptor, the mapping and its size */
+  int fd;
+  unsigned char *map;
+  size_t map_size;
+  /* snapshot table of capacity entries inside the mapping */
+  librdf_hash_mmap_entry *table;
+  size_t capacity;
+  u32 seed;
+  /* number of snapshot keys */
+  u64 keys;
+
+  /* pairs added since the snapshot was written */
+  librdf_hash* overlay;
+  /* snapshot pairs deleted since it was written and how many */
+  librdf_hash* deletions;
+  int deleted;
+  /* this many values */
+  int values;
+  /* non 0 if the snapshot needs writing */
+  int is_dirty;
+
+  /* number of open cursors, the snapshot is not replaced while >0 */
+  int cursors;
+
+  /* values of one key being written */
+  librdf_hash_mmap_value *write_values;
+  size_t write_values_size;
+} librdf_hash_mmap_context;
+
+
+/* snapshot writer state */
+typedef struct
+{
+  FILE *fh;
+  u64 offset;
+  int failed;
+} librdf_hash_mmap_writer;
+
+
+/* prototypes for local functions */
+static u32 librdf_hash_mmap_tag(u32 seed, const void *key, size_t key_len);
+static int librdf_hash_mmap_compare(const void *data1, size_t size1, const void *data2, size_t size2);
+static int librdf_hash_mmap_compare_values(const void *a, const void *b);
+static librdf_hash_mmap_record* librdf_hash_mmap_find_key(librdf_hash_mmap_context* hash, const void *key, size_t key_len, size_t *entry_p);
+static librdf_hash_mmap_value_record* librdf_hash_mmap_get_value(librdf_hash_mmap_context* hash, librdf_hash_mmap_record* record, u32 i);
+static int librdf_hash_mmap_find_value(librdf_hash_mmap_context* hash, librdf_hash_mmap_record* record, const void *data, size_t size);
+static int librdf_hash_mmap_is_deleted(librdf_hash_mmap_context* hash, librdf_hash_mmap_record* record, librdf_hash_mmap_value_record* value_record);
+static int librdf_hash_mmap_key_values(librdf_hash_mmap_context* hash, librdf_hash_mmap_record* record);
+static int librdf_hash_mmap_new_overlay(librdf_hash_mmap_context* hash);
+static void librdf_hash_mmap_free_overlay(librdf_hash_mmap_context* hash);
+static int librdf_hash_mmap_map(librdf_hash_mmap_context* hash);
+static void librdf_hash_mmap_unmap(librdf_hash_mmap_context* hash);
+static void librdf_hash_mmap_emit(librdf_hash_mmap_writer* writer, const void *data, size_t size);
+static int librdf_hash_mmap_add_write_value(librdf_hash_mmap_context* hash, void *data, size_t size, size_t *count_p);
+static int librdf_hash_mmap_gather(librdf_hash_mmap_context* hash, librdf_hash_cursor* cursor, librdf_hash_datum *key, librdf_hash_mmap_record* record, size_t *count_p);
+static int librdf_hash_mmap_write_key(librdf_hash_mmap_context* hash, librdf_hash_mmap_writer* writer, librdf_hash_mmap_header* header, librdf_hash_mmap_entry* table, librdf_hash_datum *key, size_t count);
+static int librdf_hash_mmap_write(librdf_hash_mmap_context* hash);
+
+
+/* Implementing the hash cursor */
+static int librdf_hash_mmap_cursor_init(void *cursor_context, void *hash_context);
+static int librdf_hash_mmap_cursor_get(void* context, librdf_hash_datum* key, librdf_hash_datum* value, unsigned int flags);
+static void librdf_hash_mmap_cursor_finish(void* context);
+
+
+/* prototypes for local functions */
+static int librdf_hash_mmap_create(librdf_hash* new_hash, void* context);
+static int librdf_hash_mmap_destroy(void* context);
+static int librdf_hash_mmap_open(void* context, const char *identifier, int mode, int is_writable, int is_new, librdf_hash* options);
+static int librdf_hash_mmap_close(void* context);
+static int librdf_hash_mmap_clone(librdf_hash* new_hash, void *new_context, char *new_identifier, void* old_context);
+static int librdf_hash_mmap_values_count(void *context);
+static int librdf_hash_mmap_key_values_count(void *context, librdf_hash_datum *key);
+static int librdf_hash_mmap_put(void* context, librdf_hash_datum *key, librdf_hash_datum *data);
+static int librdf_hash_mmap_exists(void* context, librdf_hash_datum *key, librdf_hash_datum *value);
+static int librdf_hash_mmap_delete_key(void* context, librdf_hash_datum *key);
+static int librdf_hash_mmap_delete_key_value(void* context, librdf_hash_datum *key, librdf_hash_datum *value);
+static int librdf_hash_mmap_sync(void* context);
+static int librdf_hash_mmap_get_fd(void* context);
+
+static void librdf_hash_mmap_register_factory(librdf_hash_factory *factory);
+
+
+
+/* helper functions */
+
+
+/*
+ * librdf_hash_mmap_tag:
+ * @seed: snapshot seed
+ * @key: key bytes
+ * @key_len: key length
+ *
+ * INTERNAL - Get the snapshot table tag of a key
+ *
+ * Return value: hash tag, never 0
+ **/
+static u32
+librdf_hash_mmap_tag(u32 seed, const void *key, size_t key_len)
+{
+  u32 tag=librdf_hash_memory_murmur64(key, key_len, seed);
+
+  return tag ? tag : 1;
+}
+
+
+/*
+ * librdf_hash_mmap_compare:
+ * @data1: first bytes
+ * @size1: first length
+ * @data2: second bytes
+ * @size2: second length
+ *
+ * INTERNAL - Order two byte strings, a prefix first
+ *
+ * Return value: <0, 0 or >0 like memcmp()
+ **/
+static int
+librdf_hash_mmap_compare(const void *data1, size_t size1,
+                         const void *data2, size_t size2)
+{
+  size_t size=(size1 < size2) ? size1 : size2;
+  int rc=size ? memcmp(data1, data2, size) : 0;
+
+  if(rc)
+    return rc;
+  return (size1 > size2) - (size1 < size2);
+}
+
+
+static int
+librdf_hash_mmap_compare_values(const void *a, const void *b)
+{
+  const librdf_hash_mmap_value* value1=(const librdf_hash_mmap_value*)a;
+  const librdf_hash_mmap_value* value2=(const librdf_hash_mmap_value*)b;
+
+  return librdf_hash_mmap_compare(value1->data, value1->size,
+                                  value2->data, value2->size);
+}
+
+
+/*
+ * librdf_hash_mmap_find_key:
+ * @hash: the mmap hash context
+ * @key: key bytes
+ * @key_len: key length
+ * @entry_p: pointer to store the table entry index or NULL
+ *
+ * INTERNAL - Find the snapshot record of a key
+ *
+ * Return value: record or NULL if the key is not in the snapshot
+ **/
+static librdf_hash_mmap_record*
+librdf_hash_mmap_find_key(librdf_hash_mmap_context* hash,
+                          const void *key, size_t key_len, size_t *entry_p)
+{
+  u32 tag;
+  size_t mask;
+  size_t i;
+
+  if(!hash->map)
+    return NULL;
+
+  tag=librdf_hash_mmap_tag(hash->seed, key, key_len);
+  mask=hash->capacity - 1;
+  for(i=tag & mask; hash->table[i].tag; i=(i + 1) & mask) {
+    librdf_hash_mmap_record* record;
+
+    if(hash->table[i].tag != tag)
+      continue;
+
+    record=(librdf_hash_mmap_record*)(hash->map + hash->table[i].offset);
+    if(record->key_len == key_len &&
+       !memcmp(LIBRDF_HASH_MMAP_RECORD_KEY(record), key, key_len)) {
+      if(entry_p)
+        *entry_p=i;
+      return record;
+    }
+  }
+
+  return NULL;
+}
+
+
+/*
+ * librdf_hash_mmap_get_value:
+ * @hash: the mmap hash context
+ * @record: snapshot key record
+ * @i: value index
+ *
+ * INTERNAL - Get a value of a snapshot key
+ *
+ * Return value: value record
+ **/
+static librdf_hash_mmap_value_record*
+librdf_hash_mmap_get_value(librdf_hash_mmap_context* hash,
+                           librdf_hash_mmap_record* record, u32 i)
+{
+  return (librdf_hash_mmap_value_record*)(hash->map + LIBRDF_HASH_MMAP_RECORD_VALUES(record)[i]);
+}
+
+
+/*
+ * librdf_hash_mmap_find_value:
+ * @hash: the mmap hash context
+ * @record: snapshot key record
+ * @data: value bytes
+ * @size: value length
+ *
+ * INTERNAL - Binary search the sorted values of a snapshot key
+ *
+ * Return value: value index or <0 if the key does not have the value
+ **/
+static int
+librdf_hash_mmap_find_value(librdf_hash_mmap_context* hash,
+                            librdf_hash_mmap_record* record,
+                            const void *data, size_t size)
+{
+  u32 low=0;
+  u32 high=record->values_count;
+
+  while(low < high) {
+    u32 middle=low + (high - low) / 2;
+    librdf_hash_mmap_value_record* value_record;
+    int rc;
+
+    value_record=librdf_hash_mmap_get_value(hash, record, middle);
+    rc=librdf_hash_mmap_compare(LIBRDF_HASH_MMAP_VALUE_DATA(value_record),
+                                value_record->size, data, size);
+    if(!rc)
+      return (int)middle;
+    if(rc < 0)
+      low=middle + 1;
+    else
+      high=middle;
+  }
+
+  return -1;
+}
+
+
+/*
+ * librdf_hash_mmap_is_deleted:
+ * @hash: the mmap hash context
+ * @record: snapshot key record
+ * @value_record: snapshot value of that key
+ *
+ * INTERNAL - Test if a snapshot pair has been deleted
+ *
+ * Return value: non 0 if the pair is deleted
+ **/
+static int
+librdf_hash_mmap_is_deleted(librdf_hash_mmap_context* hash,
+                            librdf_hash_mmap_record* record,
+                            librdf_hash_mmap_value_record* value_record)
+{
+  librdf_hash_datum hd_key, hd_value; /* on stack */
+
+  if(!hash->deleted)
+    return 0;
+
+  hd_key.data=LIBRDF_HASH_MMAP_RECORD_KEY(record);
+  hd_key.size=record->key_len;
+  hd_value.data=LIBRDF_HASH_MMAP_VALUE_DATA(value_record);
+  hd_value.size=value_record->size;
+
+  return librdf_hash_exists(hash->deletions, &hd_key, &hd_value) > 0;
+}
+
+
+/*
+ * librdf_hash_mmap_key_values:
+ * @hash: the mmap hash context
+ * @record: snapshot key record or NULL
+ *
+ * INTERNAL - Count the snapshot values of a key that are not deleted
+ *
+ * Return value: number of values
+ **/
+static int
+librdf_hash_mmap_key_values(librdf_hash_mmap_context* hash,
+                            librdf_hash_mmap_record* record)
+{
+  librdf_hash_datum hd_key; /* on stack */
+  int count;
+
+  if(!record)
+    return 0;
+
+  count=(int)record->values_count;
+  if(hash->deleted) {
+    hd_key.data=LIBRDF_HASH_MMAP_RECORD_KEY(record);
+    hd_key.size=record->key_len;
+    count-= librdf_hash_key_values_count(hash->deletions, &hd_key);
+  }
+
+  return count;
+}
+
+
+/*
+ * librdf_hash_mmap_new_overlay:
+ * @hash: the mmap hash context
+ *
+ * INTERNAL - Make empty memory hashes for the changes to a snapshot
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_new_overlay(librdf_hash_mmap_context* hash)
+{
+  librdf_world* world=hash->hash->world;
+
+  hash->overlay=librdf_new_hash(world, "memory");
+  if(!hash->overlay || librdf_hash_open(hash->overlay, NULL, 0, 1, 1, NULL))
+    return 1;
+
+  hash->deletions=librdf_new_hash(world, "memory");
+  if(!hash->deletions || librdf_hash_open(hash->deletions, NULL, 0, 1, 1, NULL))
+    return 1;
+
+  hash->deleted=0;
+  return 0;
+}
+
+
+static void
+librdf_hash_mmap_free_overlay(librdf_hash_mmap_context* hash)
+{
+  if(hash->overlay) {
+    librdf_free_hash(hash->overlay);
+    hash->overlay=NULL;
+  }
+  if(hash->deletions) {
+    librdf_free_hash(hash->deletions);
+    hash->deletions=NULL;
+  }
+  hash->deleted=0;
+}
+
+
+/*
+ * librdf_hash_mmap_map:
+ * @hash: the mmap hash context
+ *
+ * INTERNAL - Map the snapshot file and check its header
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_map(librdf_hash_mmap_context* hash)
+{
+  librdf_world* world=hash->hash->world;
+  librdf_hash_mmap_header* header;
+  struct stat buf;
+  void *map;
+
+  hash->fd=open(hash->file_name, O_RDONLY);
+  if(hash->fd < 0) {
+    librdf_log(world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+               "Failed to open mmap hash file '%s' - %s", hash->file_name,
+               strerror(errno));
+    return 1;
+  }
+
+  if(fstat(hash->fd, &buf) ||
+     (size_t)buf.st_size < sizeof(librdf_hash_mmap_header) ||
+     (off_t)(size_t)buf.st_size != buf.st_size) {
+    librdf_log(world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+               "mmap hash file '%s' is not a snapshot", hash->file_name);
+    return 1;
+  }
+
+  map=mmap(NULL, (size_t)buf.st_size, PROT_READ, MAP_SHARED, hash->fd, 0);
+  if(map == MAP_FAILED) {
+    librdf_log(world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+               "Failed to map mmap hash file '%s' - %s", hash->file_name,
+               strerror(errno));
+    return 1;
+  }
+  hash->map=(unsigned char*)map;
+  hash->map_size=(size_t)buf.st_size;
+
+  header=(librdf_hash_mmap_header*)hash->map;
+  if(memcmp(header->magic, LIBRDF_HASH_MMAP_MAGIC, sizeof(LIBRDF_HASH_MMAP_MAGIC)) ||
+     header->version != LIBRDF_HASH_MMAP_VERSION ||
+     header->byte_order != LIBRDF_HASH_MMAP_BYTE_ORDER ||
+     header->size != (u64)hash->map_size ||
+     header->capacity < LIBRDF_HASH_MMAP_MIN_CAPACITY ||
+     (header->capacity & (header->capacity - 1)) ||
+     header->table_offset > header->size ||
+     header->capacity > (header->size - header->table_offset) / sizeof(librdf_hash_mmap_entry)) {
+    librdf_log(world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+               "mmap hash file '%s' is not a snapshot of this version and byte order",
+               hash->file_name);
+    return 1;
+  }
+
+  hash->table=(librdf_hash_mmap_entry*)(hash->map + header->table_offset);
+  hash->capacity=(size_t)header->capacity;
+  hash->seed=header->seed;
+  hash->keys=header->keys;
+  hash->values=(int)header->values;
+
+  return 0;
+}
+
+
+static void
+librdf_hash_mmap_unmap(librdf_hash_mmap_context* hash)
+{
+  if(hash->map) {
+    munmap((void*)hash->map, hash->map_size);
+    hash->map=NULL;
+    hash->map_size=0;
+  }
+  hash->table=NULL;
+  hash->capacity=0;
+  hash->keys=0;
+
+  if(hash->fd >= 0) {
+    close(hash->fd);
+    hash->fd= -1;
+  }
+}
+
+
+/*
+ * librdf_hash_mmap_emit:
+ * @writer: snapshot writer
+ * @data: bytes or NULL for zeros
+ * @size: number of bytes
+ *
+ * INTERNAL - Write bytes to a snapshot
+ *
+ * Failures are remembered in the writer.
+ **/
+static void
+librdf_hash_mmap_emit(librdf_hash_mmap_writer* writer,
+                      const void *data, size_t size)
+{
+  static const unsigned char zeros[8]={0, 0, 0, 0, 0, 0, 0, 0};
+
+  if(!size || writer->failed)
+    return;
+
+  if(!data) {
+    /* only used to pad to the next 8 byte boundary */
+    if(fwrite(zeros, 1, size, writer->fh) != size)
+      writer->failed=1;
+  } else if(fwrite(data, 1, size, writer->fh) != size)
+    writer->failed=1;
+
+  writer->offset+= size;
+}
+
+
+/*
+ * librdf_hash_mmap_add_write_value:
+ * @hash: the mmap hash context
+ * @data: value bytes
+ * @size: value length
+ * @count_p: pointer to the number of values gathered
+ *
+ * INTERNAL - Add a value to those of the key being written
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_add_write_value(librdf_hash_mmap_context* hash,
+                                 void *data, size_t size, size_t *count_p)
+{
+  if(*count_p == hash->write_values_size) {
+    librdf_hash_mmap_value* new_values;
+    size_t new_size=hash->write_values_size ? 2 * hash->write_values_size : 64;
+
+    new_values=(librdf_hash_mmap_value*)LIBRDF_REALLOC(librdf_hash_mmap_value,
+                                                       hash->write_values,
+                                                       new_size * sizeof(librdf_hash_mmap_value));
+    if(!new_values)
+      return 1;
+    hash->write_values=new_values;
+    hash->write_values_size=new_size;
+  }
+
+  hash->write_values[*count_p].data=data;
+  hash->write_values[*count_p].size=size;
+  (*count_p)++;
+  return 0;
+}
+
+
+/*
+ * librdf_hash_mmap_gather:
+ * @hash: the mmap hash context
+ * @cursor: overlay cursor
+ * @key: key
+ * @record: snapshot record of the key or NULL
+ * @count_p: pointer to store the number of values
+ *
+ * INTERNAL - Gather the sorted distinct values of a key for writing
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_gather(librdf_hash_mmap_context* hash,
+                        librdf_hash_cursor* cursor, librdf_hash_datum *key,
+                        librdf_hash_mmap_record* record, size_t *count_p)
+{
+  librdf_hash_datum hd_key, hd_value; /* on stack */
+  size_t count=0;
+  size_t i, j;
+  u32 k;
+  int status;
+
+  if(record) {
+    for(k=0; k < record->values_count; k++) {
+      librdf_hash_mmap_value_record* value_record;
+
+      value_record=librdf_hash_mmap_get_value(hash, record, k);
+      if(librdf_hash_mmap_is_deleted(hash, record, value_record))
+        continue;
+      if(librdf_hash_mmap_add_write_value(hash,
+                                          LIBRDF_HASH_MMAP_VALUE_DATA(value_record),
+                                          value_record->size, &count))
+        return 1;
+    }
+  }
+
+  hd_key.data=key->data;
+  hd_key.size=key->size;
+  status=librdf_hash_cursor_set(cursor, &hd_key, &hd_value);
+  while(!status) {
+    if(librdf_hash_mmap_add_write_value(hash, hd_value.data, hd_value.size,
+                                        &count))
+      return 1;
+    status=librdf_hash_cursor_get_next_value(cursor, &hd_key, &hd_value);
+  }
+
+  if(count > 1) {
+    qsort(hash->write_values, count, sizeof(librdf_hash_mmap_value),
+          librdf_hash_mmap_compare_values);
+    for(i=1, j=1; i < count; i++)
+      if(librdf_hash_mmap_compare_values(&hash->write_values[i],
+                                         &hash->write_values[j - 1]))
+        hash->write_values[j++]=hash->write_values[i];
+    count=j;
+  }
+
+  *count_p=count;
+  return 0;
+}
+
+
+/*
+ * librdf_hash_mmap_write_key:
+ * @hash: the mmap hash context
+ * @writer: snapshot writer
+ * @header: header of the snapshot being written
+ * @table: table of the snapshot being written
+ * @key: key
+ * @count: number of gathered values
+ *
+ * INTERNAL - Write the record and values of a key to a snapshot
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_write_key(librdf_hash_mmap_context* hash,
+                           librdf_hash_mmap_writer* writer,
+                           librdf_hash_mmap_header* header,
+                           librdf_hash_mmap_entry* table,
+                           librdf_hash_datum *key, size_t count)
+{
+  librdf_hash_mmap_record record;
+  u64 record_offset=writer->offset;
+  u64 value_offset;
+  u64 mask;
+  u64 i;
+  size_t j;
+  u32 tag;
+
+  if(!count)
+    return 0;
+
+  if(key->size > 0xffffffffU || count > 0xffffffffU)
+    return 1;
+
+  record.key_len=(u32)key->size;
+  record.values_count=(u32)count;
+  librdf_hash_mmap_emit(writer, &record, sizeof(record));
+  librdf_hash_mmap_emit(writer, key->data, key->size);
+  librdf_hash_mmap_emit(writer, NULL,
+                        (size_t)(LIBRDF_HASH_MMAP_ALIGN(writer->offset) - writer->offset));
+
+  value_offset=writer->offset + count * sizeof(u64);
+  for(j=0; j < count; j++) {
+    librdf_hash_mmap_emit(writer, &value_offset, sizeof(value_offset));
+    value_offset+= LIBRDF_HASH_MMAP_ALIGN(sizeof(librdf_hash_mmap_value_record) +
+                                          hash->write_values[j].size);
+  }
+
+  for(j=0; j < count; j++) {
+    librdf_hash_mmap_value_record value_record;
+
+    if(hash->write_values[j].size > 0xffffffffU)
+      return 1;
+    value_record.size=(u32)hash->write_values[j].size;
+    librdf_hash_mmap_emit(writer, &value_record, sizeof(value_record));
+    librdf_hash_mmap_emit(writer, hash->write_values[j].data,
+                          hash->write_values[j].size);
+    librdf_hash_mmap_emit(writer, NULL,
+                          (size_t)(LIBRDF_HASH_MMAP_ALIGN(writer->offset) - writer->offset));
+  }
+
+  tag=librdf_hash_mmap_tag(header->seed, key->data, key->size);
+  mask=header->capacity - 1;
+  for(i=tag & mask; table[i].tag; i=(i + 1) & mask)
+    ;
+  table[i].tag=tag;
+  table[i].offset=record_offset;
+
+  header->keys++;
+  header->values+= count;
+
+  return writer->failed;
+}
+
+
+/*
+ * librdf_hash_mmap_write:
+ * @hash: the mmap hash context
+ *
+ * INTERNAL - Write a new snapshot and map it
+ *
+ * The visible pairs are written to a new file which is renamed over
+ * the old snapshot, then the overlay is emptied.  On failure the hash
+ * is unchanged.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_write(librdf_hash_mmap_context* hash)
+{
+  librdf_world* world=hash->hash->world;
+  librdf_hash_mmap_header header;
+  librdf_hash_mmap_entry* table=NULL;
+  librdf_hash_mmap_writer writer;
+  librdf_hash_cursor* keys_cursor=NULL;
+  librdf_hash_cursor* values_cursor=NULL;
+  librdf_hash_datum hd_key; /* on stack */
+  char *new_file_name;
+  u64 max_keys;
+  size_t i;
+  size_t count;
+  int fd;
+  int status=1;
+
+  new_file_name=(char*)LIBRDF_MALLOC(cstring, strlen(hash->file_name) + 5);
+  if(!new_file_name)
+    return 1;
+  sprintf(new_file_name, "%s.new", hash->file_name);
+
+  /* the overlay has at most one key per value */
+  max_keys=hash->keys + (u64)librdf_hash_values_count(hash->overlay);
+
+  memset(&header, '\0', sizeof(header));
+  memcpy(header.magic, LIBRDF_HASH_MMAP_MAGIC, sizeof(LIBRDF_HASH_MMAP_MAGIC));
+  header.version=LIBRDF_HASH_MMAP_VERSION;
+  header.byte_order=LIBRDF_HASH_MMAP_BYTE_ORDER;
+  header.seed=hash->map ? hash->seed : librdf_hash_memory_murmur64(&hash, sizeof(hash),
+                                                                   (u32)time(NULL));
+  header.capacity=LIBRDF_HASH_MMAP_MIN_CAPACITY;
+  while(header.capacity < 2 * max_keys)
+    header.capacity<<= 1;
+
+  if((u64)(size_t)header.capacity != header.capacity)
+    goto tidy;
+  table=(librdf_hash_mmap_entry*)LIBRDF_CALLOC(librdf_hash_mmap_entry,
+                                               (size_t)header.capacity,
+                                               sizeof(librdf_hash_mmap_entry));
+  keys_cursor=librdf_new_hash_cursor(hash->overlay);
+  values_cursor=librdf_new_hash_cursor(hash->overlay);
+  if(!table || !keys_cursor || !values_cursor)
+    goto tidy;
+
+  fd=open(new_file_name, O_WRONLY | O_CREAT | O_TRUNC,
+          hash->mode ? hash->mode : 0644);
+  writer.fh=(fd < 0) ? NULL : fdopen(fd, "wb");
+  writer.offset=0;
+  writer.failed=0;
+  if(!writer.fh) {
+    if(fd >= 0)
+      close(fd);
+    librdf_log(world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+               "Failed to create mmap hash file '%s' - %s", new_file_name,
+               strerror(errno));
+    goto tidy;
+  }
+  librdf_hash_mmap_emit(&writer, &header, sizeof(header));
+
+  /* keys in the snapshot with their overlay values */
+  for(i=0; i < hash->capacity; i++) {
+    librdf_hash_mmap_record* record;
+
+    if(!hash->table[i].tag)
+      continue;
+    record=(librdf_hash_mmap_record*)(hash->map + hash->table[i].offset);
+    hd_key.data=LIBRDF_HASH_MMAP_RECORD_KEY(record);
+    hd_key.size=record->key_len;
+    if(librdf_hash_mmap_gather(hash, values_cursor, &hd_key, record, &count) ||
+       librdf_hash_mmap_write_key(hash, &writer, &header, table, &hd_key, count))
+      goto failed;
+  }
+
+  /* keys only in the overlay */
+  hd_key.data=NULL;
+  status=librdf_hash_cursor_get_first(keys_cursor, &hd_key, NULL);
+  while(!status) {
+    if(!librdf_hash_mmap_find_key(hash, hd_key.data, hd_key.size, NULL)) {
+      if(librdf_hash_mmap_gather(hash, values_cursor, &hd_key, NULL, &count) ||
+         librdf_hash_mmap_write_key(hash, &writer, &header, table, &hd_key, count))
+        goto failed;
+    }
+    status=librdf_hash_cursor_get_next(keys_cursor, &hd_key, NULL);
+  }
+
+  header.table_offset=writer.offset;
+  librdf_hash_mmap_emit(&writer, table,
+                        (size_t)header.capacity * sizeof(librdf_hash_mmap_entry));
+  header.size=writer.offset;
+
+  if(writer.failed || fseek(writer.fh, 0L, SEEK_SET))
+    goto failed;
+  librdf_hash_mmap_emit(&writer, &header, sizeof(header));
+  if(writer.failed || fflush(writer.fh))
+    goto failed;
+#ifdef HAVE_FSYNC
+  /* the new file must be complete before it replaces the old one */
+  if(fsync(fileno(writer.fh)))
+    goto failed;
+#endif
+  if(fclose(writer.fh)) {
+    writer.fh=NULL;
+    goto failed;
+  }
+  writer.fh=NULL;
+
+  if(rename(new_file_name, hash->file_name))
+    goto failed;
+
+  /* the cursors are over the overlay being replaced */
+  librdf_free_hash_cursor(values_cursor);
+  values_cursor=NULL;
+  librdf_free_hash_cursor(keys_cursor);
+  keys_cursor=NULL;
+
+  librdf_hash_mmap_unmap(hash);
+  librdf_hash_mmap_free_overlay(hash);
+  hash->values=0;
+  hash->is_dirty=0;
+  status=librdf_hash_mmap_new_overlay(hash) || librdf_hash_mmap_map(hash);
+  goto tidy;
+
+  failed:
+  librdf_log(world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+             "Failed to write mmap hash file '%s'", new_file_name);
+  if(writer.fh)
+    fclose(writer.fh);
+  unlink(new_file_name);
+  status=1;
+
+  tidy:
+  if(values_cursor)
+    librdf_free_hash_cursor(values_cursor);
+  if(keys_cursor)
+    librdf_free_hash_cursor(keys_cursor);
+  if(table)
+    LIBRDF_FREE(librdf_hash_mmap_entry, table);
+  LIBRDF_FREE(cstring, new_file_name);
+
+  return status;
+}
+
+
+
+/* functions implementing the API */
+
+/**
+ * librdf_hash_mmap_create:
+ * @hash: #librdf_hash hash
+ * @context: mmap hash context
+ *
+ * Create a new mmap hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_create(librdf_hash* hash, void* context)
+{
+  librdf_hash_mmap_context* hcontext=(librdf_hash_mmap_context*)context;
+
+  hcontext->hash=hash;
+  hcontext->fd= -1;
+  return 0;
+}
+
+
+/**
+ * librdf_hash_mmap_destroy:
+ * @context: mmap hash context
+ *
+ * Destroy a mmap hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_destroy(void* context)
+{
+  librdf_hash_mmap_context* hcontext=(librdf_hash_mmap_context*)context;
+
+  librdf_hash_mmap_unmap(hcontext);
+  librdf_hash_mmap_free_overlay(hcontext);
+
+  if(hcontext->file_name) {
+    LIBRDF_FREE(cstring, hcontext->file_name);
+    hcontext->file_name=NULL;
+  }
+  if(hcontext->write_values) {
+    LIBRDF_FREE(librdf_hash_mmap_value, hcontext->write_values);
+    hcontext->write_values=NULL;
+    hcontext->write_values_size=0;
+  }
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_mmap_open:
+ * @context: mmap hash context
+ * @identifier: filename to use for the snapshot, with .mmap appended
+ * @mode: file creation mode
+ * @is_writable: is hash writable?
+ * @is_new: is hash new?
+ * @options: #librdf_hash of options - not used
+ *
+ * Open and maybe create a new mmap hash.
+ *
+ * A new or missing snapshot is written empty straight away.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_open(void* context, const char *identifier,
+                      int mode, int is_writable, int is_new,
+                      librdf_hash* options)
+{
+  librdf_hash_mmap_context* hash=(librdf_hash_mmap_context*)context;
+  struct stat buf;
+
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(identifier, cstring, 1);
+
+  hash->mode=mode;
+  hash->is_writable=is_writable;
+
+  hash->file_name=(char*)LIBRDF_MALLOC(cstring, strlen(identifier) + 6);
+  if(!hash->file_name)
+    return 1;
+  sprintf(hash->file_name, "%s.mmap", identifier);
+
+  if(librdf_hash_mmap_new_overlay(hash))
+    return 1;
+
+  if(is_writable && (is_new || stat(hash->file_name, &buf))) {
+    /* writes an empty snapshot and maps it */
+    return librdf_hash_mmap_write(hash);
+  }
+
+  return librdf_hash_mmap_map(hash);
+}
+
+
+/**
+ * librdf_hash_mmap_close:
+ * @context: mmap hash context
+ *
+ * Close the hash, writing a new snapshot if it was changed.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_close(void* context)
+{
+  librdf_hash_mmap_context* hash=(librdf_hash_mmap_context*)context;
+  int status=0;
+
+  if(hash->is_writable && hash->is_dirty)
+    status=librdf_hash_mmap_write(hash);
+
+  librdf_hash_mmap_destroy(hash);
+
+  return status;
+}
+
+
+static int
+librdf_hash_mmap_clone(librdf_hash *hash, void* context, char *new_identifier,
+                       void *old_context)
+{
+  librdf_hash_mmap_context* hcontext=(librdf_hash_mmap_context*)context;
+  librdf_hash_mmap_context* old_hcontext=(librdf_hash_mmap_context*)old_context;
+  librdf_hash_datum *key, *value;
+  librdf_iterator *iterator;
+  int status=0;
+
+  /* copy data fields that might change */
+  hcontext->hash=hash;
+
+  if(librdf_hash_mmap_open(context, new_identifier,
+                           old_hcontext->mode, 1, 1, NULL))
+    return 1;
+
+  /* Use higher level functions to iterator this data
+   * on the other hand, maybe this is a good idea since that
+   * code is tested and works
+   */
+
+  key=librdf_new_hash_datum(hash->world, NULL, 0);
+  value=librdf_new_hash_datum(hash->world, NULL, 0);
+
+  iterator=librdf_hash_get_all(old_hcontext->hash, key, value);
+  while(!librdf_iterator_end(iterator)) {
+    librdf_hash_datum* k= (librdf_hash_datum*)librdf_iterator_get_key(iterator);
+    librdf_hash_datum* v= (librdf_hash_datum*)librdf_iterator_get_value(iterator);
+
+    if(librdf_hash_mmap_put(hcontext, k, v)) {
+      status=1;
+      break;
+    }
+    librdf_iterator_next(iterator);
+  }
+  if(iterator)
+    librdf_free_iterator(iterator);
+
+  librdf_free_hash_datum(value);
+  librdf_free_hash_datum(key);
+
+  hcontext->is_writable=old_hcontext->is_writable;
+
+  return status;
+}
+
+
+/**
+ * librdf_hash_mmap_values_count:
+ * @context: mmap hash context
+ *
+ * Get the number of values in the hash.
+ *
+ * Return value: number of values in the hash or <0 on failure
+ **/
+static int
+librdf_hash_mmap_values_count(void *context)
+{
+  librdf_hash_mmap_context* hash=(librdf_hash_mmap_context*)context;
+
+  return hash->values;
+}
+
+
+/**
+ * librdf_hash_mmap_key_values_count:
+ * @context: mmap hash context
+ * @key: pointer to key
+ *
+ * Get the number of values of one key in the hash.
+ *
+ * Return value: number of values of the key
+ **/
+static int
+librdf_hash_mmap_key_values_count(void *context, librdf_hash_datum *key)
+{
+  librdf_hash_mmap_context* hash=(librdf_hash_mmap_context*)context;
+  librdf_hash_mmap_record* record;
+
+  record=librdf_hash_mmap_find_key(hash, key->data, key->size, NULL);
+  return librdf_hash_mmap_key_values(hash, record) +
+         librdf_hash_key_values_count(hash->overlay, key);
+}
+
+
+
+/*
+ * The cursor walks the snapshot table entries then the overlay with
+ * an overlay cursor, skipping deleted snapshot pairs.  The snapshot
+ * is not replaced while a cursor is open.
+ */
+typedef struct {
+  librdf_hash_mmap_context* hash;
+  /* non 0 once the walk has reached the overlay */
+  int in_overlay;
+  /* non 0 once the overlay cursor has returned a key */
+  int overlay_started;
+  /* snapshot table entry of the current key */
+  size_t current_entry;
+  /* index of the next snapshot value of that key */
+  u32 current_value;
+  librdf_hash_cursor* overlay_cursor;
+  /* key prefix for SET_RANGE / NEXT_RANGE */
+  void *range_key;
+  size_t range_key_len;
+} librdf_hash_mmap_cursor_context;
+
+
+
+/**
+ * librdf_hash_mmap_cursor_init:
+ * @cursor_context: hash cursor context
+ * @hash_context: hash to operate over
+ *
+ * Initialise a new hash cursor.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_cursor_init(void *cursor_context, void *hash_context)
+{
+  librdf_hash_mmap_cursor_context *cursor=(librdf_hash_mmap_cursor_context*)cursor_context;
+
+  cursor->hash=(librdf_hash_mmap_context*)hash_context;
+  cursor->overlay_cursor=librdf_new_hash_cursor(cursor->hash->overlay);
+  if(!cursor->overlay_cursor)
+    return 1;
+  cursor->hash->cursors++;
+  return 0;
+}
+
+
+/**
+ * librdf_hash_mmap_cursor_get:
+ * @context: mmap hash cursor context
+ * @key: pointer to key to use
+ * @value: pointer to value to use
+ * @flags: flags
+ *
+ * Retrieve a hash value for the given key.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_cursor_get(void* context,
+                            librdf_hash_datum *key,
+                            librdf_hash_datum *value,
+                            unsigned int flags)
+{
+  librdf_hash_mmap_cursor_context *cursor=(librdf_hash_mmap_cursor_context*)context;
+  librdf_hash_mmap_context* hash=cursor->hash;
+  librdf_hash_mmap_record* record;
+  librdf_hash_mmap_value_record* value_record;
+  librdf_hash_datum hd_key; /* on stack */
+  int status;
+
+  if(flags == LIBRDF_HASH_CURSOR_SET_RANGE ||
+     flags == LIBRDF_HASH_CURSOR_NEXT_RANGE) {
+    /* Keys are not ordered so walk all pairs from the start and skip
+     * those with keys not starting with the prefix */
+    if(flags == LIBRDF_HASH_CURSOR_SET_RANGE) {
+      if(cursor->range_key)
+        LIBRDF_FREE(cstring, cursor->range_key);
+      cursor->range_key=LIBRDF_MALLOC(cstring, key->size ? key->size : 1);
+      if(!cursor->range_key)
+        return 1;
+      memcpy(cursor->range_key, key->data, key->size);
+      cursor->range_key_len=key->size;
+      flags=LIBRDF_HASH_CURSOR_FIRST;
+    } else {
+      if(!cursor->range_key)
+        return 1;
+      flags=LIBRDF_HASH_CURSOR_NEXT;
+    }
+
+    while(1) {
+      key->data=NULL;
+      if(librdf_hash_mmap_cursor_get(context, key, value, flags))
+        return 1;
+      if(key->size >= cursor->range_key_len &&
+         !memcmp(key->data, cursor->range_key, cursor->range_key_len))
+        return 0;
+      flags=LIBRDF_HASH_CURSOR_NEXT;
+    }
+  }
+
+  switch(flags) {
+    case LIBRDF_HASH_CURSOR_SET:
+      if(!key || !key->data)
+        return 1;
+      record=librdf_hash_mmap_find_key(hash, key->data, key->size,
+                                       &cursor->current_entry);
+      if(!record) {
+        cursor->in_overlay=1;
+        return librdf_hash_cursor_set(cursor->overlay_cursor, key, value);
+      }
+      cursor->in_overlay=0;
+      cursor->current_value=0;
+      break;
+
+    case LIBRDF_HASH_CURSOR_FIRST:
+      cursor->in_overlay=0;
+      cursor->overlay_started=0;
+      cursor->current_entry=0;
+      cursor->current_value=0;
+      break;
+
+    case LIBRDF_HASH_CURSOR_NEXT_VALUE:
+    case LIBRDF_HASH_CURSOR_NEXT:
+      break;
+
+    default:
+      librdf_log(hash->hash->world,
+                 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+                 "Unknown hash method flag %d", flags);
+      return 1;
+  }
+
+
+  if(flags == LIBRDF_HASH_CURSOR_SET ||
+     flags == LIBRDF_HASH_CURSOR_NEXT_VALUE) {
+    if(cursor->in_overlay)
+      return librdf_hash_cursor_get_next_value(cursor->overlay_cursor,
+                                               key, value);
+
+    record=(librdf_hash_mmap_record*)(hash->map + hash->table[cursor->current_entry].offset);
+    while(cursor->current_value < record->values_count) {
+      value_record=librdf_hash_mmap_get_value(hash, record,
+                                              cursor->current_value++);
+      if(!librdf_hash_mmap_is_deleted(hash, record, value_record)) {
+        value->data=LIBRDF_HASH_MMAP_VALUE_DATA(value_record);
+        value->size=value_record->size;
+        return 0;
+      }
+    }
+
+    /* then the values added to the overlay */
+    cursor->in_overlay=1;
+    hd_key.data=LIBRDF_HASH_MMAP_RECORD_KEY(record);
+    hd_key.size=record->key_len;
+    return librdf_hash_cursor_set(cursor->overlay_cursor, &hd_key, value);
+  }
+
+
+  /* LIBRDF_HASH_CURSOR_FIRST or LIBRDF_HASH_CURSOR_NEXT */
+  while(!cursor->in_overlay) {
+    if(cursor->current_entry >= hash->capacity) {
+      cursor->in_overlay=1;
+      break;
+    }
+
+    if(!hash->table[cursor->current_entry].tag) {
+      cursor->current_entry++;
+      continue;
+    }
+
+    record=(librdf_hash_mmap_record*)(hash->map + hash->table[cursor->current_entry].offset);
+    while(cursor->current_value < record->values_count) {
+      value_record=librdf_hash_mmap_get_value(hash, record,
+                                              cursor->current_value++);
+      if(librdf_hash_mmap_is_deleted(hash, record, value_record))
+        continue;
+
+      key->data=LIBRDF_HASH_MMAP_RECORD_KEY(record);
+      key->size=record->key_len;
+      if(value) {
+        value->data=LIBRDF_HASH_MMAP_VALUE_DATA(value_record);
+        value->size=value_record->size;
+      } else
+        /* keys only - move to the next key */
+        cursor->current_value=record->values_count;
+      return 0;
+    }
+
+    cursor->current_entry++;
+    cursor->current_value=0;
+  }
+
+  while(1) {
+    if(cursor->overlay_started)
+      status=librdf_hash_cursor_get_next(cursor->overlay_cursor, key, value);
+    else
+      status=librdf_hash_cursor_get_first(cursor->overlay_cursor, key, value);
+    cursor->overlay_started=1;
+    if(status)
+      return status;
+
+    /* keys only - skip those already returned from the snapshot */
+    if(!value &&
+       librdf_hash_mmap_key_values(hash, librdf_hash_mmap_find_key(hash, key->data, key->size, NULL)))
+      continue;
+
+    return 0;
+  }
+}
+
+
+/**
+ * librdf_hash_mmap_cursor_finished:
+ * @context: hash mmap get iterator context
+ *
+ * Finish the serialisation of the hash mmap get.
+ *
+ **/
+static void
+librdf_hash_mmap_cursor_finish(void* context)
+{
+  librdf_hash_mmap_cursor_context *cursor=(librdf_hash_mmap_cursor_context*)context;
+
+  if(cursor->range_key)
+    LIBRDF_FREE(cstring, cursor->range_key);
+
+  if(cursor->overlay_cursor) {
+    librdf_free_hash_cursor(cursor->overlay_cursor);
+    cursor->hash->cursors--;
+  }
+}
+
+
+/**
+ * librdf_hash_mmap_put:
+ * @context: mmap hash context
+ * @key: pointer to key to store
+ * @value: pointer to value to store
+ *
+ * - Store a key/value pair in the hash.
+ *
+ * A deleted snapshot pair is restored, other pairs go in the overlay.
+ * A pair that is already stored is not added again.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_put(void* context, librdf_hash_datum *key,
+                     librdf_hash_datum *value)
+{
+  librdf_hash_mmap_context* hash=(librdf_hash_mmap_context*)context;
+  librdf_hash_mmap_record* record;
+  int i= -1;
+
+  if(!hash->is_writable)
+    return 1;
+
+  record=librdf_hash_mmap_find_key(hash, key->data, key->size, NULL);
+  if(record)
+    i=librdf_hash_mmap_find_value(hash, record, value->data, value->size);
+
+  if(i >= 0) {
+    /* already stored */
+    if(!librdf_hash_mmap_is_deleted(hash, record, librdf_hash_mmap_get_value(hash, record, (u32)i)))
+      return 0;
+
+    if(librdf_hash_delete(hash->deletions, key, value))
+      return 1;
+    hash->deleted--;
+  } else {
+    int status=librdf_hash_exists(hash->overlay, key, value);
+
+    /* already stored */
+    if(status > 0)
+      return 0;
+
+    if(status < 0 || librdf_hash_put(hash->overlay, key, value))
+      return 1;
+  }
+
+  hash->values++;
+  hash->is_dirty=1;
+  return 0;
+}
+
+
+/**
+ * librdf_hash_mmap_exists:
+ * @context: mmap hash context
+ * @key: key
+ * @value: value
+ *
+ * Test the existence of a key in the hash.
+ *
+ * Return value: >0 if the key/value exists in the hash, 0 if not, <0 on failure
+ **/
+static int
+librdf_hash_mmap_exists(void* context,
+                        librdf_hash_datum *key, librdf_hash_datum *value)
+{
+  librdf_hash_mmap_context* hash=(librdf_hash_mmap_context*)context;
+  librdf_hash_mmap_record* record;
+  int i;
+
+  record=librdf_hash_mmap_find_key(hash, key->data, key->size, NULL);
+  if(record) {
+    if(!value) {
+      if(librdf_hash_mmap_key_values(hash, record))
+        return 1;
+    } else {
+      i=librdf_hash_mmap_find_value(hash, record, value->data, value->size);
+      if(i >= 0 &&
+         !librdf_hash_mmap_is_deleted(hash, record, librdf_hash_mmap_get_value(hash, record, (u32)i)))
+        return 1;
+    }
+  }
+
+  return librdf_hash_exists(hash->overlay, key, value);
+}
+
+
+/**
+ * librdf_hash_mmap_delete_key_value:
+ * @context: mmap hash context
+ * @key: pointer to key to delete
+ * @value: pointer to value to delete
+ *
+ * - Delete a key/value pair from the hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_delete_key_value(void* context, librdf_hash_datum *key,
+                                  librdf_hash_datum *value)
+{
+  librdf_hash_mmap_context* hash=(librdf_hash_mmap_context*)context;
+  librdf_hash_mmap_record* record;
+  int i;
+
+  if(!hash->is_writable)
+    return 1;
+
+  if(librdf_hash_delete(hash->overlay, key, value)) {
+    record=librdf_hash_mmap_find_key(hash, key->data, key->size, NULL);
+    if(!record)
+      return 1;
+    i=librdf_hash_mmap_find_value(hash, record, value->data, value->size);
+    if(i < 0 ||
+       librdf_hash_mmap_is_deleted(hash, record, librdf_hash_mmap_get_value(hash, record, (u32)i)))
+      return 1;
+
+    if(librdf_hash_put(hash->deletions, key, value))
+      return 1;
+    hash->deleted++;
+  }
+
+  hash->values--;
+  hash->is_dirty=1;
+  return 0;
+}
+
+
+/**
+ * librdf_hash_mmap_delete_key:
+ * @context: mmap hash context
+ * @key: pointer to key to delete
+ *
+ * - Delete a key and all its values from the hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_delete_key(void* context, librdf_hash_datum *key)
+{
+  librdf_hash_mmap_context* hash=(librdf_hash_mmap_context*)context;
+  librdf_hash_mmap_record* record;
+  librdf_hash_datum hd_value; /* on stack */
+  int count;
+  u32 i;
+
+  if(!hash->is_writable)
+    return 1;
+
+  count=librdf_hash_key_values_count(hash->overlay, key);
+  if(count > 0)
+    librdf_hash_delete_all(hash->overlay, key);
+  hash->values-= count;
+
+  record=librdf_hash_mmap_find_key(hash, key->data, key->size, NULL);
+  for(i=0; record && i < record->values_count; i++) {
+    librdf_hash_mmap_value_record* value_record;
+
+    value_record=librdf_hash_mmap_get_value(hash, record, i);
+    if(librdf_hash_mmap_is_deleted(hash, record, value_record))
+      continue;
+
+    hd_value.data=LIBRDF_HASH_MMAP_VALUE_DATA(value_record);
+    hd_value.size=value_record->size;
+    if(librdf_hash_put(hash->deletions, key, &hd_value))
+      return 1;
+    hash->deleted++;
+    hash->values--;
+    count++;
+  }
+
+  if(!count)
+    return 1;
+
+  hash->is_dirty=1;
+  return 0;
+}
+
+
+/**
+ * librdf_hash_mmap_sync:
+ * @context: mmap hash context
+ *
+ * Write the changes to the hash into a new compacted snapshot.
+ *
+ * Deferred to a later sync or the close while cursors are open.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_sync(void* context)
+{
+  librdf_hash_mmap_context* hash=(librdf_hash_mmap_context*)context;
+
+  if(!hash->is_writable || !hash->is_dirty || hash->cursors)
+    return 0;
+
+  return librdf_hash_mmap_write(hash);
+}
+
+
+/**
+ * librdf_hash_mmap_get_fd:
+ * @context: mmap hash context
+ *
+ * Get the file descriptor of the mapped snapshot.
+ *
+ * Return value: the file descriptor or -1
+ **/
+static int
+librdf_hash_mmap_get_fd(void* context)
+{
+  librdf_hash_mmap_context* hash=(librdf_hash_mmap_context*)context;
+
+  return hash->fd;
+}
+
+
+/* local function to register mmap hash functions */
+
+/**
+ * librdf_hash_mmap_register_factory:
+ * @factory: hash factory prototype
+ *
+ * Register the mmap hash module with the hash factory.
+ *
+ **/
+static void
+librdf_hash_mmap_register_factory(librdf_hash_factory *factory)
+{
+  factory->context_length = sizeof(librdf_hash_mmap_context);
+  factory->cursor_context_length = sizeof(librdf_hash_mmap_cursor_context);
+
+  factory->create  = librdf_hash_mmap_create;
+  factory->destroy = librdf_hash_mmap_destroy;
+
+  factory->open    = librdf_hash_mmap_open;
+  factory->close   = librdf_hash_mmap_close;
+  factory->clone   = librdf_hash_mmap_clone;
+
+  factory->values_count = librdf_hash_mmap_values_count;
+  factory->key_values_count = librdf_hash_mmap_key_values_count;
+
+  factory->put     = librdf_hash_mmap_put;
+  factory->exists  = librdf_hash_mmap_exists;
+  factory->delete_key  = librdf_hash_mmap_delete_key;
+  factory->delete_key_value  = librdf_hash_mmap_delete_key_value;
+  factory->sync    = librdf_hash_mmap_sync;
+  factory->get_fd  = librdf_hash_mmap_get_fd;
+
+  factory->cursor_init   = librdf_hash_mmap_cursor_init;
+  factory->cursor_get    = librdf_hash_mmap_cursor_get;
+  factory->cursor_finish = librdf_hash_mmap_cursor_finish;
+}
+
+
+/**
+ * librdf_init_hash_mmap:
+ * @world: redland world object
+ *
+ * Initialise the mmap snapshot hash module.
+ **/
+void
+librdf_init_hash_mmap(librdf_world *world)
+{
+  librdf_hash_register_factory(world,
+                               "mmap", &librdf_hash_mmap_register_factory);
+}
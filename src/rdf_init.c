@@ -179,6 +179,10 @@ librdf_new_world(void)
 void
 librdf_free_world(librdf_world *world)
 {
+#ifdef WITH_THREADS
+  int i;
+#endif
+
   if(!world)
     return;
   
@@ -215,8 +219,16 @@ librdf_free_world(librdf_world *world)
     world->statements_mutex = NULL;
   }
 
+  if(world->uris_mutex) {
+    for(i = 0; i < LIBRDF_WORLD_SHARDS; i++)
+      pthread_mutex_destroy(&world->uris_mutex[i]);
+    SYSTEM_FREE(world->uris_mutex);
+    world->uris_mutex = NULL;
+  }
+
   if(world->nodes_mutex) {
-    pthread_mutex_destroy(world->nodes_mutex);
+    for(i = 0; i < LIBRDF_WORLD_SHARDS; i++)
+      pthread_mutex_destroy(&world->nodes_mutex[i]);
     SYSTEM_FREE(world->nodes_mutex);
     world->nodes_mutex = NULL;
   }
@@ -249,11 +261,18 @@ void
 librdf_world_init_mutex(librdf_world* world)
 {
 #ifdef WITH_THREADS
+  int i;
+
   world->mutex = (pthread_mutex_t *) SYSTEM_MALLOC(sizeof(pthread_mutex_t));
   pthread_mutex_init(world->mutex, NULL);
 
-  world->nodes_mutex = (pthread_mutex_t *) SYSTEM_MALLOC(sizeof(pthread_mutex_t));
-  pthread_mutex_init(world->nodes_mutex, NULL);
+  world->nodes_mutex = (pthread_mutex_t *) SYSTEM_MALLOC(LIBRDF_WORLD_SHARDS * sizeof(pthread_mutex_t));
+  for(i = 0; i < LIBRDF_WORLD_SHARDS; i++)
+    pthread_mutex_init(&world->nodes_mutex[i], NULL);
+
+  world->uris_mutex = (pthread_mutex_t *) SYSTEM_MALLOC(LIBRDF_WORLD_SHARDS * sizeof(pthread_mutex_t));
+  for(i = 0; i < LIBRDF_WORLD_SHARDS; i++)
+    pthread_mutex_init(&world->uris_mutex[i], NULL);
 
   world->statements_mutex = (pthread_mutex_t *) SYSTEM_MALLOC(sizeof(pthread_mutex_t));
   pthread_mutex_init(world->statements_mutex, NULL);
@@ -554,6 +573,33 @@ librdf_world_get_genid(librdf_world* world)
 }
 
 
+/**
+ * librdf_world_hash_key:
+ * @data: key bytes
+ * @size: key length
+ *
+ * INTERNAL - Hash a node or URI interning key to pick its shard.
+ *
+ * Uses FNV-1a, which is cheap for the short keys interned.
+ *
+ * Return value: hash of the key
+ */
+unsigned int
+librdf_world_hash_key(const void* data, size_t size)
+{
+  const unsigned char* p = (const unsigned char*)data;
+  unsigned int hash = 2166136261U;
+
+  while(size--) {
+    hash ^= *p++;
+    hash *= 16777619U;
+  }
+
+  /* fold the better mixed high bits down into the shard bits */
+  return hash ^ (hash >> 16);
+}
+
+
 
 /* OLD INTERFACES BELOW HERE */
 
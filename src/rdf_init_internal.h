@@ -34,6 +34,14 @@ extern "C" {
 #include <pthread.h>
 #endif
 
+/* Number of shards the node and URI interning tables are split into,
+ * each with its own lock, so that threads making unrelated nodes
+ * rarely wait for each other.  Must be a power of 2. */
+#define LIBRDF_WORLD_SHARDS 16
+
+/* shard of an interning key hash from librdf_world_hash_key() */
+#define LIBRDF_WORLD_SHARD(hash) ((hash) & (LIBRDF_WORLD_SHARDS - 1))
+
 #ifdef RASQAL_H
 /* rasqal.h will have defined this */
 #else
@@ -61,12 +69,11 @@ struct librdf_world_s
   char *digest_factory_name;
   librdf_digest_factory* digest_factory;
 
-  /* URI interning */
-  librdf_hash* uris_hash;
-  int uris_hash_allocated_here;
+  /* URI interning, sharded by hash of the URI string */
+  librdf_hash* uris_hash[LIBRDF_WORLD_SHARDS];
 
-  /* Node interning */
-  librdf_hash* nodes_hash[3]; /* resource, literal, blank */
+  /* Node interning, sharded by hash of the node key */
+  librdf_hash* nodes_hash[LIBRDF_WORLD_SHARDS][3]; /* resource, literal, blank */
 
   /* Sequence of model factories */
   raptor_sequence* models;
@@ -101,13 +108,20 @@ struct librdf_world_s
   /* Unique counter from there */
   long genid_counter;
 
+  /* Count of nodes interned in each shard, giving their ordinals
+   * (locked by the shard's nodes_mutex) */
+  unsigned long nodes_ordinal[LIBRDF_WORLD_SHARDS];
+
 #ifdef WITH_THREADS
   /* mutex so we can lock around this when we need to */
   pthread_mutex_t* mutex;
 
-  /* mutex to lock the nodes class */
+  /* mutexes to lock the nodes class, one per shard */
   pthread_mutex_t* nodes_mutex;
 
+  /* mutexes to lock the URIs class, one per shard */
+  pthread_mutex_t* uris_mutex;
+
   /* mutex to lock the statements class */
   pthread_mutex_t* statements_mutex;
 
@@ -117,6 +131,7 @@ struct librdf_world_s
   /* !WITH_THREADS - pad structure to same size */
   void* mutex_fake;
   void* nodes_mutex_fake;
+  void* uris_mutex_fake;
   void* statements_mutex_fake;
   void* hash_datums_mutex_fake;
 #endif
@@ -149,9 +164,13 @@ struct librdf_world_s
   /* raptor world object */
   raptor_world* raptor_world_ptr;
   int raptor_world_allocated_here;
+
+  /* BDB environments shared by hashes, see rdf_hash_bdb.c */
+  struct librdf_hash_bdb_env_s* bdb_envs;
 };
 
 unsigned char* librdf_world_get_genid(librdf_world* world);
+unsigned int librdf_world_hash_key(const void* data, size_t size);
 
 
 #ifdef __cplusplus
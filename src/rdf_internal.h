@@ -166,6 +166,7 @@ void librdf_sign_free(void *ptr);
 #else
 #define LIBRDF_MALLOC(type, size) malloc(size)
 #define LIBRDF_CALLOC(type, size, count) calloc(size, count)
+#define LIBRDF_REALLOC(type, ptr, size) realloc(ptr, size)
 #define LIBRDF_FREE(type, ptr)   free(ptr)
 
 #endif
@@ -1933,6 +1933,8 @@ int main(int argc, char *argv[]);
 "</rdf:RDF>"
 
 int test_model_cloning(char const *program, librdf_world *);
+int test_model_bulk_add(char const *program, librdf_world *);
+int test_model_snapshots(char const *program, librdf_world *);
 int test_model(librdf_world *world, const char *program,
     const char *storage_type, const char *storage_name, const char* storage_options);
 
@@ -1954,6 +1956,16 @@ main(int argc, char *argv[])
   if(test_model_cloning(program, world))
     return(1);
 
+#ifdef STORAGE_HASHES
+  if(test_model_bulk_add(program, world))
+    return(1);
+#endif
+
+#ifdef STORAGE_TREES
+  if(test_model_snapshots(program, world))
+    return(1);
+#endif
+
   /* Get storage configuration */
   storage_type=getenv("REDLAND_TEST_STORAGE_TYPE");
   storage_name=getenv("REDLAND_TEST_STORAGE_NAME");
@@ -1968,9 +1980,17 @@ main(int argc, char *argv[])
 #else
       "hashes", "test", "hash-type='memory',write='yes',new='yes',contexts='yes'",
 #endif
+      /* explicit index set without po2s or so2p */
+      "hashes", "test", "hash-type='memory',write='yes',new='yes',indexes='sp2o,s2po,o2sp,c2spo'",
+      /* term IDs in keys and values */
+      "hashes", "test", "hash-type='memory',write='yes',new='yes',contexts='yes',dictionary='yes'",
 #endif
 #ifdef STORAGE_TREES
       "trees", "test", "contexts='yes'",
+      /* graphs with and without the index a search needs */
+      "trees", "test", "contexts='yes',index-adaptive='yes'",
+      /* searches across graphs in one store-wide index */
+      "trees", "test", "contexts='yes',index-all-graphs='yes'",
 #endif
 #ifdef STORAGE_FILE
       "file", "test.rdf", NULL,
@@ -2441,5 +2461,327 @@ int test_model_cloning(char const *program, librdf_world *world) {
   return 0;
 }
 
+
+static int
+test_model_bulk_add_compare_strings(const void *a, const void *b)
+{
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+
+static void
+test_model_bulk_add_free_strings(char** strings)
+{
+  int i;
+
+  if(!strings)
+    return;
+  for(i=0; strings[i]; i++)
+    free(strings[i]);
+  free(strings);
+}
+
+
+/* Write each statement of the model with its context as a string,
+ * returned as a sorted NULL terminated array or NULL on failure */
+static char**
+test_model_bulk_add_statements(librdf_world *world, librdf_model* model)
+{
+  librdf_stream* stream;
+  char** strings;
+  int size;
+  int count=0;
+
+  size=librdf_model_size(model);
+  if(size < 0)
+    return NULL;
+
+  strings=(char**)calloc(size+1, sizeof(char*));
+  if(!strings)
+    return NULL;
+
+  stream=librdf_model_as_stream(model);
+  if(!stream)
+    goto failed;
+
+  while(!librdf_stream_end(stream)) {
+    librdf_statement* statement=librdf_stream_get_object(stream);
+    librdf_node* context_node=librdf_stream_get_context2(stream);
+    raptor_iostream* iostr;
+    int rc;
+
+    if(count == size)
+      break;
+
+    iostr=raptor_new_iostream_to_string(world->raptor_world_ptr,
+                                        (void**)&strings[count], NULL, malloc);
+    if(!iostr)
+      break;
+    rc=librdf_statement_write(statement, iostr);
+    if(!rc && context_node) {
+      raptor_iostream_write_byte(' ', iostr);
+      rc=librdf_node_write(context_node, iostr);
+    }
+    raptor_free_iostream(iostr);
+    if(rc || !strings[count])
+      break;
+
+    count++;
+    librdf_stream_next(stream);
+  }
+
+  if(!librdf_stream_end(stream) || count != size) {
+    librdf_free_stream(stream);
+    goto failed;
+  }
+  librdf_free_stream(stream);
+
+  qsort(strings, count, sizeof(char*), test_model_bulk_add_compare_strings);
+  return strings;
+
+  failed:
+  test_model_bulk_add_free_strings(strings);
+  return NULL;
+}
+
+
+/* Adding streams to a hashes store with contexts gives the same
+ * statements whether they are written in sorted runs or one by one */
+int test_model_bulk_add(char const *program, librdf_world *world) {
+  const char* const storage_options[] = {
+    "hash-type='memory',write='yes',new='yes',contexts='yes'",
+    "hash-type='memory',write='yes',new='yes',contexts='yes',bulk-add='yes'",
+    "hash-type='memory',write='yes',new='yes',contexts='yes',bulk-add='yes',bulk-run-size='2'",
+    /* no spo2c index so stored statements are looked for one by one */
+    "hash-type='memory',write='yes',new='yes',contexts='yes',indexes='sp2o,s2po,po2s',bulk-add='yes',bulk-run-size='2'",
+    NULL
+  };
+  librdf_uri* base_uri;
+  librdf_node* context_node;
+  char** expected=NULL;
+  int i;
+  int rc=0;
+
+  base_uri=librdf_new_uri(world, (const unsigned char*)"http://example.org/bulk.rdf");
+  context_node=librdf_new_node_from_uri(world, base_uri);
+
+  for(i=0; !rc && storage_options[i]; i++) {
+    librdf_storage* storage;
+    librdf_model* model=NULL;
+    librdf_parser* parser;
+    librdf_stream* stream;
+    char** statements=NULL;
+    int j;
+
+    fprintf(stderr, "%s: Bulk adding to hashes storage with options %s\n",
+            program, storage_options[i]);
+    storage=librdf_new_storage(world, "hashes", "test", storage_options[i]);
+    if(storage)
+      model=librdf_new_model(world, storage, NULL);
+    parser=librdf_new_parser(world, "rdfxml", NULL, NULL);
+    if(!model || !parser) {
+      fprintf(stderr, "%s: Failed to create hashes model or parser\n", program);
+      rc=1;
+      goto tidy;
+    }
+
+    /* some statements already stored in a context, then streams
+     * without a context repeating them and each other */
+    stream=librdf_parser_parse_string_as_stream(parser, (const unsigned char*)EX1_CONTENT, base_uri);
+    librdf_model_context_add_statements(model, context_node, stream);
+    librdf_free_stream(stream);
+
+    stream=librdf_parser_parse_string_as_stream(parser, (const unsigned char*)EX1_CONTENT, base_uri);
+    librdf_model_add_statements(model, stream);
+    librdf_free_stream(stream);
+
+    stream=librdf_parser_parse_string_as_stream(parser, (const unsigned char*)EX2_CONTENT, base_uri);
+    librdf_model_add_statements(model, stream);
+    librdf_free_stream(stream);
+
+    statements=test_model_bulk_add_statements(world, model);
+    if(!statements) {
+      fprintf(stderr, "%s: Failed to list statements with options %s\n",
+              program, storage_options[i]);
+      rc=1;
+      goto tidy;
+    }
+
+    if(!expected) {
+      expected=statements;
+      statements=NULL;
+      goto tidy;
+    }
+
+    for(j=0; expected[j] || statements[j]; j++) {
+      if(!expected[j] || !statements[j] ||
+         strcmp(expected[j], statements[j])) {
+        fprintf(stderr, "%s: Bulk add with options %s gave statement %s, expected %s\n",
+                program, storage_options[i],
+                statements[j] ? statements[j] : "(none)",
+                expected[j] ? expected[j] : "(none)");
+        rc=1;
+        break;
+      }
+    }
+
+    tidy:
+    test_model_bulk_add_free_strings(statements);
+    if(parser)
+      librdf_free_parser(parser);
+    if(model)
+      librdf_free_model(model);
+    if(storage)
+      librdf_free_storage(storage);
+  }
+
+  test_model_bulk_add_free_strings(expected);
+  librdf_free_node(context_node);
+  librdf_free_uri(base_uri);
+
+  return rc;
+}
+
+
+
+#ifdef STORAGE_TREES
+/* Count the statements left in a stream, reading each and its context */
+static int
+test_model_snapshots_count(librdf_stream* stream)
+{
+  int count=0;
+
+  for(; !librdf_stream_end(stream); librdf_stream_next(stream)) {
+    librdf_statement* statement=librdf_stream_get_object(stream);
+    librdf_node* context_node=librdf_stream_get_context2(stream);
+
+    if(!statement || !librdf_statement_get_subject(statement) ||
+       (context_node && !librdf_node_get_uri(context_node)))
+      return -1;
+    count++;
+  }
+
+  return count;
+}
+
+
+/* Streams over a trees store with snapshots go on reading graphs that
+ * are removed while they are open */
+int test_model_snapshots(char const *program, librdf_world *world) {
+  librdf_storage* storage;
+  librdf_model* model=NULL;
+  librdf_parser* parser;
+  librdf_uri* base_uri;
+  librdf_node* context1;
+  librdf_node* context2;
+  librdf_stream* stream;
+  librdf_stream* context_stream=NULL;
+  librdf_stream* find_stream=NULL;
+  librdf_stream* all_stream=NULL;
+  librdf_statement* partial;
+  int count;
+  int rc=0;
+
+  base_uri=librdf_new_uri(world, (const unsigned char*)"http://example.org/snapshots.rdf");
+  context1=librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/context1");
+  context2=librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/context2");
+
+  fprintf(stderr, "%s: Removing contexts from trees storage with snapshots while they are read\n", program);
+  storage=librdf_new_storage(world, "trees", "test", "contexts='yes',snapshots='yes'");
+  if(storage)
+    model=librdf_new_model(world, storage, NULL);
+  parser=librdf_new_parser(world, "rdfxml", NULL, NULL);
+  if(!model || !parser) {
+    fprintf(stderr, "%s: Failed to create trees model or parser\n", program);
+    rc=1;
+    goto tidy;
+  }
+
+  /* 3 statements in context1, 4 in context2 and 3 without a context */
+  stream=librdf_parser_parse_string_as_stream(parser, (const unsigned char*)EX1_CONTENT, base_uri);
+  librdf_model_context_add_statements(model, context1, stream);
+  librdf_free_stream(stream);
+
+  stream=librdf_parser_parse_string_as_stream(parser, (const unsigned char*)EX2_CONTENT, base_uri);
+  librdf_model_context_add_statements(model, context2, stream);
+  librdf_free_stream(stream);
+
+  stream=librdf_parser_parse_string_as_stream(parser, (const unsigned char*)EX1_CONTENT, base_uri);
+  librdf_model_add_statements(model, stream);
+  librdf_free_stream(stream);
+
+  partial=librdf_new_statement(world);
+  librdf_statement_set_subject(partial, librdf_new_node_from_uri_string(world, (const unsigned char*)"http://purl.org/net/dajobe/"));
+  context_stream=librdf_model_context_as_stream(model, context1);
+  find_stream=librdf_model_find_statements_in_context(model, partial, context2);
+  all_stream=librdf_model_as_stream(model);
+  librdf_free_statement(partial);
+  if(!context_stream || !find_stream || !all_stream) {
+    fprintf(stderr, "%s: Failed to make streams over trees model\n", program);
+    rc=1;
+    goto tidy;
+  }
+
+  /* remove both contexts, the second a statement at a time */
+  librdf_model_context_remove_statements(model, context1);
+  stream=librdf_model_context_as_stream(model, context2);
+  while(stream && !librdf_stream_end(stream)) {
+    librdf_model_context_remove_statement(model, context2,
+                                          librdf_stream_get_object(stream));
+    librdf_stream_next(stream);
+  }
+  if(stream)
+    librdf_free_stream(stream);
+
+  if(librdf_model_size(model) != 3) {
+    fprintf(stderr, "%s: Trees model has %d statements after removing contexts, expected 3\n",
+            program, librdf_model_size(model));
+    rc=1;
+    goto tidy;
+  }
+
+  count=test_model_snapshots_count(context_stream);
+  if(count != 3) {
+    fprintf(stderr, "%s: Stream over removed context gave %d statements, expected 3\n",
+            program, count);
+    rc=1;
+  }
+
+  count=test_model_snapshots_count(find_stream);
+  if(count != 4) {
+    fprintf(stderr, "%s: Search of removed context gave %d statements, expected 4\n",
+            program, count);
+    rc=1;
+  }
+
+  /* each graph is read as it is when the stream gets to it: context1
+   * was dropped whole but context2 was emptied first */
+  count=test_model_snapshots_count(all_stream);
+  if(count != 6) {
+    fprintf(stderr, "%s: Stream over all contexts gave %d statements, expected 6\n",
+            program, count);
+    rc=1;
+  }
+
+  tidy:
+  if(all_stream)
+    librdf_free_stream(all_stream);
+  if(find_stream)
+    librdf_free_stream(find_stream);
+  if(context_stream)
+    librdf_free_stream(context_stream);
+  if(parser)
+    librdf_free_parser(parser);
+  if(model)
+    librdf_free_model(model);
+  if(storage)
+    librdf_free_storage(storage);
+  librdf_free_node(context2);
+  librdf_free_node(context1);
+  librdf_free_uri(base_uri);
+
+  return rc;
+}
 #endif
 
+#endif
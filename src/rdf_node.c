@@ -54,6 +54,11 @@ enum {
 
 #define H_COUNT (H_LAST+1)
 
+/* ordinal for a new node in a locked shard: counts up within the
+ * shard, with the shard in the low bits keeping it unique */
+#define LIBRDF_NODE_NEXT_ORDINAL(world, shard) \
+  (++(world)->nodes_ordinal[shard] * LIBRDF_WORLD_SHARDS + (shard))
+
 
 /* class functions */
 
@@ -67,15 +72,18 @@ enum {
 void
 librdf_init_node(librdf_world* world) 
 {
+  int shard;
   int i;
   
-  for(i=0; i<H_COUNT; i++) {
-    world->nodes_hash[i]=librdf_new_hash(world, NULL);
-    if(!world->nodes_hash[i])
-      LIBRDF_FATAL1(world, LIBRDF_FROM_NODE, "Failed to create Nodes hash from factory");
+  for(shard=0; shard < LIBRDF_WORLD_SHARDS; shard++) {
+    for(i=0; i<H_COUNT; i++) {
+      world->nodes_hash[shard][i]=librdf_new_hash(world, NULL);
+      if(!world->nodes_hash[shard][i])
+        LIBRDF_FATAL1(world, LIBRDF_FROM_NODE, "Failed to create Nodes hash from factory");
     
-    if(librdf_hash_open(world->nodes_hash[i], NULL, 0, 1, 1, NULL))
-      LIBRDF_FATAL1(world, LIBRDF_FROM_NODE, "Failed to open Nodes hash");
+      if(librdf_hash_open(world->nodes_hash[shard][i], NULL, 0, 1, 1, NULL))
+        LIBRDF_FATAL1(world, LIBRDF_FROM_NODE, "Failed to open Nodes hash");
+    }
   }
 }
 
@@ -90,12 +98,16 @@ librdf_init_node(librdf_world* world)
 void
 librdf_finish_node(librdf_world *world)
 {
+  int shard;
   int i;
 
-  for(i=0; i<H_COUNT; i++) {
-    if(world->nodes_hash[i]) {
-      librdf_hash_close(world->nodes_hash[i]);
-      librdf_free_hash(world->nodes_hash[i]);
+  for(shard=0; shard < LIBRDF_WORLD_SHARDS; shard++) {
+    for(i=0; i<H_COUNT; i++) {
+      if(world->nodes_hash[shard][i]) {
+        librdf_hash_close(world->nodes_hash[shard][i]);
+        librdf_free_hash(world->nodes_hash[shard][i]);
+        world->nodes_hash[shard][i]=NULL;
+      }
     }
   }
 }
@@ -148,7 +160,8 @@ librdf_new_node_from_uri_string_or_uri(librdf_world *world,
   librdf_node* new_node;
   librdf_uri *new_uri;
   librdf_hash_datum key, value; /* on stack - not allocated */
-  librdf_hash_datum *old_value;
+  unsigned int hash;
+  int shard;
 
   librdf_world_open(world);
 
@@ -172,25 +185,25 @@ librdf_new_node_from_uri_string_or_uri(librdf_world *world,
   } else
     new_uri=librdf_new_uri_from_uri(uri);
   
+  /* URIs are interned so the URI pointer is the key */
+  key.data=&new_uri;
+  key.size=sizeof(librdf_uri*);
+
+  hash=librdf_world_hash_key(key.data, key.size);
+  shard=LIBRDF_WORLD_SHARD(hash);
 
 #ifdef WITH_THREADS
-  pthread_mutex_lock(world->nodes_mutex);
+  pthread_mutex_lock(&world->nodes_mutex[shard]);
 #endif
   
-  key.data=&new_uri;
-  key.size=sizeof(librdf_uri*);
-
   /* if the existing node found in resource hash, return it */
-  if((old_value=librdf_hash_get_one(world->nodes_hash[H_RESOURCE], &key))) {
-    new_node=*(librdf_node**)old_value->data;
-
+  if((new_node=(librdf_node*)librdf_hash_get_one_pointer(world->nodes_hash[shard][H_RESOURCE], &key))) {
     librdf_free_uri(new_uri);
     
 #if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
     LIBRDF_DEBUG3("Found existing resource node with URI %s in hash with current usage %d\n", uri_string, new_node->usage);
 #endif
 
-    librdf_free_hash_datum(old_value);
     new_node->usage++;
 
     goto unlock;
@@ -214,11 +227,13 @@ librdf_new_node_from_uri_string_or_uri(librdf_world *world,
   new_node->type = LIBRDF_NODE_TYPE_RESOURCE;
 
   new_node->usage=1;
+  new_node->hash=hash;
+  new_node->ordinal=LIBRDF_NODE_NEXT_ORDINAL(world, shard);
 
   value.data=&new_node; value.size=sizeof(librdf_node*);
 
   /* store in hash: (librdf_uri*)uri => (librdf_node*) */
-  if(librdf_hash_put(world->nodes_hash[H_RESOURCE], &key, &value)) {
+  if(librdf_hash_put(world->nodes_hash[shard][H_RESOURCE], &key, &value)) {
     LIBRDF_FREE(librdf_node, new_node);
     librdf_free_uri(new_uri);
     new_node=NULL;
@@ -227,7 +242,7 @@ librdf_new_node_from_uri_string_or_uri(librdf_world *world,
   
  unlock:
 #ifdef WITH_THREADS
-  pthread_mutex_unlock(world->nodes_mutex);
+  pthread_mutex_unlock(&world->nodes_mutex[shard]);
 #endif
 
   return new_node;
@@ -453,12 +468,14 @@ librdf_new_node_from_typed_counted_literal(librdf_world *world,
                                            librdf_uri* datatype_uri) 
 {
   librdf_node* new_node;
+  librdf_node* old_node;
   unsigned char *new_value;
   char *new_xml_language;
   librdf_hash_datum key, value_hd; /* on stack - not allocated */
-  librdf_hash_datum *old_value;
   size_t size;
   unsigned char *buffer;
+  unsigned int hash;
+  int shard;
   
   librdf_world_open(world);
 
@@ -470,13 +487,11 @@ librdf_new_node_from_typed_counted_literal(librdf_world *world,
   if(xml_language && datatype_uri)
     return NULL;
   
-#ifdef WITH_THREADS
-  pthread_mutex_lock(world->nodes_mutex);
-#endif
-
+  /* the node is made and encoded before locking its shard, which
+   * only guards the lookup */
   new_node = (librdf_node*)LIBRDF_CALLOC(librdf_node, 1, sizeof(librdf_node));
   if(!new_node)
-    goto unlock;
+    return NULL;
 
   new_node->world=world;
   
@@ -489,8 +504,7 @@ librdf_new_node_from_typed_counted_literal(librdf_world *world,
   new_value=(unsigned char*)LIBRDF_MALLOC(cstring, value_len + 1);
   if(!new_value) {
     LIBRDF_FREE(librdf_node, new_node);
-    new_node=NULL;
-    goto unlock;
+    return NULL;
   }
   strncpy((char*)new_value, (const char*)value, value_len);
   new_value[value_len]='\0';
@@ -501,8 +515,7 @@ librdf_new_node_from_typed_counted_literal(librdf_world *world,
     if(!new_xml_language) {
       LIBRDF_FREE(cstring, new_value);
       LIBRDF_FREE(librdf_node, new_node);
-      new_node=NULL;
-      goto unlock;
+      return NULL;
     }
     strncpy(new_xml_language, xml_language, xml_language_len);
     new_xml_language[xml_language_len]='\0';
@@ -540,8 +553,25 @@ librdf_new_node_from_typed_counted_literal(librdf_world *world,
   key.data=buffer;
   key.size=size;
 
+  hash=librdf_world_hash_key(buffer, size);
+  shard=LIBRDF_WORLD_SHARD(hash);
+
+#ifdef WITH_THREADS
+  pthread_mutex_lock(&world->nodes_mutex[shard]);
+#endif
+
   /* if the existing node found in resource hash, return it */
-  if((old_value=librdf_hash_get_one(world->nodes_hash[H_LITERAL], &key))) {
+  if((old_node=(librdf_node*)librdf_hash_get_one_pointer(world->nodes_hash[shard][H_LITERAL], &key))) {
+#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
+    LIBRDF_DEBUG3("Found existing resource node with typed literal %s in hash with current usage %d\n", value, old_node->usage);
+#endif
+
+    old_node->usage++;
+
+#ifdef WITH_THREADS
+    pthread_mutex_unlock(&world->nodes_mutex[shard]);
+#endif
+
     LIBRDF_FREE(cstring, buffer);
     if(new_xml_language)
       LIBRDF_FREE(cstring, new_xml_language);
@@ -550,25 +580,18 @@ librdf_new_node_from_typed_counted_literal(librdf_world *world,
     LIBRDF_FREE(cstring, new_value);
     LIBRDF_FREE(librdf_node, new_node);
 
-    new_node=*(librdf_node**)old_value->data;
-
-#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
-    LIBRDF_DEBUG3("Found existing resource node with typed literal %s in hash with current usage %d\n", value, new_node->usage);
-#endif
-
-    librdf_free_hash_datum(old_value);
-    new_node->usage++;
-
-    goto unlock;
+    return old_node;
   }
     
   /* otherwise add the new node */
   new_node->usage=1;
+  new_node->hash=hash;
+  new_node->ordinal=LIBRDF_NODE_NEXT_ORDINAL(world, shard);
 
   value_hd.data=&new_node; value_hd.size=sizeof(librdf_node*);
 
   /* store in hash: (serialised node) => (librdf_node*) */
-  if(librdf_hash_put(world->nodes_hash[H_LITERAL], &key, &value_hd)) {
+  if(librdf_hash_put(world->nodes_hash[shard][H_LITERAL], &key, &value_hd)) {
     LIBRDF_FREE(cstring, buffer);
     if(new_xml_language)
       LIBRDF_FREE(cstring, new_xml_language);
@@ -580,10 +603,8 @@ librdf_new_node_from_typed_counted_literal(librdf_world *world,
     new_node=NULL;
   }
 
-  
- unlock:
 #ifdef WITH_THREADS
-    pthread_mutex_unlock(world->nodes_mutex);
+  pthread_mutex_unlock(&world->nodes_mutex[shard]);
 #endif
 
   return new_node;
@@ -646,44 +667,41 @@ librdf_new_node_from_counted_blank_identifier(librdf_world *world,
   librdf_node* new_node;
   unsigned char *new_identifier;
   librdf_hash_datum key, value; /* on stack - not allocated */
-  librdf_hash_datum *old_value;
+  unsigned int hash;
+  int shard;
 
   librdf_world_open(world);
 
-#ifdef WITH_THREADS
-  pthread_mutex_lock(world->nodes_mutex);
-#endif
-
   if(!identifier) {
     new_identifier = librdf_world_get_genid(world);
-    if(!new_identifier) {
-      new_node = NULL;
-      goto unlock;
-    }
+    if(!new_identifier)
+      return NULL;
     identifier_len = strlen((const char *)new_identifier);
   } else {
     new_identifier = (unsigned char*)LIBRDF_MALLOC(cstring, identifier_len + 1);
-    if(!new_identifier) {
-      new_node=NULL;
-      goto unlock;
-    }
+    if(!new_identifier)
+      return NULL;
     memcpy(new_identifier, identifier, identifier_len + 1);
   }
 
   key.data = new_identifier;
   key.size = identifier_len;
 
-  /* if the existing node found in resource hash, return it */
-  if((old_value = librdf_hash_get_one(world->nodes_hash[H_BLANK], &key))) {
-    new_node = *(librdf_node**)old_value->data;
+  hash = librdf_world_hash_key(key.data, key.size);
+  shard = LIBRDF_WORLD_SHARD(hash);
+
+#ifdef WITH_THREADS
+  pthread_mutex_lock(&world->nodes_mutex[shard]);
+#endif
 
+  /* if the existing node found in resource hash, return it */
+  if((new_node = (librdf_node*)librdf_hash_get_one_pointer(world->nodes_hash[shard][H_BLANK], &key))) {
 #if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
     LIBRDF_DEBUG3("Found existing blank node identifier %s in hash with current usage %d\n", new_identifier, new_node->usage);
 #endif
 
     LIBRDF_FREE(cstring, new_identifier);
     
-    librdf_free_hash_datum(old_value);
     new_node->usage++;
 
     goto unlock;
@@ -702,11 +720,13 @@ librdf_new_node_from_counted_blank_identifier(librdf_world *world,
   new_node->type = LIBRDF_NODE_TYPE_BLANK;
 
   new_node->usage = 1;
+  new_node->hash = hash;
+  new_node->ordinal = LIBRDF_NODE_NEXT_ORDINAL(world, shard);
 
   value.data = &new_node; value.size = sizeof(librdf_node*);
 
   /* store in hash: (blank node ID string) => (librdf_node*) */
-  if(librdf_hash_put(world->nodes_hash[H_BLANK], &key, &value)) {
+  if(librdf_hash_put(world->nodes_hash[shard][H_BLANK], &key, &value)) {
     LIBRDF_FREE(librdf_node, new_node);
     LIBRDF_FREE(cstring, new_identifier);
     new_node = NULL;
@@ -715,7 +735,7 @@ librdf_new_node_from_counted_blank_identifier(librdf_world *world,
 
  unlock:
 #ifdef WITH_THREADS
-    pthread_mutex_unlock(world->nodes_mutex);
+  pthread_mutex_unlock(&world->nodes_mutex[shard]);
 #endif
 
   return new_node;
@@ -765,7 +785,14 @@ librdf_new_node_from_node(librdf_node *node)
 {
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(node, librdf_node, NULL);
 
+#ifdef WITH_THREADS
+  /* usage is locked by the node's shard */
+  pthread_mutex_lock(&node->world->nodes_mutex[LIBRDF_WORLD_SHARD(node->hash)]);
+#endif
   node->usage++;
+#ifdef WITH_THREADS
+  pthread_mutex_unlock(&node->world->nodes_mutex[LIBRDF_WORLD_SHARD(node->hash)]);
+#endif
   return node;
 }
 
@@ -781,16 +808,17 @@ void
 librdf_free_node(librdf_node *node) 
 {
   librdf_hash_datum key; /* on stack */
-#ifdef WITH_THREADS
   librdf_world *world;
-#endif
+  int shard;
 
   if(!node)
     return;
   
-#ifdef WITH_THREADS
   world = node->world;
-  pthread_mutex_lock(world->nodes_mutex);
+  shard = LIBRDF_WORLD_SHARD(node->hash);
+
+#ifdef WITH_THREADS
+  pthread_mutex_lock(&world->nodes_mutex[shard]);
 #endif
 
   node->usage--;
@@ -802,7 +830,7 @@ librdf_free_node(librdf_node *node)
   /* decrement usage, don't free if not 0 yet*/
   if(node->usage) {
 #ifdef WITH_THREADS
-    pthread_mutex_unlock(world->nodes_mutex);
+    pthread_mutex_unlock(&world->nodes_mutex[shard]);
 #endif
     return;
   }
@@ -811,24 +839,47 @@ librdf_free_node(librdf_node *node)
   LIBRDF_DEBUG2("Deleting Node %p from hash\n", node);
 #endif
 
+  /* Hash deletion fails only if the key is not found.
+     This is not a fatal error so do not check for return value. */
   switch(node->type) {
     case LIBRDF_NODE_TYPE_RESOURCE:
       key.data=&node->value.resource.uri;
       key.size=sizeof(librdf_uri*);
-      /* Hash deletion fails only if the key is not found.
-         This is not a fatal error so do not check for return value. */
-      librdf_hash_delete_all(node->world->nodes_hash[H_RESOURCE], &key);
-      librdf_free_uri(node->value.resource.uri);
+      librdf_hash_delete_all(world->nodes_hash[shard][H_RESOURCE], &key);
       break;
       
     case LIBRDF_NODE_TYPE_LITERAL:
       if(node->value.literal.key) {
         key.data=node->value.literal.key;
         key.size=node->value.literal.size;
-        librdf_hash_delete_all(node->world->nodes_hash[H_LITERAL], &key); /* see above */
-        LIBRDF_FREE(cstring, node->value.literal.key);
+        librdf_hash_delete_all(world->nodes_hash[shard][H_LITERAL], &key);
       }
+      break;
+
+    case LIBRDF_NODE_TYPE_BLANK:
+      key.data=node->value.blank.identifier;
+      key.size=node->value.blank.identifier_len;
+      librdf_hash_delete_all(world->nodes_hash[shard][H_BLANK], &key);
+      break;
+
+    case LIBRDF_NODE_TYPE_UNKNOWN:
+    default:
+      break;
+  }
+
+#ifdef WITH_THREADS
+  /* no longer reachable so the rest needs no lock */
+  pthread_mutex_unlock(&world->nodes_mutex[shard]);
+#endif
+
+  switch(node->type) {
+    case LIBRDF_NODE_TYPE_RESOURCE:
+      librdf_free_uri(node->value.resource.uri);
+      break;
       
+    case LIBRDF_NODE_TYPE_LITERAL:
+      if(node->value.literal.key)
+        LIBRDF_FREE(cstring, node->value.literal.key);
       if(node->value.literal.string != NULL)
         LIBRDF_FREE(cstring, node->value.literal.string);
       if(node->value.literal.xml_language != NULL)
@@ -838,9 +889,6 @@ librdf_free_node(librdf_node *node)
       break;
 
     case LIBRDF_NODE_TYPE_BLANK:
-      key.data=node->value.blank.identifier;
-      key.size=node->value.blank.identifier_len;
-      librdf_hash_delete_all(node->world->nodes_hash[H_BLANK], &key); /* see above */
       if(node->value.blank.identifier != NULL)
         LIBRDF_FREE(cstring, node->value.blank.identifier);
       break;
@@ -850,10 +898,6 @@ librdf_free_node(librdf_node *node)
       break;
   }
 
-#ifdef WITH_THREADS
-  pthread_mutex_unlock(world->nodes_mutex);
-#endif
-
   LIBRDF_FREE(librdf_node, node);
 }
 
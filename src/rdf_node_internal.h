@@ -36,6 +36,11 @@ struct librdf_node_s
   librdf_world *world;
   librdf_node_type type;
   int usage;
+  /* unique per world for the node lifetime; ordered by interning
+   * within a shard but not across shards */
+  unsigned long ordinal;
+  /* hash of the interning key, picking the node's shard */
+  unsigned int hash;
   union 
   {
     struct
@@ -57,9 +57,6 @@ static int librdf_storage_stream_to_node_iterator_next_method(void* iterator);
 static void* librdf_storage_stream_to_node_iterator_get_method(void* iterator, int flags);
 static void librdf_storage_stream_to_node_iterator_finished(void* iterator);
 
-/* helper function for creating iterators for get sources, targets, arcs */
-static librdf_iterator* librdf_storage_node_stream_to_node_create(librdf_storage* storage, librdf_node* node1, librdf_node *node2, librdf_statement_part want);
-
 /* helper functions for dynamically loading storage modules */
 #ifdef MODULAR_LIBRDF
 void
@@ -1196,7 +1193,7 @@ librdf_storage_stream_to_node_iterator_finished(void* iterator)
  * 
  * Return value: a new #librdf_iterator or NULL on failure
  **/
-static librdf_iterator*
+librdf_iterator*
 librdf_storage_node_stream_to_node_create(librdf_storage* storage,
                                           librdf_node *node1,
                                           librdf_node *node2,
@@ -1728,6 +1725,28 @@ librdf_storage_sync(librdf_storage* storage)
 }
 
 
+/**
+ * librdf_storage_compact:
+ * @storage: #librdf_storage object
+ * 
+ * Reclaim space in the backing store left unused by removed statements.
+ *
+ * The storage stays open while this runs.  Storages without
+ * compaction are synchronised instead.
+ * 
+ * Return value: non-0 on failure
+ **/
+int
+librdf_storage_compact(librdf_storage* storage) 
+{
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, 1);
+
+  if(storage->factory->compact)
+    return storage->factory->compact(storage);
+  return librdf_storage_sync(storage);
+}
+
+
 /**
  * librdf_storage_find_statements_in_context:
  * @storage: #librdf_storage object
@@ -140,6 +140,10 @@ librdf_query_results* librdf_storage_query_execute(librdf_storage* storage, libr
 REDLAND_API
 int librdf_storage_sync(librdf_storage *storage);
 
+/* reclaim unused space in the backing store */
+REDLAND_API
+int librdf_storage_compact(librdf_storage *storage);
+
 /* find statements in a given context */
 REDLAND_API
 librdf_stream* librdf_storage_find_statements_in_context(librdf_storage* storage, librdf_statement* statement, librdf_node* context_node);
@@ -65,6 +65,15 @@ static const librdf_hash_descriptor librdf_storage_hashes_descriptions[]= {
   {"p2so", 
    LIBRDF_STATEMENT_PREDICATE,
    LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_OBJECT},  /* For '(?, p, ?)' */
+  {"s2po", 
+   LIBRDF_STATEMENT_SUBJECT,
+   LIBRDF_STATEMENT_PREDICATE|LIBRDF_STATEMENT_OBJECT},  /* For '(s, ?, ?)' */
+  {"o2sp", 
+   LIBRDF_STATEMENT_OBJECT,
+   LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_PREDICATE},  /* For '(?, ?, o)' */
+  {"spo2c", 
+   LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_PREDICATE|LIBRDF_STATEMENT_OBJECT,
+   0L},  /* For 'contains' with contexts; value is only the context */
   {"contexts",
    0L, /* for contexts - do not touch when storing statements! */
    0L},
@@ -78,6 +87,10 @@ librdf_storage_get_hash_description_by_name(const char *name)
   int i;
   const librdf_hash_descriptor *d;
   
+  /* c2spo is accepted as another name for the contexts index */
+  if(!strcmp(name, "c2spo"))
+    name="contexts";
+
   for(i=0; (d=&librdf_storage_hashes_descriptions[i]); i++) {
     if(!d->name)
       return NULL;
@@ -113,12 +126,13 @@ typedef struct
   int arcs_index;
   int targets_index;
 
-  int p2so_index;
-
   /* If this is non-0, contexts are being used */
   int index_contexts;
   int contexts_index;
 
+  /* index keyed by whole statements, for contains with contexts */
+  int contains_index;
+
   int all_statements_hash_index;
 
   /* growing buffers used to en/decode keys/values */
@@ -126,12 +140,63 @@ typedef struct
   size_t key_buffer_len;
   unsigned char *value_buffer;
   size_t value_buffer_len;
+
+  /* growing scratch buffer with the subject, predicate, object and
+   * context nodes of the statement being added or removed, each
+   * encoded once and copied into the keys and values of all hashes */
+  unsigned char *parts_buffer;
+  size_t parts_buffer_len;
+  size_t parts_offset[4];
+  size_t parts_len[4]; /* 0 if part is not present */
+
+  /* statements per sorted run in add_statements, <2 to add one by one */
+  int bulk_run_size;
+
+  /* Optional term dictionary.  When used, the parts of keys and
+   * values are term IDs instead of node encodings and these hashes
+   * map between the two.  Terms are never removed from them. */
+  librdf_hash* term2id;
+  librdf_hash* id2term;
+  char* term2id_name;
+  char* id2term_name;
+  unsigned long next_term_id;
+  int term_ids_dirty; /* non 0 if next_term_id is not yet stored */
+  unsigned char *term_buffer;
+  size_t term_buffer_len;
+
+  /* non 0 while all hashes are in a transaction */
+  int in_transaction;
 } librdf_storage_hashes_instance;
 
 
+/* default number of statements sorted and written per run by
+ * add_statements when bulk-add is set; set with the bulk-run-size option */
+#define LIBRDF_STORAGE_HASHES_BULK_RUN_SIZE 16384
+
+/* one key/value pair of one hash for a statement in a bulk run */
+typedef struct {
+  size_t key_offset;   /* offsets into the run buffer while filling it */
+  size_t value_offset;
+  unsigned char *key;  /* pointers into the run buffer when full */
+  size_t key_len;
+  unsigned char *value;
+  size_t value_len;
+  int statement_index; /* position of statement in run */
+} librdf_storage_hashes_bulk_entry;
+
+/* the last node decoded for each statement part by one stream or
+ * iterator; statements read in key order repeat their leading terms */
+typedef struct {
+  unsigned long ids[4];
+  librdf_node* nodes[4]; /* NULL when nothing is cached */
+} librdf_storage_hashes_term_cache;
+
+
 
 /* helper function for implementing init and clone methods */
 static int librdf_storage_hashes_register(librdf_storage *storage, const char *name, const librdf_hash_descriptor *source_desc);
+static int librdf_storage_hashes_register_by_name(librdf_storage *storage, const char *name, const char *index_name);
+static char* librdf_storage_hashes_hash_name(librdf_storage_hashes_instance* context, const char *name, const char *suffix);
 static int librdf_storage_hashes_init_common(librdf_storage* storage, const char *name, char *hash_type, char *db_dir, char *indexes, int mode, int is_writable, int is_new, librdf_hash* options);
 
 
@@ -145,6 +210,7 @@ static int librdf_storage_hashes_size(librdf_storage* storage);
 static int librdf_storage_hashes_add_statement(librdf_storage* storage, librdf_statement* statement);
 static int librdf_storage_hashes_add_statements(librdf_storage* storage, librdf_stream* statement_stream);
 static int librdf_storage_hashes_remove_statement(librdf_storage* storage, librdf_statement* statement);
+static int librdf_storage_hashes_has_statement(librdf_storage* storage, librdf_statement* statement);
 static int librdf_storage_hashes_contains_statement(librdf_storage* storage, librdf_statement* statement);
 static librdf_stream* librdf_storage_hashes_serialise(librdf_storage* storage);
 static librdf_stream* librdf_storage_hashes_find_statements(librdf_storage* storage, librdf_statement* statement);
@@ -152,6 +218,12 @@ static librdf_iterator* librdf_storage_hashes_find_sources(librdf_storage* stora
 static librdf_iterator* librdf_storage_hashes_find_arcs(librdf_storage* storage, librdf_node* source, librdf_node *target);
 static librdf_iterator* librdf_storage_hashes_find_targets(librdf_storage* storage, librdf_node* source, librdf_node *arc);
 
+/* transactions */
+static int librdf_storage_hashes_transaction_start(librdf_storage *storage);
+static int librdf_storage_hashes_transaction_end(librdf_storage *storage, int commit);
+static int librdf_storage_hashes_transaction_commit(librdf_storage *storage);
+static int librdf_storage_hashes_transaction_rollback(librdf_storage *storage);
+
 /* serialising implementing functions */
 static int librdf_storage_hashes_serialise_end_of_stream(void* context);
 static int librdf_storage_hashes_serialise_next_statement(void* context);
@@ -177,6 +249,9 @@ static int librdf_storage_hashes_node_iterator_is_end(void* iterator);
 static int librdf_storage_hashes_node_iterator_next_method(void* iterator);
 static void* librdf_storage_hashes_node_iterator_get_method(void* iterator, int flags);
 static void librdf_storage_hashes_node_iterator_finished(void* iterator);
+static int librdf_storage_hashes_open_dictionary(librdf_storage* storage);
+static int librdf_storage_hashes_store_term_ids(librdf_storage* storage);
+static int librdf_storage_hashes_fill_indexes(librdf_storage* storage);
 /* common initialisation code for creating get sources, targets, arcs iterators */
 static librdf_iterator* librdf_storage_hashes_node_iterator_create(librdf_storage* storage, librdf_node* node1, librdf_node *node2, int hash_index, int want);
 
@@ -188,7 +263,6 @@ librdf_storage_hashes_register(librdf_storage *storage,
                                const librdf_hash_descriptor *source_desc) 
 {
   librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
-  int len;
   char *full_name=NULL;
   int hash_index;
   librdf_hash_descriptor *desc=(librdf_hash_descriptor*)LIBRDF_MALLOC(librdf_hash_descriptor, sizeof(librdf_hash_descriptor));
@@ -203,19 +277,9 @@ librdf_storage_hashes_register(librdf_storage *storage,
   context->hash_descriptions[hash_index]=desc;
     
   if(name) {
-    len=strlen(desc->name) + 1 + strlen(name) + 1; /* "%s-%s\0" */
-    if(context->db_dir)
-      len+=strlen(context->db_dir) +1;
-    
-    full_name=(char*)LIBRDF_MALLOC(cstring, len);
+    full_name=librdf_storage_hashes_hash_name(context, name, desc->name);
     if(!full_name)
       return 1;
-
-    /* FIXME: Implies Unix filenames */
-    if(context->db_dir)
-      sprintf(full_name, "%s/%s-%s", context->db_dir, name, desc->name);
-    else
-      sprintf(full_name, "%s-%s", name, desc->name);
   }
   
   context->hashes[hash_index]=librdf_new_hash(storage->world, 
@@ -225,6 +289,76 @@ librdf_storage_hashes_register(librdf_storage *storage,
   return (context->hashes[hash_index] == NULL);
 }
 
+
+/*
+ * librdf_storage_hashes_hash_name:
+ * @context: the storage hashes instance
+ * @name: storage name
+ * @suffix: hash name such as "sp2o"
+ *
+ * INTERNAL - Build the name of one hash of the storage
+ *
+ * Return value: new name or NULL on failure
+ **/
+static char*
+librdf_storage_hashes_hash_name(librdf_storage_hashes_instance* context,
+                                const char *name, const char *suffix)
+{
+  char *full_name;
+  int len;
+
+  len=strlen(suffix) + 1 + strlen(name) + 1; /* "%s-%s\0" */
+  if(context->db_dir)
+    len+=strlen(context->db_dir) +1;
+    
+  full_name=(char*)LIBRDF_MALLOC(cstring, len);
+  if(!full_name)
+    return NULL;
+
+  /* FIXME: Implies Unix filenames */
+  if(context->db_dir)
+    sprintf(full_name, "%s/%s-%s", context->db_dir, name, suffix);
+  else
+    sprintf(full_name, "%s-%s", name, suffix);
+
+  return full_name;
+}
+
+
+/*
+ * librdf_storage_hashes_register_by_name:
+ * @storage: storage object
+ * @name: storage name used to build the hash file name (or NULL)
+ * @index_name: index name such as "sp2o" or "contexts"
+ *
+ * INTERNAL - Register the index called @index_name unless already present
+ *
+ * Return value: non 0 on failure or if @index_name is not a known index
+ **/
+static int
+librdf_storage_hashes_register_by_name(librdf_storage *storage,
+                                       const char *name,
+                                       const char *index_name)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  const librdf_hash_descriptor *desc;
+  int i;
+
+  desc=librdf_storage_get_hash_description_by_name(index_name);
+  if(!desc) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "Unknown hashes storage index '%s'", index_name);
+    return 1;
+  }
+
+  for(i=0; i<context->hash_count; i++) {
+    if(!strcmp(context->hash_descriptions[i]->name, desc->name))
+      return 0;
+  }
+
+  return librdf_storage_hashes_register(storage, name, desc);
+}
+
 /* helper function for implementing init and clone methods */
 
 static int
@@ -239,7 +373,9 @@ librdf_storage_hashes_init_common(librdf_storage* storage, const char *name,
   int status=0;
   int index_predicates=0;
   int index_contexts=0;
+  int use_dictionary=0;
   int hash_count=0;
+  long bulk_run_size;
   
   context=(librdf_storage_hashes_instance*)LIBRDF_CALLOC(
     librdf_storage_hashes_instance, 1, sizeof(librdf_storage_hashes_instance));
@@ -260,20 +396,25 @@ librdf_storage_hashes_init_common(librdf_storage* storage, const char *name,
   context->is_new=is_new;
   context->options=options;
 
-  /* Work out the number of hashes for allocating stuff below */
-  hash_count=3;
-
   if((index_contexts=librdf_hash_get_as_boolean(options, "contexts"))<0)
     index_contexts=0; /* default is no contexts */
-  context->index_contexts=index_contexts;
-
-  if(index_contexts)
-    hash_count++;
 
   if((index_predicates=librdf_hash_get_as_boolean(options, "index-predicates"))<0)
     index_predicates=0; /* default is NO index on properties */
   
-  if(index_predicates)
+  if((bulk_run_size=librdf_hash_get_as_long(options, "bulk-run-size"))<0)
+    bulk_run_size=LIBRDF_STORAGE_HASHES_BULK_RUN_SIZE;
+  /* sorted runs are a bulk mode, used only with bulk-add='yes' */
+  if(librdf_hash_get_as_boolean(options, "bulk-add") <= 0)
+    bulk_run_size=0;
+  context->bulk_run_size=(int)bulk_run_size;
+
+  if((use_dictionary=librdf_hash_get_as_boolean(options, "dictionary"))<0)
+    use_dictionary=0; /* default is full node encodings in keys */
+
+  /* Work out the number of hashes for allocating stuff below; each
+   * index is registered at most once so this is an upper bound */
+  for(hash_count=0; librdf_storage_hashes_descriptions[hash_count].name; )
     hash_count++;
 
 
@@ -302,29 +443,75 @@ librdf_storage_hashes_init_common(librdf_storage* storage, const char *name,
     return 1;
   }
   
-  for(i=0; i<3; i++) {
-    status=librdf_storage_hashes_register(storage, name,
-                                          &librdf_storage_hashes_descriptions[i]);
-    if(status)
-      break;
+  if(indexes) {
+    /* comma-separated list of index names such as "sp2o,po2s,s2po" */
+    const char *p=indexes;
+    
+    while(*p && !status) {
+      char index_name[16];
+      size_t len;
+
+      while(*p == ' ' || *p == ',')
+        p++;
+      for(len=0; p[len] && p[len] != ',' && p[len] != ' '; len++)
+        ;
+      if(!len)
+        break;
+
+      if(len >= sizeof(index_name)) {
+        librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE,
+                   NULL, "Unknown hashes storage index '%.*s'", (int)len, p);
+        status=1;
+        break;
+      }
+      memcpy(index_name, p, len);
+      index_name[len]='\0';
+      p+=len;
+
+      status=librdf_storage_hashes_register_by_name(storage, name, index_name);
+    }
+  } else {
+    for(i=0; i<3; i++) {
+      status=librdf_storage_hashes_register(storage, name,
+                                            &librdf_storage_hashes_descriptions[i]);
+      if(status)
+        break;
+    }
   }
 
   if(index_predicates && !status)
-    status=librdf_storage_hashes_register(storage, name,
-                                          librdf_storage_get_hash_description_by_name("p2so"));
+    status=librdf_storage_hashes_register_by_name(storage, name, "p2so");
+
+  if(index_contexts && !status) {
+    status=librdf_storage_hashes_register_by_name(storage, name, "contexts");
+    /* with the default indexes, let contains use one exists probe */
+    if(!indexes && !status)
+      status=librdf_storage_hashes_register_by_name(storage, name, "spo2c");
+  }
 
-  if(index_contexts && !status)
-    librdf_storage_hashes_register(storage, name,
-                                   librdf_storage_get_hash_description_by_name("contexts"));
+  if(use_dictionary && !status) {
+    context->term2id=librdf_new_hash(storage->world, context->hash_type);
+    context->id2term=librdf_new_hash(storage->world, context->hash_type);
+    if(!context->term2id || !context->id2term)
+      status=1;
+    else if(name) {
+      context->term2id_name=librdf_storage_hashes_hash_name(context, name,
+                                                            "term2id");
+      context->id2term_name=librdf_storage_hashes_hash_name(context, name,
+                                                            "id2term");
+      if(!context->term2id_name || !context->id2term_name)
+        status=1;
+    }
+  }
 
 
   /* find indexes for get targets, sources and arcs */
   context->sources_index= -1;
   context->arcs_index= -1;
   context->targets_index= -1;
-  context->p2so_index= -1;
   /* and index for contexts (no key or value fields) */
   context->contexts_index= -1;
+  context->contains_index= -1;
 
   context->all_statements_hash_index= -1;
 
@@ -346,14 +533,22 @@ librdf_storage_hashes_init_common(librdf_storage* storage, const char *name,
     } else if(key_fields == (LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_OBJECT) &&
               value_fields == LIBRDF_STATEMENT_PREDICATE) {
       context->arcs_index=i;
-    } else if(key_fields == LIBRDF_STATEMENT_PREDICATE &&
-              value_fields == (LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_OBJECT)) {
-      context->p2so_index=i;
-    } else if(!key_fields || !value_fields) {
+    } else if(key_fields == (LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_PREDICATE|LIBRDF_STATEMENT_OBJECT)) {
+      context->contains_index=i;
+    } else if(!key_fields) {
        context->contexts_index=i;
     }
   }
 
+  /* contexts may also be enabled by listing the index in indexes */
+  context->index_contexts=(context->contexts_index >= 0);
+
+  if(!status && context->all_statements_hash_index < 0) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "Hashes storage needs at least one statement index");
+    status=1;
+  }
+
   return status;
 }
 
@@ -445,6 +640,19 @@ librdf_storage_hashes_terminate(librdf_storage* storage)
     LIBRDF_FREE(data, context->key_buffer);
   if(context->value_buffer)
     LIBRDF_FREE(data, context->value_buffer);
+  if(context->parts_buffer)
+    LIBRDF_FREE(data, context->parts_buffer);
+  if(context->term_buffer)
+    LIBRDF_FREE(data, context->term_buffer);
+
+  if(context->term2id)
+    librdf_free_hash(context->term2id);
+  if(context->id2term)
+    librdf_free_hash(context->id2term);
+  if(context->term2id_name)
+    LIBRDF_FREE(cstring, context->term2id_name);
+  if(context->id2term_name)
+    LIBRDF_FREE(cstring, context->id2term_name);
 
   if(context->name)
     LIBRDF_FREE(cstring, context->name);
@@ -524,6 +732,21 @@ librdf_storage_hashes_open(librdf_storage* storage, librdf_model* model)
       break;
   }
 
+  if(!result && context->term2id &&
+     librdf_storage_hashes_open_dictionary(storage)) {
+    for(i=0; i<context->hash_count; i++) {
+      librdf_hash_close(context->hashes[i]);
+      context->hashes[i]=NULL;
+    }
+    result=1;
+  }
+
+  if(!result && context->is_writable && !context->is_new &&
+     librdf_storage_hashes_fill_indexes(storage)) {
+    librdf_storage_hashes_close(storage);
+    result=1;
+  }
+
   return result;
 }
 
@@ -542,11 +765,20 @@ librdf_storage_hashes_close(librdf_storage* storage)
   librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
   int i;
   
+  if(context->in_transaction)
+    librdf_storage_hashes_transaction_rollback(storage);
+
   for(i=0; i<context->hash_count; i++) {
     if(context->hashes[i])
       librdf_hash_close(context->hashes[i]);
   }
   
+  if(context->term2id) {
+    librdf_storage_hashes_store_term_ids(storage);
+    librdf_hash_close(context->term2id);
+    librdf_hash_close(context->id2term);
+  }
+
   return 0;
 }
 
@@ -581,246 +813,1132 @@ librdf_storage_hashes_grow_buffer(unsigned char **buffer, size_t *len,
 }
 
 
-static int
-librdf_storage_hashes_add_remove_statement(librdf_storage* storage, 
-                                           librdf_statement* statement,
-                                           librdf_node* context_node,
-                                           int is_addition)
-{
-  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
-  int i;
-  int status=0;
-  librdf_world* world = storage->world;
-
-#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
-  if(is_addition)
-    LIBRDF_DEBUG1("Adding statement: ");
-  else
-    LIBRDF_DEBUG1("Removing statement: ");
-  librdf_statement_print(statement, stderr);
-  fputc('\n', stderr);
-#endif  
-
-  for(i=0; i<context->hash_count; i++) {
-    librdf_hash_datum hd_key, hd_value; /* on stack */
-    int key_len, value_len;
-
-    /* ENCODE KEY */
+/* longest term ID encoding: 7 bits per byte of an unsigned long */
+#define LIBRDF_STORAGE_HASHES_TERM_ID_MAX_LEN ((sizeof(unsigned long) * 8 + 6) / 7)
 
-    librdf_statement_part fields=(librdf_statement_part)context->hash_descriptions[i]->key_fields;
-    if(!fields)
-      continue;
-    
-    key_len=librdf_statement_encode_parts2(world, statement, NULL, NULL, 0, fields);
-    if(!key_len)
-      return 1;
-    if(librdf_storage_hashes_grow_buffer(&context->key_buffer, 
-                                         &context->key_buffer_len, key_len)) {
-      status=1;
-      break;
-    }
-       
-    if(!librdf_statement_encode_parts2(world, statement, NULL,
-                                       context->key_buffer,
-                                       context->key_buffer_len, fields)) {
-      status=1;
-      break;
-    }
 
-    
-    /* ENCODE VALUE */
-    
-    fields=(librdf_statement_part)context->hash_descriptions[i]->value_fields;
-    if(!fields)
-      continue;
-    
-    value_len=librdf_statement_encode_parts2(world, statement, context_node,
-                                             NULL, 0, fields);
-    if(!value_len) {
-      status=1;
-      break;
-    }
-    
-    if(librdf_storage_hashes_grow_buffer(&context->value_buffer, 
-                                         &context->value_buffer_len, value_len)) {
-      status=1;
-      break;
-    }
-       
-    if(!librdf_statement_encode_parts2(world, statement, context_node,
-                                       context->value_buffer,
-                                       context->value_buffer_len, fields)) {
-      status=1;
-      break;
+/*
+ * librdf_storage_hashes_encode_term_id:
+ * @id: term ID
+ * @buffer: buffer of at least LIBRDF_STORAGE_HASHES_TERM_ID_MAX_LEN bytes or NULL
+ *
+ * INTERNAL - Encode a term ID as 7 bits per byte, most significant first
+ *
+ * All bytes but the last have the top bit set so the encodings are
+ * self-delimiting and none is a prefix of another, as with node
+ * encodings.  This keeps key prefix range scans working.
+ *
+ * Return value: the number of bytes (to be) written
+ **/
+static size_t
+librdf_storage_hashes_encode_term_id(unsigned long id, unsigned char *buffer)
+{
+  size_t len=1;
+  unsigned long v;
+  size_t i;
+
+  for(v=id >> 7; v; v >>= 7)
+    len++;
+
+  if(buffer) {
+    for(i=0; i < len; i++) {
+      buffer[i]=(unsigned char)((id >> (7 * (len - 1 - i))) & 0x7f);
+      if(i < len - 1)
+        buffer[i]|=0x80;
     }
-
-
-#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
-    LIBRDF_DEBUG4("Using %s hash key %d bytes -> value %d bytes\n", context->hash_descriptions[i]->name, key_len, value_len);
-#endif
-
-    /* Finally, store / remove the sucker */
-    hd_key.data=context->key_buffer; hd_key.size=key_len;
-    hd_value.data=context->value_buffer; hd_value.size=value_len;
-    
-    if(is_addition)
-      status=librdf_hash_put(context->hashes[i], &hd_key, &hd_value);
-    else
-      status=librdf_hash_delete(context->hashes[i], &hd_key, &hd_value);
-    
-    if(status)
-      break;
   }
 
-  return status;
+  return len;
 }
 
 
-static int
-librdf_storage_hashes_add_statement(librdf_storage* storage, librdf_statement* statement)
+/*
+ * librdf_storage_hashes_decode_term_id:
+ * @buffer: buffer
+ * @length: buffer size
+ * @id_p: pointer to store the term ID
+ *
+ * INTERNAL - Decode a term ID encoded by librdf_storage_hashes_encode_term_id()
+ *
+ * Return value: the number of bytes used or 0 on failure
+ **/
+static size_t
+librdf_storage_hashes_decode_term_id(const unsigned char *buffer,
+                                     size_t length, unsigned long *id_p)
 {
-  /* Do not add duplicate statements */
-  if(librdf_storage_hashes_contains_statement(storage, statement))
-    return 0;
+  unsigned long id=0;
+  size_t i;
+
+  for(i=0; i < length && i < LIBRDF_STORAGE_HASHES_TERM_ID_MAX_LEN; i++) {
+    id=(id << 7) | (buffer[i] & 0x7f);
+    if(!(buffer[i] & 0x80)) {
+      *id_p=id;
+      return i+1;
+    }
+  }
 
-  return librdf_storage_hashes_add_remove_statement(storage, statement, NULL, 1);
+  return 0;
 }
 
 
+/*
+ * librdf_storage_hashes_open_dictionary:
+ * @storage: the storage hashes object
+ *
+ * INTERNAL - Open the term dictionary hashes and find the next free term ID
+ *
+ * Term ID 0 is never given to a term; in the id2term hash it is the
+ * key of the next free ID, stored on sync and close.  IDs given out
+ * after it was last stored are found by probing forward.
+ *
+ * Return value: non 0 on failure
+ **/
 static int
-librdf_storage_hashes_add_statements(librdf_storage* storage,
-                                     librdf_stream* statement_stream)
+librdf_storage_hashes_open_dictionary(librdf_storage* storage)
 {
-  int status=0;
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  unsigned char id_buffer[LIBRDF_STORAGE_HASHES_TERM_ID_MAX_LEN];
+  librdf_hash_datum key; /* on stack */
+  librdf_hash_datum *value;
+  unsigned long stored_id=1;
 
-  while(!librdf_stream_end(statement_stream)) {
-    librdf_statement* statement=librdf_stream_get_object(statement_stream);
+  if(librdf_hash_open(context->term2id, context->term2id_name,
+                      context->mode, context->is_writable, context->is_new,
+                      context->options))
+    return 1;
 
-    if(statement) {
-      status=librdf_storage_hashes_add_statement(storage, statement);
-    } else
-      status=1;
+  if(librdf_hash_open(context->id2term, context->id2term_name,
+                      context->mode, context->is_writable, context->is_new,
+                      context->options)) {
+    librdf_hash_close(context->term2id);
+    return 1;
+  }
 
-    if(status)
-      break;
+  key.data=id_buffer;
+  key.size=librdf_storage_hashes_encode_term_id(0, id_buffer);
+  value=librdf_hash_get_one(context->id2term, &key);
+  if(value) {
+    if(!librdf_storage_hashes_decode_term_id((unsigned char*)value->data,
+                                             value->size, &stored_id))
+      stored_id=1;
+    librdf_free_hash_datum(value);
+  }
 
-    librdf_stream_next(statement_stream);
+  context->next_term_id=stored_id;
+  while(1) {
+    key.size=librdf_storage_hashes_encode_term_id(context->next_term_id,
+                                                  id_buffer);
+    if(librdf_hash_exists(context->id2term, &key, NULL) <= 0)
+      break;
+    context->next_term_id++;
   }
+  context->term_ids_dirty=(context->next_term_id != stored_id);
 
-  return status;
+  return 0;
 }
 
 
+/*
+ * librdf_storage_hashes_store_term_ids:
+ * @storage: the storage hashes object
+ *
+ * INTERNAL - Store the next free term ID if it has changed
+ *
+ * Return value: non 0 on failure
+ **/
 static int
-librdf_storage_hashes_remove_statement(librdf_storage* storage, librdf_statement* statement)
+librdf_storage_hashes_store_term_ids(librdf_storage* storage)
 {
-  return librdf_storage_hashes_add_remove_statement(storage, statement, NULL, 0);
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  unsigned char key_buffer[LIBRDF_STORAGE_HASHES_TERM_ID_MAX_LEN];
+  unsigned char value_buffer[LIBRDF_STORAGE_HASHES_TERM_ID_MAX_LEN];
+  librdf_hash_datum key, value; /* on stack */
+
+  if(!context->term_ids_dirty)
+    return 0;
+
+  key.data=key_buffer;
+  key.size=librdf_storage_hashes_encode_term_id(0, key_buffer);
+  value.data=value_buffer;
+  value.size=librdf_storage_hashes_encode_term_id(context->next_term_id,
+                                                  value_buffer);
+
+  /* hashes may hold several values per key, so replace it */
+  librdf_hash_delete_all(context->id2term, &key);
+  if(librdf_hash_put(context->id2term, &key, &value))
+    return 1;
+
+  context->term_ids_dirty=0;
+  return 0;
 }
 
 
+/*
+ * librdf_storage_hashes_get_term_id:
+ * @storage: the storage hashes object
+ * @node: node to look up
+ * @create: non 0 to give @node a new ID if it has none
+ * @id_p: pointer to store the term ID
+ *
+ * INTERNAL - Find the term ID of a node in the term dictionary
+ *
+ * Return value: 0 on success, <0 if @node has no ID and @create is 0,
+ * >0 on failure
+ **/
 static int
-librdf_storage_hashes_contains_statement(librdf_storage* storage, librdf_statement* statement)
+librdf_storage_hashes_get_term_id(librdf_storage* storage, librdf_node* node,
+                                  int create, unsigned long *id_p)
 {
   librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
-  librdf_hash_datum hd_key, hd_value; /* on stack */
-  unsigned char *key_buffer, *value_buffer;
-  int key_len, value_len;
-  int hash_index=context->all_statements_hash_index;
-  librdf_statement_part fields;
-  int status;
-  librdf_world* world = storage->world;
-  
-  if(storage->index_contexts) {
-    /* When we have contexts, we have to use find_statements for contains
-     * since a statement is encoded in KEY/VALUE and the VALUE may
-     * contain some context node.
-     */
-    librdf_stream *stream=librdf_storage_hashes_find_statements(storage, statement);
-    
-    if(!stream)
-      return 0;
-    /* librdf_stream_end returns 0 if have more, non-0 at end */
-    status=!librdf_stream_end(stream);
-    /* convert to 0 if at end (not found) and non-zero otherwise (found) */
-    librdf_free_stream(stream);
-    return status;
-  }
+  unsigned char id_buffer[LIBRDF_STORAGE_HASHES_TERM_ID_MAX_LEN];
+  librdf_hash_datum key, id; /* on stack */
+  librdf_hash_datum *value;
+  size_t len;
+  int status=0;
 
-  /* ENCODE KEY */
-  fields=(librdf_statement_part)context->hash_descriptions[hash_index]->key_fields;
-  key_len=librdf_statement_encode_parts2(world, statement, NULL,
-                                         NULL, 0, fields);
-  if(!key_len)
+  len=librdf_node_encode(node, NULL, 0);
+  if(!len)
     return 1;
-  if(!(key_buffer=(unsigned char*)LIBRDF_MALLOC(data, key_len)))
+  if(librdf_storage_hashes_grow_buffer(&context->term_buffer,
+                                       &context->term_buffer_len, len))
     return 1;
-       
-  if(!librdf_statement_encode_parts2(world, statement, NULL,
-                                     key_buffer, key_len, fields)) {
-    LIBRDF_FREE(data, key_buffer);
+  if(!librdf_node_encode(node, context->term_buffer, len))
     return 1;
-  }
 
-  /* ENCODE VALUE */
-  fields=(librdf_statement_part)context->hash_descriptions[hash_index]->value_fields;
-  value_len=librdf_statement_encode_parts2(world, statement, NULL,
-                                           NULL, 0, fields);
-  if(!value_len) {
-    LIBRDF_FREE(data, key_buffer);
-    return 1;
-  }
-    
-  if(!(value_buffer=(unsigned char*)LIBRDF_MALLOC(data, value_len))) {
-    LIBRDF_FREE(data, key_buffer);
-    return 1;
+  key.data=context->term_buffer;
+  key.size=len;
+
+  value=librdf_hash_get_one(context->term2id, &key);
+  if(value) {
+    if(!librdf_storage_hashes_decode_term_id((unsigned char*)value->data,
+                                             value->size, id_p))
+      status=1;
+    librdf_free_hash_datum(value);
+    return status;
   }
 
-       
-  if(!librdf_statement_encode_parts2(world, statement, NULL,
-                                     value_buffer, value_len, fields)) {
-    LIBRDF_FREE(data, key_buffer);
-    LIBRDF_FREE(data, value_buffer);
+  /* NULL is also returned when the lookup fails; minting a second ID
+   * for a stored term would lose the statements stored under the first */
+  status=librdf_hash_exists(context->term2id, &key, NULL);
+  if(status)
     return 1;
-  }
 
+  if(!create)
+    return -1;
+
+  *id_p=context->next_term_id++;
+  context->term_ids_dirty=1;
 
-#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
-  LIBRDF_DEBUG4("Using %s hash key %d bytes -> value %d bytes\n", context->hash_descriptions[hash_index]->name, key_len, value_len);
-#endif
+  id.data=id_buffer;
+  id.size=librdf_storage_hashes_encode_term_id(*id_p, id_buffer);
 
-  hd_key.data=key_buffer; hd_key.size=key_len;
-  hd_value.data=value_buffer; hd_value.size=value_len;
-  status=librdf_hash_exists(context->hashes[hash_index], &hd_key, &hd_value);
-  
-  LIBRDF_FREE(data, key_buffer);
-  LIBRDF_FREE(data, value_buffer);
+  if(librdf_hash_put(context->term2id, &key, &id) ||
+     librdf_hash_put(context->id2term, &id, &key))
+    return 1;
 
-  /* DO NOT free statement, ownership was not passed in */
-  return status;
+  return 0;
 }
 
 
-
-typedef struct {
-  librdf_storage *storage;
-  librdf_storage_hashes_instance* hash_context;
-  int index;
-  librdf_iterator* iterator;
-  librdf_hash_datum *key;
+/*
+ * librdf_storage_hashes_decode_term:
+ * @storage: the storage hashes object
+ * @buffer: buffer starting with an encoded term ID
+ * @length: buffer size
+ * @length_p: pointer to store the number of bytes used (or NULL)
+ *
+ * INTERNAL - Find the node for an encoded term ID in the term dictionary
+ *
+ * Return value: new #librdf_node or NULL on failure
+ **/
+static librdf_node*
+librdf_storage_hashes_decode_term(librdf_storage* storage,
+                                  unsigned char *buffer, size_t length,
+                                  size_t *length_p)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_hash_datum key; /* on stack */
   librdf_hash_datum *value;
-  librdf_node *search_node;
-  librdf_statement current; /* static, shared when search_node not used */
-  int index_contexts; /* true if this storage indexes contexts */
-  librdf_node *context_node;
-  int current_is_ok; /* true when current statement and context_node fresh */
-} librdf_storage_hashes_serialise_stream_context;
+  librdf_node* node;
+  unsigned long id;
+  size_t len;
 
+  len=librdf_storage_hashes_decode_term_id(buffer, length, &id);
+  if(!len)
+    return NULL;
 
-static librdf_stream*
-librdf_storage_hashes_serialise_common(librdf_storage* storage, int hash_index,
-                                       librdf_node* search_node, int want)
-{
-  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  key.data=buffer;
+  key.size=len;
+  value=librdf_hash_get_one(context->id2term, &key);
+  if(!value)
+    return NULL;
+
+  node=librdf_node_decode(storage->world, NULL,
+                          (unsigned char*)value->data, value->size);
+  librdf_free_hash_datum(value);
+
+  if(length_p)
+    *length_p=len;
+  return node;
+}
+
+
+/*
+ * librdf_storage_hashes_term_cache_clear:
+ * @cache: the term cache
+ *
+ * INTERNAL - Free the nodes held by a term cache
+ **/
+static void
+librdf_storage_hashes_term_cache_clear(librdf_storage_hashes_term_cache* cache)
+{
+  int i;
+
+  for(i=0; i < 4; i++) {
+    if(cache->nodes[i]) {
+      librdf_free_node(cache->nodes[i]);
+      cache->nodes[i]=NULL;
+    }
+  }
+}
+
+
+/*
+ * librdf_storage_hashes_decode_parts:
+ * @storage: the storage hashes object
+ * @statement: statement to decode into
+ * @context_node: pointer to store the context node (or NULL)
+ * @buffer: the buffer to use
+ * @length: buffer size
+ * @cache: term cache of the calling stream or iterator (or NULL)
+ *
+ * INTERNAL - Decode a key or value as librdf_statement_decode2() does
+ *
+ * With a term dictionary, each part is looked up by term ID and the
+ * context is only looked up when @context_node is given.  A part with
+ * the same term ID as the last one decoded into the same position of
+ * @cache is copied from the cache without a dictionary lookup.
+ *
+ * Return value: number of bytes used or 0 on failure
+ **/
+static size_t
+librdf_storage_hashes_decode_parts(librdf_storage* storage,
+                                   librdf_statement* statement,
+                                   librdf_node** context_node,
+                                   unsigned char *buffer, size_t length,
+                                   librdf_storage_hashes_term_cache* cache)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  unsigned char *p;
+
+  if(!context->id2term)
+    return librdf_statement_decode2(storage->world, statement, context_node,
+                                    buffer, length);
+
+  if(length < 1 || *buffer != 'x')
+    return 0;
+  p=buffer+1;
+  length--;
+
+  while(length > 0) {
+    unsigned char type=*p++;
+    librdf_node* node=NULL;
+    unsigned long id;
+    size_t len;
+    int position;
+
+    length--;
+
+    switch(type) {
+      case 's': position=0; break;
+      case 'p': position=1; break;
+      case 'o': position=2; break;
+      default:  position=3; break;
+    }
+
+    len=librdf_storage_hashes_decode_term_id(p, length, &id);
+    if(!len)
+      return 0;
+
+    if(type != 'c' || context_node) {
+      if(cache && cache->nodes[position] && cache->ids[position] == id)
+        node=librdf_new_node_from_node(cache->nodes[position]);
+      else {
+        node=librdf_storage_hashes_decode_term(storage, p, length, NULL);
+        if(node && cache) {
+          if(cache->nodes[position])
+            librdf_free_node(cache->nodes[position]);
+          cache->ids[position]=id;
+          cache->nodes[position]=librdf_new_node_from_node(node);
+        }
+      }
+      if(!node)
+        return 0;
+    }
+    p+=len;
+    length-=len;
+
+    switch(type) {
+      case 's': /* subject */
+        librdf_statement_set_subject(statement, node);
+        break;
+        
+      case 'p': /* predicate */
+        librdf_statement_set_predicate(statement, node);
+        break;
+        
+      case 'o': /* object */
+        librdf_statement_set_object(statement, node);
+        break;
+
+      case 'c': /* context */
+        if(context_node)
+          *context_node=node;
+        break;
+
+      default:
+        if(node)
+          librdf_free_node(node);
+        librdf_log(storage->world,
+                   0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                   "Illegal statement encoding '%c' seen", type);
+        return 0;
+    }
+  }
+
+  return p - buffer;
+}
+
+
+/*
+ * librdf_storage_hashes_encode_parts:
+ * @storage: the storage hashes object
+ * @statement: statement to encode (or NULL)
+ * @context_node: context node (or NULL)
+ * @create: non 0 to add nodes missing from the term dictionary
+ *
+ * INTERNAL - Encode each statement node once into the parts buffer
+ *
+ * With a term dictionary, the parts are term IDs.
+ *
+ * Return value: 0 on success, <0 if a node is not in the term
+ * dictionary and @create is 0, >0 on failure
+ **/
+static int
+librdf_storage_hashes_encode_parts(librdf_storage* storage,
+                                   librdf_statement* statement,
+                                   librdf_node* context_node,
+                                   int create)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_node* nodes[4];
+  unsigned long ids[4];
+  size_t total_len=0;
+  int i;
+
+  nodes[0]=statement ? librdf_statement_get_subject(statement) : NULL;
+  nodes[1]=statement ? librdf_statement_get_predicate(statement) : NULL;
+  nodes[2]=statement ? librdf_statement_get_object(statement) : NULL;
+  nodes[3]=context_node;
+
+  for(i=0; i<4; i++) {
+    context->parts_offset[i]=total_len;
+    context->parts_len[i]=0;
+    if(!nodes[i])
+      continue;
+    
+    if(context->term2id) {
+      int rc=librdf_storage_hashes_get_term_id(storage, nodes[i], create,
+                                               &ids[i]);
+      if(rc)
+        return rc;
+      context->parts_len[i]=librdf_storage_hashes_encode_term_id(ids[i], NULL);
+    } else {
+      context->parts_len[i]=librdf_node_encode(nodes[i], NULL, 0);
+      if(!context->parts_len[i])
+        return 1;
+    }
+    total_len+=context->parts_len[i];
+  }
+
+  if(librdf_storage_hashes_grow_buffer(&context->parts_buffer,
+                                       &context->parts_buffer_len, total_len))
+    return 1;
+
+  for(i=0; i<4; i++) {
+    unsigned char *buffer=context->parts_buffer + context->parts_offset[i];
+
+    if(!nodes[i])
+      continue;
+    
+    if(context->term2id)
+      librdf_storage_hashes_encode_term_id(ids[i], buffer);
+    else if(!librdf_node_encode(nodes[i], buffer, context->parts_len[i]))
+      return 1;
+  }
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_hashes_assemble_parts:
+ * @context: the storage hashes instance
+ * @fields: OR of LIBRDF_STATEMENT_* parts to include
+ * @with_context: non 0 to include the context node, if any
+ * @buffer: buffer to write to or NULL to only return the size
+ *
+ * INTERNAL - Build a key or value from the encoded parts buffer
+ *
+ * Without a term dictionary, the result is the same as
+ * librdf_statement_encode_parts2() gives for the statement and context
+ * node passed to librdf_storage_hashes_encode_parts().
+ *
+ * Return value: the number of bytes (to be) written
+ **/
+static size_t
+librdf_storage_hashes_assemble_parts(librdf_storage_hashes_instance* context,
+                                     int fields, int with_context,
+                                     unsigned char *buffer)
+{
+  static const int part_fields[3]={ LIBRDF_STATEMENT_SUBJECT,
+                                    LIBRDF_STATEMENT_PREDICATE,
+                                    LIBRDF_STATEMENT_OBJECT };
+  static const char part_tags[4]={ 's', 'p', 'o', 'c' };
+  size_t total_len=1;
+  int i;
+
+  /* magic number 'x' */
+  if(buffer)
+    *buffer++='x';
+
+  for(i=0; i<4; i++) {
+    size_t len=context->parts_len[i];
+
+    if(!len)
+      continue;
+    if(i < 3 ? !(fields & part_fields[i]) : !with_context)
+      continue;
+    
+    if(buffer) {
+      *buffer++=(unsigned char)part_tags[i];
+      memcpy(buffer, context->parts_buffer + context->parts_offset[i], len);
+      buffer+=len;
+    }
+    total_len+=1+len;
+  }
+
+  return total_len;
+}
+
+
+/*
+ * librdf_storage_hashes_update_hash:
+ * @context: the storage hashes instance
+ * @hash_index: index of a statement hash
+ * @is_addition: non 0 to add, 0 to remove
+ *
+ * INTERNAL - Add or remove the statement in the parts buffer to one hash
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_hashes_update_hash(librdf_storage_hashes_instance* context,
+                                  int hash_index, int is_addition)
+{
+  librdf_hash_datum hd_key, hd_value; /* on stack */
+  size_t key_len, value_len;
+  int key_fields=context->hash_descriptions[hash_index]->key_fields;
+  int value_fields=context->hash_descriptions[hash_index]->value_fields;
+
+  /* ENCODE KEY */
+  key_len=librdf_storage_hashes_assemble_parts(context, key_fields, 0, NULL);
+  if(librdf_storage_hashes_grow_buffer(&context->key_buffer, 
+                                       &context->key_buffer_len, key_len))
+    return 1;
+  librdf_storage_hashes_assemble_parts(context, key_fields, 0,
+                                       context->key_buffer);
+
+  /* ENCODE VALUE */
+  value_len=librdf_storage_hashes_assemble_parts(context, value_fields, 1,
+                                                 NULL);
+  if(librdf_storage_hashes_grow_buffer(&context->value_buffer, 
+                                       &context->value_buffer_len, value_len))
+    return 1;
+  librdf_storage_hashes_assemble_parts(context, value_fields, 1,
+                                       context->value_buffer);
+
+
+#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
+  LIBRDF_DEBUG4("Using %s hash key %d bytes -> value %d bytes\n", context->hash_descriptions[hash_index]->name, (int)key_len, (int)value_len);
+#endif
+
+  /* Finally, store / remove the sucker */
+  hd_key.data=context->key_buffer; hd_key.size=key_len;
+  hd_value.data=context->value_buffer; hd_value.size=value_len;
+    
+  if(is_addition)
+    return librdf_hash_put(context->hashes[hash_index], &hd_key, &hd_value);
+  else
+    return librdf_hash_delete(context->hashes[hash_index], &hd_key, &hd_value);
+}
+
+
+static int
+librdf_storage_hashes_add_remove_statement(librdf_storage* storage, 
+                                           librdf_statement* statement,
+                                           librdf_node* context_node,
+                                           int is_addition)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  int i;
+  int status=0;
+
+#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
+  if(is_addition)
+    LIBRDF_DEBUG1("Adding statement: ");
+  else
+    LIBRDF_DEBUG1("Removing statement: ");
+  librdf_statement_print(statement, stderr);
+  fputc('\n', stderr);
+#endif  
+
+  /* Encode the nodes once, keys and values are copied from them;
+   * a removed statement with a node not in the dictionary is absent */
+  status=librdf_storage_hashes_encode_parts(storage, statement, context_node,
+                                            is_addition);
+  if(status)
+    return status;
+
+  for(i=0; i<context->hash_count; i++) {
+    /* contexts hash is not touched here */
+    if(!context->hash_descriptions[i]->key_fields)
+      continue;
+    
+    status=librdf_storage_hashes_update_hash(context, i, is_addition);
+    if(status)
+      break;
+  }
+
+  return status;
+}
+
+
+static int
+librdf_storage_hashes_add_statement(librdf_storage* storage, librdf_statement* statement)
+{
+  int status;
+
+  /* Do not add duplicate statements */
+  status=librdf_storage_hashes_has_statement(storage, statement);
+  if(status)
+    return (status < 0) ? 1 : 0;
+
+  return librdf_storage_hashes_add_remove_statement(storage, statement, NULL, 1);
+}
+
+
+/*
+ * librdf_storage_hashes_bulk_entry_compare:
+ * @a: pointer to first #librdf_storage_hashes_bulk_entry
+ * @b: pointer to second #librdf_storage_hashes_bulk_entry
+ *
+ * INTERNAL - qsort comparison of bulk entries by key then value
+ *
+ * Bytes compare as in the default BDB BTree order, with a prefix
+ * before longer keys.
+ *
+ * Return value: <0, 0 or >0 as for memcmp()
+ **/
+static int
+librdf_storage_hashes_bulk_entry_compare(const void *a, const void *b)
+{
+  const librdf_storage_hashes_bulk_entry* e1=(const librdf_storage_hashes_bulk_entry*)a;
+  const librdf_storage_hashes_bulk_entry* e2=(const librdf_storage_hashes_bulk_entry*)b;
+  size_t len;
+  int rc;
+
+  len=(e1->key_len < e2->key_len) ? e1->key_len : e2->key_len;
+  rc=memcmp(e1->key, e2->key, len);
+  if(rc)
+    return rc;
+  if(e1->key_len != e2->key_len)
+    return (e1->key_len < e2->key_len) ? -1 : 1;
+
+  len=(e1->value_len < e2->value_len) ? e1->value_len : e2->value_len;
+  rc=memcmp(e1->value, e2->value, len);
+  if(rc)
+    return rc;
+  if(e1->value_len != e2->value_len)
+    return (e1->value_len < e2->value_len) ? -1 : 1;
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_hashes_bulk_write_run:
+ * @storage: the storage hashes object
+ * @entries: array of entries per hash, NULL for the contexts hash
+ * @count: number of statements in the run
+ * @buffer: run buffer holding the encoded keys and values
+ * @keep: array of @count flags to use
+ *
+ * INTERNAL - Write one run of statements to all hashes in key order
+ *
+ * Statements appearing earlier in the run or already stored are
+ * dropped first, as librdf_storage_hashes_add_statement() does.
+ * With contexts but no spo2c index, stored statements were already
+ * skipped when the run was filled.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_hashes_bulk_write_run(librdf_storage* storage,
+                                     librdf_storage_hashes_bulk_entry** entries,
+                                     int count, unsigned char *buffer,
+                                     char *keep)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_storage_hashes_bulk_entry* all_entries;
+  int all_index=context->all_statements_hash_index;
+  int probe_index;
+  int i, j;
+
+  for(i=0; i<context->hash_count; i++) {
+    if(!entries[i])
+      continue;
+    for(j=0; j<count; j++) {
+      entries[i][j].key=buffer + entries[i][j].key_offset;
+      entries[i][j].value=buffer + entries[i][j].value_offset;
+    }
+  }
+
+  /* De-duplicate in the key order of the all statements hash, which
+   * holds every statement once */
+  all_entries=entries[all_index];
+  qsort(all_entries, count, sizeof(librdf_storage_hashes_bulk_entry),
+        librdf_storage_hashes_bulk_entry_compare);
+  
+  for(j=0; j<count; j++) {
+    librdf_storage_hashes_bulk_entry* e=&all_entries[j];
+
+    keep[e->statement_index]=(j == 0 ||
+      librdf_storage_hashes_bulk_entry_compare(&all_entries[j-1], e) != 0);
+  }
+
+  /* Drop statements already stored, probing in key order.  With
+   * contexts a stored copy may be in any context so only the whole
+   * statement key of the spo2c index is probed. */
+  probe_index=context->index_contexts ? context->contains_index : all_index;
+  if(probe_index >= 0) {
+    if(probe_index != all_index)
+      qsort(entries[probe_index], count,
+            sizeof(librdf_storage_hashes_bulk_entry),
+            librdf_storage_hashes_bulk_entry_compare);
+
+    for(j=0; j<count; j++) {
+      librdf_storage_hashes_bulk_entry* e=&entries[probe_index][j];
+      librdf_hash_datum hd_key, hd_value; /* on stack */
+      int rc;
+
+      if(!keep[e->statement_index])
+        continue;
+      
+      hd_key.data=e->key; hd_key.size=e->key_len;
+      hd_value.data=e->value; hd_value.size=e->value_len;
+      rc=librdf_hash_exists(context->hashes[probe_index], &hd_key,
+                            context->index_contexts ? NULL : &hd_value);
+      if(rc < 0)
+        return 1;
+      if(rc)
+        keep[e->statement_index]=0;
+    }
+  }
+  
+  for(i=0; i<context->hash_count; i++) {
+    if(!entries[i])
+      continue;
+
+    if(i != all_index && i != probe_index)
+      qsort(entries[i], count, sizeof(librdf_storage_hashes_bulk_entry),
+            librdf_storage_hashes_bulk_entry_compare);
+
+    for(j=0; j<count; j++) {
+      librdf_storage_hashes_bulk_entry* e=&entries[i][j];
+      librdf_hash_datum hd_key, hd_value; /* on stack */
+
+      if(!keep[e->statement_index])
+        continue;
+      
+      hd_key.data=e->key; hd_key.size=e->key_len;
+      hd_value.data=e->value; hd_value.size=e->value_len;
+      if(librdf_hash_put(context->hashes[i], &hd_key, &hd_value))
+        return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_hashes_bulk_add_statements:
+ * @storage: the storage hashes object
+ * @statement_stream: stream of statements to add
+ *
+ * INTERNAL - Add statements in sorted runs of bulk_run_size statements
+ *
+ * Each run is encoded into one buffer, then every hash is written in
+ * key order which is much faster for BTree hashes than the order
+ * statements arrive in.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_hashes_bulk_add_statements(librdf_storage* storage,
+                                          librdf_stream* statement_stream)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  int run_size=context->bulk_run_size;
+  librdf_storage_hashes_bulk_entry** entries;
+  unsigned char *buffer=NULL;
+  size_t buffer_size=0;
+  char *keep=NULL;
+  int status=0;
+  int i;
+
+  entries=(librdf_storage_hashes_bulk_entry**)LIBRDF_CALLOC(librdf_storage_hashes_bulk_entry, context->hash_count, sizeof(librdf_storage_hashes_bulk_entry*));
+  if(!entries)
+    return 1;
+
+  for(i=0; i<context->hash_count; i++) {
+    /* contexts hash is not touched here */
+    if(!context->hash_descriptions[i]->key_fields)
+      continue;
+    
+    entries[i]=(librdf_storage_hashes_bulk_entry*)LIBRDF_MALLOC(librdf_storage_hashes_bulk_entry, run_size * sizeof(librdf_storage_hashes_bulk_entry));
+    if(!entries[i]) {
+      status=1;
+      goto tidy;
+    }
+  }
+
+  keep=(char*)LIBRDF_MALLOC(cstring, run_size);
+  if(!keep) {
+    status=1;
+    goto tidy;
+  }
+
+  while(!librdf_stream_end(statement_stream)) {
+    size_t buffer_len=0;
+    int count;
+    
+    for(count=0;
+        count < run_size && !librdf_stream_end(statement_stream);
+        librdf_stream_next(statement_stream)) {
+      librdf_statement* statement=librdf_stream_get_object(statement_stream);
+      size_t needed=0;
+
+      if(!statement) {
+        status=1;
+        goto tidy;
+      }
+
+      /* With contexts but no spo2c index, the key order probe in the
+       * run writer cannot find a stored copy in some context */
+      if(context->index_contexts && context->contains_index < 0) {
+        int rc=librdf_storage_hashes_has_statement(storage, statement);
+
+        if(rc < 0) {
+          status=1;
+          goto tidy;
+        }
+        if(rc)
+          continue;
+      }
+
+      if(librdf_storage_hashes_encode_parts(storage, statement, NULL, 1)) {
+        status=1;
+        goto tidy;
+      }
+
+      for(i=0; i<context->hash_count; i++) {
+        if(!entries[i])
+          continue;
+        needed+=librdf_storage_hashes_assemble_parts(context,
+                                                     context->hash_descriptions[i]->key_fields,
+                                                     0, NULL);
+        needed+=librdf_storage_hashes_assemble_parts(context,
+                                                     context->hash_descriptions[i]->value_fields,
+                                                     1, NULL);
+      }
+
+      if(buffer_len + needed > buffer_size) {
+        size_t new_size=(buffer_len + needed) * 2;
+        unsigned char *new_buffer;
+
+        new_buffer=(unsigned char*)LIBRDF_REALLOC(data, buffer, new_size);
+        if(!new_buffer) {
+          status=1;
+          goto tidy;
+        }
+        buffer=new_buffer;
+        buffer_size=new_size;
+      }
+
+      for(i=0; i<context->hash_count; i++) {
+        librdf_storage_hashes_bulk_entry* e;
+
+        if(!entries[i])
+          continue;
+
+        e=&entries[i][count];
+        e->statement_index=count;
+        e->key_offset=buffer_len;
+        e->key_len=librdf_storage_hashes_assemble_parts(context,
+                                                        context->hash_descriptions[i]->key_fields,
+                                                        0, buffer + buffer_len);
+        buffer_len+=e->key_len;
+        e->value_offset=buffer_len;
+        e->value_len=librdf_storage_hashes_assemble_parts(context,
+                                                          context->hash_descriptions[i]->value_fields,
+                                                          1, buffer + buffer_len);
+        buffer_len+=e->value_len;
+      }
+      count++;
+    }
+
+    if(!count)
+      continue;
+
+    if(librdf_storage_hashes_bulk_write_run(storage, entries, count,
+                                            buffer, keep)) {
+      status=1;
+      break;
+    }
+  }
+
+  tidy:
+  for(i=0; i<context->hash_count; i++) {
+    if(entries[i])
+      LIBRDF_FREE(librdf_storage_hashes_bulk_entry, entries[i]);
+  }
+  LIBRDF_FREE(librdf_storage_hashes_bulk_entry, entries);
+  if(keep)
+    LIBRDF_FREE(cstring, keep);
+  if(buffer)
+    LIBRDF_FREE(data, buffer);
+
+  return status;
+}
+
+
+static int
+librdf_storage_hashes_add_statements(librdf_storage* storage,
+                                     librdf_stream* statement_stream)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  int status=0;
+
+  if(context->bulk_run_size > 1)
+    return librdf_storage_hashes_bulk_add_statements(storage,
+                                                     statement_stream);
+
+  while(!librdf_stream_end(statement_stream)) {
+    librdf_statement* statement=librdf_stream_get_object(statement_stream);
+
+    if(statement) {
+      status=librdf_storage_hashes_add_statement(storage, statement);
+    } else
+      status=1;
+
+    if(status)
+      break;
+
+    librdf_stream_next(statement_stream);
+  }
+
+  return status;
+}
+
+
+static int
+librdf_storage_hashes_remove_statement(librdf_storage* storage, librdf_statement* statement)
+{
+  int status;
+
+  status=librdf_storage_hashes_add_remove_statement(storage, statement, NULL, 0);
+  return (status < 0) ? 0 : status;
+}
+
+
+/*
+ * librdf_storage_hashes_statement_exists:
+ * @storage: the storage hashes object
+ * @statement: complete statement to look for
+ * @context_node: context node to look for or NULL for any
+ *
+ * INTERNAL - Check if a statement is stored with one hash probe
+ *
+ * Without contexts, the key and value of the all statements hash are
+ * exact.  With contexts the spo2c index is used: its key is the whole
+ * statement and the values are the contexts.
+ * 
+ * Return value: >0 if present, 0 if not, <0 on failure
+ **/
+static int
+librdf_storage_hashes_statement_exists(librdf_storage* storage,
+                                       librdf_statement* statement,
+                                       librdf_node* context_node)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_hash_datum hd_key, hd_value; /* on stack */
+  size_t key_len, value_len=0;
+  int key_fields, value_fields;
+  int hash_index=context->all_statements_hash_index;
+  int any_context=0;
+  int status;
+  
+  if(context->index_contexts) {
+    hash_index=context->contains_index;
+    any_context=(context_node == NULL);
+  }
+
+  /* a node not in the term dictionary cannot be in any statement */
+  status=librdf_storage_hashes_encode_parts(storage, statement, context_node,
+                                            0);
+  if(status)
+    return (status < 0) ? 0 : -1;
+
+  /* ENCODE KEY */
+  key_fields=context->hash_descriptions[hash_index]->key_fields;
+  key_len=librdf_storage_hashes_assemble_parts(context, key_fields, 0, NULL);
+  if(librdf_storage_hashes_grow_buffer(&context->key_buffer,
+                                       &context->key_buffer_len, key_len))
+    return -1;
+  librdf_storage_hashes_assemble_parts(context, key_fields, 0,
+                                       context->key_buffer);
+
+  /* ENCODE VALUE */
+  if(!any_context) {
+    value_fields=context->hash_descriptions[hash_index]->value_fields;
+    value_len=librdf_storage_hashes_assemble_parts(context, value_fields, 1,
+                                                   NULL);
+    if(librdf_storage_hashes_grow_buffer(&context->value_buffer,
+                                         &context->value_buffer_len,
+                                         value_len))
+      return -1;
+    librdf_storage_hashes_assemble_parts(context, value_fields, 1,
+                                         context->value_buffer);
+  }
+
+
+#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
+  LIBRDF_DEBUG4("Using %s hash key %d bytes -> value %d bytes\n", context->hash_descriptions[hash_index]->name, (int)key_len, (int)value_len);
+#endif
+
+  hd_key.data=context->key_buffer; hd_key.size=key_len;
+  hd_value.data=context->value_buffer; hd_value.size=value_len;
+  return librdf_hash_exists(context->hashes[hash_index], &hd_key,
+                            any_context ? NULL : &hd_value);
+}
+
+
+/*
+ * librdf_storage_hashes_has_statement:
+ * @storage: the storage hashes object
+ * @statement: complete statement to look for
+ *
+ * INTERNAL - Check if a statement is stored in any context
+ *
+ * Return value: >0 if present, 0 if not, <0 on failure
+ **/
+static int
+librdf_storage_hashes_has_statement(librdf_storage* storage,
+                                    librdf_statement* statement)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  int status;
+  
+  if(context->index_contexts && context->contains_index < 0) {
+    /* When we have contexts but no spo2c index, we have to use
+     * find_statements for contains since a statement is encoded in
+     * KEY/VALUE and the VALUE may contain some context node.
+     */
+    librdf_stream *stream=librdf_storage_hashes_find_statements(storage, statement);
+    
+    if(!stream)
+      return -1;
+    /* librdf_stream_end returns 0 if have more, non-0 at end */
+    status=!librdf_stream_end(stream);
+    /* convert to 0 if at end (not found) and non-zero otherwise (found) */
+    librdf_free_stream(stream);
+    return status;
+  }
+
+  /* DO NOT free statement, ownership was not passed in */
+  return librdf_storage_hashes_statement_exists(storage, statement, NULL);
+}
+
+
+static int
+librdf_storage_hashes_contains_statement(librdf_storage* storage, librdf_statement* statement)
+{
+  int status;
+  
+  status=librdf_storage_hashes_has_statement(storage, statement);
+  if(status < 0) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "Failed to look up statement in hashes storage");
+    return 0;
+  }
+  return status;
+}
+
+
+
+typedef struct {
+  librdf_storage *storage;
+  librdf_storage_hashes_instance* hash_context;
+  int index;
+  librdf_iterator* iterator;
+  librdf_hash_datum *key;
+  librdf_hash_datum *value;
+  unsigned char *search_key; /* owned; key or key prefix scanned */
+  size_t search_key_len;
+  int search_range; /* non-0 if search_key is a key prefix */
+  librdf_statement current; /* static, shared */
+  int index_contexts; /* true if this storage indexes contexts */
+  librdf_node *context_node;
+  int current_is_ok; /* true when current statement and context_node fresh */
+  librdf_storage_hashes_term_cache term_cache;
+} librdf_storage_hashes_serialise_stream_context;
+
+
+/*
+ * librdf_storage_hashes_serialise_common:
+ * @storage: the storage hashes object
+ * @hash_index: the index of the hash to iterate over
+ * @search_statement: statement to build the hash key from (or NULL)
+ * @search_fields: parts of @search_statement to build the key from
+ *
+ * INTERNAL - Create a stream of statements from one hash
+ *
+ * If @search_statement is given, only the values of the key made
+ * from its @search_fields parts are returned, otherwise the entire
+ * hash is returned.  When @search_fields are only the leading parts
+ * of the hash key fields, the encoded parts are a key prefix and all
+ * keys starting with it are returned.
+ * 
+ * Return value: a new #librdf_stream or NULL on failure
+ **/
+static librdf_stream*
+librdf_storage_hashes_serialise_common(librdf_storage* storage, int hash_index,
+                                       librdf_statement* search_statement,
+                                       int search_fields)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
   librdf_storage_hashes_serialise_stream_context *scontext;
   librdf_hash *hash;
   librdf_stream *stream;
@@ -830,6 +1948,7 @@ librdf_storage_hashes_serialise_common(librdf_storage* storage, int hash_index,
     return NULL;
 
   scontext->hash_context=context;
+  scontext->index=hash_index;
 
   librdf_statement_init(storage->world, &scontext->current);
 
@@ -848,17 +1967,42 @@ librdf_storage_hashes_serialise_common(librdf_storage* storage, int hash_index,
   /* scurrent->current_is_ok=0; */
   scontext->index_contexts=context->index_contexts;
   
-  if(search_node) {
-    scontext->search_node=search_node;
-    scontext->iterator=librdf_storage_hashes_node_iterator_create(storage,
-                                                                  search_node,
-                                                                  NULL,
-                                                                  hash_index,
-                                                                  want);
-  } else {
-    scontext->iterator=librdf_hash_get_all(hash,
-                                           scontext->key, scontext->value);
+  if(search_statement) {
+    size_t len;
+    int status;
+    
+    if(search_fields != context->hash_descriptions[hash_index]->key_fields)
+      scontext->search_range=1;
+
+    status=librdf_storage_hashes_encode_parts(storage, search_statement, NULL,
+                                              0);
+    if(status) {
+      librdf_storage_hashes_serialise_finished((void*)scontext);
+      /* a node not in the term dictionary matches nothing */
+      return (status < 0) ? librdf_new_empty_stream(storage->world) : NULL;
+    }
+
+    len=librdf_storage_hashes_assemble_parts(context, search_fields, 0, NULL);
+    scontext->search_key=(unsigned char*)LIBRDF_MALLOC(data, len);
+    if(!scontext->search_key) {
+      librdf_storage_hashes_serialise_finished((void*)scontext);
+      return NULL;
+    }
+    librdf_storage_hashes_assemble_parts(context, search_fields, 0,
+                                         scontext->search_key);
+    scontext->search_key_len=len;
+
+    /* a key with data set makes get_all return the values of that key */
+    scontext->key->data=scontext->search_key;
+    scontext->key->size=len;
   }
+
+  if(scontext->search_range)
+    scontext->iterator=librdf_hash_get_range(hash, scontext->key,
+                                             scontext->value);
+  else
+    scontext->iterator=librdf_hash_get_all(hash, scontext->key,
+                                           scontext->value);
   if(!scontext->iterator) {
     librdf_storage_hashes_serialise_finished((void*)scontext);
     return librdf_new_empty_stream(storage->world);
@@ -915,27 +2059,10 @@ librdf_storage_hashes_serialise_next_statement(void* context)
 static void*
 librdf_storage_hashes_serialise_get_statement(void* context, int flags)
 {
-  librdf_storage_hashes_serialise_stream_context* scontext=(librdf_storage_hashes_serialise_stream_context*)context;
-  librdf_hash_datum* hd;
-  librdf_node** cnp=NULL;
-  librdf_world* world;
-  
-  world = scontext->storage->world;
-  
-  if(scontext->search_node) {
-    switch(flags) {
-      case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
-        return librdf_iterator_get_object(scontext->iterator);
-      case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
-        return librdf_iterator_get_context(scontext->iterator);
-      default:
-        librdf_log(scontext->iterator->world,
-                   0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
-                   "Unimplemented flags %d seen", flags);
-        return NULL;
-    }
-  }
-    
+  librdf_storage_hashes_serialise_stream_context* scontext=(librdf_storage_hashes_serialise_stream_context*)context;
+  librdf_hash_datum* hd;
+  librdf_node** cnp=NULL;
+  
   switch(flags) {
     case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
     case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
@@ -957,19 +2084,31 @@ librdf_storage_hashes_serialise_get_statement(void* context, int flags)
       
       librdf_statement_clear(&scontext->current);
       
-      hd=(librdf_hash_datum*)librdf_iterator_get_key(scontext->iterator);
-      
-      /* decode key content */
-      if(!librdf_statement_decode2(world, &scontext->current, NULL,
-                                   (unsigned char*)hd->data, hd->size)) {
-        return NULL;
+      /* decode key content; the iterator does not return the key
+       * when scanning the values of one key */
+      if(scontext->search_key && !scontext->search_range) {
+        if(!librdf_storage_hashes_decode_parts(scontext->storage,
+                                               &scontext->current, NULL,
+                                               scontext->search_key,
+                                               scontext->search_key_len,
+                                               &scontext->term_cache))
+          return NULL;
+      } else {
+        hd=(librdf_hash_datum*)librdf_iterator_get_key(scontext->iterator);
+        if(!librdf_storage_hashes_decode_parts(scontext->storage,
+                                               &scontext->current, NULL,
+                                               (unsigned char*)hd->data,
+                                               hd->size, &scontext->term_cache))
+          return NULL;
       }
       
       hd=(librdf_hash_datum*)librdf_iterator_get_value(scontext->iterator);
       
       /* decode value content and optional context */
-      if(!librdf_statement_decode2(world, &scontext->current, cnp,
-                                   (unsigned char*)hd->data, hd->size)) {
+      if(!librdf_storage_hashes_decode_parts(scontext->storage,
+                                             &scontext->current, cnp,
+                                             (unsigned char*)hd->data,
+                                             hd->size, &scontext->term_cache)) {
         return NULL;
       }
 
@@ -1009,8 +2148,13 @@ librdf_storage_hashes_serialise_finished(void* context)
     librdf_free_hash_datum(scontext->value);
   }
 
+  if(scontext->search_key)
+    LIBRDF_FREE(data, scontext->search_key);
+
   librdf_statement_clear(&scontext->current);
 
+  librdf_storage_hashes_term_cache_clear(&scontext->term_cache);
+
   if(scontext->storage)
     librdf_storage_remove_reference(scontext->storage);
 
@@ -1018,6 +2162,68 @@ librdf_storage_hashes_serialise_finished(void* context)
 }
 
 
+/*
+ * librdf_storage_hashes_find_index:
+ * @context: the storage hashes instance
+ * @fields: OR of LIBRDF_STATEMENT_* parts that are known
+ * @search_fields_p: pointer to store the key fields to search with
+ *
+ * INTERNAL - Pick the narrowest index usable for a lookup
+ *
+ * Keys encode the parts in subject, predicate, object order so an
+ * index is usable when its leading key fields are in @fields: all of
+ * them give one key, otherwise they are a key prefix for a range
+ * scan.  The index using the most known fields is the most selective
+ * and a whole key is preferred to a prefix.
+ * 
+ * Return value: index of the hash or <0 if none can be used
+ **/
+static int
+librdf_storage_hashes_find_index(librdf_storage_hashes_instance* context,
+                                 int fields, int *search_fields_p)
+{
+  static const int parts[3]={ LIBRDF_STATEMENT_SUBJECT,
+                              LIBRDF_STATEMENT_PREDICATE,
+                              LIBRDF_STATEMENT_OBJECT };
+  int i;
+  int best_index= -1;
+  int best_score=0;
+  
+  for(i=0; i<context->hash_count; i++) {
+    int key_fields=context->hash_descriptions[i]->key_fields;
+    int search_fields=0;
+    int score=0;
+    int j;
+
+    /* skip the contexts index */
+    if(!key_fields)
+      continue;
+
+    for(j=0; j < 3; j++) {
+      if(!(key_fields & parts[j]))
+        continue;
+      if(!(fields & parts[j]))
+        break;
+      search_fields|=parts[j];
+      score+=2;
+    }
+    if(!score)
+      continue;
+
+    if(search_fields == key_fields)
+      score++;
+
+    if(score > best_score) {
+      best_index=i;
+      best_score=score;
+      *search_fields_p=search_fields;
+    }
+  }
+
+  return best_index;
+}
+
+
 /**
  * librdf_storage_hashes_find_statements:
  * @storage: the storage
@@ -1028,7 +2234,9 @@ librdf_storage_hashes_serialise_finished(void* context)
  * Return a stream of statements matching the given statement (or
  * all statements if NULL).  Parts (subject, predicate, object) of the
  * statement can be empty in which case any statement part will match that.
- * Uses #librdf_statement_match to do the matching.
+ * The narrowest index with a key or key prefix made only of given
+ * parts is used to find candidates and #librdf_statement_match checks
+ * any remaining parts.
  * 
  * Return value: a #librdf_stream or NULL on failure
  **/
@@ -1037,27 +2245,42 @@ librdf_storage_hashes_find_statements(librdf_storage* storage, librdf_statement*
 {
   librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
   librdf_stream* stream;
+  int fields=0;
+  int search_fields=0;
+  int hash_index= -1;
+
+  if(librdf_statement_get_subject(statement))
+    fields|=LIBRDF_STATEMENT_SUBJECT;
+  if(librdf_statement_get_predicate(statement))
+    fields|=LIBRDF_STATEMENT_PREDICATE;
+  if(librdf_statement_get_object(statement))
+    fields|=LIBRDF_STATEMENT_OBJECT;
+
+  if(fields)
+    hash_index=librdf_storage_hashes_find_index(context, fields,
+                                                &search_fields);
+
+  if(hash_index >= 0) {
+    stream=librdf_storage_hashes_serialise_common(storage, hash_index,
+                                                  statement, search_fields);
+    /* key covers every given part so all values match */
+    if(!stream || search_fields == fields)
+      return stream;
+  } else
+    stream=librdf_storage_hashes_serialise(storage);
 
-  if(!librdf_statement_get_subject(statement) &&
-     librdf_statement_get_predicate(statement) &&
-     !librdf_statement_get_object(statement) &&
-     context->p2so_index >= 0) {
-    /* (? p ?) -> (s p o) wanted */
-    stream=librdf_storage_hashes_serialise_common(storage,
-                                                  context->p2so_index,
-                                                  librdf_statement_get_predicate(statement),
-                                                  LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_OBJECT);
-  } else {
-    statement=librdf_new_statement_from_statement(statement);
-    if(!statement)
-      return NULL;
+  if(!stream)
+    return NULL;
 
-    stream=librdf_storage_hashes_serialise(storage);
-    if(stream)
-      librdf_stream_add_map(stream, 
-                            &librdf_stream_statement_find_map,
-                            (librdf_stream_map_free_context_handler)&librdf_free_statement, (void*)statement);
+  statement=librdf_new_statement_from_statement(statement);
+  if(!statement) {
+    librdf_free_stream(stream);
+    return NULL;
   }
+
+  librdf_stream_add_map(stream, 
+                        &librdf_stream_statement_find_map,
+                        (librdf_stream_map_free_context_handler)&librdf_free_statement, (void*)statement);
   
   return stream;
 }
@@ -1069,12 +2292,11 @@ typedef struct {
   librdf_iterator* iterator; /* owned iterator over above hash */
   int want;                  /* part of decoded statement to return */
   librdf_statement statement; /* NOTE: stored here, never allocated */
-  librdf_statement statement2; /* NOTE: stored here, never allocated */
   librdf_hash_datum key;
   librdf_hash_datum value;
-  librdf_node *search_node;
   int index_contexts;
   librdf_node *context_node;
+  librdf_storage_hashes_term_cache term_cache;
 } librdf_storage_hashes_node_iterator_context;
 
 
@@ -1105,9 +2327,6 @@ librdf_storage_hashes_node_iterator_get_method(void* iterator, int flags)
   librdf_storage_hashes_node_iterator_context* context=(librdf_storage_hashes_node_iterator_context*)iterator;
   librdf_node* node;
   librdf_hash_datum* value;
-  librdf_world* world;
-  
-  world = context->storage->world;
   
   if(librdf_iterator_end(context->iterator))
     return NULL;
@@ -1124,9 +2343,11 @@ librdf_storage_hashes_node_iterator_get_method(void* iterator, int flags)
     context->context_node=NULL;
       
     /* decode value content and optional context */
-    if(!librdf_statement_decode2(world, &context->statement,
-                                 &context->context_node,
-                                 (unsigned char*)value->data, value->size))
+    if(!librdf_storage_hashes_decode_parts(context->storage,
+                                           &context->statement,
+                                           &context->context_node,
+                                           (unsigned char*)value->data,
+                                           value->size, &context->term_cache))
       return NULL;
     librdf_statement_clear(&context->statement);
     
@@ -1159,13 +2380,6 @@ librdf_storage_hashes_node_iterator_get_method(void* iterator, int flags)
          librdf_free_node(node);
       break;
       
-    case (LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_OBJECT): /* p2so */
-      if((node=librdf_statement_get_subject(&context->statement)))
-         librdf_free_node(node);
-      if((node=librdf_statement_get_object(&context->statement)))
-         librdf_free_node(node);
-      break;
-      
     default: /* error */
       librdf_log(context->iterator->world,
                  0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
@@ -1178,9 +2392,10 @@ librdf_storage_hashes_node_iterator_get_method(void* iterator, int flags)
   if(!value)
     return NULL;
 
-  if(!librdf_statement_decode2(world, &context->statement, NULL,
-                               (unsigned char*)value->data,
-                               value->size))
+  if(!librdf_storage_hashes_decode_parts(context->storage,
+                                         &context->statement, NULL,
+                                         (unsigned char*)value->data,
+                                         value->size, &context->term_cache))
     return NULL;
 
   switch(context->want) {
@@ -1196,17 +2411,6 @@ librdf_storage_hashes_node_iterator_get_method(void* iterator, int flags)
       node=librdf_statement_get_object(&context->statement);
       break;
       
-    case (LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_OBJECT): /* p2so */
-      librdf_statement_set_subject(&context->statement2, librdf_statement_get_subject(&context->statement));
-      /* fill in the only blank from the node stored in our context */
-      node=librdf_new_node_from_node(context->search_node);
-      if(!node)
-        return NULL;
-      librdf_statement_set_predicate(&context->statement2, node);
-      librdf_statement_set_object(&context->statement2, librdf_statement_get_object(&context->statement));
-      return (void*)&context->statement2;
-      break;
-      
     default: /* error */
       librdf_log(context->iterator->world,
                  0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
@@ -1222,11 +2426,7 @@ static void
 librdf_storage_hashes_node_iterator_finished(void* iterator) 
 {
   librdf_storage_hashes_node_iterator_context* icontext=(librdf_storage_hashes_node_iterator_context*)iterator;
-  librdf_node* node;
   
-  if(icontext->search_node)
-    librdf_free_node(icontext->search_node);
-
   if(icontext->context_node)
     librdf_free_node(icontext->context_node);
 
@@ -1234,8 +2434,8 @@ librdf_storage_hashes_node_iterator_finished(void* iterator)
     librdf_free_iterator(icontext->iterator);
 
   librdf_statement_clear(&icontext->statement);
-  if((node=librdf_statement_get_predicate(&icontext->statement2)))
-     librdf_free_node(node);
+
+  librdf_storage_hashes_term_cache_clear(&icontext->term_cache);
 
   if(icontext->storage)
     librdf_storage_remove_reference(icontext->storage);
@@ -1264,10 +2464,9 @@ librdf_storage_hashes_node_iterator_create(librdf_storage* storage,
   librdf_storage_hashes_instance* scontext=(librdf_storage_hashes_instance*)storage->instance;
   librdf_storage_hashes_node_iterator_context* icontext;
   librdf_hash *hash;
-  librdf_statement_part fields;
-  unsigned char *key_buffer;
+  int key_fields;
+  int status;
   librdf_iterator* iterator;
-  librdf_world* world = storage->world;
   
   icontext=(librdf_storage_hashes_node_iterator_context*)LIBRDF_CALLOC(librdf_storage_hashes_node_iterator_context, 1, sizeof(librdf_storage_hashes_node_iterator_context));
   if(!icontext)
@@ -1295,7 +2494,6 @@ librdf_storage_hashes_node_iterator_create(librdf_storage* storage,
   }
 
   librdf_statement_init(storage->world, &icontext->statement);
-  librdf_statement_init(storage->world, &icontext->statement2);
 
   hash=scontext->hashes[icontext->hash_index];
 
@@ -1316,11 +2514,6 @@ librdf_storage_hashes_node_iterator_create(librdf_storage* storage,
       librdf_statement_set_predicate(&icontext->statement, node2);
       break;
       
-    case (LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_OBJECT): /* p2so */
-      icontext->search_node=librdf_new_node_from_node(node1);
-      librdf_statement_set_predicate(&icontext->statement, node1);
-      break;
-      
     default: /* error */
       LIBRDF_FREE(librdf_storage_hashes_node_iterator_context, icontext);
       librdf_log(storage->world,
@@ -1330,43 +2523,42 @@ librdf_storage_hashes_node_iterator_create(librdf_storage* storage,
   }
 
 
-  /* ENCODE KEY */
-  fields=(librdf_statement_part)scontext->hash_descriptions[hash_index]->key_fields;
-  icontext->key.size=librdf_statement_encode_parts2(world, &icontext->statement, NULL,
-                                                    NULL, 0, fields);
-  if(!icontext->key.size) {
-    LIBRDF_FREE(librdf_storage_hashes_node_iterator_context, icontext);
-    return NULL;
-  }
-  if(!(key_buffer=(unsigned char*)LIBRDF_MALLOC(data, icontext->key.size))) {
-    LIBRDF_FREE(librdf_storage_hashes_node_iterator_context, icontext);
-    return NULL;
-  }
-       
   /* after this point the finished method is called on errors
    * so must bump the reference count
    */
   librdf_storage_add_reference(icontext->storage);
 
-  if(!librdf_statement_encode_parts2(world, &icontext->statement, NULL,
-                                     key_buffer, icontext->key.size, fields)) {
-    LIBRDF_FREE(data, key_buffer);
+  /* ENCODE KEY */
+  status=librdf_storage_hashes_encode_parts(storage, &icontext->statement,
+                                            NULL, 0);
+  if(status) {
+    librdf_storage_hashes_node_iterator_finished(icontext);
+    /* a node not in the term dictionary matches nothing */
+    return (status < 0) ? librdf_new_empty_iterator(storage->world) : NULL;
+  }
+
+  key_fields=scontext->hash_descriptions[hash_index]->key_fields;
+  icontext->key.size=librdf_storage_hashes_assemble_parts(scontext, key_fields,
+                                                          0, NULL);
+  if(librdf_storage_hashes_grow_buffer(&scontext->key_buffer,
+                                       &scontext->key_buffer_len,
+                                       icontext->key.size)) {
     librdf_storage_hashes_node_iterator_finished(icontext);
     return NULL;
   }
+  librdf_storage_hashes_assemble_parts(scontext, key_fields, 0,
+                                       scontext->key_buffer);
 
-    
-  icontext->key.data=key_buffer;
+  /* the key is only read when the iterator is created */
+  icontext->key.data=scontext->key_buffer;
 
   icontext->iterator=librdf_hash_get_all(hash, &icontext->key, &icontext->value);
+  icontext->key.data=NULL;
   if(!icontext->iterator) {
-    LIBRDF_FREE(data, key_buffer);
     librdf_storage_hashes_node_iterator_finished(icontext);
     return librdf_new_empty_iterator(storage->world);
   }
 
-  LIBRDF_FREE(data, key_buffer);
-
   iterator=librdf_new_iterator(storage->world,
                                (void*)icontext,
                                librdf_storage_hashes_node_iterator_is_end,
@@ -1384,6 +2576,11 @@ librdf_storage_hashes_find_sources(librdf_storage* storage,
                                    librdf_node* arc, librdf_node *target) 
 {
   librdf_storage_hashes_instance* scontext=(librdf_storage_hashes_instance*)storage->instance;
+
+  if(scontext->sources_index < 0)
+    return librdf_storage_node_stream_to_node_create(storage, arc, target,
+                                                     LIBRDF_STATEMENT_SUBJECT);
+
   return librdf_storage_hashes_node_iterator_create(storage, arc, target,
                                                     scontext->sources_index,
                                                     LIBRDF_STATEMENT_SUBJECT);
@@ -1395,6 +2592,11 @@ librdf_storage_hashes_find_arcs(librdf_storage* storage,
                                 librdf_node* source, librdf_node *target) 
 {
   librdf_storage_hashes_instance* scontext=(librdf_storage_hashes_instance*)storage->instance;
+
+  if(scontext->arcs_index < 0)
+    return librdf_storage_node_stream_to_node_create(storage, source, target,
+                                                     LIBRDF_STATEMENT_PREDICATE);
+
   return librdf_storage_hashes_node_iterator_create(storage, source, target,
                                                     scontext->arcs_index,
                                                     LIBRDF_STATEMENT_PREDICATE);
@@ -1405,11 +2607,125 @@ librdf_storage_hashes_find_targets(librdf_storage* storage,
                                    librdf_node* source, librdf_node *arc) 
 {
   librdf_storage_hashes_instance* scontext=(librdf_storage_hashes_instance*)storage->instance;
+
+  if(scontext->targets_index < 0)
+    return librdf_storage_node_stream_to_node_create(storage, source, arc,
+                                                     LIBRDF_STATEMENT_OBJECT);
+
   return librdf_storage_hashes_node_iterator_create(storage, source, arc,
                                                     scontext->targets_index,
                                                     LIBRDF_STATEMENT_OBJECT);
 }
 
+/*
+ * librdf_storage_hashes_hash_is_empty:
+ * @hash: hash
+ *
+ * INTERNAL - Check if a hash has no keys
+ *
+ * Return value: non 0 if empty
+ **/
+static int
+librdf_storage_hashes_hash_is_empty(librdf_hash* hash)
+{
+  librdf_hash_datum key, value; /* on stack */
+  librdf_iterator* iterator;
+  int is_empty;
+
+  key.data=NULL; key.size=0;
+  value.data=NULL; value.size=0;
+  iterator=librdf_hash_get_all(hash, &key, &value);
+  if(!iterator)
+    return 1;
+
+  is_empty=librdf_iterator_end(iterator);
+  librdf_free_iterator(iterator);
+
+  return is_empty;
+}
+
+
+/*
+ * librdf_storage_hashes_fill_indexes:
+ * @storage: the storage hashes object
+ *
+ * INTERNAL - Fill empty statement indexes of a store with statements
+ *
+ * Every statement index holds all statements, so an empty one beside
+ * a non-empty one has been added to the indexes of an existing store,
+ * such as spo2c when opening a store with contexts made before it
+ * was a default index.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_hashes_fill_indexes(librdf_storage* storage)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  char *is_empty;
+  int source_index= -1;
+  int empty_count=0;
+  librdf_stream* stream;
+  int status=0;
+  int i;
+
+  is_empty=(char*)LIBRDF_CALLOC(cstring, context->hash_count, 1);
+  if(!is_empty)
+    return 1;
+
+  for(i=0; i<context->hash_count; i++) {
+    if(!context->hash_descriptions[i]->key_fields)
+      continue;
+    
+    is_empty[i]=(char)librdf_storage_hashes_hash_is_empty(context->hashes[i]);
+    if(is_empty[i])
+      empty_count++;
+    else if(source_index < 0)
+      source_index=i;
+  }
+
+  if(source_index < 0 || !empty_count) {
+    LIBRDF_FREE(cstring, is_empty);
+    return 0;
+  }
+
+  librdf_log(storage->world, 0, LIBRDF_LOG_INFO, LIBRDF_FROM_STORAGE, NULL,
+             "Filling %d new hashes storage indexes", empty_count);
+
+  stream=librdf_storage_hashes_serialise_common(storage, source_index, NULL, 0);
+  if(!stream) {
+    LIBRDF_FREE(cstring, is_empty);
+    return 1;
+  }
+
+  while(!status && !librdf_stream_end(stream)) {
+    librdf_statement* statement=librdf_stream_get_object(stream);
+    librdf_node* context_node=librdf_stream_get_context2(stream);
+
+    if(!statement ||
+       librdf_storage_hashes_encode_parts(storage, statement, context_node, 1)) {
+      status=1;
+      break;
+    }
+
+    for(i=0; i<context->hash_count; i++) {
+      if(is_empty[i] &&
+         librdf_storage_hashes_update_hash(context, i, 1)) {
+        status=1;
+        break;
+      }
+    }
+
+    librdf_stream_next(stream);
+  }
+
+  librdf_free_stream(stream);
+  LIBRDF_FREE(cstring, is_empty);
+
+  return status;
+}
+
+
 /**
  * librdf_storage_hashes_context_add_statement:
  * @storage: #librdf_storage object
@@ -1427,9 +2743,7 @@ librdf_storage_hashes_context_add_statement(librdf_storage* storage,
 {
   librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
   librdf_hash_datum key, value; /* on stack - not allocated */
-  int size;
   int status;
-  librdf_world* world = storage->world;
   
   if(context->contexts_index <0) {
     librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
@@ -1441,19 +2755,23 @@ librdf_storage_hashes_context_add_statement(librdf_storage* storage,
                                                 statement, context_node, 1))
     return 1;
 
-  size=librdf_node_encode(context_node, NULL, 0);
-  key.data=(char*)LIBRDF_MALLOC(cstring, size);
-  key.size=librdf_node_encode(context_node, 
-                               (unsigned char*)key.data, size);
-
-  size=librdf_statement_encode2(world, statement, NULL, 0);
-
-  value.data=(char*)LIBRDF_MALLOC(cstring, size);
-  value.size=librdf_statement_encode2(world, statement, (unsigned char*)value.data, size);
+  /* key is the context node and value the statement, reusing the
+   * node encodings made when updating the statement hashes */
+  key.data=context->parts_buffer + context->parts_offset[3];
+  key.size=context->parts_len[3];
+
+  value.size=librdf_storage_hashes_assemble_parts(context,
+                                                  LIBRDF_STATEMENT_ALL, 0,
+                                                  NULL);
+  if(librdf_storage_hashes_grow_buffer(&context->value_buffer,
+                                       &context->value_buffer_len,
+                                       value.size))
+    return 1;
+  librdf_storage_hashes_assemble_parts(context, LIBRDF_STATEMENT_ALL, 0,
+                                       context->value_buffer);
+  value.data=context->value_buffer;
 
   status=librdf_hash_put(context->hashes[context->contexts_index], &key, &value);
-  LIBRDF_FREE(data, key.data);
-  LIBRDF_FREE(data, value.data);
 
   return status;
 }
@@ -1476,32 +2794,38 @@ librdf_storage_hashes_context_remove_statement(librdf_storage* storage,
 {
   librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
   librdf_hash_datum key, value; /* on stack - not allocated */
-  int size;
   int status;
-  librdf_world* world = storage->world;
   
   if(context_node && context->contexts_index <0) {
     librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
                "Storage was created without context support");
   }
   
-  if(librdf_storage_hashes_add_remove_statement(storage, 
-                                                statement, context_node, 0))
-    return 1;
+  status=librdf_storage_hashes_add_remove_statement(storage, 
+                                                   statement, context_node, 0);
+  if(status)
+    return (status < 0) ? 0 : status;
   
-  size=librdf_node_encode(context_node, NULL, 0);
-  key.data=(char*)LIBRDF_MALLOC(cstring, size);
-  key.size=librdf_node_encode(context_node,
-                               (unsigned char*)key.data, size);
-
-  size=librdf_statement_encode2(world, statement, NULL, 0);
+  if(context->contexts_index <0)
+    return 0;
 
-  value.data=(char*)LIBRDF_MALLOC(cstring, size);
-  value.size=librdf_statement_encode2(world, statement, (unsigned char*)value.data, size);
+  /* key is the context node and value the statement, reusing the
+   * node encodings made when updating the statement hashes */
+  key.data=context->parts_buffer + context->parts_offset[3];
+  key.size=context->parts_len[3];
+
+  value.size=librdf_storage_hashes_assemble_parts(context,
+                                                  LIBRDF_STATEMENT_ALL, 0,
+                                                  NULL);
+  if(librdf_storage_hashes_grow_buffer(&context->value_buffer,
+                                       &context->value_buffer_len,
+                                       value.size))
+    return 1;
+  librdf_storage_hashes_assemble_parts(context, LIBRDF_STATEMENT_ALL, 0,
+                                       context->value_buffer);
+  value.data=context->value_buffer;
 
   status=librdf_hash_delete(context->hashes[context->contexts_index], &key, &value);
-  LIBRDF_FREE(data, key.data);
-  LIBRDF_FREE(data, value.data);
   
   return status;
 }
@@ -1517,6 +2841,7 @@ typedef struct {
   librdf_node *context_node;
   char *context_node_data;
   int current_is_ok; /* true when current statement and context_node fresh */
+  librdf_storage_hashes_term_cache term_cache;
 } librdf_storage_hashes_context_serialise_stream_context;
 
 
@@ -1537,6 +2862,7 @@ librdf_storage_hashes_context_serialise(librdf_storage* storage,
   librdf_storage_hashes_context_serialise_stream_context* scontext;
   librdf_stream* stream;
   size_t size;
+  int status;
 
   if(context->contexts_index <0) {
     librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
@@ -1564,11 +2890,21 @@ librdf_storage_hashes_context_serialise(librdf_storage* storage,
   scontext->index_contexts=context->index_contexts;
   scontext->context_node=librdf_new_node_from_node(context_node);
 
-  size=librdf_node_encode(context_node, NULL, 0);
+  /* a context node not in the term dictionary has no statements */
+  status=librdf_storage_hashes_encode_parts(storage, NULL, context_node, 0);
+  if(status) {
+    librdf_storage_hashes_context_serialise_finished((void*)scontext);
+    return (status < 0) ? librdf_new_empty_stream(storage->world) : NULL;
+  }
+  size=context->parts_len[3];
   scontext->key->data=scontext->context_node_data=(char*)LIBRDF_MALLOC(cstring, size);
-  scontext->key->size=librdf_node_encode(context_node,
-                                         (unsigned char*)scontext->key->data,
-                                         size);
+  if(!scontext->key->data) {
+    librdf_storage_hashes_context_serialise_finished((void*)scontext);
+    return NULL;
+  }
+  memcpy(scontext->key->data, context->parts_buffer + context->parts_offset[3],
+         size);
+  scontext->key->size=size;
 
   scontext->iterator=librdf_hash_get_all(context->hashes[context->contexts_index], 
                                          scontext->key, scontext->value);
@@ -1618,10 +2954,8 @@ librdf_storage_hashes_context_serialise_get_statement(void* context, int flags)
 {
   librdf_storage_hashes_context_serialise_stream_context* scontext;
   librdf_hash_datum* v;
-  librdf_world* world;
 
   scontext = (librdf_storage_hashes_context_serialise_stream_context*)context;
-  world = scontext->storage->world;
 
   switch(flags) {
     case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
@@ -1639,8 +2973,10 @@ librdf_storage_hashes_context_serialise_get_statement(void* context, int flags)
       v = (librdf_hash_datum*)librdf_iterator_get_value(scontext->iterator);
       
       /* decode value content and optional context */
-      if(!librdf_statement_decode2(world, &scontext->current, NULL,
-                                   (unsigned char*)v->data, v->size)) {
+      if(!librdf_storage_hashes_decode_parts(scontext->storage,
+                                             &scontext->current, NULL,
+                                             (unsigned char*)v->data,
+                                             v->size, &scontext->term_cache)) {
         return NULL;
       }
       
@@ -1682,6 +3018,8 @@ librdf_storage_hashes_context_serialise_finished(void* context)
 
   librdf_statement_clear(&scontext->current);
 
+  librdf_storage_hashes_term_cache_clear(&scontext->term_cache);
+
   if(scontext->context_node_data)
     LIBRDF_FREE(cstring, scontext->context_node_data);
 
@@ -1700,7 +3038,186 @@ librdf_storage_hashes_sync(librdf_storage *storage)
   
   for(i=0; i<context->hash_count; i++)
     librdf_hash_sync(context->hashes[i]);
+
+  if(context->term2id) {
+    librdf_storage_hashes_store_term_ids(storage);
+    librdf_hash_sync(context->term2id);
+    librdf_hash_sync(context->id2term);
+  }
+  return 0;
+}
+
+
+/*
+ * librdf_storage_hashes_compact:
+ * @storage: the storage
+ *
+ * INTERNAL - Reclaim unused space in every index hash and the term hashes
+ *
+ * The store stays open and usable while this runs.  A read-only
+ * store cannot be compacted and is left as it is.
+ *
+ * Return value: non 0 if any hash failed
+ */
+static int
+librdf_storage_hashes_compact(librdf_storage *storage)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  int status=0;
+  int i;
+
+  if(!context->is_writable)
+    return 0;
+
+  for(i=0; i<context->hash_count; i++) {
+    if(librdf_hash_compact(context->hashes[i]))
+      status=1;
+  }
+
+  if(context->term2id) {
+    if(librdf_storage_hashes_store_term_ids(storage))
+      status=1;
+    if(librdf_hash_compact(context->term2id))
+      status=1;
+    if(librdf_hash_compact(context->id2term))
+      status=1;
+  }
+
+  return status;
+}
+
+
+/**
+ * librdf_storage_hashes_transaction_start:
+ * @storage: #librdf_storage object
+ *
+ * Start a transaction over all the index and term hashes.
+ *
+ * This needs hashes supporting transactions, such as BDB hashes
+ * opened in one environment with option transactions.  The first
+ * index begins the transaction and the other hashes of this storage
+ * join it, so it is not shared with other storages.
+ * 
+ * Return value: 0 if transaction successfully started, non-0 on error
+ * (including a transaction already active)
+ **/
+static int
+librdf_storage_hashes_transaction_start(librdf_storage *storage)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  int i;
+
+  if(context->in_transaction)
+    return 1;
+
+  if(librdf_hash_transaction_start(context->hashes[0]))
+    return 1;
+
+  for(i=1; i<context->hash_count; i++) {
+    if(librdf_hash_transaction_join(context->hashes[i], context->hashes[0]))
+      goto failed;
+  }
+
+  if(context->term2id) {
+    if(librdf_hash_transaction_join(context->term2id, context->hashes[0]))
+      goto failed;
+    if(librdf_hash_transaction_join(context->id2term, context->hashes[0])) {
+      librdf_hash_transaction_rollback(context->term2id);
+      goto failed;
+    }
+  }
+
+  context->in_transaction=1;
   return 0;
+
+  failed:
+  /* the first index that began it last */
+  while(--i >= 0)
+    librdf_hash_transaction_rollback(context->hashes[i]);
+  return 1;
+}
+
+
+/*
+ * librdf_storage_hashes_transaction_end:
+ * @storage: #librdf_storage object
+ * @commit: non 0 to commit, 0 to roll back
+ *
+ * INTERNAL - Commit or roll back the transaction in every hash
+ *
+ * The hashes that joined the transaction leave it before the first
+ * index, which began it, ends it.
+ *
+ * Return value: non-0 on failure
+ */
+static int
+librdf_storage_hashes_transaction_end(librdf_storage *storage, int commit)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  int (*end)(librdf_hash* hash);
+  int status=0;
+  int i;
+
+  if(!context->in_transaction)
+    return 1;
+
+  end=commit ? librdf_hash_transaction_commit : librdf_hash_transaction_rollback;
+
+  if(context->term2id) {
+    /* the next term ID is part of the transaction */
+    if(commit)
+      librdf_storage_hashes_store_term_ids(storage);
+    if(end(context->term2id))
+      status=1;
+    if(end(context->id2term))
+      status=1;
+    /* IDs given out stay given out, store the counter again */
+    if(!commit || status)
+      context->term_ids_dirty=1;
+  }
+
+  for(i=context->hash_count-1; i >= 0; i--) {
+    if(end(context->hashes[i]))
+      status=1;
+  }
+
+  context->in_transaction=0;
+  return status;
+}
+
+
+/**
+ * librdf_storage_hashes_transaction_commit:
+ * @storage: #librdf_storage object
+ *
+ * Commit an active transaction.
+ *
+ * The changes to all the indexes are made durable together; iterators
+ * and streams started in the transaction must be freed first.
+ * 
+ * Return value: 0 if transaction successfully committed, non-0 on error
+ * (including no transaction active)
+ **/
+static int
+librdf_storage_hashes_transaction_commit(librdf_storage *storage)
+{
+  return librdf_storage_hashes_transaction_end(storage, 1);
+}
+
+
+/**
+ * librdf_storage_hashes_transaction_rollback:
+ * @storage: #librdf_storage object
+ *
+ * Roll back an active transaction.
+ * 
+ * Return value: 0 if transaction successfully rolled back, non-0 on error
+ * (including no transaction active)
+ **/
+static int
+librdf_storage_hashes_transaction_rollback(librdf_storage *storage)
+{
+  return librdf_storage_hashes_transaction_end(storage, 0);
 }
 
 
@@ -1735,6 +3252,7 @@ static void*
 librdf_storage_hashes_get_contexts_get_method(void* iterator, int flags) 
 {
   librdf_storage_hashes_get_contexts_iterator_context* icontext=(librdf_storage_hashes_get_contexts_iterator_context*)iterator;
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)icontext->storage->instance;
   void *result=NULL;
   librdf_hash_datum* k;
   
@@ -1746,9 +3264,14 @@ librdf_storage_hashes_get_contexts_get_method(void* iterator, int flags)
       if(icontext->current)
         librdf_free_node(icontext->current);
 
-      /* decode value content */
-      icontext->current=librdf_node_decode(icontext->storage->world, NULL,
-                                           (unsigned char*)k->data, k->size);
+      /* decode key content */
+      if(context->id2term)
+        icontext->current=librdf_storage_hashes_decode_term(icontext->storage,
+                                                           (unsigned char*)k->data,
+                                                           k->size, NULL);
+      else
+        icontext->current=librdf_node_decode(icontext->storage->world, NULL,
+                                             (unsigned char*)k->data, k->size);
       result=icontext->current;
       break;
 
@@ -1905,6 +3428,11 @@ librdf_storage_hashes_register_factory(librdf_storage_factory *factory)
   factory->context_remove_statement = librdf_storage_hashes_context_remove_statement;
   factory->context_serialise        = librdf_storage_hashes_context_serialise;
   factory->sync                     = librdf_storage_hashes_sync;
+  factory->compact                  = librdf_storage_hashes_compact;
+
+  factory->transaction_start        = librdf_storage_hashes_transaction_start;
+  factory->transaction_commit       = librdf_storage_hashes_transaction_commit;
+  factory->transaction_rollback     = librdf_storage_hashes_transaction_rollback;
   factory->get_contexts             = librdf_storage_hashes_get_contexts;
   factory->get_feature              = librdf_storage_hashes_get_feature;
 }
@@ -88,6 +88,9 @@ void librdf_finish_storage(librdf_world *world);
 /* class methods */
 librdf_storage_factory* librdf_get_storage_factory(librdf_world* world, const char *name);
 
+/* helper function for creating iterators for get sources, targets, arcs */
+librdf_iterator* librdf_storage_node_stream_to_node_create(librdf_storage* storage, librdf_node* node1, librdf_node *node2, librdf_statement_part want);
+
 
 /* rdf_storage_sql.c */
 typedef struct  
@@ -39,33 +39,74 @@
 #include <sys/types.h>
 
 #include <redland.h>
-#include "rdf_avltree_internal.h"
+#include "rdf_bptree_internal.h"
 
-/* Not yet fully implemented (namely iteration) */
-/*#define RDF_STORAGE_TREES_WITH_CONTEXTS 1*/
+
+/* Index orderings */
+typedef enum {
+  LIBRDF_STORAGE_TREES_INDEX_SPO,
+  LIBRDF_STORAGE_TREES_INDEX_SOP,
+  LIBRDF_STORAGE_TREES_INDEX_OPS,
+  LIBRDF_STORAGE_TREES_INDEX_PSO,
+  LIBRDF_STORAGE_TREES_INDEX_COUNT
+} librdf_storage_trees_index;
 
 typedef struct
 {
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-  librdf_node* context;
-#endif
-  librdf_avltree* spo_tree; /* Always present */
-  librdf_avltree* sop_tree; /* Optional */
-  librdf_avltree* ops_tree; /* Optional */
-  librdf_avltree* pso_tree; /* Optional */
+  librdf_node* context; /* NULL for statements without a context */
+  librdf_bptree* spo_tree; /* Always present */
+  librdf_bptree* sop_tree; /* Optional */
+  librdf_bptree* ops_tree; /* Optional */
+  librdf_bptree* pso_tree; /* Optional */
+  /* Adaptive indexing: searches made in this graph, and for each
+   * ordering the search count when last used and the searches that
+   * wanted it while it was missing */
+  unsigned long finds;
+  unsigned long used[LIBRDF_STORAGE_TREES_INDEX_COUNT];
+  int misses[LIBRDF_STORAGE_TREES_INDEX_COUNT];
 } librdf_storage_trees_graph;
 
+/* An entry in the index of every graph: a statement and its context */
+typedef struct
+{
+  librdf_statement* statement; /* Shared with the graph holding it */
+  librdf_node* context; /* Shared with the graph, NULL for no context */
+  /* non-0 in a search key to match statements in any context */
+  int any_context;
+} librdf_storage_trees_quad;
+
 typedef struct
 {
   librdf_storage_trees_graph* graph; /* Statements without a context */
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-  librdf_avltree* contexts; /* Tree of librdf_storage_trees_graph */
-#endif
+  librdf_bptree* contexts; /* Tree of librdf_storage_trees_graph or NULL */
+  /* Tree of librdf_storage_trees_quad for the statements of every
+   * graph in (s, p, o, context) order, or NULL */
+  librdf_bptree* all_graphs;
   int index_sop;
   int index_ops;
   int index_pso;
+  /* non-0 to order indexes by node value rather than node ordinal */
+  int sorted;
+  /* non-0 to build and drop optional indexes as searches need them */
+  int adaptive;
+  /* number of open statement streams, counted for adaptive indexing */
+  int streams;
+  /* Shared by every tree when streams read snapshots, or NULL */
+  librdf_bptree_versions* versions;
 } librdf_storage_trees_instance;
 
+/* Batches of statements smaller than 1/LIBRDF_STORAGE_TREES_BULK_RATIO
+ * of a graph are added one at a time rather than rebuilding its indexes */
+#define LIBRDF_STORAGE_TREES_BULK_RATIO 16
+
+/* Adaptive indexing builds a missing index after this many searches of
+ * a graph wanted it - each of those walked the whole graph, and the
+ * build is a sort of the graph, costing about as much as a few walks */
+#define LIBRDF_STORAGE_TREES_ADAPT_MISSES 8
+
+/* ...and drops an optional index not used in this many searches */
+#define LIBRDF_STORAGE_TREES_ADAPT_IDLE 1024
+
 /* prototypes for local functions */
 static int librdf_storage_trees_init(librdf_storage* storage, const char *name, librdf_hash* options);
 static int librdf_storage_trees_open(librdf_storage* storage, librdf_model* model);
@@ -74,7 +115,7 @@ static int librdf_storage_trees_size(librdf_storage* storage);
 static int librdf_storage_trees_add_statement(librdf_storage* storage, librdf_statement* statement);
 static int librdf_storage_trees_add_statements(librdf_storage* storage, librdf_stream* statement_stream);
 static int librdf_storage_trees_remove_statement(librdf_storage* storage, librdf_statement* statement);
-static int librdf_storage_trees_remove_statement_internal(librdf_storage_trees_graph* graph, librdf_statement* statement);
+static int librdf_storage_trees_remove_statement_internal(librdf_storage* storage, librdf_storage_trees_graph* graph, librdf_statement* statement);
 static int librdf_storage_trees_contains_statement(librdf_storage* storage, librdf_statement* statement);
 static librdf_stream* librdf_storage_trees_serialise(librdf_storage* storage);
 static librdf_stream* librdf_storage_trees_find_statements(librdf_storage* storage, librdf_statement* statement);
@@ -82,9 +123,27 @@ static librdf_stream* librdf_storage_trees_find_statements(librdf_storage* stora
 /* graph functions */
 static librdf_storage_trees_graph* librdf_storage_trees_graph_new(librdf_storage* storage, librdf_node* context);
 static void librdf_storage_trees_graph_free(void* data);
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
 static int librdf_storage_trees_graph_compare(const void* data1, const void* data2);
+#ifndef HAVE_RAPTOR2_API
+static int librdf_storage_trees_graph_compare_ordinal(const void* data1, const void* data2);
+#endif
+static librdf_storage_trees_graph* librdf_storage_trees_graph_lookup(librdf_storage* storage, librdf_node* context_node);
+static librdf_bptree** librdf_storage_trees_graph_index(librdf_storage_trees_graph* graph, librdf_storage_trees_index index);
+static librdf_bptree_data_compare_function librdf_storage_trees_index_compare(librdf_storage_trees_instance* context, librdf_storage_trees_index index);
+static int librdf_storage_trees_graph_build_index(librdf_storage* storage, librdf_storage_trees_graph* graph, librdf_storage_trees_index index);
+static void librdf_storage_trees_graph_adapt(librdf_storage* storage, librdf_storage_trees_graph* graph, librdf_storage_trees_index index);
+static int librdf_storage_trees_pin(librdf_storage* storage, librdf_bptree_pin** pin_p);
+static void librdf_storage_trees_unpin(librdf_storage* storage, librdf_bptree_pin* pin);
+
+/* index of every graph functions */
+static int librdf_storage_trees_all_graphs_add(librdf_storage* storage, librdf_storage_trees_graph* graph, librdf_statement* statement);
+static int librdf_storage_trees_all_graphs_add_array(librdf_storage* storage, librdf_storage_trees_graph* graph, void** statements, int count);
+static int librdf_storage_trees_all_graphs_remove_graph(librdf_storage* storage, librdf_storage_trees_graph* graph);
+static int librdf_storage_trees_quad_compare(const void* data1, const void* data2);
+#ifndef HAVE_RAPTOR2_API
+static int librdf_storage_trees_quad_compare_ordinal(const void* data1, const void* data2);
 #endif
+static void librdf_storage_trees_quad_free(void* data);
 
 /* serialising implementing functions */
 static int librdf_storage_trees_serialise_end_of_stream(void* context);
@@ -93,18 +152,26 @@ static void* librdf_storage_trees_serialise_get_statement(void* context, int fla
 static void librdf_storage_trees_serialise_finished(void* context);
 
 /* context functions */
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
 static int librdf_storage_trees_context_add_statement(librdf_storage* storage, librdf_node* context_node, librdf_statement* statement);
+static int librdf_storage_trees_context_add_statements(librdf_storage* storage, librdf_node* context_node, librdf_stream* statement_stream);
 static int librdf_storage_trees_context_remove_statement(librdf_storage* storage, librdf_node* context_node, librdf_statement* statement);
+static int librdf_storage_trees_context_remove_statements(librdf_storage* storage, librdf_node* context_node);
 static librdf_stream* librdf_storage_trees_context_serialise(librdf_storage* storage, librdf_node* context_node);
-#endif
+static librdf_stream* librdf_storage_trees_find_statements_in_context(librdf_storage* storage, librdf_statement* statement, librdf_node* context_node);
+static librdf_iterator* librdf_storage_trees_get_contexts(librdf_storage* storage);
 
 /* statement tree functions */
 static int librdf_statement_compare_spo(const void* data1, const void* data2);
 static int librdf_statement_compare_sop(const void* data1, const void* data2);
 static int librdf_statement_compare_ops(const void* data1, const void* data2);
 static int librdf_statement_compare_pso(const void* data1, const void* data2);
-static void librdf_storage_trees_avl_free(void* data);
+#ifndef HAVE_RAPTOR2_API
+static int librdf_statement_compare_spo_ordinal(const void* data1, const void* data2);
+static int librdf_statement_compare_sop_ordinal(const void* data1, const void* data2);
+static int librdf_statement_compare_ops_ordinal(const void* data1, const void* data2);
+static int librdf_statement_compare_pso_ordinal(const void* data1, const void* data2);
+#endif
+static void librdf_storage_trees_statement_free(void* data);
 
 
 static void librdf_storage_trees_register_factory(librdf_storage_factory *factory);
@@ -119,6 +186,11 @@ librdf_storage_trees_init(librdf_storage* storage, const char *name,
   const int index_sop_option = librdf_hash_get_as_boolean(options, "index-sop") > 0;
   const int index_ops_option = librdf_hash_get_as_boolean(options, "index-ops") > 0;
   const int index_pso_option = librdf_hash_get_as_boolean(options, "index-pso") > 0;
+  const int index_adaptive_option = librdf_hash_get_as_boolean(options, "index-adaptive") > 0;
+  const int snapshots_option = librdf_hash_get_as_boolean(options, "snapshots") > 0;
+  const int index_all_graphs_option = librdf_hash_get_as_boolean(options, "index-all-graphs") > 0;
+  librdf_bptree_data_compare_function graph_compare;
+  librdf_bptree_data_compare_function quad_compare;
 
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)LIBRDF_CALLOC(
     librdf_storage_trees_instance, 1, sizeof(librdf_storage_trees_instance));
@@ -131,21 +203,26 @@ librdf_storage_trees_init(librdf_storage* storage, const char *name,
 
   librdf_storage_set_instance(storage, context);
 
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-  /* Support contexts if option given */
-  if (librdf_hash_get_as_boolean(options, "contexts") > 0) {
-    context->contexts=librdf_new_avltree(librdf_storage_trees_graph_compare,
-      librdf_storage_trees_graph_free);
-  } else {
-    context->contexts=NULL;
+  /* Streams read a snapshot of one graph, taken when they start on
+   * it, so a stream over every context sees each graph as it was when
+   * it got there.  Building an index during a search would make the
+   * reader a second writer, so snapshots turn adaptive indexing off. */
+  if(snapshots_option) {
+    context->versions=librdf_new_bptree_versions();
+    if(!context->versions) {
+      if(options)
+        librdf_free_hash(options);
+      return 1;
+    }
   }
-#endif
+  context->adaptive=index_adaptive_option && !snapshots_option;
 
-  /* No indexing options given, index all by default */
+  /* No indexing options given, index all by default, or with
+   * adaptive indexing start from spo only and let searches decide */
   if (!index_spo_option && !index_sop_option && !index_ops_option && !index_pso_option) {
-    context->index_sop=1;
-    context->index_ops=1;
-    context->index_pso=1;
+    context->index_sop=!context->adaptive;
+    context->index_ops=!context->adaptive;
+    context->index_pso=!context->adaptive;
   } else {
     /* spo is always indexed, option just exists so user can
      * specifically /only/ index spo */
@@ -153,6 +230,49 @@ librdf_storage_trees_init(librdf_storage* storage, const char *name,
     context->index_ops=index_ops_option;
     context->index_pso=index_pso_option;
   }
+
+#ifdef HAVE_RAPTOR2_API
+  /* raptor terms are not interned so only have values to compare */
+  context->sorted=1;
+  graph_compare=librdf_storage_trees_graph_compare;
+  quad_compare=librdf_storage_trees_quad_compare;
+#else
+  /* Order by node value only if asked; ordinals compare much faster */
+  context->sorted=(librdf_hash_get_as_boolean(options, "sorted") > 0);
+  graph_compare=context->sorted ? librdf_storage_trees_graph_compare :
+                                  librdf_storage_trees_graph_compare_ordinal;
+  quad_compare=context->sorted ? librdf_storage_trees_quad_compare :
+                                 librdf_storage_trees_quad_compare_ordinal;
+#endif
+
+  /* Support contexts if option given */
+  if (librdf_hash_get_as_boolean(options, "contexts") > 0) {
+    context->contexts=librdf_new_bptree(graph_compare,
+                                        librdf_storage_trees_graph_free);
+    if(!context->contexts) {
+      if(options)
+        librdf_free_hash(options);
+      return 1;
+    }
+    if(context->versions)
+      librdf_bptree_set_versions(context->contexts, context->versions);
+
+    /* Find statements across graphs with one search rather than one
+     * per graph */
+    if(index_all_graphs_option) {
+      context->all_graphs=librdf_new_bptree(quad_compare,
+                                            librdf_storage_trees_quad_free);
+      if(!context->all_graphs) {
+        if(options)
+          librdf_free_hash(options);
+        return 1;
+      }
+      if(context->versions)
+        librdf_bptree_set_versions(context->all_graphs, context->versions);
+    }
+  } else {
+    context->contexts=NULL;
+  }
   
   context->graph = librdf_storage_trees_graph_new(storage, NULL);
   
@@ -160,7 +280,7 @@ librdf_storage_trees_init(librdf_storage* storage, const char *name,
   if(options)
     librdf_free_hash(options);
 
-  return 0;
+  return (context->graph == NULL);
 }
 
 
@@ -195,13 +315,22 @@ librdf_storage_trees_close(librdf_storage* storage)
 {
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
   
-  librdf_storage_trees_graph_free(context->graph);
+  if(context->graph)
+    librdf_storage_trees_graph_free(context->graph);
   context->graph=NULL;
   
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-  librdf_free_avltree(context->contexts);
+  if(context->contexts)
+    librdf_free_bptree(context->contexts);
   context->contexts=NULL;
-#endif
+
+  if(context->all_graphs)
+    librdf_free_bptree(context->all_graphs);
+  context->all_graphs=NULL;
+
+  /* frees any graphs still waiting for old snapshots */
+  if(context->versions)
+    librdf_free_bptree_versions(context->versions);
+  context->versions=NULL;
   
   return 0;
 }
@@ -211,40 +340,81 @@ static int
 librdf_storage_trees_size(librdf_storage* storage)
 {
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_iterator* iterator;
+  librdf_bptree_pin* pin;
+  int size;
+
+  /* counts the statements of every graph */
+  if(context->all_graphs)
+    return librdf_bptree_size(context->all_graphs);
+
+  if(librdf_storage_trees_pin(storage, &pin))
+    return -1;
+
+  size=librdf_bptree_size(context->graph->spo_tree);
+  if(!context->contexts) {
+    librdf_storage_trees_unpin(storage, pin);
+    return size;
+  }
+
+  /* add the statements in each context */
+  iterator=librdf_bptree_get_iterator_start(storage->world, context->contexts,
+                                            NULL, NULL);
+  if(!iterator) {
+    librdf_storage_trees_unpin(storage, pin);
+    return -1;
+  }
+
+  for(; !librdf_iterator_end(iterator); librdf_iterator_next(iterator)) {
+    librdf_storage_trees_graph* graph;
+
+    graph=(librdf_storage_trees_graph*)librdf_iterator_get_object(iterator);
+    size+=librdf_bptree_size(graph->spo_tree);
+  }
+  librdf_free_iterator(iterator);
+  librdf_storage_trees_unpin(storage, pin);
 
-  return librdf_avltree_size(context->graph->spo_tree);
+  return size;
 }
 
 
+/* add a statement to a graph (becomes owned by the graph) */
 static int
 librdf_storage_trees_add_statement_internal(librdf_storage* storage,
                                             librdf_storage_trees_graph* graph,
                                             librdf_statement* statement) 
 {
-  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
   int status = 0;
   
-  /* copy statement (store single copy in all trees) */
-  statement = librdf_new_statement_from_statement(statement);
-    
   /* spo_tree owns statement */
-  status = librdf_avltree_add(graph->spo_tree, statement);
-  if (status == LIBRDF_AVLTREE_EXISTS)
+  status = librdf_bptree_add(graph->spo_tree, statement);
+  if (status == LIBRDF_BPTREE_EXISTS)
     return 0;
-  else if (status != 0) /* LIBRDF_AVLTREE_ENOMEM */
+  else if (status != 0) { /* LIBRDF_BPTREE_ENOMEM */
+    /* ownership was passed in, so free it unless the tree kept it */
+    if (librdf_bptree_search(graph->spo_tree, statement) != statement)
+      librdf_free_statement(statement);
+    return status;
+  }
+
+  status = librdf_storage_trees_all_graphs_add(storage, graph, statement);
+  if (status) {
+    /* keep the graph in step with the index of every graph */
+    librdf_bptree_delete(graph->spo_tree, statement);
     return status;
+  }
     
   /* others have null deleters */
   /* (XXX: corrupt model if insertions fail) */
 
-  if (context->index_sop)
-    librdf_avltree_add(graph->sop_tree, statement);
+  if (graph->sop_tree)
+    librdf_bptree_add(graph->sop_tree, statement);
     
-  if (context->index_ops)
-    librdf_avltree_add(graph->ops_tree, statement);
+  if (graph->ops_tree)
+    librdf_bptree_add(graph->ops_tree, statement);
     
-  if (context->index_pso)
-    librdf_avltree_add(graph->pso_tree, statement);
+  if (graph->pso_tree)
+    librdf_bptree_add(graph->pso_tree, statement);
     
   return status;
 }
@@ -253,7 +423,6 @@ librdf_storage_trees_add_statement_internal(librdf_storage* storage,
 /**
  * librdf_storage_trees_add_statement:
  * @storage: #librdf_storage object
- * @context_node: #librdf_node object
  * @statement: #librdf_statement statement to add
  *
  * Add a statement (with no context) to the storage.
@@ -266,46 +435,175 @@ librdf_storage_trees_add_statement(librdf_storage* storage,
                                    librdf_statement* statement) 
 {
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+
+  /* copy statement (store single copy in all trees) */
+  statement = librdf_new_statement_from_statement(statement);
+  if(!statement)
+    return 1;
+
   return librdf_storage_trees_add_statement_internal(storage, context->graph, statement);
 }
 
 
+/*
+ * librdf_storage_trees_add_statements_internal:
+ * @storage: the storage
+ * @graph: graph to add to
+ * @statement_stream: stream of statements to add
+ *
+ * INTERNAL - Add a stream of statements to a graph.
+ *
+ * The statements are gathered up first and, unless there are only a
+ * few of them compared to the graph, each index is rebuilt with them
+ * in one go.  That costs a sort plus time linear in the size of the
+ * index, instead of a tree descent and rebalance per statement per
+ * index.
+ *
+ * Return value: non 0 on failure
+ */
 static int
-librdf_storage_trees_add_statements(librdf_storage* storage,
-                                    librdf_stream* statement_stream)
+librdf_storage_trees_add_statements_internal(librdf_storage* storage,
+                                             librdf_storage_trees_graph* graph,
+                                             librdf_stream* statement_stream)
 {
+  void** statements=NULL;
+  int size=0;
+  int count=0;
   int status=0;
+  int i;
+  int j;
 
   for(; !librdf_stream_end(statement_stream); librdf_stream_next(statement_stream)) {
     librdf_statement* statement=librdf_stream_get_object(statement_stream);
 
-    if (statement) {
-      status=librdf_storage_trees_add_statement(storage, statement);
-      if (status)
-        break;
-    } else {
+    if (!statement) {
       status=1;
       break;
     }
+
+    if(count == size) {
+      void** new_statements;
+
+      size=size ? size*2 : 1024;
+      new_statements=(void**)LIBRDF_REALLOC(array, statements,
+                                            size*sizeof(void*));
+      if(!new_statements) {
+        status=-1;
+        break;
+      }
+      statements=new_statements;
+    }
+
+    /* copy statement (store single copy in all trees) */
+    statements[count]=librdf_new_statement_from_statement(statement);
+    if(!statements[count]) {
+      status=-1;
+      break;
+    }
+    count++;
   }
-  
+
+  if(!count) {
+    if(statements)
+      LIBRDF_FREE(array, statements);
+    return status;
+  }
+
+  if(count < librdf_bptree_size(graph->spo_tree) / LIBRDF_STORAGE_TREES_BULK_RATIO) {
+    /* too few to be worth rebuilding the indexes */
+    for(i=0; i < count; i++) {
+      int rc=librdf_storage_trees_add_statement_internal(storage, graph,
+                                                         (librdf_statement*)statements[i]);
+      if(rc) {
+        while(++i < count)
+          librdf_free_statement((librdf_statement*)statements[i]);
+        if(!status)
+          status=rc;
+      }
+    }
+
+    LIBRDF_FREE(array, statements);
+    return status;
+  }
+
+  /* spo_tree owns statements and frees any it already has */
+  j=librdf_bptree_add_array(graph->spo_tree, statements, count);
+  if(j < 0) { /* LIBRDF_BPTREE_ENOMEM */
+    for(i=0; i < count; i++)
+      librdf_free_statement((librdf_statement*)statements[i]);
+    LIBRDF_FREE(array, statements);
+    return j;
+  }
+
+  for(i=0, j=0; i < count; i++) {
+    if(statements[i])
+      statements[j++]=statements[i];
+  }
+  count=j;
+
+  if(librdf_storage_trees_all_graphs_add_array(storage, graph, statements,
+                                               count)) {
+    /* keep the graph in step with the index of every graph */
+    for(i=0; i < count; i++)
+      librdf_bptree_delete(graph->spo_tree, statements[i]);
+    LIBRDF_FREE(array, statements);
+    return LIBRDF_BPTREE_ENOMEM;
+  }
+
+  /* others have null deleters */
+  /* (XXX: corrupt model if insertions fail) */
+
+  if (graph->sop_tree)
+    librdf_bptree_add_array(graph->sop_tree, statements, count);
+
+  if (graph->ops_tree)
+    librdf_bptree_add_array(graph->ops_tree, statements, count);
+
+  if (graph->pso_tree)
+    librdf_bptree_add_array(graph->pso_tree, statements, count);
+
+  LIBRDF_FREE(array, statements);
+
   return status;
 }
 
+
+static int
+librdf_storage_trees_add_statements(librdf_storage* storage,
+                                    librdf_stream* statement_stream)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+
+  return librdf_storage_trees_add_statements_internal(storage, context->graph,
+                                                      statement_stream);
+}
+
 static int
-librdf_storage_trees_remove_statement_internal(librdf_storage_trees_graph* graph,
+librdf_storage_trees_remove_statement_internal(librdf_storage* storage,
+                                               librdf_storage_trees_graph* graph,
                                                librdf_statement* statement) 
 {
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+
+  if (context->all_graphs) {
+    librdf_storage_trees_quad key; /* on stack */
+
+    key.statement=statement;
+    key.context=graph->context;
+    key.any_context=0;
+    librdf_bptree_delete(context->all_graphs, &key);
+  }
+
   if (graph->sop_tree)
-    librdf_avltree_delete(graph->sop_tree, statement);
+    librdf_bptree_delete(graph->sop_tree, statement);
 
   if (graph->ops_tree)
-    librdf_avltree_delete(graph->ops_tree, statement);
+    librdf_bptree_delete(graph->ops_tree, statement);
 
   if (graph->pso_tree)
-    librdf_avltree_delete(graph->pso_tree, statement);
+    librdf_bptree_delete(graph->pso_tree, statement);
   
-  librdf_avltree_delete(graph->spo_tree, statement);
+  librdf_bptree_delete(graph->spo_tree, statement);
   
   return 0;
 }
@@ -314,7 +612,6 @@ librdf_storage_trees_remove_statement_internal(librdf_storage_trees_graph* graph
 /**
  * librdf_storage_trees_remove_statement:
  * @storage: #librdf_storage object
- * @context_node: #librdf_node object
  * @statement: #librdf_statement statement to remove
  *
  * Remove a statement (without context) from the storage.
@@ -327,95 +624,277 @@ librdf_storage_trees_remove_statement(librdf_storage* storage,
 {
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
 
-  return librdf_storage_trees_remove_statement_internal(context->graph, statement);
+  return librdf_storage_trees_remove_statement_internal(storage, context->graph,
+                                                        statement);
 }
 
 static int
 librdf_storage_trees_contains_statement(librdf_storage* storage, librdf_statement* statement)
 {
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_iterator* iterator;
+  librdf_bptree_pin* pin;
+  int found;
+
+  /* one search finds the statement in any graph */
+  if(context->all_graphs) {
+    librdf_storage_trees_quad key; /* on stack */
+
+    key.statement=statement;
+    key.context=NULL;
+    key.any_context=1;
+    return (librdf_bptree_search(context->all_graphs, &key) != NULL);
+  }
+
+  if(librdf_storage_trees_pin(storage, &pin))
+    return 0;
+
+  found=(librdf_bptree_search(context->graph->spo_tree, statement) != NULL);
+  if(found || !context->contexts) {
+    librdf_storage_trees_unpin(storage, pin);
+    return found;
+  }
+
+  /* look in each context */
+  iterator=librdf_bptree_get_iterator_start(storage->world, context->contexts,
+                                            NULL, NULL);
+  if(!iterator) {
+    librdf_storage_trees_unpin(storage, pin);
+    return 0;
+  }
+
+  for(; !found && !librdf_iterator_end(iterator);
+      librdf_iterator_next(iterator)) {
+    librdf_storage_trees_graph* graph;
 
-  return (librdf_avltree_search(context->graph->spo_tree, statement) != NULL);
+    graph=(librdf_storage_trees_graph*)librdf_iterator_get_object(iterator);
+    found=(librdf_bptree_search(graph->spo_tree, statement) != NULL);
+  }
+  librdf_free_iterator(iterator);
+  librdf_storage_trees_unpin(storage, pin);
+
+  return found;
 }
 
 
 typedef struct {
   librdf_storage *storage;
+  /* statements in the current graph */
   librdf_iterator *iterator;
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
+  /* context of the current graph */
   librdf_node *context_node;
-#endif
+  /* named graphs still to walk or NULL */
+  librdf_iterator *graphs;
+  /* statement to match or NULL for all */
+  librdf_statement *range;
+  /* non 0 if the current graph is walked without a matching index so
+   * its statements must be matched against range */
+  int filter;
+  /* non 0 if iterator walks the index of every graph, with key */
+  int quads;
+  librdf_storage_trees_quad key;
+  /* pinned version the graphs were found in, or NULL */
+  librdf_bptree_versions* versions;
+  librdf_bptree_pin* pin;
 } librdf_storage_trees_serialise_stream_context;
 
 
-static librdf_stream*
-librdf_storage_trees_serialise_range(librdf_storage* storage, librdf_statement* range)
+/*
+ * librdf_storage_trees_graph_find:
+ * @storage: #librdf_storage object
+ * @graph: graph to search
+ * @range: statement to match or NULL for all
+ * @filter_p: pointer to flag set if the results must be filtered
+ *
+ * INTERNAL - Start an iterator over the statements in a graph matching
+ * a range, using the index that matches the range best.
+ *
+ * If the index needed is missing, the whole graph is returned and
+ * *@filter_p is set.  @range remains owned by the caller.
+ *
+ * Return value: new #librdf_iterator or NULL on failure
+ */
+static librdf_iterator*
+librdf_storage_trees_graph_find(librdf_storage* storage,
+                                librdf_storage_trees_graph* graph,
+                                librdf_statement* range, int* filter_p)
 {
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
-  librdf_storage_trees_serialise_stream_context* scontext;
-  librdf_stream* stream;
-  int filter = 0;
-  
-  scontext=(librdf_storage_trees_serialise_stream_context*)LIBRDF_CALLOC(librdf_storage_trees_serialise_stream_context, 1, sizeof(librdf_storage_trees_serialise_stream_context));
-  if(!scontext)
-    return NULL;
-    
-  scontext->iterator = NULL;
+  librdf_storage_trees_index index;
+  librdf_bptree* tree;
+
+  *filter_p=0;
 
   /* ?s ?p ?o */
-  if (!range || (!range->subject && !range->predicate && !range->object)) {
-    scontext->iterator=librdf_avltree_get_iterator_start(storage->world, context->graph->spo_tree,
-        NULL, NULL);
-    if (range) {
-      librdf_free_statement(range);
-      range=NULL;
-    }
+  if (!range) {
+    index=LIBRDF_STORAGE_TREES_INDEX_SPO;
   /* s ?p o */
   } else if (range->subject && !range->predicate && range->object) {
-    if (context->index_sop)
-      scontext->iterator=librdf_avltree_get_iterator_start(storage->world, context->graph->sop_tree,
-        range, librdf_storage_trees_avl_free);
-	else
-		filter=1;
+    index=LIBRDF_STORAGE_TREES_INDEX_SOP;
   /* s _ _ */
   } else if (range->subject) {
-    scontext->iterator=librdf_avltree_get_iterator_start(storage->world, context->graph->spo_tree,
-        range, librdf_storage_trees_avl_free);
+    index=LIBRDF_STORAGE_TREES_INDEX_SPO;
   /* ?s _ o */
   } else if (range->object) {
-    if (context->index_ops)
-      scontext->iterator=librdf_avltree_get_iterator_start(storage->world, context->graph->ops_tree,
-          range, librdf_storage_trees_avl_free);
-	else
-		filter=1;
+    index=LIBRDF_STORAGE_TREES_INDEX_OPS;
   /* ?s p ?o */
   } else { /* range->predicate != NULL */
-    if (context->index_pso)
-      scontext->iterator=librdf_avltree_get_iterator_start(storage->world, context->graph->pso_tree,
-          range, librdf_storage_trees_avl_free);
-	else
-		filter=1;
+    index=LIBRDF_STORAGE_TREES_INDEX_PSO;
   }
-    
-  /* If filter is set, we're missing the required index.
-   * Iterate over the entire model and filter the stream.
+
+  if (context->adaptive)
+    librdf_storage_trees_graph_adapt(storage, graph, index);
+
+  tree=*librdf_storage_trees_graph_index(graph, index);
+
+  /* If tree is not set, we're missing the required index.
+   * Iterate over the entire graph and filter the stream.
    * (With a fully indexed store, this will never happen) */
-  if (filter) {
-    scontext->iterator=librdf_avltree_get_iterator_start(storage->world, context->graph->spo_tree,
-        range, librdf_storage_trees_avl_free);
+  if (!tree) {
+    tree=graph->spo_tree;
+    *filter_p=1;
   }
 
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-  scontext->context_node=NULL;
-#endif
+  return librdf_bptree_get_iterator_start(storage->world, tree, range, NULL);
+}
 
-  if(!scontext->iterator) {
-    LIBRDF_FREE(librdf_storage_trees_serialise_stream_context, scontext);
-    return librdf_new_empty_stream(storage->world);
+
+/*
+ * librdf_storage_trees_serialise_next_graph:
+ * @scontext: stream context
+ *
+ * INTERNAL - Skip statements of the current graph that do not match
+ * and move on to the next named graph with matches once the current
+ * graph has none left.
+ *
+ * Each graph may lack the index its search needs, so whether its
+ * statements are matched against the range is decided per graph.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_trees_serialise_next_graph(librdf_storage_trees_serialise_stream_context* scontext)
+{
+  while(1) {
+    librdf_storage_trees_graph* graph;
+
+    while(scontext->filter && !librdf_iterator_end(scontext->iterator)) {
+      librdf_statement* statement;
+
+      statement=(librdf_statement*)librdf_iterator_get_object(scontext->iterator);
+      if(librdf_statement_match(statement, scontext->range))
+        break;
+      librdf_iterator_next(scontext->iterator);
+    }
+
+    if(!librdf_iterator_end(scontext->iterator) || !scontext->graphs ||
+       librdf_iterator_end(scontext->graphs))
+      return 0;
+
+    graph=(librdf_storage_trees_graph*)librdf_iterator_get_object(scontext->graphs);
+    librdf_iterator_next(scontext->graphs);
+
+    librdf_free_iterator(scontext->iterator);
+    scontext->iterator=librdf_storage_trees_graph_find(scontext->storage, graph,
+                                                       scontext->range,
+                                                       &scontext->filter);
+    scontext->context_node=graph->context;
+    if(!scontext->iterator)
+      return 1;
+  }
+}
+
+
+/*
+ * librdf_storage_trees_serialise_range:
+ * @storage: #librdf_storage object
+ * @graph: graph to start with or NULL to search the index of every graph
+ * @range: statement to match or NULL for all (becomes owned by the stream)
+ * @all_graphs: non 0 to go on to every named graph after @graph
+ * @pin: pin taken before @graph was found or NULL (becomes owned by the stream)
+ *
+ * INTERNAL - Make a stream of the statements matching @range in one or
+ * every graph.
+ *
+ * Without @graph, @range must have a subject, and the statements of
+ * every graph matching it are found in the index of every graph.
+ *
+ * With snapshots, @pin keeps @graph from being freed while the stream
+ * reads it, however the store is written.
+ *
+ * Return value: new #librdf_stream or NULL on failure
+ */
+static librdf_stream*
+librdf_storage_trees_serialise_range(librdf_storage* storage,
+                                     librdf_storage_trees_graph* graph,
+                                     librdf_statement* range, int all_graphs,
+                                     librdf_bptree_pin* pin)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_serialise_stream_context* scontext;
+  librdf_stream* stream;
+  
+  scontext=(librdf_storage_trees_serialise_stream_context*)LIBRDF_CALLOC(librdf_storage_trees_serialise_stream_context, 1, sizeof(librdf_storage_trees_serialise_stream_context));
+  if(!scontext) {
+    if(range)
+      librdf_free_statement(range);
+    librdf_storage_trees_unpin(storage, pin);
+    return NULL;
+  }
+
+  scontext->versions=context->versions;
+  scontext->pin=pin;
+    
+  /* ?s ?p ?o matches everything */
+  if (range && !range->subject && !range->predicate && !range->object) {
+    librdf_free_statement(range);
+    range=NULL;
   }
   
+  scontext->range=range;
+
+  if(!graph) {
+    /* the iterator returns quads matching key, which it shares */
+    scontext->quads=1;
+    scontext->key.statement=range;
+    scontext->key.context=NULL;
+    scontext->key.any_context=1;
+    scontext->iterator=librdf_bptree_get_iterator_start(storage->world,
+                                                        context->all_graphs,
+                                                        &scontext->key, NULL);
+  } else {
+    scontext->context_node=graph->context;
+
+    /* searching may drop idle indexes so is done before this stream
+     * counts as open */
+    scontext->iterator=librdf_storage_trees_graph_find(storage, graph, range,
+                                                       &scontext->filter);
+  }
+  if(!scontext->iterator) {
+    librdf_storage_trees_serialise_finished((void*)scontext);
+    return NULL;
+  }
+
   scontext->storage=storage;
   librdf_storage_add_reference(scontext->storage);
+  if(context->adaptive)
+    context->streams++;
+
+  if(all_graphs && context->contexts) {
+    scontext->graphs=librdf_bptree_get_iterator_start(storage->world,
+                                                      context->contexts,
+                                                      NULL, NULL);
+    if(!scontext->graphs) {
+      librdf_storage_trees_serialise_finished((void*)scontext);
+      return NULL;
+    }
+  }
+
+  /* to the first match */
+  if(librdf_storage_trees_serialise_next_graph(scontext)) {
+    librdf_storage_trees_serialise_finished((void*)scontext);
+    return NULL;
+  }
 
   stream=librdf_new_stream(storage->world,
                            (void*)scontext,
@@ -429,14 +908,6 @@ librdf_storage_trees_serialise_range(librdf_storage* storage, librdf_statement*
     return NULL;
   }
 
-  if(filter) {
-    if(librdf_stream_add_map(stream, &librdf_stream_statement_find_map, NULL, (void*)range)) {
-      /* error - stream_add_map failed */
-      librdf_free_stream(stream);
-      stream=NULL;
-    }
-  }
-  
   return stream;  
 }
 
@@ -444,7 +915,14 @@ librdf_storage_trees_serialise_range(librdf_storage* storage, librdf_statement*
 static librdf_stream*
 librdf_storage_trees_serialise(librdf_storage* storage)
 {
-  return librdf_storage_trees_serialise_range(storage, NULL);
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_bptree_pin* pin;
+
+  if(librdf_storage_trees_pin(storage, &pin))
+    return NULL;
+
+  return librdf_storage_trees_serialise_range(storage, context->graph, NULL, 1,
+                                              pin);
 }
 
 
@@ -461,7 +939,11 @@ librdf_storage_trees_serialise_next_statement(void* context)
 {
   librdf_storage_trees_serialise_stream_context* scontext=(librdf_storage_trees_serialise_stream_context*)context;
 
-  return librdf_iterator_next(scontext->iterator);
+  librdf_iterator_next(scontext->iterator);
+  if(librdf_storage_trees_serialise_next_graph(scontext))
+    return 1;
+
+  return librdf_iterator_end(scontext->iterator);
 }
 
 
@@ -469,14 +951,22 @@ static void*
 librdf_storage_trees_serialise_get_statement(void* context, int flags)
 {
   librdf_storage_trees_serialise_stream_context* scontext=(librdf_storage_trees_serialise_stream_context*)context;
+  librdf_storage_trees_quad* quad;
+
+  if(scontext->quads) {
+    quad=(librdf_storage_trees_quad*)librdf_iterator_get_object(scontext->iterator);
+    if(flags == LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT)
+      return quad->statement;
+    if(flags == LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT)
+      return quad->context;
+    return NULL;
+  }
 
   switch(flags) {
   case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
     return (librdf_statement*)librdf_iterator_get_object(scontext->iterator);
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
   case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
    return scontext->context_node;
-#endif
   default:
    return NULL;
   }
@@ -491,14 +981,27 @@ librdf_storage_trees_serialise_finished(void* context)
   if(scontext->iterator)
     librdf_free_iterator(scontext->iterator);
 
-  if(scontext->storage)
+  if(scontext->graphs)
+    librdf_free_iterator(scontext->graphs);
+
+  if(scontext->range)
+    librdf_free_statement(scontext->range);
+
+  if(scontext->pin)
+    librdf_bptree_versions_unpin(scontext->versions, scontext->pin);
+
+  if(scontext->storage) {
+    librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)scontext->storage->instance;
+
+    if(context->adaptive)
+      context->streams--;
     librdf_storage_remove_reference(scontext->storage);
+  }
   
   LIBRDF_FREE(librdf_storage_trees_serialise_stream_context, scontext);
 }
 
 
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
 /**
  * librdf_storage_trees_context_add_statement:
  * @storage: #librdf_storage object
@@ -515,81 +1018,320 @@ librdf_storage_trees_context_add_statement(librdf_storage* storage,
                                            librdf_statement* statement) 
 {
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_graph* graph;
   
-  librdf_storage_trees_graph* key=librdf_storage_trees_graph_new(storage, context_node);
-  librdf_storage_trees_graph* graph=(librdf_storage_trees_graph*)
-    librdf_avltree_search(context->contexts, key);
+  if(!context_node)
+    return librdf_storage_trees_add_statement(storage, statement);
   
-  if(graph) {
-    librdf_storage_trees_graph_free(key);
-  } else {
-    librdf_avltree_add(context->contexts, key);
-    graph=key;
+  if(!context->contexts) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
+               "Storage was created without context support");
+    return 1;
+  }
+
+  graph=librdf_storage_trees_graph_lookup(storage, context_node);
+  if(!graph) {
+    graph=librdf_storage_trees_graph_new(storage, context_node);
+    if(!graph)
+      return 1;
+
+    if(librdf_bptree_add(context->contexts, graph)) {
+      librdf_storage_trees_graph_free(graph);
+      return 1;
+    }
   }
+
+  /* copy statement (store single copy in all trees) */
+  statement = librdf_new_statement_from_statement(statement);
+  if(!statement)
+    return 1;
     
   return librdf_storage_trees_add_statement_internal(storage, graph, statement);
 }
 
 
 /**
- * librdf_storage_trees_context_remove_statement:
+ * librdf_storage_trees_context_add_statements:
  * @storage: #librdf_storage object
  * @context_node: #librdf_node object
- * @statement: #librdf_statement statement to remove
+ * @statement_stream: #librdf_stream of statements to add
  *
- * Remove a statement from a storage context.
+ * Add statements to a storage context.
  * 
  * Return value: non 0 on failure
  **/
 static int
-librdf_storage_trees_context_remove_statement(librdf_storage* storage, 
-                                              librdf_node* context_node,
-                                              librdf_statement* statement) 
+librdf_storage_trees_context_add_statements(librdf_storage* storage,
+                                            librdf_node* context_node,
+                                            librdf_stream* statement_stream) 
 {
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
-  librdf_storage_trees_graph* key=librdf_storage_trees_graph_new(storage, context_node);
-  librdf_storage_trees_graph* graph=(librdf_storage_trees_graph*)
-    librdf_avltree_search(context->contexts, &key);
-  librdf_storage_trees_graph_free(key);
-  if (graph) {
-    return librdf_storage_trees_remove_statement_internal(graph, statement);
-  } else {
-    return -1;
+  librdf_storage_trees_graph* graph;
+  int status;
+  
+  if(!context_node)
+    return librdf_storage_trees_add_statements(storage, statement_stream);
+  
+  if(!context->contexts) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
+               "Storage was created without context support");
+    return 1;
   }
-}
 
+  graph=librdf_storage_trees_graph_lookup(storage, context_node);
+  if(graph)
+    return librdf_storage_trees_add_statements_internal(storage, graph,
+                                                        statement_stream);
 
-/**
- * librdf_storage_trees_context_serialise:
- * @storage: #librdf_storage object
- * @context_node: #librdf_node object
- *
- * List all statements in a storage context.
+  /* a new context is added first, so that its statements are never
+   * only in the index of every graph, and is only kept if something
+   * was added to it */
+  graph=librdf_storage_trees_graph_new(storage, context_node);
+  if(!graph)
+    return 1;
+
+  if(librdf_bptree_add(context->contexts, graph)) {
+    librdf_storage_trees_graph_free(graph);
+    return 1;
+  }
+
+  status=librdf_storage_trees_add_statements_internal(storage, graph,
+                                                      statement_stream);
+  if(!librdf_bptree_size(graph->spo_tree))
+    librdf_bptree_delete(context->contexts, graph);
+
+  return status;
+}
+
+
+/**
+ * librdf_storage_trees_context_remove_statement:
+ * @storage: #librdf_storage object
+ * @context_node: #librdf_node object
+ * @statement: #librdf_statement statement to remove
+ *
+ * Remove a statement from a storage context.
+ * 
+ * A context left with no statements is removed.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_trees_context_remove_statement(librdf_storage* storage, 
+                                              librdf_node* context_node,
+                                              librdf_statement* statement) 
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_graph* graph;
+
+  if(!context_node)
+    return librdf_storage_trees_remove_statement(storage, statement);
+
+  if(!context->contexts)
+    return 1;
+
+  graph=librdf_storage_trees_graph_lookup(storage, context_node);
+  if(!graph)
+    return 1;
+
+  librdf_storage_trees_remove_statement_internal(storage, graph, statement);
+
+  if(!librdf_bptree_size(graph->spo_tree))
+    librdf_bptree_delete(context->contexts, graph);
+
+  return 0;
+}
+
+
+/**
+ * librdf_storage_trees_context_remove_statements:
+ * @storage: #librdf_storage object
+ * @context_node: #librdf_node object
+ *
+ * Remove all statements in a storage context.
+ *
+ * The whole graph for the context is dropped at once, after its
+ * statements are removed one by one from any index of every graph.
+ * With no context, all statements without a context are removed.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_trees_context_remove_statements(librdf_storage* storage,
+                                               librdf_node* context_node)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_graph* graph;
+
+  if(!context_node) {
+    graph=librdf_storage_trees_graph_new(storage, NULL);
+    if(!graph)
+      return 1;
+
+    if(librdf_storage_trees_all_graphs_remove_graph(storage, context->graph)) {
+      librdf_storage_trees_graph_free(graph);
+      return 1;
+    }
+
+    /* streams may still be reading the old graph */
+    if(context->versions)
+      librdf_bptree_versions_retire(context->versions, context->graph,
+                                    librdf_storage_trees_graph_free);
+    else
+      librdf_storage_trees_graph_free(context->graph);
+    context->graph=graph;
+    return 0;
+  }
+
+  if(!context->contexts)
+    return 1;
+
+  graph=librdf_storage_trees_graph_lookup(storage, context_node);
+  if(!graph)
+    return 0;
+
+  if(librdf_storage_trees_all_graphs_remove_graph(storage, graph))
+    return 1;
+
+  librdf_bptree_delete(context->contexts, graph);
+
+  return 0;
+}
+
+
+/**
+ * librdf_storage_trees_context_serialise:
+ * @storage: #librdf_storage object
+ * @context_node: #librdf_node object
+ *
+ * List all statements in a storage context.
  * 
- * Return value: #librdf_stream of statements or NULL on failure or context is empty
+ * Return value: #librdf_stream of statements or NULL on failure
  **/
 static librdf_stream*
 librdf_storage_trees_context_serialise(librdf_storage* storage,
                                         librdf_node* context_node) 
 {
-  return NULL;
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_graph* graph;
+  librdf_bptree_pin* pin;
+
+  if(context_node && !context->contexts) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
+               "Storage was created without context support");
+    return NULL;
+  }
+
+  if(librdf_storage_trees_pin(storage, &pin))
+    return NULL;
+
+  if(!context_node)
+    graph=context->graph;
+  else {
+    graph=librdf_storage_trees_graph_lookup(storage, context_node);
+    if(!graph) {
+      librdf_storage_trees_unpin(storage, pin);
+      return librdf_new_empty_stream(storage->world);
+    }
+  }
+
+  return librdf_storage_trees_serialise_range(storage, graph, NULL, 0, pin);
 }
 
 
 /**
- * librdf_storage_trees_context_get_contexts:
+ * librdf_storage_trees_find_statements_in_context:
+ * @storage: #librdf_storage object
+ * @statement: #librdf_statement partial statement to find
+ * @context_node: context #librdf_node (or NULL)
+ *
+ * Find statements matching a partial statement in a storage context.
+ *
+ * This is a search in the indexes of the context graph alone.
+ *
+ * Return value: #librdf_stream of statements or NULL on failure
+ **/
+static librdf_stream*
+librdf_storage_trees_find_statements_in_context(librdf_storage* storage,
+                                                librdf_statement* statement,
+                                                librdf_node* context_node)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_graph* graph;
+  librdf_statement* range;
+  librdf_bptree_pin* pin;
+
+  if(!context_node)
+    return librdf_storage_trees_find_statements(storage, statement);
+
+  if(!context->contexts)
+    return NULL;
+
+  range=librdf_new_statement_from_statement(statement);
+  if(!range)
+    return NULL;
+
+  if(librdf_storage_trees_pin(storage, &pin)) {
+    librdf_free_statement(range);
+    return NULL;
+  }
+
+  graph=librdf_storage_trees_graph_lookup(storage, context_node);
+  if(!graph) {
+    librdf_storage_trees_unpin(storage, pin);
+    librdf_free_statement(range);
+    return librdf_new_empty_stream(storage->world);
+  }
+
+  return librdf_storage_trees_serialise_range(storage, graph, range, 0, pin);
+}
+
+
+static void*
+librdf_storage_trees_get_contexts_map(librdf_iterator* iterator,
+                                      void* map_context, void* item)
+{
+  return ((librdf_storage_trees_graph*)item)->context;
+}
+
+
+/**
+ * librdf_storage_trees_get_contexts:
  * @storage: #librdf_storage object
  *
  * List all context nodes in a storage.
  * 
- * Return value: #librdf_iterator of context_nodes or NULL on failure or no contexts
+ * Return value: #librdf_iterator of context_nodes or NULL on failure
  **/
 static librdf_iterator*
 librdf_storage_trees_get_contexts(librdf_storage* storage) 
 {
-  return NULL;
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_iterator* iterator;
+
+  if(!context->contexts) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
+               "Storage was created without context support");
+    return NULL;
+  }
+
+  iterator=librdf_bptree_get_iterator_start(storage->world, context->contexts,
+                                            NULL, NULL);
+  if(!iterator)
+    return NULL;
+
+  /* the map holds a storage reference for the life of the iterator */
+  librdf_storage_add_reference(storage);
+  if(librdf_iterator_add_map(iterator, &librdf_storage_trees_get_contexts_map,
+                             (librdf_iterator_map_free_context_handler)&librdf_storage_remove_reference,
+                             storage)) {
+    librdf_storage_remove_reference(storage);
+    librdf_free_iterator(iterator);
+    return NULL;
+  }
+
+  return iterator;
 }
-#endif
 
 
 /**
@@ -609,13 +1351,27 @@ librdf_storage_trees_get_contexts(librdf_storage* storage)
 static librdf_stream*
 librdf_storage_trees_find_statements(librdf_storage* storage, librdf_statement* statement)
 {
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
   librdf_stream* stream;
+  librdf_bptree_pin* pin;
 
   librdf_statement* range=librdf_new_statement_from_statement(statement);
   if(!range)
     return NULL;
 
-  stream=librdf_storage_trees_serialise_range(storage, range);
+  if(librdf_storage_trees_pin(storage, &pin)) {
+    librdf_free_statement(range);
+    return NULL;
+  }
+
+  /* statements with a subject, and a predicate unless there is an
+   * object, are a range of the index of every graph */
+  if(context->all_graphs && range->subject &&
+     (range->predicate || !range->object))
+    return librdf_storage_trees_serialise_range(storage, NULL, range, 0, pin);
+
+  stream=librdf_storage_trees_serialise_range(storage, context->graph, range, 1,
+                                              pin);
 
   return stream;
 }
@@ -886,54 +1642,511 @@ librdf_statement_compare_pso(const void* data1, const void* data2)
 }
 
 
+#ifndef HAVE_RAPTOR2_API
+/*
+ * librdf_storage_trees_ordinal_compare:
+ * @a1: first part of first statement
+ * @b1: first part of second statement
+ * @a2: second part of first statement
+ * @b2: second part of second statement
+ * @a3: third part of first statement
+ * @b3: third part of second statement
+ *
+ * INTERNAL - Compare two statements by the ordinals of their parts.
+ *
+ * Nodes are interned so equal nodes are the same node with the same
+ * ordinal, and the order is that the nodes were first created in.
+ * NULL parts act as wildcards.
+ *
+ * Return value: <0, 0 or >0 as for strcmp()
+ */
+static int
+librdf_storage_trees_ordinal_compare(librdf_node* a1, librdf_node* b1,
+                                     librdf_node* a2, librdf_node* b2,
+                                     librdf_node* a3, librdf_node* b3)
+{
+  if (!a1 || !b1)
+    return 0;
+  if (a1 != b1)
+    return (a1->ordinal < b1->ordinal) ? -1 : 1;
+
+  if (!a2 || !b2)
+    return 0;
+  if (a2 != b2)
+    return (a2->ordinal < b2->ordinal) ? -1 : 1;
+
+  if (!a3 || !b3 || a3 == b3)
+    return 0;
+  return (a3->ordinal < b3->ordinal) ? -1 : 1;
+}
+
+
+/* Compare two statements in (s, p, o) ordinal order. */
+static int
+librdf_statement_compare_spo_ordinal(const void* data1, const void* data2)
+{
+  librdf_statement* a = (librdf_statement*)data1;
+  librdf_statement* b = (librdf_statement*)data2;
+
+  return librdf_storage_trees_ordinal_compare(a->subject, b->subject,
+                                              a->predicate, b->predicate,
+                                              a->object, b->object);
+}
+
+
+/* Compare two statements in (s, o, p) ordinal order. */
+static int
+librdf_statement_compare_sop_ordinal(const void* data1, const void* data2)
+{
+  librdf_statement* a = (librdf_statement*)data1;
+  librdf_statement* b = (librdf_statement*)data2;
+
+  return librdf_storage_trees_ordinal_compare(a->subject, b->subject,
+                                              a->object, b->object,
+                                              a->predicate, b->predicate);
+}
+
+
+/* Compare two statements in (o, p, s) ordinal order. */
+static int
+librdf_statement_compare_ops_ordinal(const void* data1, const void* data2)
+{
+  librdf_statement* a = (librdf_statement*)data1;
+  librdf_statement* b = (librdf_statement*)data2;
+
+  return librdf_storage_trees_ordinal_compare(a->object, b->object,
+                                              a->predicate, b->predicate,
+                                              a->subject, b->subject);
+}
+
+
+/* Compare two statements in (p, s, o) ordinal order. */
+static int
+librdf_statement_compare_pso_ordinal(const void* data1, const void* data2)
+{
+  librdf_statement* a = (librdf_statement*)data1;
+  librdf_statement* b = (librdf_statement*)data2;
+
+  return librdf_storage_trees_ordinal_compare(a->predicate, b->predicate,
+                                              a->subject, b->subject,
+                                              a->object, b->object);
+}
+#endif
+
+
 static void
-librdf_storage_trees_avl_free(void* data)
+librdf_storage_trees_statement_free(void* data)
 {
   librdf_statement* stmnt=(librdf_statement*)data;
   librdf_free_statement(stmnt);
 }
 
 
+/* index of every graph functions */
+
+/* Compare two quads in (s, p, o, context) order, with no context first.
+ * NULL statement fields act as wildcards, as does the context of a
+ * key with any_context set. */
+static int
+librdf_storage_trees_quad_compare(const void* data1, const void* data2)
+{
+  librdf_storage_trees_quad* a = (librdf_storage_trees_quad*)data1;
+  librdf_storage_trees_quad* b = (librdf_storage_trees_quad*)data2;
+  int cmp;
+
+  cmp = librdf_statement_compare_spo(a->statement, b->statement);
+  if (cmp || a->any_context || b->any_context || a->context == b->context)
+    return cmp;
+
+  if (!a->context || !b->context)
+    return a->context ? 1 : -1;
+  return librdf_storage_trees_node_compare(a->context, b->context);
+}
+
+
+#ifndef HAVE_RAPTOR2_API
+/* Compare two quads in (s, p, o, context) ordinal order. */
+static int
+librdf_storage_trees_quad_compare_ordinal(const void* data1, const void* data2)
+{
+  librdf_storage_trees_quad* a = (librdf_storage_trees_quad*)data1;
+  librdf_storage_trees_quad* b = (librdf_storage_trees_quad*)data2;
+  int cmp;
+
+  cmp = librdf_statement_compare_spo_ordinal(a->statement, b->statement);
+  if (cmp || a->any_context || b->any_context || a->context == b->context)
+    return cmp;
+
+  if (!a->context || !b->context)
+    return a->context ? 1 : -1;
+  return (a->context->ordinal < b->context->ordinal) ? -1 : 1;
+}
+#endif
+
+
+static void
+librdf_storage_trees_quad_free(void* data)
+{
+  LIBRDF_FREE(librdf_storage_trees_quad, data);
+}
+
+
+/* make a quad for a statement of a graph or return NULL on failure */
+static librdf_storage_trees_quad*
+librdf_storage_trees_quad_new(librdf_storage_trees_graph* graph,
+                              librdf_statement* statement)
+{
+  librdf_storage_trees_quad* quad;
+
+  quad=(librdf_storage_trees_quad*)LIBRDF_MALLOC(librdf_storage_trees_quad,
+                                                 sizeof(librdf_storage_trees_quad));
+  if(!quad)
+    return NULL;
+
+  quad->statement=statement;
+  quad->context=graph->context;
+  quad->any_context=0;
+
+  return quad;
+}
+
+
+/*
+ * librdf_storage_trees_all_graphs_add:
+ * @storage: the storage
+ * @graph: graph @statement was just added to
+ * @statement: statement
+ *
+ * INTERNAL - Add a statement new to a graph to any index of every graph.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_trees_all_graphs_add(librdf_storage* storage,
+                                    librdf_storage_trees_graph* graph,
+                                    librdf_statement* statement)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_quad* quad;
+  int status;
+
+  if(!context->all_graphs)
+    return 0;
+
+  quad=librdf_storage_trees_quad_new(graph, statement);
+  if(!quad)
+    return LIBRDF_BPTREE_ENOMEM;
+
+  /* the statement is new to the graph so the quad cannot exist */
+  status=librdf_bptree_add(context->all_graphs, quad);
+  if(status < 0) {
+    librdf_storage_trees_quad_free(quad);
+    return status;
+  }
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_trees_all_graphs_add_array:
+ * @storage: the storage
+ * @graph: graph @statements were just added to
+ * @statements: array of statements
+ * @count: number of statements
+ *
+ * INTERNAL - Add statements new to a graph to any index of every
+ * graph in one go, or none of them on failure.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_trees_all_graphs_add_array(librdf_storage* storage,
+                                          librdf_storage_trees_graph* graph,
+                                          void** statements, int count)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  void** quads;
+  int status=0;
+  int i;
+
+  if(!context->all_graphs || !count)
+    return 0;
+
+  quads=(void**)LIBRDF_CALLOC(array, count, sizeof(void*));
+  if(!quads)
+    return 1;
+
+  for(i=0; i < count; i++) {
+    quads[i]=librdf_storage_trees_quad_new(graph,
+                                           (librdf_statement*)statements[i]);
+    if(!quads[i]) {
+      status=1;
+      break;
+    }
+  }
+
+  if(!status && librdf_bptree_add_array(context->all_graphs, quads, count) < 0)
+    status=1;
+
+  if(status) {
+    for(i=0; i < count && quads[i]; i++)
+      librdf_storage_trees_quad_free(quads[i]);
+  }
+
+  LIBRDF_FREE(array, quads);
+
+  return status;
+}
+
+
+/*
+ * librdf_storage_trees_all_graphs_remove_graph:
+ * @storage: the storage
+ * @graph: graph about to be dropped
+ *
+ * INTERNAL - Remove every statement of a graph from any index of
+ * every graph, one at a time.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_trees_all_graphs_remove_graph(librdf_storage* storage,
+                                             librdf_storage_trees_graph* graph)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_iterator* iterator;
+  librdf_storage_trees_quad key; /* on stack */
+
+  if(!context->all_graphs)
+    return 0;
+
+  iterator=librdf_bptree_get_iterator_start(storage->world, graph->spo_tree,
+                                            NULL, NULL);
+  if(!iterator)
+    return 1;
+
+  key.context=graph->context;
+  key.any_context=0;
+  for(; !librdf_iterator_end(iterator); librdf_iterator_next(iterator)) {
+    key.statement=(librdf_statement*)librdf_iterator_get_object(iterator);
+    librdf_bptree_delete(context->all_graphs, &key);
+  }
+  librdf_free_iterator(iterator);
+
+  return 0;
+}
+
+
 /* graph functions */
 
 static librdf_storage_trees_graph*
 librdf_storage_trees_graph_new(librdf_storage* storage, librdf_node* context_node)
 {
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
-  librdf_storage_trees_graph* graph=(librdf_storage_trees_graph*)LIBRDF_MALLOC(
-    librdf_storage_trees_graph, sizeof(librdf_storage_trees_graph));
+  librdf_storage_trees_graph* graph=(librdf_storage_trees_graph*)LIBRDF_CALLOC(
+    librdf_storage_trees_graph, 1, sizeof(librdf_storage_trees_graph));
   
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
+  if(!graph)
+    return NULL;
+
   graph->context=(context_node ? librdf_new_node_from_node(context_node) : NULL);
-#endif
 
   /* Always create SPO index */
-  graph->spo_tree=librdf_new_avltree(librdf_statement_compare_spo, librdf_storage_trees_avl_free);
+  graph->spo_tree=librdf_new_bptree(librdf_storage_trees_index_compare(context, LIBRDF_STORAGE_TREES_INDEX_SPO),
+                                    librdf_storage_trees_statement_free);
   if(!graph->spo_tree) {
+    if(graph->context)
+      librdf_free_node(graph->context);
     LIBRDF_FREE(librdf_storage_trees_graph, graph);
     return NULL;
   }
   
   if(context->index_sop)
-    graph->sop_tree=librdf_new_avltree(librdf_statement_compare_sop, NULL);
+    graph->sop_tree=librdf_new_bptree(librdf_storage_trees_index_compare(context, LIBRDF_STORAGE_TREES_INDEX_SOP), NULL);
   else
     graph->sop_tree=NULL;
 
   if(context->index_ops)
-    graph->ops_tree=librdf_new_avltree(librdf_statement_compare_ops, NULL);
+    graph->ops_tree=librdf_new_bptree(librdf_storage_trees_index_compare(context, LIBRDF_STORAGE_TREES_INDEX_OPS), NULL);
   else
     graph->ops_tree=NULL;
   
   if(context->index_pso)
-    graph->pso_tree=librdf_new_avltree(librdf_statement_compare_pso, NULL);
+    graph->pso_tree=librdf_new_bptree(librdf_storage_trees_index_compare(context, LIBRDF_STORAGE_TREES_INDEX_PSO), NULL);
   else
     graph->pso_tree=NULL;
 
+  if(context->versions) {
+    librdf_storage_trees_index index;
+
+    for(index=LIBRDF_STORAGE_TREES_INDEX_SPO;
+        index < LIBRDF_STORAGE_TREES_INDEX_COUNT; index++) {
+      librdf_bptree* tree=*librdf_storage_trees_graph_index(graph, index);
+      if(tree)
+        librdf_bptree_set_versions(tree, context->versions);
+    }
+  }
+
   return graph;
 }
 
 
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
+/* address of the tree holding an index of a graph */
+static librdf_bptree**
+librdf_storage_trees_graph_index(librdf_storage_trees_graph* graph,
+                                 librdf_storage_trees_index index)
+{
+  switch(index) {
+    case LIBRDF_STORAGE_TREES_INDEX_SOP:
+      return &graph->sop_tree;
+    case LIBRDF_STORAGE_TREES_INDEX_OPS:
+      return &graph->ops_tree;
+    case LIBRDF_STORAGE_TREES_INDEX_PSO:
+      return &graph->pso_tree;
+    case LIBRDF_STORAGE_TREES_INDEX_SPO:
+    case LIBRDF_STORAGE_TREES_INDEX_COUNT:
+    default:
+      return &graph->spo_tree;
+  }
+}
+
+
+/* statement comparison function ordering an index */
+static librdf_bptree_data_compare_function
+librdf_storage_trees_index_compare(librdf_storage_trees_instance* context,
+                                   librdf_storage_trees_index index)
+{
+#ifndef HAVE_RAPTOR2_API
+  if(!context->sorted) {
+    switch(index) {
+      case LIBRDF_STORAGE_TREES_INDEX_SOP:
+        return librdf_statement_compare_sop_ordinal;
+      case LIBRDF_STORAGE_TREES_INDEX_OPS:
+        return librdf_statement_compare_ops_ordinal;
+      case LIBRDF_STORAGE_TREES_INDEX_PSO:
+        return librdf_statement_compare_pso_ordinal;
+      case LIBRDF_STORAGE_TREES_INDEX_SPO:
+      case LIBRDF_STORAGE_TREES_INDEX_COUNT:
+      default:
+        return librdf_statement_compare_spo_ordinal;
+    }
+  }
+#endif
+
+  switch(index) {
+    case LIBRDF_STORAGE_TREES_INDEX_SOP:
+      return librdf_statement_compare_sop;
+    case LIBRDF_STORAGE_TREES_INDEX_OPS:
+      return librdf_statement_compare_ops;
+    case LIBRDF_STORAGE_TREES_INDEX_PSO:
+      return librdf_statement_compare_pso;
+    case LIBRDF_STORAGE_TREES_INDEX_SPO:
+    case LIBRDF_STORAGE_TREES_INDEX_COUNT:
+    default:
+      return librdf_statement_compare_spo;
+  }
+}
+
+
+/*
+ * librdf_storage_trees_graph_build_index:
+ * @storage: the storage
+ * @graph: graph
+ * @index: missing optional index to build
+ *
+ * INTERNAL - Build an index of a graph from its spo index in one go.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_trees_graph_build_index(librdf_storage* storage,
+                                       librdf_storage_trees_graph* graph,
+                                       librdf_storage_trees_index index)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_bptree* tree;
+  librdf_iterator* iterator;
+  void** statements;
+  int count=0;
+  int status=0;
+
+  tree=librdf_new_bptree(librdf_storage_trees_index_compare(context, index),
+                         NULL);
+  if(!tree)
+    return 1;
+
+  statements=(void**)LIBRDF_MALLOC(array, (librdf_bptree_size(graph->spo_tree) + 1) * sizeof(void*));
+  iterator=librdf_bptree_get_iterator_start(storage->world, graph->spo_tree,
+                                            NULL, NULL);
+  if(!statements || !iterator) {
+    status=1;
+  } else {
+    for(; !librdf_iterator_end(iterator); librdf_iterator_next(iterator))
+      statements[count++]=librdf_iterator_get_object(iterator);
+
+    if(librdf_bptree_add_array(tree, statements, count) < 0)
+      status=1;
+  }
+
+  if(iterator)
+    librdf_free_iterator(iterator);
+  if(statements)
+    LIBRDF_FREE(array, statements);
+
+  if(status) {
+    librdf_free_bptree(tree);
+    return status;
+  }
+
+  *librdf_storage_trees_graph_index(graph, index)=tree;
+  return 0;
+}
+
+
+/*
+ * librdf_storage_trees_graph_adapt:
+ * @storage: the storage
+ * @graph: graph about to be searched
+ * @index: index the search wants
+ *
+ * INTERNAL - Adaptive indexing: record a search of a graph, building
+ * the index it wants if that has been missing too often, and dropping
+ * optional indexes that have gone unused.
+ */
+static void
+librdf_storage_trees_graph_adapt(librdf_storage* storage,
+                                 librdf_storage_trees_graph* graph,
+                                 librdf_storage_trees_index index)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  int i;
+
+  graph->finds++;
+
+  if(!*librdf_storage_trees_graph_index(graph, index) &&
+     ++graph->misses[index] >= LIBRDF_STORAGE_TREES_ADAPT_MISSES) {
+    graph->misses[index]=0;
+    librdf_storage_trees_graph_build_index(storage, graph, index);
+  }
+  graph->used[index]=graph->finds;
+
+  /* an open stream may be walking any of the indexes */
+  if(context->streams)
+    return;
+
+  for(i=LIBRDF_STORAGE_TREES_INDEX_SOP; i < LIBRDF_STORAGE_TREES_INDEX_COUNT; i++) {
+    librdf_bptree** tree_p;
+
+    tree_p=librdf_storage_trees_graph_index(graph, (librdf_storage_trees_index)i);
+    if(*tree_p && graph->finds - graph->used[i] > LIBRDF_STORAGE_TREES_ADAPT_IDLE) {
+      librdf_free_bptree(*tree_p);
+      *tree_p=NULL;
+    }
+  }
+}
+
+
 static int
 librdf_storage_trees_graph_compare(const void* data1, const void* data2)
 {
@@ -941,28 +2154,91 @@ librdf_storage_trees_graph_compare(const void* data1, const void* data2)
   librdf_storage_trees_graph* b = (librdf_storage_trees_graph*)data2;
   return librdf_storage_trees_node_compare(a->context, b->context);
 }
+
+
+#ifndef HAVE_RAPTOR2_API
+static int
+librdf_storage_trees_graph_compare_ordinal(const void* data1, const void* data2)
+{
+  librdf_storage_trees_graph* a = (librdf_storage_trees_graph*)data1;
+  librdf_storage_trees_graph* b = (librdf_storage_trees_graph*)data2;
+
+  if (a->context == b->context)
+    return 0;
+  return (a->context->ordinal < b->context->ordinal) ? -1 : 1;
+}
 #endif
 
 
+/* Find the graph for a context node or NULL if it has no statements */
+static librdf_storage_trees_graph*
+librdf_storage_trees_graph_lookup(librdf_storage* storage,
+                                  librdf_node* context_node)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_graph key; /* on stack */
+
+  key.context=context_node;
+
+  return (librdf_storage_trees_graph*)librdf_bptree_search(context->contexts,
+                                                           &key);
+}
+
+
+/*
+ * librdf_storage_trees_pin:
+ * @storage: #librdf_storage object
+ * @pin_p: pointer to the pin, set to NULL without snapshots
+ *
+ * INTERNAL - With snapshots, pin the current version of every tree so
+ * that graphs found from now on, or read from the storage, are not
+ * freed by a writer removing them until librdf_storage_trees_unpin().
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_trees_pin(librdf_storage* storage, librdf_bptree_pin** pin_p)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+
+  *pin_p=NULL;
+  if(!context->versions)
+    return 0;
+
+  *pin_p=librdf_bptree_versions_pin(context->versions);
+  return (*pin_p == NULL);
+}
+
+
+/* INTERNAL - release a pin from librdf_storage_trees_pin() */
+static void
+librdf_storage_trees_unpin(librdf_storage* storage, librdf_bptree_pin* pin)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+
+  if(pin)
+    librdf_bptree_versions_unpin(context->versions, pin);
+}
+
+
 static void
 librdf_storage_trees_graph_free(void* data)
 {
   librdf_storage_trees_graph* graph = (librdf_storage_trees_graph*)data;
   
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-  librdf_free_node(graph->context);
-#endif
+  if (graph->context)
+    librdf_free_node(graph->context);
   
   /* Extra index trees have null deleters (statements are shared) */
   if (graph->sop_tree)
-    librdf_free_avltree(graph->sop_tree);
+    librdf_free_bptree(graph->sop_tree);
   if (graph->ops_tree)
-    librdf_free_avltree(graph->ops_tree);
+    librdf_free_bptree(graph->ops_tree);
   if (graph->pso_tree)
-    librdf_free_avltree(graph->pso_tree);
+    librdf_free_bptree(graph->pso_tree);
 
   /* Free spo tree and statements */
-  librdf_free_avltree(graph->spo_tree);
+  librdf_free_bptree(graph->spo_tree);
 
   graph->spo_tree=NULL;
   graph->sop_tree=NULL;
@@ -986,7 +2262,6 @@ librdf_storage_trees_graph_free(void* data)
 static librdf_node*
 librdf_storage_trees_get_feature(librdf_storage* storage, librdf_uri* feature)
 {
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
   librdf_storage_trees_instance* scontext=(librdf_storage_trees_instance*)storage->instance;
   unsigned char *uri_string;
 
@@ -1004,7 +2279,6 @@ librdf_storage_trees_get_feature(librdf_storage* storage, librdf_uri* feature)
     return librdf_new_node_from_typed_literal(storage->world, 
                                               value, NULL, NULL);
   }
-#endif
 
   return NULL;
 }
@@ -1040,17 +2314,13 @@ librdf_storage_trees_register_factory(librdf_storage_factory *factory)
   factory->find_arcs                = NULL;
   factory->find_targets             = NULL;
 
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
   factory->context_add_statement    = librdf_storage_trees_context_add_statement;
+  factory->context_add_statements   = librdf_storage_trees_context_add_statements;
   factory->context_remove_statement = librdf_storage_trees_context_remove_statement;
+  factory->context_remove_statements = librdf_storage_trees_context_remove_statements;
   factory->context_serialise        = librdf_storage_trees_context_serialise;
+  factory->find_statements_in_context = librdf_storage_trees_find_statements_in_context;
   factory->get_contexts             = librdf_storage_trees_get_contexts;
-#else
-  factory->context_add_statement    = NULL;
-  factory->context_remove_statement = NULL;
-  factory->context_serialise        = NULL;
-  factory->get_contexts             = NULL;
-#endif
 
   factory->sync                     = NULL;
   factory->get_feature              = librdf_storage_trees_get_feature;
@@ -60,16 +60,15 @@ void
 librdf_init_uri(librdf_world *world)
 {
 #ifndef LIBRDF_USE_RAPTOR_URI
-  /* If no default given, create an in memory hash */
-  if(!world->uris_hash) {
-    world->uris_hash=librdf_new_hash(world, NULL);
-    if(!world->uris_hash)
+  int i;
+
+  /* one in memory hash per shard */
+  for(i=0; i < LIBRDF_WORLD_SHARDS; i++) {
+    world->uris_hash[i]=librdf_new_hash(world, NULL);
+    if(!world->uris_hash[i])
       LIBRDF_FATAL1(world, LIBRDF_FROM_URI, "Failed to create URI hash from factory");
     
-    /* remember to free it later */
-    world->uris_hash_allocated_here=1;
-
-    if(librdf_hash_open(world->uris_hash, NULL, 0, 1, 1, NULL))
+    if(librdf_hash_open(world->uris_hash[i], NULL, 0, 1, 1, NULL))
       LIBRDF_FATAL1(world, LIBRDF_FROM_URI, "Failed to open URI hash");
   }
 #endif
@@ -88,11 +87,14 @@ void
 librdf_finish_uri(librdf_world *world)
 {
 #ifndef LIBRDF_USE_RAPTOR_URI
-  if (world->uris_hash) {
-    librdf_hash_close(world->uris_hash);
-
-    if(world->uris_hash_allocated_here)
-      librdf_free_hash(world->uris_hash);
+  int i;
+
+  for(i=0; i < LIBRDF_WORLD_SHARDS; i++) {
+    if (world->uris_hash[i]) {
+      librdf_hash_close(world->uris_hash[i]);
+      librdf_free_hash(world->uris_hash[i]);
+      world->uris_hash[i]=NULL;
+    }
   }
 #endif
 }
@@ -125,7 +127,8 @@ librdf_new_uri2(librdf_world *world,
   librdf_uri* new_uri;
   unsigned char *new_string;
   librdf_hash_datum key, value; /* on stack - not allocated */
-  librdf_hash_datum *old_value;
+  unsigned int hash;
+  int shard;
 
   /* just to be safe */
   memset(&key, 0, sizeof(key));
@@ -136,22 +139,22 @@ librdf_new_uri2(librdf_world *world,
   if(!uri_string || !length || !*uri_string)
     return NULL;
 
+  hash = librdf_world_hash_key(uri_string, length);
+  shard = LIBRDF_WORLD_SHARD(hash);
+
 #ifdef WITH_THREADS
-  pthread_mutex_lock(world->mutex);
+  pthread_mutex_lock(&world->uris_mutex[shard]);
 #endif
   
   key.data = (char*)uri_string;
   key.size = length;
 
   /* if existing URI found in hash, return it */
-  if((old_value = librdf_hash_get_one(world->uris_hash, &key))) {
-    new_uri = *(librdf_uri**)old_value->data;
-
+  if((new_uri = (librdf_uri*)librdf_hash_get_one_pointer(world->uris_hash[shard], &key))) {
 #if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
     LIBRDF_DEBUG3("Found existing URI %s in hash with current usage %d\n", uri_string, new_uri->usage);
 #endif
 
-    librdf_free_hash_datum(old_value);
     new_uri->usage++;
 
 #if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
@@ -175,6 +178,7 @@ librdf_new_uri2(librdf_world *world,
 
   new_uri->world = world;
   new_uri->string_length = length;
+  new_uri->hash = hash;
 
   new_string = (unsigned char*)LIBRDF_MALLOC(cstring, length+1);
   if(!new_string) {
@@ -194,7 +198,7 @@ librdf_new_uri2(librdf_world *world,
   value.data = &new_uri; value.size = sizeof(librdf_uri*);
   
   /* store in hash: URI-string => (librdf_uri*) */
-  if(librdf_hash_put(world->uris_hash, &key, &value)) {
+  if(librdf_hash_put(world->uris_hash[shard], &key, &value)) {
     LIBRDF_FREE(cstring, new_string);
     LIBRDF_FREE(librdf_uri, new_uri);
     new_uri = NULL;
@@ -202,7 +206,7 @@ librdf_new_uri2(librdf_world *world,
 
  unlock:
 #ifdef WITH_THREADS
-  pthread_mutex_unlock(world->mutex);
+  pthread_mutex_unlock(&world->uris_mutex[shard]);
 #endif
 
   return new_uri;
@@ -251,7 +255,14 @@ librdf_new_uri_from_uri (librdf_uri* old_uri) {
 #ifdef LIBRDF_USE_RAPTOR_URI
   return raptor_uri_copy(old_uri);
 #else
+#ifdef WITH_THREADS
+  /* usage is locked by the URI's shard */
+  pthread_mutex_lock(&old_uri->world->uris_mutex[LIBRDF_WORLD_SHARD(old_uri->hash)]);
+#endif
   old_uri->usage++;
+#ifdef WITH_THREADS
+  pthread_mutex_unlock(&old_uri->world->uris_mutex[LIBRDF_WORLD_SHARD(old_uri->hash)]);
+#endif
   return old_uri;
 #endif
 }
@@ -492,16 +503,15 @@ librdf_free_uri(librdf_uri* uri)
   raptor_free_uri(uri);
 #else
   librdf_hash_datum key; /* on stack */
-#ifdef WITH_THREADS
-  librdf_world *world;
-#endif
+  int shard;
 
   if(!uri)
     return;
   
+  shard = LIBRDF_WORLD_SHARD(uri->hash);
+
 #ifdef WITH_THREADS
-  world = uri->world;
-  pthread_mutex_lock(world->mutex);
+  pthread_mutex_lock(&uri->world->uris_mutex[shard]);
 #endif
 
   uri->usage--;
@@ -513,7 +523,7 @@ librdf_free_uri(librdf_uri* uri)
   /* decrement usage, don't free if not 0 yet*/
   if(uri->usage) {
 #ifdef WITH_THREADS
-    pthread_mutex_unlock(world->mutex);
+    pthread_mutex_unlock(&uri->world->uris_mutex[shard]);
 #endif
     return;
   }
@@ -526,15 +536,16 @@ librdf_free_uri(librdf_uri* uri)
   key.size=uri->string_length;
   /* Hash deletion fails only if the key is not found.
      This is not a fatal error so do not check for return value. */
-  librdf_hash_delete_all(uri->world->uris_hash, &key);
+  librdf_hash_delete_all(uri->world->uris_hash[shard], &key);
+
+#ifdef WITH_THREADS
+  /* no longer reachable so the rest needs no lock */
+  pthread_mutex_unlock(&uri->world->uris_mutex[shard]);
+#endif
 
   if(uri->string)
     LIBRDF_FREE(cstring, uri->string);
   LIBRDF_FREE(librdf_uri, uri);
-
-#ifdef WITH_THREADS
-  pthread_mutex_unlock(world->mutex);
-#endif
 #endif /* !LIBRDF_USE_RAPTOR_URI */
 }
 
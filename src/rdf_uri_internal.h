@@ -39,6 +39,7 @@ struct librdf_uri_s
   unsigned char *string;
   int string_length; /* useful for fast comparisons (that fail) */
   int usage;
+  unsigned int hash; /* of the string, picking the URI's shard */
   int max_usage;
 };
 #else
@@ -48,6 +49,7 @@ struct librdf_uri_s
   unsigned char *string;
   int string_length; /* useful for fast comparisons (that fail) */
   int usage;
+  unsigned int hash; /* of the string, picking the URI's shard */
 };
 #endif
 
@@ -83,6 +83,9 @@ extern "C" {
 /* BDB cursor method has 4 arguments */
 #define HAVE_BDB_CURSOR_4_ARGS 1
 
+/* BDB cursor has c_count method */
+#define HAVE_BDB_CURSOR_COUNT 1
+
 /* BDB defines DB_TXN */
 #define HAVE_BDB_DB_TXN 1
 
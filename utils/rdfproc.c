@@ -84,7 +84,8 @@ enum command_type {
   CMD_REMOVE_CONTEXT,
   CMD_CONTEXTS,
   CMD_MATCH,
-  CMD_SIZE
+  CMD_SIZE,
+  CMD_COMPACT
 };
 
 typedef struct
@@ -123,6 +124,7 @@ static command commands[]={
   {CMD_CONTEXTS, "contexts", 0, 0, 0},
   {CMD_MATCH, "match", 3, 4, 0},
   {CMD_SIZE, "size", 0, 0, 0},
+  {CMD_COMPACT, "compact", 0, 0, 1},
   {(enum command_type)-1, NULL, 0, 0, 0}  
 };
  
@@ -636,6 +638,7 @@ main(int argc, char *argv[])
     puts("  arcs-in | arcs-out NODE                   Show properties in/out of NODE");
     puts("  has-arc-in | has-arc-out NODE ARC         Check for property in/out of NODE.");
     puts("  size                                      Print the number of triples in the graph.");
+    puts("  compact                                   Reclaim unused space in the store.");
     puts("\nNotation:");
     puts("  nodes are either blank node identifiers like _:ABC,");
     puts("    URIs like http://example.org otherwise are literal strings.");
@@ -1548,6 +1551,14 @@ main(int argc, char *argv[])
         fprintf(stdout, "%s: graph has unknown number of triples\n", program);
       break;
 
+    case CMD_COMPACT:
+      rc=librdf_storage_compact(storage);
+      if(rc)
+        fprintf(stderr, "%s: failed to compact the store\n", program);
+      else if(verbosity)
+        fprintf(stderr, "%s: compacted the store\n", program);
+      break;
+
     default:
       fprintf(stderr, "%s: Unknown command %d\n", program, type);
       return(1);